@@ -147,11 +147,35 @@ static inline CPUTLBEntry *tlb_entry(CPUState *cpu, uintptr_t mmu_idx,
     return &cpu->neg.tlb.f[mmu_idx].table[tlb_index(cpu, mmu_idx, addr)];
 }
 
+/*
+ * Bounds of the dynamic TLB size as set with "-accel tcg,tlb-{min,max}-bits",
+ * or 0 to use the defaults.  tcg_init_machine() makes sure that they only
+ * narrow the default bounds.
+ */
+unsigned tlb_dyn_min_bits;
+unsigned tlb_dyn_max_bits;
+
+static unsigned tlb_max_bits(void)
+{
+    return tlb_dyn_max_bits ?: CPU_TLB_DYN_MAX_BITS;
+}
+
+static unsigned tlb_min_bits(void)
+{
+    return tlb_dyn_min_bits ?: CPU_TLB_DYN_MIN_BITS;
+}
+
 static void tlb_window_reset(CPUTLBDesc *desc, int64_t ns,
                              size_t max_entries)
 {
     desc->window_begin_ns = ns;
     desc->window_max_entries = max_entries;
+    desc->window_flushes = 0;
+}
+
+static inline void tlb_stat_inc(size_t *stat)
+{
+    qatomic_set(stat, *stat + 1);
 }
 
 static void tb_jmp_cache_clear_page(CPUState *cpu, vaddr page_addr)
@@ -208,25 +232,39 @@ static void tb_jmp_cache_clear_page(CPUState *cpu, vaddr page_addr)
  * is direct mapped, so we want the use rate to be low (or at least not too
  * high), since otherwise we are likely to have a significant amount of
  * conflict misses.
+ *
+ * 4. Use rate alone does not see conflict misses: a workload whose pages
+ * collide in the direct mapped table keeps evicting entries to the victim
+ * TLB while the use rate stays moderate. Grow the TLB as well when the
+ * number of such evictions since the last flush exceeds 30% of its size.
+ *
+ * 5. Flushing costs time proportional to the size of the TLB. When flushes
+ * are very frequent (more than one per millisecond over the window), do
+ * not grow because of conflict misses, and shrink as soon as the use rate
+ * falls below 50% rather than 30%.
  */
 static void tlb_mmu_resize_locked(CPUTLBDesc *desc, CPUTLBDescFast *fast,
                                   int64_t now)
 {
     size_t old_size = tlb_n_entries(fast);
-    size_t rate;
+    size_t rate, evict_rate, low_rate;
     size_t new_size = old_size;
     int64_t window_len_ms = 100;
     int64_t window_len_ns = window_len_ms * 1000 * 1000;
     bool window_expired = now > desc->window_begin_ns + window_len_ns;
+    bool flush_heavy;
 
     if (desc->n_used_entries > desc->window_max_entries) {
         desc->window_max_entries = desc->n_used_entries;
     }
     rate = desc->window_max_entries * 100 / old_size;
+    evict_rate = desc->n_evicted_entries * 100 / old_size;
+    flush_heavy = ++desc->window_flushes > window_len_ms;
+    low_rate = flush_heavy ? 50 : 30;
 
-    if (rate > 70) {
-        new_size = MIN(old_size << 1, 1 << CPU_TLB_DYN_MAX_BITS);
-    } else if (rate < 30 && window_expired) {
+    if (rate > 70 || (evict_rate > 30 && !flush_heavy)) {
+        new_size = MIN(old_size << 1, 1 << tlb_max_bits());
+    } else if (rate < low_rate && window_expired) {
         size_t ceil = pow2ceil(desc->window_max_entries);
         size_t expected_rate = desc->window_max_entries * 100 / ceil;
 
@@ -243,7 +281,7 @@ static void tlb_mmu_resize_locked(CPUTLBDesc *desc, CPUTLBDescFast *fast,
         if (expected_rate > 70) {
             ceil *= 2;
         }
-        new_size = MAX(ceil, 1 << CPU_TLB_DYN_MIN_BITS);
+        new_size = MAX(ceil, 1 << tlb_min_bits());
     }
 
     if (new_size == old_size) {
@@ -256,6 +294,7 @@ static void tlb_mmu_resize_locked(CPUTLBDesc *desc, CPUTLBDescFast *fast,
     g_free(fast->table);
     g_free(desc->fulltlb);
 
+    tlb_stat_inc(&desc->resize_count);
     tlb_window_reset(desc, now, 0);
     /* desc->n_used_entries is cleared by the caller */
     fast->mask = (new_size - 1) << CPU_TLB_ENTRY_BITS;
@@ -270,11 +309,11 @@ static void tlb_mmu_resize_locked(CPUTLBDesc *desc, CPUTLBDescFast *fast,
      * size, aborting if we cannot even allocate the smallest TLB we support.
      */
     while (fast->table == NULL || desc->fulltlb == NULL) {
-        if (new_size == (1 << CPU_TLB_DYN_MIN_BITS)) {
+        if (new_size == (1 << tlb_min_bits())) {
             error_report("%s: %s", __func__, strerror(errno));
             abort();
         }
-        new_size = MAX(new_size >> 1, 1 << CPU_TLB_DYN_MIN_BITS);
+        new_size = MAX(new_size >> 1, 1 << tlb_min_bits());
         fast->mask = (new_size - 1) << CPU_TLB_ENTRY_BITS;
 
         g_free(fast->table);
@@ -287,6 +326,7 @@ static void tlb_mmu_resize_locked(CPUTLBDesc *desc, CPUTLBDescFast *fast,
 static void tlb_mmu_flush_locked(CPUTLBDesc *desc, CPUTLBDescFast *fast)
 {
     desc->n_used_entries = 0;
+    desc->n_evicted_entries = 0;
     desc->large_page_addr = -1;
     desc->large_page_mask = -1;
     desc->vindex = 0;
@@ -302,11 +342,13 @@ static void tlb_flush_one_mmuidx_locked(CPUState *cpu, int mmu_idx,
 
     tlb_mmu_resize_locked(desc, fast, now);
     tlb_mmu_flush_locked(desc, fast);
+    tlb_stat_inc(&desc->flush_count);
 }
 
 static void tlb_mmu_init(CPUTLBDesc *desc, CPUTLBDescFast *fast, int64_t now)
 {
-    size_t n_entries = 1 << CPU_TLB_DYN_DEFAULT_BITS;
+    size_t n_entries = 1 << MIN(MAX(CPU_TLB_DYN_DEFAULT_BITS, tlb_min_bits()),
+                                tlb_max_bits());
 
     tlb_window_reset(desc, now, 0);
     desc->n_used_entries = 0;
@@ -668,6 +710,58 @@ void tlb_flush_page_all_cpus_synced(CPUState *src, vaddr addr)
     tlb_flush_page_by_mmuidx_all_cpus_synced(src, addr, ALL_MMUIDX_BITS);
 }
 
+/*
+ * Called with tlb_c.lock held.
+ * The distance of the page from @addr is taken modulo the address space
+ * under @mask, so that a range that wraps past the top of it also matches
+ * the pages at its bottom.
+ */
+static bool tlb_flush_entry_range_locked(CPUTLBEntry *tlb_entry,
+                                         vaddr addr, vaddr len, vaddr mask)
+{
+    vaddr page_mask = mask & TARGET_PAGE_MASK;
+
+    for (int i = MMU_DATA_LOAD; i <= MMU_INST_FETCH; i++) {
+        uint64_t cmp = tlb_read_idx(tlb_entry, i);
+
+        /* Unused and force-refill comparators never hit; skip them. */
+        if (!(cmp & TLB_INVALID_MASK) &&
+            (((cmp & page_mask) - addr) & mask) < len) {
+            memset(tlb_entry, -1, sizeof(*tlb_entry));
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Called with tlb_c.lock held.
+ * Flush every entry of @midx, including the victim tlb, whose page
+ * lies within [@addr, @addr + @len) when compared under @mask.
+ */
+static void tlb_flush_range_walk_locked(CPUState *cpu, int midx,
+                                        vaddr addr, vaddr len, vaddr mask)
+{
+    CPUTLBDesc *d = &cpu->neg.tlb.d[midx];
+    CPUTLBDescFast *f = &cpu->neg.tlb.f[midx];
+    size_t i, n = tlb_n_entries(f);
+
+    if (d->n_used_entries == 0) {
+        return;
+    }
+    addr &= mask;
+    for (i = 0; i < n; i++) {
+        if (tlb_flush_entry_range_locked(&f->table[i], addr, len, mask)) {
+            tlb_n_used_entries_dec(cpu, midx);
+        }
+    }
+    for (i = 0; i < CPU_VTLB_SIZE; i++) {
+        if (tlb_flush_entry_range_locked(&d->vtable[i], addr, len, mask)) {
+            tlb_n_used_entries_dec(cpu, midx);
+        }
+    }
+}
+
 static void tlb_flush_range_locked(CPUState *cpu, int midx,
                                    vaddr addr, vaddr len,
                                    unsigned bits)
@@ -676,24 +770,6 @@ static void tlb_flush_range_locked(CPUState *cpu, int midx,
     CPUTLBDescFast *f = &cpu->neg.tlb.f[midx];
     vaddr mask = MAKE_64BIT_MASK(0, bits);
 
-    /*
-     * If @bits is smaller than the tlb size, there may be multiple entries
-     * within the TLB; otherwise all addresses that match under @mask hit
-     * the same TLB entry.
-     * TODO: Perhaps allow bits to be a few bits less than the size.
-     * For now, just flush the entire TLB.
-     *
-     * If @len is larger than the tlb size, then it will take longer to
-     * test all of the entries in the TLB than it will to flush it all.
-     */
-    if (mask < f->mask || len > f->mask) {
-        tlb_debug("forcing full flush midx %d ("
-                  "%016" VADDR_PRIx "/%016" VADDR_PRIx "+%016" VADDR_PRIx ")\n",
-                  midx, addr, mask, len);
-        tlb_flush_one_mmuidx_locked(cpu, midx, get_clock_realtime());
-        return;
-    }
-
     /*
      * Check if we need to flush due to large pages.
      * Because large_page_mask contains all 1's from the msb,
@@ -707,6 +783,25 @@ static void tlb_flush_range_locked(CPUState *cpu, int midx,
         return;
     }
 
+    /*
+     * If @bits is smaller than the tlb size, there may be multiple entries
+     * within the TLB for each page; otherwise all addresses that match
+     * under @mask hit the same TLB entry.
+     *
+     * If @len is larger than the tlb size, then it will take longer to
+     * probe each page of the range than to test every entry of the TLB.
+     *
+     * In either case walk the whole TLB, which keeps the flush exact
+     * rather than discarding the unrelated entries as well.
+     */
+    if (mask < f->mask || len > f->mask) {
+        tlb_debug("walking midx %d ("
+                  "%016" VADDR_PRIx "/%016" VADDR_PRIx "+%016" VADDR_PRIx ")\n",
+                  midx, addr, mask, len);
+        tlb_flush_range_walk_locked(cpu, midx, addr, len, mask);
+        return;
+    }
+
     for (vaddr i = 0; i < len; i += TARGET_PAGE_SIZE) {
         vaddr page = addr + i;
         CPUTLBEntry *entry = tlb_entry(cpu, midx, page);
@@ -718,15 +813,8 @@ static void tlb_flush_range_locked(CPUState *cpu, int midx,
     }
 }
 
-typedef struct {
-    vaddr addr;
-    vaddr len;
-    uint16_t idxmap;
-    uint16_t bits;
-} TLBFlushRangeData;
-
 static void tlb_flush_range_by_mmuidx_async_0(CPUState *cpu,
-                                              TLBFlushRangeData d)
+                                              CPUTLBFlushRange d)
 {
     int mmu_idx;
 
@@ -766,16 +854,93 @@ static void tlb_flush_range_by_mmuidx_async_0(CPUState *cpu,
 static void tlb_flush_range_by_mmuidx_async_1(CPUState *cpu,
                                               run_on_cpu_data data)
 {
-    TLBFlushRangeData *d = data.host_ptr;
+    CPUTLBFlushRange *d = data.host_ptr;
     tlb_flush_range_by_mmuidx_async_0(cpu, *d);
     g_free(d);
 }
 
+static void tlb_flush_pending_ranges_async_work(CPUState *cpu,
+                                                run_on_cpu_data data)
+{
+    CPUTLBCommon *c = &cpu->neg.tlb.c;
+    CPUTLBFlushRange ranges[CPU_TLB_PENDING_RANGES];
+    unsigned i, n;
+    uint16_t full;
+
+    assert_cpu_is_self(cpu);
+
+    /*
+     * Take ownership of everything queued so far.  Anything queued after
+     * pending_queued is cleared is the responsibility of a new work item.
+     */
+    qemu_spin_lock(&c->lock);
+    n = c->n_pending;
+    memcpy(ranges, c->pending, n * sizeof(ranges[0]));
+    full = c->pending_full;
+    c->n_pending = 0;
+    c->pending_full = 0;
+    c->pending_queued = false;
+    qemu_spin_unlock(&c->lock);
+
+    if (full) {
+        tlb_flush_by_mmuidx_async_work(cpu, RUN_ON_CPU_HOST_INT(full));
+    }
+    for (i = 0; i < n; i++) {
+        ranges[i].idxmap &= ~full;
+        if (ranges[i].idxmap) {
+            tlb_flush_range_by_mmuidx_async_0(cpu, ranges[i]);
+        }
+    }
+}
+
+/*
+ * Add @d to the ranges pending for @cpu, merging it with an overlapping
+ * or adjacent range where possible.  Return true if the caller must
+ * queue the work item that performs the pending flushes.
+ */
+static bool tlb_queue_pending_range(CPUState *cpu, const CPUTLBFlushRange *d)
+{
+    CPUTLBCommon *c = &cpu->neg.tlb.c;
+    vaddr d_last = d->addr + d->len - 1;
+    bool need_work;
+    unsigned i;
+
+    qemu_spin_lock(&c->lock);
+
+    for (i = 0; i < c->n_pending; i++) {
+        CPUTLBFlushRange *p = &c->pending[i];
+        vaddr p_last = p->addr + p->len - 1;
+
+        if (p->idxmap != d->idxmap || p->bits != d->bits ||
+            p_last == (vaddr)-1 || d_last == (vaddr)-1) {
+            continue;
+        }
+        if (d->addr <= p_last + 1 && p->addr <= d_last + 1) {
+            p->addr = MIN(p->addr, d->addr);
+            p->len = MAX(p_last, d_last) - p->addr + 1;
+            break;
+        }
+    }
+    if (i == c->n_pending) {
+        if (i < CPU_TLB_PENDING_RANGES) {
+            c->pending[c->n_pending++] = *d;
+        } else {
+            c->pending_full |= d->idxmap;
+        }
+    }
+
+    need_work = !c->pending_queued;
+    c->pending_queued = true;
+
+    qemu_spin_unlock(&c->lock);
+    return need_work;
+}
+
 void tlb_flush_range_by_mmuidx(CPUState *cpu, vaddr addr,
                                vaddr len, uint16_t idxmap,
                                unsigned bits)
 {
-    TLBFlushRangeData d;
+    CPUTLBFlushRange d;
 
     assert_cpu_is_self(cpu);
 
@@ -814,7 +979,7 @@ void tlb_flush_range_by_mmuidx_all_cpus_synced(CPUState *src_cpu,
                                                uint16_t idxmap,
                                                unsigned bits)
 {
-    TLBFlushRangeData d, *p;
+    CPUTLBFlushRange d, *p;
     CPUState *dst_cpu;
 
     /*
@@ -837,12 +1002,15 @@ void tlb_flush_range_by_mmuidx_all_cpus_synced(CPUState *src_cpu,
     d.idxmap = idxmap;
     d.bits = bits;
 
-    /* Allocate a separate data block for each destination cpu.  */
+    /*
+     * Append to each destination cpu's pending ranges.  Only the first
+     * range queued since the cpu last drained its list needs a work item;
+     * later ones are picked up by the same item, without another kick.
+     */
     CPU_FOREACH(dst_cpu) {
-        if (dst_cpu != src_cpu) {
-            p = g_memdup(&d, sizeof(d));
-            async_run_on_cpu(dst_cpu, tlb_flush_range_by_mmuidx_async_1,
-                             RUN_ON_CPU_HOST_PTR(p));
+        if (dst_cpu != src_cpu && tlb_queue_pending_range(dst_cpu, &d)) {
+            async_run_on_cpu(dst_cpu, tlb_flush_pending_ranges_async_work,
+                             RUN_ON_CPU_NULL);
         }
     }
 
@@ -1149,6 +1317,7 @@ void tlb_set_page_full(CPUState *cpu, int mmu_idx,
         copy_tlb_helper_locked(tv, te);
         desc->vfulltlb[vidx] = desc->fulltlb[index];
         tlb_n_used_entries_dec(cpu, mmu_idx);
+        desc->n_evicted_entries++;
     }
 
     /* refill the tlb */
@@ -1194,6 +1363,7 @@ void tlb_set_page_full(CPUState *cpu, int mmu_idx,
 
     copy_tlb_helper_locked(te, &tn);
     tlb_n_used_entries_inc(cpu, mmu_idx);
+    tlb_stat_inc(&desc->fill_count);
     qemu_spin_unlock(&tlb->c.lock);
 }
 
@@ -1305,6 +1475,7 @@ static bool victim_tlb_hit(CPUState *cpu, size_t mmu_idx, size_t index,
             CPUTLBEntryFull *f2 = &cpu->neg.tlb.d[mmu_idx].vfulltlb[vidx];
             CPUTLBEntryFull tmpf;
             tmpf = *f1; *f1 = *f2; *f2 = tmpf;
+            tlb_stat_inc(&cpu->neg.tlb.d[mmu_idx].victim_hit_count);
             return true;
         }
     }
@@ -16,6 +16,7 @@
 #include "sysemu/cpus.h"
 #include "sysemu/cpu-timers.h"
 #include "sysemu/tcg.h"
+#include "sysemu/stats.h"
 #include "tcg/tcg.h"
 #include "internal-common.h"
 #include "tb-context.h"
@@ -235,10 +236,96 @@ HumanReadableText *qmp_x_query_opcount(Error **errp)
     return human_readable_text_from_str(buf);
 }
 
+/*
+ * Per-vCPU softmmu TLB statistics for query-stats.  Each one is a list
+ * with one value for each MMU mode, indexed by mmu_idx.
+ */
+static const struct {
+    const char *name;
+    size_t offset;
+} tlb_stats[] = {
+    { "tlb-fills", offsetof(CPUTLBDesc, fill_count) },
+    { "tlb-flushes", offsetof(CPUTLBDesc, flush_count) },
+    { "tlb-resizes", offsetof(CPUTLBDesc, resize_count) },
+    { "tlb-victim-hits", offsetof(CPUTLBDesc, victim_hit_count) },
+};
+
+static StatsList *tcg_stats_vcpu(CPUState *cpu, strList *names)
+{
+    StatsList *stats_list = NULL;
+    int i, mmu_idx;
+
+    for (i = ARRAY_SIZE(tlb_stats) - 1; i >= 0; i--) {
+        uint64List *val_list = NULL;
+        Stats *stats;
+
+        if (!apply_str_list_filter(tlb_stats[i].name, names)) {
+            continue;
+        }
+        for (mmu_idx = NB_MMU_MODES - 1; mmu_idx >= 0; mmu_idx--) {
+            size_t *p = (void *)&cpu->neg.tlb.d[mmu_idx] + tlb_stats[i].offset;
+            QAPI_LIST_PREPEND(val_list, qatomic_read(p));
+        }
+
+        stats = g_new0(Stats, 1);
+        stats->name = g_strdup(tlb_stats[i].name);
+        stats->value = g_new0(StatsValue, 1);
+        stats->value->u.list = val_list;
+        stats->value->type = QTYPE_QLIST;
+        QAPI_LIST_PREPEND(stats_list, stats);
+    }
+    return stats_list;
+}
+
+static void tcg_stats_cb(StatsResultList **result, StatsTarget target,
+                         strList *names, strList *targets, Error **errp)
+{
+    CPUState *cpu;
+
+    if (!tcg_enabled() || target != STATS_TARGET_VCPU) {
+        return;
+    }
+
+    CPU_FOREACH(cpu) {
+        StatsList *stats_list;
+
+        if (!apply_str_list_filter(cpu->parent_obj.canonical_path, targets)) {
+            continue;
+        }
+        stats_list = tcg_stats_vcpu(cpu, names);
+        if (stats_list) {
+            add_stats_entry(result, STATS_PROVIDER_TCG,
+                            cpu->parent_obj.canonical_path, stats_list);
+        }
+    }
+}
+
+static void tcg_stats_schemas_cb(StatsSchemaList **result, Error **errp)
+{
+    StatsSchemaValueList *stats_list = NULL;
+    int i;
+
+    if (!tcg_enabled()) {
+        return;
+    }
+
+    for (i = ARRAY_SIZE(tlb_stats) - 1; i >= 0; i--) {
+        StatsSchemaValue *value = g_new0(StatsSchemaValue, 1);
+
+        value->type = STATS_TYPE_CUMULATIVE;
+        value->name = g_strdup(tlb_stats[i].name);
+        QAPI_LIST_PREPEND(stats_list, value);
+    }
+    add_stats_schema(result, STATS_PROVIDER_TCG, STATS_TARGET_VCPU,
+                     stats_list);
+}
+
 static void hmp_tcg_register(void)
 {
     monitor_register_hmp_info_hrt("jit", qmp_x_query_jit);
     monitor_register_hmp_info_hrt("opcount", qmp_x_query_opcount);
+    add_stats_callbacks(STATS_PROVIDER_TCG, tcg_stats_cb,
+                        tcg_stats_schemas_cb);
 }
 
 type_init(hmp_tcg_register);
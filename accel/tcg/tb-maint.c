@@ -398,9 +398,20 @@ static void page_unlock(PageDesc *pd)
     page_unlock__debug(pd);
 }
 
-void tb_lock_page0(tb_page_addr_t paddr)
+/*
+ * Lock the first page of a TB about to be translated.
+ * Return true if the lock was contended, i.e. we had to wait for
+ * another thread translating or invalidating code on the same page.
+ */
+bool tb_lock_page0(tb_page_addr_t paddr)
 {
-    page_lock(page_find_alloc(paddr >> TARGET_PAGE_BITS, true));
+    PageDesc *pd = page_find_alloc(paddr >> TARGET_PAGE_BITS, true);
+
+    if (likely(!page_trylock(pd))) {
+        return false;
+    }
+    page_lock(pd);
+    return true;
 }
 
 void tb_lock_page1(tb_page_addr_t paddr0, tb_page_addr_t paddr1)
@@ -999,6 +1010,30 @@ TranslationBlock *tb_link_page(TranslationBlock *tb)
     return tb;
 }
 
+/*
+ * Look up a TB equivalent to @tb that another thread linked while we
+ * were waiting for the lock on the first page of @tb.
+ *
+ * Only @tb's first page is known at this point, so only TBs that lie
+ * entirely within that page can match.  Called before translation,
+ * with the first page of @tb locked.
+ */
+TranslationBlock *tb_htable_lookup_raced(TranslationBlock *tb)
+{
+    TranslationBlock *existing_tb;
+    uint32_t h;
+
+    tcg_debug_assert(tb_page_addr1(tb) == -1);
+
+    h = tb_hash_func(tb_page_addr0(tb), (tb->cflags & CF_PCREL ? 0 : tb->pc),
+                     tb->flags, tb->cs_base, tb->cflags);
+    existing_tb = qht_lookup(&tb_ctx.htable, tb, h);
+    if (existing_tb && !(tb_cflags(existing_tb) & CF_INVALID)) {
+        return existing_tb;
+    }
+    return NULL;
+}
+
 #ifdef CONFIG_USER_ONLY
 /*
  * Invalidate all TBs which intersect with the target address range.
@@ -39,6 +39,7 @@
 #include "hw/boards.h"
 #endif
 #include "internal-common.h"
+#include "internal-target.h"
 
 struct TCGState {
     AccelState parent_obj;
@@ -47,6 +48,10 @@ struct TCGState {
     bool one_insn_per_tb;
     int splitwx_enabled;
     unsigned long tb_size;
+#ifdef CONFIG_SOFTMMU
+    uint8_t tlb_min_bits;
+    uint8_t tlb_max_bits;
+#endif
 };
 typedef struct TCGState TCGState;
 
@@ -109,6 +114,26 @@ static int tcg_init_machine(MachineState *ms)
     unsigned max_cpus = ms->smp.max_cpus;
 #endif
 
+#ifdef CONFIG_SOFTMMU
+    if (s->tlb_max_bits > CPU_TLB_DYN_MAX_BITS) {
+        error_report("tlb-max-bits (%d) must not exceed %d for this target",
+                     s->tlb_max_bits, (int)CPU_TLB_DYN_MAX_BITS);
+        return -EINVAL;
+    }
+    if (s->tlb_min_bits > CPU_TLB_DYN_MAX_BITS) {
+        error_report("tlb-min-bits (%d) must not exceed %d for this target",
+                     s->tlb_min_bits, (int)CPU_TLB_DYN_MAX_BITS);
+        return -EINVAL;
+    }
+    if (s->tlb_max_bits && s->tlb_min_bits > s->tlb_max_bits) {
+        error_report("tlb-min-bits (%d) must not exceed tlb-max-bits (%d)",
+                     s->tlb_min_bits, s->tlb_max_bits);
+        return -EINVAL;
+    }
+    tlb_dyn_min_bits = s->tlb_min_bits;
+    tlb_dyn_max_bits = s->tlb_max_bits;
+#endif
+
     tcg_allowed = true;
     mttcg_enabled = s->mttcg_enabled;
 
@@ -181,6 +206,35 @@ static void tcg_set_tb_size(Object *obj, Visitor *v,
     s->tb_size = value;
 }
 
+#ifdef CONFIG_SOFTMMU
+static void tcg_get_tlb_bits(Object *obj, Visitor *v,
+                             const char *name, void *opaque,
+                             Error **errp)
+{
+    uint8_t *ptr = (void *)TCG_STATE(obj) + (uintptr_t)opaque;
+
+    visit_type_uint8(v, name, ptr, errp);
+}
+
+static void tcg_set_tlb_bits(Object *obj, Visitor *v,
+                             const char *name, void *opaque,
+                             Error **errp)
+{
+    uint8_t *ptr = (void *)TCG_STATE(obj) + (uintptr_t)opaque;
+    uint8_t value;
+
+    if (!visit_type_uint8(v, name, &value, errp)) {
+        return;
+    }
+    if (value < CPU_TLB_DYN_MIN_BITS || value > 32) {
+        error_setg(errp, "%s must be between %d and 32", name,
+                   CPU_TLB_DYN_MIN_BITS);
+        return;
+    }
+    *ptr = value;
+}
+#endif
+
 static bool tcg_get_splitwx(Object *obj, Error **errp)
 {
     TCGState *s = TCG_STATE(obj);
@@ -252,6 +306,20 @@ static void tcg_accel_class_init(ObjectClass *oc, void *data)
                                    tcg_set_one_insn_per_tb);
     object_class_property_set_description(oc, "one-insn-per-tb",
         "Only put one guest insn in each translation block");
+
+#ifdef CONFIG_SOFTMMU
+    object_class_property_add(oc, "tlb-min-bits", "uint8",
+        tcg_get_tlb_bits, tcg_set_tlb_bits,
+        NULL, (void *)offsetof(TCGState, tlb_min_bits));
+    object_class_property_set_description(oc, "tlb-min-bits",
+        "Log2 of the minimum number of entries of each softmmu TLB");
+
+    object_class_property_add(oc, "tlb-max-bits", "uint8",
+        tcg_get_tlb_bits, tcg_set_tlb_bits,
+        NULL, (void *)offsetof(TCGState, tlb_max_bits));
+    object_class_property_set_description(oc, "tlb-max-bits",
+        "Log2 of the maximum number of entries of each softmmu TLB");
+#endif
 }
 
 static const TypeInfo tcg_accel_type = {
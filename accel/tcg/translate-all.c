@@ -334,8 +334,19 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb->cflags = cflags;
     tb_set_page_addr0(tb, phys_pc);
     tb_set_page_addr1(tb, -1);
-    if (phys_pc != -1) {
-        tb_lock_page0(phys_pc);
+    if (phys_pc != -1 && unlikely(tb_lock_page0(phys_pc))) {
+        /*
+         * Another thread held the page lock while we waited, and will
+         * often have been translating this very block: other vCPUs tend
+         * to run the same code at the same time, e.g. during SMP boot.
+         * If it won the race, use its TB instead of translating again.
+         */
+        existing_tb = tb_htable_lookup_raced(tb);
+        if (existing_tb) {
+            tb_unlock_pages(tb);
+            qatomic_set(&tcg_ctx->code_gen_ptr, (void *)tb);
+            return existing_tb;
+        }
     }
 
     tcg_ctx->gen_tb = tb;
@@ -36,6 +36,7 @@
 #include "block/thread-pool.h"
 #include "qemu/iov.h"
 #include "block/raw-aio.h"
+#include "exec/memory.h" /* for ram_block_discard_disable() */
 #include "qapi/qmp/qdict.h"
 #include "qapi/qmp/qstring.h"
 
@@ -161,6 +162,12 @@ typedef struct BDRVRawState {
     bool use_linux_aio:1;
     bool has_laio_fdsync:1;
     bool use_linux_io_uring:1;
+    /* LURING_* flags of the io_uring ring that requests are submitted to */
+    unsigned int luring_flags;
+    /* Index of fd in the io_uring registered file table, or -1 */
+    int luring_fd_index;
+    /* Buffers registered with io_uring, NULL if they aren't used */
+    GArray *luring_bufs;
     int page_cache_inconsistent; /* errno from fdatasync failure */
     bool has_fallocate;
     bool needs_alignment;
@@ -566,6 +573,25 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "file locking mode (on/off/auto, default: auto)",
         },
+#ifdef CONFIG_LINUX_IO_URING
+        {
+            .name = "io-uring-fixed-buffers",
+            .type = QEMU_OPT_BOOL,
+            .help = "register guest memory with io_uring (default: off)",
+        },
+        {
+            .name = "io-uring-sqpoll",
+            .type = QEMU_OPT_BOOL,
+            .help = "submit io_uring requests from a kernel thread "
+                    "(default: off)",
+        },
+        {
+            .name = "io-uring-iopoll",
+            .type = QEMU_OPT_BOOL,
+            .help = "poll for io_uring completions instead of waiting for "
+                    "interrupts, needs cache.direct=on (default: off)",
+        },
+#endif
         {
             .name = "pr-manager",
             .type = QEMU_OPT_STRING,
@@ -602,6 +628,9 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     int fd, ret;
     struct stat st;
     OnOffAuto locking;
+#ifdef CONFIG_LINUX_IO_URING
+    bool fixed_bufs;
+#endif
 
     opts = qemu_opts_create(&raw_runtime_opts, NULL, 0, &error_abort);
     if (!qemu_opts_absorb_qdict(opts, options, errp)) {
@@ -636,8 +665,35 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 
     s->use_linux_aio = (aio == BLOCKDEV_AIO_OPTIONS_NATIVE);
+    s->luring_fd_index = -1;
 #ifdef CONFIG_LINUX_IO_URING
     s->use_linux_io_uring = (aio == BLOCKDEV_AIO_OPTIONS_IO_URING);
+    if (qemu_opt_get_bool(opts, "io-uring-sqpoll", false)) {
+        s->luring_flags |= LURING_SQPOLL;
+    }
+    if (qemu_opt_get_bool(opts, "io-uring-iopoll", false)) {
+        s->luring_flags |= LURING_IOPOLL;
+    }
+    fixed_bufs = qemu_opt_get_bool(opts, "io-uring-fixed-buffers", false);
+    if ((s->luring_flags || fixed_bufs) && !s->use_linux_io_uring) {
+        error_setg(errp, "io-uring-sqpoll, io-uring-iopoll and "
+                   "io-uring-fixed-buffers require aio=io_uring");
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (s->luring_flags & LURING_IOPOLL) {
+        /* Only O_DIRECT requests can be polled for */
+        if (!(bdrv_flags & BDRV_O_NOCACHE)) {
+            error_setg(errp, "io-uring-iopoll requires cache.direct=on");
+            ret = -EINVAL;
+            goto fail;
+        }
+#ifndef HAVE_IO_URING_GET_EVENTS
+        error_setg(errp, "io-uring-iopoll is not supported in this build");
+        ret = -EINVAL;
+        goto fail;
+#endif
+    }
 #endif
 
     s->aio_max_batch = qemu_opt_get_number(opts, "aio-max-batch", 0);
@@ -809,6 +865,23 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         /* When extending regular files, we get zeros from the OS */
         bs->supported_truncate_flags = BDRV_REQ_ZERO_WRITE;
     }
+
+#ifdef CONFIG_LINUX_IO_URING
+    if (fixed_bufs) {
+        /* The kernel would keep using pinned pages that have been discarded */
+        ret = ram_block_discard_disable(true);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "io-uring-fixed-buffers cannot be "
+                             "used while guest RAM may be discarded");
+            goto fail;
+        }
+        s->luring_bufs = g_array_new(false, false, sizeof(struct iovec));
+        bs->supported_write_flags |= BDRV_REQ_REGISTERED_BUF;
+    }
+    if (s->use_linux_io_uring) {
+        s->luring_fd_index = luring_register_file(s->fd);
+    }
+#endif
     ret = 0;
 fail:
     if (ret < 0 && s->fd != -1) {
@@ -2435,7 +2508,8 @@ static bool bdrv_qiov_is_aligned(BlockDriverState *bs, QEMUIOVector *qiov)
 }
 
 #ifdef CONFIG_LINUX_IO_URING
-static inline bool raw_check_linux_io_uring(BDRVRawState *s)
+static inline bool raw_check_linux_io_uring(BDRVRawState *s,
+                                            unsigned int ring_flags)
 {
     Error *local_err = NULL;
     AioContext *ctx;
@@ -2445,7 +2519,7 @@ static inline bool raw_check_linux_io_uring(BDRVRawState *s)
     }
 
     ctx = qemu_get_current_aio_context();
-    if (unlikely(!aio_setup_linux_io_uring(ctx, &local_err))) {
+    if (unlikely(!aio_setup_linux_io_uring(ctx, ring_flags, &local_err))) {
         error_reportf_err(local_err, "Unable to use linux io_uring, "
                                      "falling back to thread pool: ");
         s->use_linux_io_uring = false;
@@ -2477,12 +2551,16 @@ static inline bool raw_check_linux_aio(BDRVRawState *s)
 #endif
 
 static int coroutine_fn raw_co_prw(BlockDriverState *bs, int64_t *offset_ptr,
-                                   uint64_t bytes, QEMUIOVector *qiov, int type)
+                                   uint64_t bytes, QEMUIOVector *qiov, int type,
+                                   BdrvRequestFlags flags)
 {
     BDRVRawState *s = bs->opaque;
     RawPosixAIOData acb;
     int ret;
     uint64_t offset = *offset_ptr;
+#ifdef CONFIG_LINUX_IO_URING
+    unsigned int ring_flags;
+#endif
 
     if (fd_open(bs) < 0)
         return -EIO;
@@ -2503,12 +2581,31 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, int64_t *offset_ptr,
      * pool read/write code which emulates this for us if we
      * set QEMU_AIO_MISALIGNED.
      */
+#ifdef CONFIG_LINUX_IO_URING
+retry:
+    ring_flags = s->luring_flags;
+#endif
     if (s->needs_alignment && !bdrv_qiov_is_aligned(bs, qiov)) {
         type |= QEMU_AIO_MISALIGNED;
 #ifdef CONFIG_LINUX_IO_URING
-    } else if (raw_check_linux_io_uring(s)) {
+    } else if (raw_check_linux_io_uring(s, ring_flags)) {
         assert(qiov->size == bytes);
-        ret = luring_co_submit(bs, s->fd, offset, qiov, type);
+        ret = luring_co_submit(bs, s->fd, s->luring_fd_index, offset, qiov,
+                               type, ring_flags,
+                               s->luring_bufs &&
+                               (flags & BDRV_REQ_REGISTERED_BUF));
+        if (ret == -EOPNOTSUPP && (ring_flags & LURING_IOPOLL)) {
+            /*
+             * The file doesn't support polling, or O_DIRECT has been
+             * disabled by a reopen.  Nothing was done for the request.
+             */
+            if (s->luring_flags & LURING_IOPOLL) {
+                warn_report("'%s' does not support polled I/O, waiting for "
+                            "interrupts instead", bs->filename);
+                s->luring_flags &= ~LURING_IOPOLL;
+            }
+            goto retry;
+        }
         goto out;
 #endif
 #ifdef CONFIG_LINUX_AIO
@@ -2571,14 +2668,14 @@ static int coroutine_fn raw_co_preadv(BlockDriverState *bs, int64_t offset,
                                       int64_t bytes, QEMUIOVector *qiov,
                                       BdrvRequestFlags flags)
 {
-    return raw_co_prw(bs, &offset, bytes, qiov, QEMU_AIO_READ);
+    return raw_co_prw(bs, &offset, bytes, qiov, QEMU_AIO_READ, flags);
 }
 
 static int coroutine_fn raw_co_pwritev(BlockDriverState *bs, int64_t offset,
                                        int64_t bytes, QEMUIOVector *qiov,
                                        BdrvRequestFlags flags)
 {
-    return raw_co_prw(bs, &offset, bytes, qiov, QEMU_AIO_WRITE);
+    return raw_co_prw(bs, &offset, bytes, qiov, QEMU_AIO_WRITE, flags);
 }
 
 static int coroutine_fn raw_co_flush_to_disk(BlockDriverState *bs)
@@ -2599,8 +2696,11 @@ static int coroutine_fn raw_co_flush_to_disk(BlockDriverState *bs)
     };
 
 #ifdef CONFIG_LINUX_IO_URING
-    if (raw_check_linux_io_uring(s)) {
-        return luring_co_submit(bs, s->fd, 0, NULL, QEMU_AIO_FLUSH);
+    /* Polled rings only read and write, so flush through a normal one */
+    if (raw_check_linux_io_uring(s, s->luring_flags & ~LURING_IOPOLL)) {
+        return luring_co_submit(bs, s->fd, s->luring_fd_index, 0, NULL,
+                                QEMU_AIO_FLUSH,
+                                s->luring_flags & ~LURING_IOPOLL, false);
     }
 #endif
 #ifdef CONFIG_LINUX_AIO
@@ -2611,6 +2711,63 @@ static int coroutine_fn raw_co_flush_to_disk(BlockDriverState *bs)
     return raw_thread_pool_submit(handle_aiocb_flush, &acb);
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+static bool raw_register_buf(BlockDriverState *bs, void *host, size_t size,
+                             Error **errp)
+{
+    BDRVRawState *s = bs->opaque;
+    struct iovec iov = { .iov_base = host, .iov_len = size };
+
+    if (!s->luring_bufs) {
+        return true;
+    }
+
+    if (!luring_register_buf(host, size, errp)) {
+        return false;
+    }
+    g_array_append_val(s->luring_bufs, iov);
+    return true;
+}
+
+static void raw_unregister_buf(BlockDriverState *bs, void *host, size_t size)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (!s->luring_bufs) {
+        return;
+    }
+
+    for (guint i = 0; i < s->luring_bufs->len; i++) {
+        struct iovec *iov = &g_array_index(s->luring_bufs, struct iovec, i);
+
+        if (iov->iov_base == host && iov->iov_len == size) {
+            luring_unregister_buf(host, size);
+            g_array_remove_index_fast(s->luring_bufs, i);
+            return;
+        }
+    }
+}
+
+/* Drop what the node still has registered with io_uring */
+static void raw_luring_close(BDRVRawState *s)
+{
+    if (s->luring_fd_index >= 0) {
+        luring_unregister_file(s->luring_fd_index);
+        s->luring_fd_index = -1;
+    }
+
+    if (s->luring_bufs) {
+        for (guint i = 0; i < s->luring_bufs->len; i++) {
+            struct iovec *iov = &g_array_index(s->luring_bufs, struct iovec, i);
+            luring_unregister_buf(iov->iov_base, iov->iov_len);
+        }
+        g_array_free(s->luring_bufs, true);
+        s->luring_bufs = NULL;
+        ram_block_discard_disable(false);
+    }
+}
+#endif
+
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
@@ -2618,6 +2775,9 @@ static void raw_close(BlockDriverState *bs)
     if (s->fd >= 0) {
 #if defined(CONFIG_BLKZONED)
         g_free(bs->wps);
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+        raw_luring_close(s);
 #endif
         qemu_close(s->fd);
         s->fd = -1;
@@ -3540,7 +3700,7 @@ static int coroutine_fn raw_co_zone_append(BlockDriverState *bs,
     }
 
     trace_zbd_zone_append(bs, *offset >> BDRV_SECTOR_BITS);
-    return raw_co_prw(bs, offset, len, qiov, QEMU_AIO_ZONE_APPEND);
+    return raw_co_prw(bs, offset, len, qiov, QEMU_AIO_ZONE_APPEND, 0);
 }
 #endif
 
@@ -3809,6 +3969,12 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
     /* For reopen, we have already switched to the new fd (.bdrv_set_perm is
      * called after .bdrv_reopen_commit) */
     if (s->perm_change_fd && s->fd != s->perm_change_fd) {
+#ifdef CONFIG_LINUX_IO_URING
+        if (s->luring_fd_index >= 0) {
+            luring_unregister_file(s->luring_fd_index);
+            s->luring_fd_index = luring_register_file(s->perm_change_fd);
+        }
+#endif
         qemu_close(s->fd);
         s->fd = s->perm_change_fd;
         s->open_flags = s->perm_change_flags;
@@ -3916,6 +4082,10 @@ BlockDriver bdrv_file = {
     .bdrv_check_perm = raw_check_perm,
     .bdrv_set_perm   = raw_set_perm,
     .bdrv_abort_perm_update = raw_abort_perm_update,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
+#endif
     .create_opts = &raw_create_opts,
     .mutable_opts = mutable_opts,
 };
@@ -4282,6 +4452,10 @@ static BlockDriver bdrv_host_device = {
     .bdrv_abort_perm_update = raw_abort_perm_update,
     .bdrv_probe_blocksizes = hdev_probe_blocksizes,
     .bdrv_probe_geometry = hdev_probe_geometry,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
+#endif
 
     /* generic scsi device */
 #ifdef __linux__
@@ -16,6 +16,9 @@
 #include "block/raw-aio.h"
 #include "qemu/coroutine.h"
 #include "qemu/defer-call.h"
+#include "qemu/bitmap.h"
+#include "qemu/rcu.h"
+#include "qemu/units.h"
 #include "qapi/error.h"
 #include "sysemu/block-backend.h"
 #include "trace.h"
@@ -26,6 +29,19 @@
 /* io_uring ring size */
 #define MAX_ENTRIES 128
 
+/* Idle time after which the submission thread of a LURING_SQPOLL ring sleeps */
+#define LURING_SQPOLL_IDLE_MS 100
+
+/* Size of the registered file table of each ring */
+#define LURING_MAX_FILES 1024
+
+/*
+ * Size of the fixed buffer table of each ring.  The kernel limits fixed
+ * buffers to 1 GiB, so larger buffers take several consecutive entries.
+ */
+#define LURING_MAX_BUFS 1024
+#define LURING_BUF_SIZE (1 * GiB)
+
 typedef struct LuringAIOCB {
     Coroutine *co;
     struct io_uring_sqe sqeq;
@@ -42,6 +58,22 @@ typedef struct LuringAIOCB {
     QEMUIOVector resubmit_qiov;
 } LuringAIOCB;
 
+typedef struct LuringBuf {
+    uint8_t *host;
+    size_t size;
+    /* Fixed buffer table index of the first LURING_BUF_SIZE bytes */
+    unsigned int first_index;
+    /* Only accessed under luring_lock */
+    unsigned int refcnt;
+} LuringBuf;
+
+/* List of the registered buffers, replaced as a whole under RCU */
+typedef struct LuringBufList {
+    struct rcu_head rcu;
+    unsigned int nbufs;
+    LuringBuf bufs[];
+} LuringBufList;
+
 typedef struct LuringQueue {
     unsigned int in_queue;
     unsigned int in_flight;
@@ -58,8 +90,43 @@ struct LuringState {
     LuringQueue io_q;
 
     QEMUBH *completion_bh;
+
+    /* LURING_* flags the ring was set up with */
+    unsigned int flags;
+
+    /* Whether the ring has the registered files and buffers */
+    bool fixed_files;
+    bool fixed_bufs;
+
+    /* Whether aio_context_set_busy_poll() is in effect */
+    bool busy_poll;
+
+    /* Protected by luring_lock */
+    QLIST_ENTRY(LuringState) next;
 };
 
+/*
+ * Files and buffers are registered with all rings at the same index, so
+ * that requests can use them whichever AioContext they are submitted in.
+ */
+static QemuMutex luring_lock;
+static QLIST_HEAD(, LuringState) luring_rings =
+    QLIST_HEAD_INITIALIZER(luring_rings);
+static int luring_files[LURING_MAX_FILES];
+#ifdef HAVE_IO_URING_REGISTER_SPARSE
+static DECLARE_BITMAP(luring_used_bufs, LURING_MAX_BUFS);
+#endif
+/* Written under luring_lock, read under RCU */
+static LuringBufList *luring_bufs;
+
+static void __attribute__((constructor)) luring_global_init(void)
+{
+    qemu_mutex_init(&luring_lock);
+    for (int i = 0; i < LURING_MAX_FILES; i++) {
+        luring_files[i] = -1;
+    }
+}
+
 /**
  * luring_resubmit:
  *
@@ -90,6 +157,15 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
     luringcb->total_read += nread;
     remaining = luringcb->qiov->size - luringcb->total_read;
 
+    if (luringcb->sqeq.opcode == IORING_OP_READ_FIXED) {
+        /* Fixed buffers are contiguous, just skip what has been read */
+        luringcb->sqeq.off += nread;
+        luringcb->sqeq.addr += nread;
+        luringcb->sqeq.len = remaining;
+        luring_resubmit(s, luringcb);
+        return;
+    }
+
     /* Shorten qiov */
     resubmit_qiov = &luringcb->resubmit_qiov;
     if (resubmit_qiov->iov == NULL) {
@@ -108,6 +184,40 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
     luring_resubmit(s, luringcb);
 }
 
+/*
+ * The completions of a LURING_IOPOLL ring are only found when the kernel is
+ * entered to poll the device for them, unless the submission thread of a
+ * LURING_SQPOLL ring does so.
+ */
+static bool luring_polls_completions(LuringState *s)
+{
+    return (s->flags & (LURING_IOPOLL | LURING_SQPOLL)) == LURING_IOPOLL;
+}
+
+static void luring_poll_completions(LuringState *s)
+{
+#ifdef HAVE_IO_URING_GET_EVENTS
+    if (luring_polls_completions(s) && s->io_q.in_flight &&
+        !io_uring_cq_ready(&s->ring)) {
+        io_uring_get_events(&s->ring);
+    }
+#endif
+}
+
+/*
+ * Polled completions don't make the ring fd ready, so the AioContext must
+ * keep polling while any are outstanding.
+ */
+static void luring_update_busy_poll(LuringState *s)
+{
+    bool busy = luring_polls_completions(s) && s->io_q.in_flight;
+
+    if (busy != s->busy_poll) {
+        s->busy_poll = busy;
+        aio_context_set_busy_poll(s->aio_context, busy);
+    }
+}
+
 /**
  * luring_process_completions:
  * @s: AIO state
@@ -145,6 +255,7 @@ static void luring_process_completions(LuringState *s)
      */
     qemu_bh_schedule(s->completion_bh);
 
+    luring_poll_completions(s);
     while (io_uring_peek_cqe(&s->ring, &cqes) == 0) {
         LuringAIOCB *luringcb;
         int ret;
@@ -222,6 +333,7 @@ end:
     }
 
     qemu_bh_cancel(s->completion_bh);
+    luring_update_busy_poll(s);
 
     defer_call_end();
 }
@@ -267,6 +379,7 @@ static int ioq_submit(LuringState *s)
          */
         luring_process_completions(s);
     }
+    luring_update_busy_poll(s);
     return ret;
 }
 
@@ -295,6 +408,17 @@ static bool qemu_luring_poll_cb(void *opaque)
 {
     LuringState *s = opaque;
 
+#ifdef IORING_SQ_TASKRUN
+    /*
+     * With IORING_SETUP_COOP_TASKRUN, completions may wait for this thread
+     * to enter the kernel.  io_uring_peek_cqe() takes care of that.
+     */
+    if (qatomic_read(s->ring.sq.kflags) & IORING_SQ_TASKRUN) {
+        return true;
+    }
+#endif
+
+    luring_poll_completions(s);
     return io_uring_cq_ready(&s->ring);
 }
 
@@ -323,35 +447,88 @@ static void luring_deferred_fn(void *opaque)
     }
 }
 
+/**
+ * luring_find_buf:
+ *
+ * Returns the index of the fixed buffer that contains all of @len bytes at
+ * @base, or -1 if there is none.
+ */
+static int luring_find_buf(void *base, size_t len)
+{
+    uint8_t *p = base;
+    LuringBufList *list;
+
+    RCU_READ_LOCK_GUARD();
+
+    list = qatomic_rcu_read(&luring_bufs);
+    if (!list) {
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < list->nbufs; i++) {
+        LuringBuf *b = &list->bufs[i];
+        size_t offset = p - b->host;
+
+        if (p < b->host || len > b->size || offset > b->size - len) {
+            continue;
+        }
+        if (offset / LURING_BUF_SIZE != (offset + len - 1) / LURING_BUF_SIZE) {
+            return -1;
+        }
+        return b->first_index + offset / LURING_BUF_SIZE;
+    }
+
+    return -1;
+}
+
 /**
  * luring_do_submit:
  * @fd: file descriptor for I/O
+ * @fd_index: index of @fd in the registered file table, or -1
  * @luringcb: AIO control block
  * @s: AIO state
  * @offset: offset for request
  * @type: type of request
+ * @registered_buf: whether the buffer may be a registered one
  *
  * Fetches sqes from ring, adds to pending queue and preps them
  *
  */
-static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
-                            uint64_t offset, int type)
+static int luring_do_submit(int fd, int fd_index, LuringAIOCB *luringcb,
+                            LuringState *s, uint64_t offset, int type,
+                            bool registered_buf)
 {
     int ret;
     struct io_uring_sqe *sqes = &luringcb->sqeq;
+    QEMUIOVector *qiov = luringcb->qiov;
+    bool fixed_file = fd_index >= 0 && s->fixed_files;
+    int buf_index = -1;
+
+    if (fixed_file) {
+        fd = fd_index;
+    }
+    if (registered_buf && s->fixed_bufs && qiov->niov == 1) {
+        buf_index = luring_find_buf(qiov->iov[0].iov_base,
+                                    qiov->iov[0].iov_len);
+    }
 
     switch (type) {
     case QEMU_AIO_WRITE:
-        io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
-                             luringcb->qiov->niov, offset);
-        break;
     case QEMU_AIO_ZONE_APPEND:
-        io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
-                             luringcb->qiov->niov, offset);
+        if (buf_index >= 0) {
+            io_uring_prep_write_fixed(sqes, fd, qiov->iov[0].iov_base,
+                                      qiov->iov[0].iov_len, offset, buf_index);
+        } else {
+            io_uring_prep_writev(sqes, fd, qiov->iov, qiov->niov, offset);
+        }
         break;
     case QEMU_AIO_READ:
-        io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
-                            luringcb->qiov->niov, offset);
+        if (buf_index >= 0) {
+            io_uring_prep_read_fixed(sqes, fd, qiov->iov[0].iov_base,
+                                     qiov->iov[0].iov_len, offset, buf_index);
+        } else {
+            io_uring_prep_readv(sqes, fd, qiov->iov, qiov->niov, offset);
+        }
         break;
     case QEMU_AIO_FLUSH:
         io_uring_prep_fsync(sqes, fd, IORING_FSYNC_DATASYNC);
@@ -361,6 +538,9 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                         __func__, type);
         abort();
     }
+    if (fixed_file) {
+        sqes->flags |= IOSQE_FIXED_FILE;
+    }
     io_uring_sqe_set_data(sqes, luringcb);
 
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
@@ -379,12 +559,14 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
     return 0;
 }
 
-int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
-                                  QEMUIOVector *qiov, int type)
+int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, int fd_index,
+                                  uint64_t offset, QEMUIOVector *qiov,
+                                  int type, unsigned int ring_flags,
+                                  bool registered_buf)
 {
     int ret;
     AioContext *ctx = qemu_get_current_aio_context();
-    LuringState *s = aio_get_linux_io_uring(ctx);
+    LuringState *s = aio_get_linux_io_uring(ctx, ring_flags);
     LuringAIOCB luringcb = {
         .co         = qemu_coroutine_self(),
         .ret        = -EINPROGRESS,
@@ -393,7 +575,8 @@ int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
     };
     trace_luring_co_submit(bs, s, &luringcb, fd, offset, qiov ? qiov->size : 0,
                            type);
-    ret = luring_do_submit(fd, &luringcb, s, offset, type);
+    ret = luring_do_submit(fd, fd_index, &luringcb, s, offset, type,
+                           registered_buf);
 
     if (ret < 0) {
         return ret;
@@ -409,6 +592,10 @@ void luring_detach_aio_context(LuringState *s, AioContext *old_context)
 {
     aio_set_fd_handler(old_context, s->ring.ring_fd,
                        NULL, NULL, NULL, NULL, s);
+    if (s->busy_poll) {
+        aio_context_set_busy_poll(old_context, false);
+        s->busy_poll = false;
+    }
     qemu_bh_delete(s->completion_bh);
     s->aio_context = NULL;
 }
@@ -422,28 +609,344 @@ void luring_attach_aio_context(LuringState *s, AioContext *new_context)
                        qemu_luring_poll_cb, qemu_luring_poll_ready, s);
 }
 
-LuringState *luring_init(Error **errp)
+#ifdef HAVE_IO_URING_REGISTER_SPARSE
+/*
+ * Point the @size bytes of fixed buffers from @first_index of @s to @host,
+ * or clear them if @host is NULL.  Called with luring_lock held.
+ */
+static int luring_update_bufs(LuringState *s, unsigned int first_index,
+                              uint8_t *host, size_t size)
+{
+    unsigned int n = DIV_ROUND_UP(size, LURING_BUF_SIZE);
+    g_autofree struct iovec *iov = g_new0(struct iovec, n);
+    int ret;
+
+    for (unsigned int i = 0; host && i < n; i++) {
+        iov[i].iov_base = host + (size_t)i * LURING_BUF_SIZE;
+        iov[i].iov_len = MIN(size - (size_t)i * LURING_BUF_SIZE,
+                             LURING_BUF_SIZE);
+    }
+
+    ret = io_uring_register_buffers_update_tag(&s->ring, first_index, iov,
+                                               NULL, n);
+    return ret < 0 ? ret : 0;
+}
+
+/* Give the new ring @s the registered files and buffers */
+static void luring_add_ring(LuringState *s)
+{
+    QEMU_LOCK_GUARD(&luring_lock);
+
+    if (io_uring_register_files_sparse(&s->ring, LURING_MAX_FILES) == 0) {
+        s->fixed_files = true;
+        for (int i = 0; i < LURING_MAX_FILES; i++) {
+            if (luring_files[i] != -1 &&
+                io_uring_register_files_update(&s->ring, i, &luring_files[i],
+                                               1) < 0) {
+                io_uring_unregister_files(&s->ring);
+                s->fixed_files = false;
+                break;
+            }
+        }
+    }
+
+    if (io_uring_register_buffers_sparse(&s->ring, LURING_MAX_BUFS) == 0) {
+        s->fixed_bufs = true;
+        for (unsigned int i = 0; luring_bufs && i < luring_bufs->nbufs; i++) {
+            LuringBuf *b = &luring_bufs->bufs[i];
+
+            if (luring_update_bufs(s, b->first_index, b->host, b->size) < 0) {
+                io_uring_unregister_buffers(&s->ring);
+                s->fixed_bufs = false;
+                break;
+            }
+        }
+    }
+
+    QLIST_INSERT_HEAD(&luring_rings, s, next);
+}
+
+/**
+ * luring_register_file:
+ *
+ * Register @fd with all rings, present and future.  Returns its index in
+ * the registered file table, or -1 if it could not be registered, in which
+ * case requests just use @fd.
+ */
+int luring_register_file(int fd)
+{
+    LuringState *s, *failed = NULL;
+    int index, none = -1;
+
+    QEMU_LOCK_GUARD(&luring_lock);
+
+    for (index = 0; index < LURING_MAX_FILES; index++) {
+        if (luring_files[index] == -1) {
+            break;
+        }
+    }
+    if (index == LURING_MAX_FILES) {
+        return -1;
+    }
+
+    QLIST_FOREACH(s, &luring_rings, next) {
+        if (s->fixed_files &&
+            io_uring_register_files_update(&s->ring, index, &fd, 1) < 0) {
+            failed = s;
+            break;
+        }
+    }
+    if (failed) {
+        QLIST_FOREACH(s, &luring_rings, next) {
+            if (s == failed) {
+                break;
+            }
+            if (s->fixed_files) {
+                io_uring_register_files_update(&s->ring, index, &none, 1);
+            }
+        }
+        return -1;
+    }
+
+    luring_files[index] = fd;
+    trace_luring_register_file(fd, index);
+    return index;
+}
+
+/*
+ * Drop the file at @index from all rings.  Requests in flight keep the file
+ * referenced, but no new ones may use the index.
+ */
+void luring_unregister_file(int index)
+{
+    LuringState *s;
+    int none = -1;
+
+    QEMU_LOCK_GUARD(&luring_lock);
+
+    QLIST_FOREACH(s, &luring_rings, next) {
+        if (s->fixed_files) {
+            io_uring_register_files_update(&s->ring, index, &none, 1);
+        }
+    }
+    luring_files[index] = -1;
+}
+
+/**
+ * luring_register_buf:
+ *
+ * Register @size bytes at @host as fixed buffers with all rings, present
+ * and future.  This pins the memory and counts against RLIMIT_MEMLOCK once
+ * for each ring.  The same buffer may be registered several times and is
+ * only dropped when it has been unregistered as many times.
+ */
+bool luring_register_buf(void *host, size_t size, Error **errp)
+{
+    unsigned int n = DIV_ROUND_UP(size, LURING_BUF_SIZE);
+    LuringBufList *old, *new;
+    LuringState *s, *failed = NULL;
+    unsigned long first_index;
+    unsigned int nbufs;
+    int ret = 0;
+
+    QEMU_LOCK_GUARD(&luring_lock);
+
+    old = luring_bufs;
+    nbufs = old ? old->nbufs : 0;
+
+    for (unsigned int i = 0; i < nbufs; i++) {
+        if (old->bufs[i].host == host && old->bufs[i].size == size) {
+            old->bufs[i].refcnt++;
+            return true;
+        }
+    }
+
+    first_index = bitmap_find_next_zero_area(luring_used_bufs, LURING_MAX_BUFS,
+                                             0, n, 0);
+    if (first_index >= LURING_MAX_BUFS) {
+        error_setg(errp, "Too many io_uring fixed buffers to register %p "
+                   "with size %zu", host, size);
+        return false;
+    }
+
+    QLIST_FOREACH(s, &luring_rings, next) {
+        if (s->fixed_bufs) {
+            ret = luring_update_bufs(s, first_index, host, size);
+            if (ret < 0) {
+                failed = s;
+                break;
+            }
+        }
+    }
+    if (failed) {
+        QLIST_FOREACH(s, &luring_rings, next) {
+            if (s == failed) {
+                break;
+            }
+            if (s->fixed_bufs) {
+                luring_update_bufs(s, first_index, NULL, size);
+            }
+        }
+        error_setg_errno(errp, -ret, "Failed to register buffer %p with size "
+                         "%zu with io_uring", host, size);
+        return false;
+    }
+
+    bitmap_set(luring_used_bufs, first_index, n);
+
+    new = g_malloc(sizeof(*new) + (nbufs + 1) * sizeof(LuringBuf));
+    new->nbufs = nbufs + 1;
+    if (nbufs) {
+        memcpy(new->bufs, old->bufs, nbufs * sizeof(LuringBuf));
+    }
+    new->bufs[nbufs] = (LuringBuf) {
+        .host = host,
+        .size = size,
+        .first_index = first_index,
+        .refcnt = 1,
+    };
+    qatomic_rcu_set(&luring_bufs, new);
+    if (old) {
+        g_free_rcu(old, rcu);
+    }
+
+    trace_luring_register_buf(host, size, first_index, n);
+    return true;
+}
+
+void luring_unregister_buf(void *host, size_t size)
+{
+    LuringBufList *old, *new;
+    LuringBuf b;
+    LuringState *s;
+    unsigned int i, nbufs;
+
+    QEMU_LOCK_GUARD(&luring_lock);
+
+    old = luring_bufs;
+    nbufs = old ? old->nbufs : 0;
+
+    for (i = 0; i < nbufs; i++) {
+        if (old->bufs[i].host == host && old->bufs[i].size == size) {
+            break;
+        }
+    }
+    if (i == nbufs || --old->bufs[i].refcnt) {
+        return;
+    }
+
+    b = old->bufs[i];
+    new = g_malloc(sizeof(*new) + (nbufs - 1) * sizeof(LuringBuf));
+    new->nbufs = nbufs - 1;
+    memcpy(new->bufs, old->bufs, i * sizeof(LuringBuf));
+    memcpy(&new->bufs[i], &old->bufs[i + 1],
+           (nbufs - i - 1) * sizeof(LuringBuf));
+    qatomic_rcu_set(&luring_bufs, new);
+    g_free_rcu(old, rcu);
+
+    /*
+     * Wait until no request can be looking up the buffer anymore.  The
+     * kernel keeps the memory of requests in flight pinned by itself.
+     */
+    synchronize_rcu();
+
+    QLIST_FOREACH(s, &luring_rings, next) {
+        if (s->fixed_bufs) {
+            luring_update_bufs(s, b.first_index, NULL, b.size);
+        }
+    }
+    bitmap_clear(luring_used_bufs, b.first_index,
+                 DIV_ROUND_UP(b.size, LURING_BUF_SIZE));
+}
+#else
+static void luring_add_ring(LuringState *s)
+{
+    QEMU_LOCK_GUARD(&luring_lock);
+    QLIST_INSERT_HEAD(&luring_rings, s, next);
+}
+
+int luring_register_file(int fd)
+{
+    return -1;
+}
+
+void luring_unregister_file(int index)
+{
+}
+
+/* Without sparse tables, requests simply don't use fixed buffers */
+bool luring_register_buf(void *host, size_t size, Error **errp)
+{
+    return true;
+}
+
+void luring_unregister_buf(void *host, size_t size)
+{
+}
+#endif
+
+LuringState *luring_init(unsigned int flags, Error **errp)
 {
     int rc;
     LuringState *s = g_new0(LuringState, 1);
     struct io_uring *ring = &s->ring;
+    struct io_uring_params params = {};
+    unsigned int setup_flags = 0;
+
+    if (flags & LURING_IOPOLL) {
+#ifdef HAVE_IO_URING_GET_EVENTS
+        setup_flags |= IORING_SETUP_IOPOLL;
+#else
+        error_setg(errp, "polled io_uring completions are not supported by "
+                   "this build");
+        g_free(s);
+        return NULL;
+#endif
+    }
 
-    trace_luring_init_state(s, sizeof(*s));
+    if (flags & LURING_SQPOLL) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = LURING_SQPOLL_IDLE_MS;
+    } else {
+#ifdef IORING_SETUP_COOP_TASKRUN
+        /*
+         * Completions are only ever reaped by the AioContext thread, so
+         * there is no need to interrupt it when they are posted.
+         */
+        params.flags |= IORING_SETUP_COOP_TASKRUN | IORING_SETUP_TASKRUN_FLAG;
+#endif
+    }
 
-    rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
+    params.flags |= setup_flags;
+    rc = io_uring_queue_init_params(MAX_ENTRIES, ring, &params);
+#ifdef IORING_SETUP_COOP_TASKRUN
+    if (rc == -EINVAL && !(flags & LURING_SQPOLL)) {
+        /* Kernels before 5.19 don't know IORING_SETUP_COOP_TASKRUN */
+        params = (struct io_uring_params) { .flags = setup_flags };
+        rc = io_uring_queue_init_params(MAX_ENTRIES, ring, &params);
+    }
+#endif
     if (rc < 0) {
         error_setg_errno(errp, -rc, "failed to init linux io_uring ring");
         g_free(s);
         return NULL;
     }
 
+    s->flags = flags;
     ioq_init(&s->io_q);
+    luring_add_ring(s);
+
+    trace_luring_init_state(s, sizeof(*s), flags, s->fixed_files,
+                            s->fixed_bufs);
     return s;
 
 }
 
 void luring_cleanup(LuringState *s)
 {
+    WITH_QEMU_LOCK_GUARD(&luring_lock) {
+        QLIST_REMOVE(s, next);
+    }
     io_uring_queue_exit(&s->ring);
     trace_luring_cleanup_state(s);
     g_free(s);
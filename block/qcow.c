@@ -1052,8 +1052,8 @@ static int GRAPH_RDLOCK qcow_make_empty(BlockDriverState *bs)
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
 static int coroutine_fn GRAPH_RDLOCK
-qcow_co_pwritev_compressed(BlockDriverState *bs, int64_t offset, int64_t bytes,
-                           QEMUIOVector *qiov)
+qcow_co_pwritev_compressed_cluster(BlockDriverState *bs, int64_t offset,
+                                   int64_t bytes, QEMUIOVector *qiov)
 {
     BDRVQcowState *s = bs->opaque;
     z_stream strm;
@@ -1134,6 +1134,40 @@ fail:
     return ret;
 }
 
+static int coroutine_fn GRAPH_RDLOCK
+qcow_co_pwritev_compressed(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                           QEMUIOVector *qiov)
+{
+    BDRVQcowState *s = bs->opaque;
+    QEMUIOVector local_qiov;
+    size_t qiov_offset = 0;
+    int ret = 0;
+
+    if (bytes <= s->cluster_size) {
+        return qcow_co_pwritev_compressed_cluster(bs, offset, bytes, qiov);
+    }
+
+    if (offset & (s->cluster_size - 1)) {
+        return -EINVAL;
+    }
+
+    /* Compress the clusters of larger requests one by one */
+    while (bytes && ret == 0) {
+        int64_t chunk_size = MIN(bytes, s->cluster_size);
+
+        qemu_iovec_init_slice(&local_qiov, qiov, qiov_offset, chunk_size);
+        ret = qcow_co_pwritev_compressed_cluster(bs, offset, chunk_size,
+                                                 &local_qiov);
+        qemu_iovec_destroy(&local_qiov);
+
+        qiov_offset += chunk_size;
+        offset += chunk_size;
+        bytes -= chunk_size;
+    }
+
+    return ret;
+}
+
 static int coroutine_fn
 qcow_co_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
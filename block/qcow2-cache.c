@@ -25,6 +25,7 @@
 #include "qemu/osdep.h"
 #include "block/block-io.h"
 #include "qemu/memalign.h"
+#include "qemu/rcu_queue.h"
 #include "qcow2.h"
 #include "trace.h"
 
@@ -33,6 +34,10 @@ typedef struct Qcow2CachedTable {
     uint64_t lru_counter;
     int      ref;
     bool     dirty;
+    /* In the hash bucket of @offset while @offset is non-zero */
+    QLIST_ENTRY(Qcow2CachedTable) hash_next;
+    /* In the LRU list while @ref is zero */
+    QTAILQ_ENTRY(Qcow2CachedTable) lru_next;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
@@ -44,6 +49,23 @@ struct Qcow2Cache {
     void                   *table_array;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+
+    /*
+     * Cached tables are looked up by offset in a hash table with at least
+     * as many buckets as there are entries.  The unused tables are kept
+     * in a list from the least to the most recently used one, with empty
+     * entries at the front, so that a lookup or a replacement does not
+     * depend on the size of the cache.
+     */
+    QLIST_HEAD(Qcow2CacheBucket, Qcow2CachedTable) *buckets;
+    int                     hash_bits;
+    QTAILQ_HEAD(, Qcow2CachedTable) lru;
+
+    /*
+     * Written whenever a table is added to or dropped from the hash table,
+     * NULL if the cache is not looked up without s->lock
+     */
+    QemuSeqLock            *seqlock;
 };
 
 static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int table)
@@ -59,6 +81,59 @@ static inline int qcow2_cache_get_table_idx(Qcow2Cache *c, void *table)
     return idx;
 }
 
+static inline int qcow2_cache_get_entry_idx(Qcow2Cache *c, Qcow2CachedTable *t)
+{
+    return t - c->entries;
+}
+
+static inline uint64_t qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    /* Fibonacci hashing spreads strided metadata offsets over all buckets */
+    return (offset / c->table_size * 0x9e3779b97f4a7c15ULL) >>
+           (64 - c->hash_bits);
+}
+
+static Qcow2CachedTable *qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    Qcow2CachedTable *t;
+
+    QLIST_FOREACH(t, &c->buckets[qcow2_cache_hash(c, offset)], hash_next) {
+        if (t->offset == offset) {
+            return t;
+        }
+    }
+    return NULL;
+}
+
+static void qcow2_cache_set_offset(Qcow2Cache *c, Qcow2CachedTable *t,
+                                   uint64_t offset)
+{
+    if (c->seqlock) {
+        seqlock_write_begin(c->seqlock);
+    }
+    if (t->offset) {
+        QLIST_REMOVE_RCU(t, hash_next);
+    }
+    t->offset = offset;
+    if (offset) {
+        QLIST_INSERT_HEAD_RCU(&c->buckets[qcow2_cache_hash(c, offset)], t,
+                              hash_next);
+    }
+    if (c->seqlock) {
+        seqlock_write_end(c->seqlock);
+    }
+}
+
+/* Drop the table of an unused entry and make it the next one to replace */
+static void qcow2_cache_entry_clear(Qcow2Cache *c, Qcow2CachedTable *t)
+{
+    assert(t->ref == 0);
+    qcow2_cache_set_offset(c, t, 0);
+    t->lru_counter = 0;
+    QTAILQ_REMOVE(&c->lru, t, lru_next);
+    QTAILQ_INSERT_HEAD(&c->lru, t, lru_next);
+}
+
 static inline const char *qcow2_cache_get_name(BDRVQcow2State *s, Qcow2Cache *c)
 {
     if (c == s->refcount_block_cache) {
@@ -106,8 +181,7 @@ void qcow2_cache_clean_unused(Qcow2Cache *c)
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
-            c->entries[i].lru_counter = 0;
+            qcow2_cache_entry_clear(c, &c->entries[i]);
             i++;
             to_clean++;
         }
@@ -121,10 +195,11 @@ void qcow2_cache_clean_unused(Qcow2Cache *c)
 }
 
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
-                               unsigned table_size)
+                               unsigned table_size, QemuSeqLock *seqlock)
 {
     BDRVQcow2State *s = bs->opaque;
     Qcow2Cache *c;
+    int i;
 
     assert(num_tables > 0);
     assert(is_power_of_2(table_size));
@@ -134,15 +209,24 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
     c->table_size = table_size;
+    c->seqlock = seqlock;
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
     c->table_array = qemu_try_blockalign(bs->file->bs,
                                          (size_t) num_tables * c->table_size);
+    c->hash_bits = MAX(ctz32(pow2ceil(num_tables)), 1);
+    c->buckets = g_try_new0(struct Qcow2CacheBucket, 1 << c->hash_bits);
 
-    if (!c->entries || !c->table_array) {
+    if (!c->entries || !c->table_array || !c->buckets) {
         qemu_vfree(c->table_array);
         g_free(c->entries);
+        g_free(c->buckets);
         g_free(c);
-        c = NULL;
+        return NULL;
+    }
+
+    QTAILQ_INIT(&c->lru);
+    for (i = 0; i < num_tables; i++) {
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru_next);
     }
 
     return c;
@@ -158,6 +242,7 @@ int qcow2_cache_destroy(Qcow2Cache *c)
 
     qemu_vfree(c->table_array);
     g_free(c->entries);
+    g_free(c->buckets);
     g_free(c);
 
     return 0;
@@ -308,9 +393,7 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
     }
 
     for (i = 0; i < c->size; i++) {
-        assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
-        c->entries[i].lru_counter = 0;
+        qcow2_cache_entry_clear(c, &c->entries[i]);
     }
 
     qcow2_cache_table_release(c, 0, c->size);
@@ -325,11 +408,9 @@ qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
                    void **table, bool read_from_disk)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2CachedTable *t;
     int i;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     assert(offset != 0);
 
@@ -344,29 +425,24 @@ qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     }
 
     /* Check if the table is already cached */
-    i = lookup_index = (offset / c->table_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
-        }
-        if (++i == c->size) {
-            i = 0;
+    t = qcow2_cache_lookup(c, offset);
+    if (t) {
+        if (c == s->l2_table_cache) {
+            stat64_add(&s->l2_cache_hits, 1);
         }
-    } while (i != lookup_index);
+        i = qcow2_cache_get_entry_idx(c, t);
+        goto found;
+    }
 
-    if (min_lru_index == -1) {
+    t = QTAILQ_FIRST(&c->lru);
+    if (!t) {
         /* This can't happen in current synchronous code, but leave the check
          * here as a reminder for whoever starts using AIO with the cache */
         abort();
     }
 
     /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
+    i = qcow2_cache_get_entry_idx(c, t);
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
 
@@ -377,10 +453,11 @@ qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    qcow2_cache_entry_clear(c, t);
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
+            stat64_add(&s->l2_cache_misses, 1);
         }
 
         ret = bdrv_pread(bs->file, offset, c->table_size,
@@ -390,11 +467,13 @@ qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
         }
     }
 
-    c->entries[i].offset = offset;
+    qcow2_cache_set_offset(c, t, offset);
 
     /* And return the right table */
 found:
-    c->entries[i].ref++;
+    if (t->ref++ == 0) {
+        QTAILQ_REMOVE(&c->lru, t, lru_next);
+    }
     *table = qcow2_cache_get_table_addr(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
@@ -424,6 +503,7 @@ void qcow2_cache_put(Qcow2Cache *c, void **table)
 
     if (c->entries[i].ref == 0) {
         c->entries[i].lru_counter = ++c->lru_counter;
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru_next);
     }
 
     assert(c->entries[i].ref >= 0);
@@ -438,11 +518,36 @@ void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset)
 {
-    int i;
+    Qcow2CachedTable *t = qcow2_cache_lookup(c, offset);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            return qcow2_cache_get_table_addr(c, i);
+    if (t) {
+        return qcow2_cache_get_table_addr(c, qcow2_cache_get_entry_idx(c, t));
+    }
+    return NULL;
+}
+
+/*
+ * Look up the table at @offset without taking a reference, which is for
+ * readers that do not hold s->lock.  The lookup and anything read from
+ * the table are only valid if the seqlock of the cache was not written
+ * in the meantime.  Entries are never freed while the cache exists, so
+ * following a stale hash chain is harmless; it is cut short in case
+ * entries move between chains while it is followed.
+ */
+void *qcow2_cache_lookup_lockless(Qcow2Cache *c, uint64_t offset)
+{
+    Qcow2CachedTable *t;
+    int n = 0;
+
+    assert(c->seqlock);
+
+    QLIST_FOREACH_RCU(t, &c->buckets[qcow2_cache_hash(c, offset)], hash_next) {
+        if (t->offset == offset) {
+            return qcow2_cache_get_table_addr(c,
+                                              qcow2_cache_get_entry_idx(c, t));
+        }
+        if (++n == c->size) {
+            break;
         }
     }
     return NULL;
@@ -452,10 +557,7 @@ void qcow2_cache_discard(Qcow2Cache *c, void *table)
 {
     int i = qcow2_cache_get_table_idx(c, table);
 
-    assert(c->entries[i].ref == 0);
-
-    c->entries[i].offset = 0;
-    c->entries[i].lru_counter = 0;
+    qcow2_cache_entry_clear(c, &c->entries[i]);
     c->entries[i].dirty = false;
 
     qcow2_cache_table_release(c, i, 1);
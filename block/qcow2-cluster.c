@@ -30,6 +30,7 @@
 #include "qcow2.h"
 #include "qemu/bswap.h"
 #include "qemu/memalign.h"
+#include "qemu/rcu.h"
 #include "trace.h"
 
 int coroutine_fn qcow2_shrink_l1_table(BlockDriverState *bs,
@@ -68,7 +69,9 @@ int coroutine_fn qcow2_shrink_l1_table(BlockDriverState *bs,
         }
         qcow2_free_clusters(bs, s->l1_table[i] & L1E_OFFSET_MASK,
                             s->cluster_size, QCOW2_DISCARD_ALWAYS);
+        qcow2_mapping_write_begin(s);
         s->l1_table[i] = 0;
+        qcow2_mapping_write_end(s);
     }
     return 0;
 
@@ -78,8 +81,10 @@ fail:
      * overwritten l1_table. In this case it would be better to clear the
      * l1_table in memory to avoid possible image corruption.
      */
+    qcow2_mapping_write_begin(s);
     memset(s->l1_table + new_l1_size, 0,
            (s->l1_size - new_l1_size) * L1E_SIZE);
+    qcow2_mapping_write_end(s);
     return ret;
 }
 
@@ -177,12 +182,14 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
     if (ret < 0) {
         goto fail;
     }
-    qemu_vfree(s->l1_table);
+    qcow2_free_l1_table(s->l1_table);
     old_l1_table_offset = s->l1_table_offset;
     s->l1_table_offset = new_l1_table_offset;
-    s->l1_table = new_l1_table;
     old_l1_size = s->l1_size;
+    qcow2_mapping_write_begin(s);
+    qatomic_rcu_set(&s->l1_table, new_l1_table);
     s->l1_size = new_l1_size;
+    qcow2_mapping_write_end(s);
     qcow2_free_clusters(bs, old_l1_table_offset, old_l1_size * L1E_SIZE,
                         QCOW2_DISCARD_OTHER);
     return 0;
@@ -193,6 +200,36 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
     return ret;
 }
 
+typedef struct Qcow2L1TableFree {
+    struct rcu_head rcu;
+    uint64_t *l1_table;
+} Qcow2L1TableFree;
+
+static void qcow2_free_l1_table_rcu(Qcow2L1TableFree *f)
+{
+    qemu_vfree(f->l1_table);
+    g_free(f);
+}
+
+/*
+ * Free an active L1 table that was replaced, once readers without
+ * s->lock can no longer be using it.
+ */
+void qcow2_free_l1_table(uint64_t *l1_table)
+{
+    Qcow2L1TableFree *f = g_new(Qcow2L1TableFree, 1);
+
+    f->l1_table = l1_table;
+    call_rcu(f, qcow2_free_l1_table_rcu, rcu);
+}
+
+/* Offset of the L2 slice that maps @offset within its L2 table */
+static inline int l2_slice_start(BDRVQcow2State *s, uint64_t offset)
+{
+    return l2_entry_size(s) *
+        (offset_to_l2_index(s, offset) - offset_to_l2_slice_index(s, offset));
+}
+
 /*
  * l2_load
  *
@@ -212,8 +249,7 @@ l2_load(BlockDriverState *bs, uint64_t offset,
         uint64_t l2_offset, uint64_t **l2_slice)
 {
     BDRVQcow2State *s = bs->opaque;
-    int start_of_slice = l2_entry_size(s) *
-        (offset_to_l2_index(s, offset) - offset_to_l2_slice_index(s, offset));
+    int start_of_slice = l2_slice_start(s, offset);
 
     return qcow2_cache_get(bs, s->l2_table_cache, l2_offset + start_of_slice,
                            (void **)l2_slice);
@@ -357,7 +393,9 @@ static int GRAPH_RDLOCK l2_allocate(BlockDriverState *bs, int l1_index)
 
     /* update the L1 entry */
     trace_qcow2_l2_allocate_write_l1(bs, l1_index);
+    qcow2_mapping_write_begin(s);
     s->l1_table[l1_index] = l2_offset | QCOW_OFLAG_COPIED;
+    qcow2_mapping_write_end(s);
     ret = qcow2_write_l1_entry(bs, l1_index);
     if (ret < 0) {
         goto fail;
@@ -371,7 +409,9 @@ fail:
     if (l2_slice != NULL) {
         qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
     }
+    qcow2_mapping_write_begin(s);
     s->l1_table[l1_index] = old_l2_offset;
+    qcow2_mapping_write_end(s);
     if (l2_offset > 0) {
         qcow2_free_clusters(bs, l2_offset, s->l2_size * l2_entry_size(s),
                             QCOW2_DISCARD_ALWAYS);
@@ -563,6 +603,155 @@ do_perform_cow_write(BlockDriverState *bs, uint64_t cluster_offset,
 }
 
 
+static void get_host_offset_bytes(BDRVQcow2State *s, uint64_t offset,
+                                  unsigned int bytes, uint64_t *bytes_needed,
+                                  uint64_t *bytes_available)
+{
+    *bytes_needed = (uint64_t) bytes + offset_into_cluster(s, offset);
+
+    /* compute how many bytes there are between the start of the cluster
+     * containing offset and the end of the l2 slice that contains
+     * the entry pointing to it */
+    *bytes_available =
+        ((uint64_t) (s->l2_slice_size - offset_to_l2_slice_index(s, offset)))
+        << s->cluster_bits;
+
+    if (*bytes_needed > *bytes_available) {
+        *bytes_needed = *bytes_available;
+    }
+}
+
+/*
+ * Find the host offset and subcluster type of @offset in @l2_slice, and
+ * how far they extend.  If @lockless, the slice may be changing under
+ * our feet, so a corrupted entry is only reported by returning -EIO.
+ */
+static int GRAPH_RDLOCK
+get_host_offset_in_slice(BlockDriverState *bs, uint64_t offset,
+                         uint64_t l2_offset, uint64_t *l2_slice,
+                         uint64_t bytes_needed, bool lockless,
+                         uint64_t *bytes_available, uint64_t *host_offset,
+                         QCow2SubclusterType *subcluster_type)
+{
+    BDRVQcow2State *s = bs->opaque;
+    unsigned int offset_in_cluster = offset_into_cluster(s, offset);
+    unsigned int l2_index, sc_index;
+    uint64_t l2_entry, l2_bitmap, nb_clusters;
+    QCow2SubclusterType type;
+    int sc;
+
+    /* find the cluster offset for the given disk offset */
+
+    l2_index = offset_to_l2_slice_index(s, offset);
+    sc_index = offset_to_sc_index(s, offset);
+    l2_entry = get_l2_entry(s, l2_slice, l2_index);
+    l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index);
+
+    nb_clusters = size_to_clusters(s, bytes_needed);
+    /* bytes_needed <= *bytes + offset_in_cluster, both of which are unsigned
+     * integers; the minimum cluster size is 512, so this assertion is always
+     * true */
+    assert(nb_clusters <= INT_MAX);
+
+    type = qcow2_get_subcluster_type(bs, l2_entry, l2_bitmap, sc_index);
+    if (s->qcow_version < 3 && (type == QCOW2_SUBCLUSTER_ZERO_PLAIN ||
+                                type == QCOW2_SUBCLUSTER_ZERO_ALLOC)) {
+        if (!lockless) {
+            qcow2_signal_corruption(bs, true, -1, -1, "Zero cluster entry "
+                                    "found in pre-v3 image (L2 offset: %#"
+                                    PRIx64 ", L2 index: %#x)", l2_offset,
+                                    l2_index);
+        }
+        return -EIO;
+    }
+    switch (type) {
+    case QCOW2_SUBCLUSTER_INVALID:
+        break; /* This is handled by count_contiguous_subclusters() below */
+    case QCOW2_SUBCLUSTER_COMPRESSED:
+        if (has_data_file(bs)) {
+            if (!lockless) {
+                qcow2_signal_corruption(bs, true, -1, -1, "Compressed "
+                                        "cluster entry found in image with "
+                                        "external data file (L2 offset: %#"
+                                        PRIx64 ", L2 index: %#x)", l2_offset,
+                                        l2_index);
+            }
+            return -EIO;
+        }
+        *host_offset = l2_entry;
+        break;
+    case QCOW2_SUBCLUSTER_ZERO_PLAIN:
+    case QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN:
+        break;
+    case QCOW2_SUBCLUSTER_ZERO_ALLOC:
+    case QCOW2_SUBCLUSTER_NORMAL:
+    case QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC: {
+        uint64_t host_cluster_offset = l2_entry & L2E_OFFSET_MASK;
+        *host_offset = host_cluster_offset + offset_in_cluster;
+        if (offset_into_cluster(s, host_cluster_offset)) {
+            if (!lockless) {
+                qcow2_signal_corruption(bs, true, -1, -1,
+                                        "Cluster allocation offset %#"
+                                        PRIx64 " unaligned (L2 offset: %#"
+                                        PRIx64 ", L2 index: %#x)",
+                                        host_cluster_offset, l2_offset,
+                                        l2_index);
+            }
+            return -EIO;
+        }
+        if (has_data_file(bs) && *host_offset != offset) {
+            if (!lockless) {
+                qcow2_signal_corruption(bs, true, -1, -1,
+                                        "External data file host cluster "
+                                        "offset %#" PRIx64 " does not match "
+                                        "guest cluster offset: %#" PRIx64
+                                        ", L2 index: %#x)",
+                                        host_cluster_offset,
+                                        offset - offset_in_cluster, l2_index);
+            }
+            return -EIO;
+        }
+        break;
+    }
+    default:
+        abort();
+    }
+
+    sc = count_contiguous_subclusters(bs, nb_clusters, sc_index,
+                                      l2_slice, &l2_index);
+    if (sc < 0) {
+        if (!lockless) {
+            qcow2_signal_corruption(bs, true, -1, -1, "Invalid cluster entry "
+                                    "found  (L2 offset: %#" PRIx64 ", L2 "
+                                    "index: %#x)", l2_offset, l2_index);
+        }
+        return -EIO;
+    }
+
+    *bytes_available = ((int64_t)sc + sc_index) << s->subcluster_bits;
+    *subcluster_type = type;
+
+    return 0;
+}
+
+static void get_host_offset_done(BDRVQcow2State *s, uint64_t offset,
+                                 uint64_t bytes_needed,
+                                 uint64_t bytes_available,
+                                 unsigned int *bytes)
+{
+    unsigned int offset_in_cluster = offset_into_cluster(s, offset);
+
+    if (bytes_available > bytes_needed) {
+        bytes_available = bytes_needed;
+    }
+
+    /* bytes_available <= bytes_needed <= *bytes + offset_in_cluster;
+     * subtracting offset_in_cluster will therefore definitely yield something
+     * not exceeding UINT_MAX */
+    assert(bytes_available - offset_in_cluster <= UINT_MAX);
+    *bytes = bytes_available - offset_in_cluster;
+}
+
 /*
  * get_host_offset
  *
@@ -588,27 +777,12 @@ int qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
                           QCow2SubclusterType *subcluster_type)
 {
     BDRVQcow2State *s = bs->opaque;
-    unsigned int l2_index, sc_index;
-    uint64_t l1_index, l2_offset, *l2_slice, l2_entry, l2_bitmap;
-    int sc;
-    unsigned int offset_in_cluster;
-    uint64_t bytes_available, bytes_needed, nb_clusters;
+    uint64_t l1_index, l2_offset, *l2_slice;
+    uint64_t bytes_available, bytes_needed;
     QCow2SubclusterType type;
     int ret;
 
-    offset_in_cluster = offset_into_cluster(s, offset);
-    bytes_needed = (uint64_t) *bytes + offset_in_cluster;
-
-    /* compute how many bytes there are between the start of the cluster
-     * containing offset and the end of the l2 slice that contains
-     * the entry pointing to it */
-    bytes_available =
-        ((uint64_t) (s->l2_slice_size - offset_to_l2_slice_index(s, offset)))
-        << s->cluster_bits;
-
-    if (bytes_needed > bytes_available) {
-        bytes_needed = bytes_available;
-    }
+    get_host_offset_bytes(s, offset, *bytes, &bytes_needed, &bytes_available);
 
     *host_offset = 0;
 
@@ -640,106 +814,224 @@ int qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
         return ret;
     }
 
-    /* find the cluster offset for the given disk offset */
+    ret = get_host_offset_in_slice(bs, offset, l2_offset, l2_slice,
+                                   bytes_needed, false, &bytes_available,
+                                   host_offset, &type);
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+    if (ret < 0) {
+        return ret;
+    }
 
-    l2_index = offset_to_l2_slice_index(s, offset);
-    sc_index = offset_to_sc_index(s, offset);
-    l2_entry = get_l2_entry(s, l2_slice, l2_index);
-    l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index);
+out:
+    get_host_offset_done(s, offset, bytes_needed, bytes_available, bytes);
+    *subcluster_type = type;
 
-    nb_clusters = size_to_clusters(s, bytes_needed);
-    /* bytes_needed <= *bytes + offset_in_cluster, both of which are unsigned
-     * integers; the minimum cluster size is 512, so this assertion is always
-     * true */
-    assert(nb_clusters <= INT_MAX);
+    return 0;
+}
 
-    type = qcow2_get_subcluster_type(bs, l2_entry, l2_bitmap, sc_index);
-    if (s->qcow_version < 3 && (type == QCOW2_SUBCLUSTER_ZERO_PLAIN ||
-                                type == QCOW2_SUBCLUSTER_ZERO_ALLOC)) {
-        qcow2_signal_corruption(bs, true, -1, -1, "Zero cluster entry found"
-                                " in pre-v3 image (L2 offset: %#" PRIx64
-                                ", L2 index: %#x)", l2_offset, l2_index);
-        ret = -EIO;
-        goto fail;
+/*
+ * Like qcow2_get_host_offset(), but without s->lock, for a caller that
+ * only reads the mapping.  The active L1 table and the L2 slice are read
+ * as they are while s->mapping_seqlock tells that nobody changes them,
+ * and the L1 table is only freed after an RCU grace period.
+ *
+ * Returns -EAGAIN without touching *bytes if the L2 slice is not cached,
+ * the mapping changed while it was read or anything looked wrong with
+ * it.  The caller must then take s->lock and use qcow2_get_host_offset().
+ */
+int qcow2_get_host_offset_lockless(BlockDriverState *bs, uint64_t offset,
+                                   unsigned int *bytes, uint64_t *host_offset,
+                                   QCow2SubclusterType *subcluster_type)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l1_index, l2_offset, *l1_table, *l2_slice;
+    uint64_t bytes_available, bytes_needed;
+    QCow2SubclusterType type;
+    bool l2_hit = false;
+    unsigned int seq;
+    int l1_size;
+
+    RCU_READ_LOCK_GUARD();
+
+    get_host_offset_bytes(s, offset, *bytes, &bytes_needed, &bytes_available);
+
+    seq = seqlock_read_begin(&s->mapping_seqlock);
+    l1_table = qatomic_rcu_read(&s->l1_table);
+    l1_size = qatomic_read(&s->l1_size);
+    /* Only use a table together with its own size */
+    if (seqlock_read_retry(&s->mapping_seqlock, seq)) {
+        return -EAGAIN;
     }
-    switch (type) {
-    case QCOW2_SUBCLUSTER_INVALID:
-        break; /* This is handled by count_contiguous_subclusters() below */
-    case QCOW2_SUBCLUSTER_COMPRESSED:
-        if (has_data_file(bs)) {
-            qcow2_signal_corruption(bs, true, -1, -1, "Compressed cluster "
-                                    "entry found in image with external data "
-                                    "file (L2 offset: %#" PRIx64 ", L2 index: "
-                                    "%#x)", l2_offset, l2_index);
-            ret = -EIO;
-            goto fail;
-        }
-        *host_offset = l2_entry;
-        break;
-    case QCOW2_SUBCLUSTER_ZERO_PLAIN:
-    case QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN:
-        break;
-    case QCOW2_SUBCLUSTER_ZERO_ALLOC:
-    case QCOW2_SUBCLUSTER_NORMAL:
-    case QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC: {
-        uint64_t host_cluster_offset = l2_entry & L2E_OFFSET_MASK;
-        *host_offset = host_cluster_offset + offset_in_cluster;
-        if (offset_into_cluster(s, host_cluster_offset)) {
-            qcow2_signal_corruption(bs, true, -1, -1,
-                                    "Cluster allocation offset %#"
-                                    PRIx64 " unaligned (L2 offset: %#" PRIx64
-                                    ", L2 index: %#x)", host_cluster_offset,
-                                    l2_offset, l2_index);
-            ret = -EIO;
-            goto fail;
-        }
-        if (has_data_file(bs) && *host_offset != offset) {
-            qcow2_signal_corruption(bs, true, -1, -1,
-                                    "External data file host cluster offset %#"
-                                    PRIx64 " does not match guest cluster "
-                                    "offset: %#" PRIx64
-                                    ", L2 index: %#x)", host_cluster_offset,
-                                    offset - offset_in_cluster, l2_index);
-            ret = -EIO;
-            goto fail;
-        }
-        break;
+
+    *host_offset = 0;
+
+    l1_index = offset_to_l1_index(s, offset);
+    if (l1_index >= l1_size) {
+        type = QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN;
+        goto out;
     }
-    default:
-        abort();
+
+    l2_offset = l1_table[l1_index] & L1E_OFFSET_MASK;
+    if (!l2_offset) {
+        type = QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN;
+        goto out;
     }
 
-    sc = count_contiguous_subclusters(bs, nb_clusters, sc_index,
-                                      l2_slice, &l2_index);
-    if (sc < 0) {
-        qcow2_signal_corruption(bs, true, -1, -1, "Invalid cluster entry found "
-                                " (L2 offset: %#" PRIx64 ", L2 index: %#x)",
-                                l2_offset, l2_index);
-        ret = -EIO;
-        goto fail;
+    if (offset_into_cluster(s, l2_offset)) {
+        return -EAGAIN;
     }
-    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
 
-    bytes_available = ((int64_t)sc + sc_index) << s->subcluster_bits;
+    l2_slice = qcow2_cache_lookup_lockless(
+        s->l2_table_cache, l2_offset + l2_slice_start(s, offset));
+    if (!l2_slice) {
+        return -EAGAIN;
+    }
 
-out:
-    if (bytes_available > bytes_needed) {
-        bytes_available = bytes_needed;
+    if (get_host_offset_in_slice(bs, offset, l2_offset, l2_slice,
+                                 bytes_needed, true, &bytes_available,
+                                 host_offset, &type) < 0) {
+        return -EAGAIN;
     }
+    l2_hit = true;
 
-    /* bytes_available <= bytes_needed <= *bytes + offset_in_cluster;
-     * subtracting offset_in_cluster will therefore definitely yield something
-     * not exceeding UINT_MAX */
-    assert(bytes_available - offset_in_cluster <= UINT_MAX);
-    *bytes = bytes_available - offset_in_cluster;
+out:
+    if (seqlock_read_retry(&s->mapping_seqlock, seq)) {
+        return -EAGAIN;
+    }
 
+    if (l2_hit) {
+        stat64_add(&s->l2_cache_hits, 1);
+    }
+    get_host_offset_done(s, offset, bytes_needed, bytes_available, bytes);
     *subcluster_type = type;
 
     return 0;
+}
 
-fail:
-    qcow2_cache_put(s->l2_table_cache, (void **)&l2_slice);
-    return ret;
+typedef struct Qcow2L2Readahead {
+    BlockDriverState *bs;
+    /* Guest offset mapped by the first slice */
+    uint64_t offset;
+    unsigned int nb_slices;
+    bool write;
+} Qcow2L2Readahead;
+
+static void coroutine_fn qcow2_l2_readahead_entry(void *opaque)
+{
+    Qcow2L2Readahead *ra = opaque;
+    BlockDriverState *bs = ra->bs;
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t slice_bytes = (uint64_t)s->l2_slice_size << s->cluster_bits;
+    bool stop = false;
+
+    /*
+     * s->lock is only held for one slice at a time, and readahead stops
+     * as soon as a request waits for it, so that guest requests never
+     * queue up behind it.  It also stops at the first slice that is
+     * cached already, which an earlier readahead or the guest loaded.
+     */
+    WITH_GRAPH_RDLOCK_GUARD() {
+        for (unsigned int i = 0; i < ra->nb_slices && !stop; i++) {
+            uint64_t offset = ra->offset + i * slice_bytes;
+            uint64_t l1_index = offset_to_l1_index(s, offset);
+            uint64_t l2_offset, *l2_slice;
+
+            qemu_co_mutex_lock(&s->lock);
+
+            if (l1_index >= s->l1_size) {
+                qemu_co_mutex_unlock(&s->lock);
+                break;
+            }
+
+            l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+            if (!l2_offset || offset_into_cluster(s, l2_offset)) {
+                stop = qemu_co_mutex_has_waiters(&s->lock);
+                qemu_co_mutex_unlock(&s->lock);
+                continue;
+            }
+            if (qcow2_cache_is_table_offset(s->l2_table_cache, l2_offset +
+                                            l2_slice_start(s, offset))) {
+                qemu_co_mutex_unlock(&s->lock);
+                break;
+            }
+
+            if (l2_load(bs, offset, l2_offset, &l2_slice) < 0) {
+                qemu_co_mutex_unlock(&s->lock);
+                break;
+            }
+            qcow2_cache_put(s->l2_table_cache, (void **)&l2_slice);
+            stat64_add(&s->l2_readahead_slices, 1);
+
+            stop = qemu_co_mutex_has_waiters(&s->lock);
+            qemu_co_mutex_unlock(&s->lock);
+        }
+
+        /*
+         * Allocating writes will soon need the refcount block after the
+         * one that the free cluster search is in.  Errors are left for
+         * the allocation to deal with.
+         */
+        if (ra->write && !stop) {
+            uint64_t refcount;
+
+            qemu_co_mutex_lock(&s->lock);
+            qcow2_get_refcount(bs, QEMU_ALIGN_UP(s->free_cluster_index + 1,
+                                                 s->refcount_block_size),
+                               &refcount);
+            qemu_co_mutex_unlock(&s->lock);
+        }
+    }
+
+    bdrv_dec_in_flight(bs);
+    g_free(ra);
+}
+
+/*
+ * Called for every guest request.  Once a request starts where the
+ * previous one ended, the L2 slices for the l2-readahead slices after it
+ * are loaded into the cache in the background, so that a sequential
+ * stream does not wait for a metadata read each time it crosses into a
+ * new slice.
+ */
+void coroutine_fn qcow2_l2_readahead(BlockDriverState *bs, uint64_t offset,
+                                     uint64_t bytes, bool write)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t slice_bytes = (uint64_t)s->l2_slice_size << s->cluster_bits;
+    int64_t start, target, end = offset + bytes;
+    Qcow2L2Readahead *ra;
+
+    if (!s->l2_readahead || !bytes) {
+        return;
+    }
+
+    if (qatomic_read_i64(&s->readahead_last_end) != offset) {
+        qatomic_set_i64(&s->readahead_last_end, end);
+        qatomic_set_i64(&s->readahead_end, 0);
+        return;
+    }
+    qatomic_set_i64(&s->readahead_last_end, end);
+
+    /* Start with the slice after the one that maps the end of the request */
+    start = QEMU_ALIGN_DOWN(end - 1, slice_bytes) + slice_bytes;
+    target = start + s->l2_readahead * slice_bytes;
+    start = MAX(start, qatomic_read_i64(&s->readahead_end));
+    if (start >= target) {
+        return;
+    }
+    qatomic_set_i64(&s->readahead_end, target);
+
+    ra = g_new(Qcow2L2Readahead, 1);
+    *ra = (Qcow2L2Readahead) {
+        .bs = bs,
+        .offset = start,
+        .nb_slices = (target - start) / slice_bytes,
+        .write = write,
+    };
+
+    bdrv_inc_in_flight(bs);
+    aio_co_enter(qemu_get_current_aio_context(),
+                 qemu_coroutine_create(qcow2_l2_readahead_entry, ra));
 }
 
 /*
@@ -884,6 +1176,97 @@ qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs, uint64_t offset,
     return 0;
 }
 
+/*
+ * Store the entry of the active L2 table for the guest @offset in
+ * @l2_entry, or 0 if no L2 table is allocated for it.
+ *
+ * Returns 0 on success, -errno in error cases
+ */
+int GRAPH_RDLOCK
+qcow2_get_l2_entry(BlockDriverState *bs, uint64_t offset, uint64_t *l2_entry)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l1_index, l2_offset, *l2_slice;
+    int ret;
+
+    *l2_entry = 0;
+
+    l1_index = offset_to_l1_index(s, offset);
+    if (l1_index >= s->l1_size) {
+        return 0;
+    }
+
+    l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+    if (!l2_offset) {
+        return 0;
+    }
+    if (offset_into_cluster(s, l2_offset)) {
+        qcow2_signal_corruption(bs, true, -1, -1, "L2 table offset %#" PRIx64
+                                " unaligned (L1 index: %#" PRIx64 ")",
+                                l2_offset, l1_index);
+        return -EIO;
+    }
+
+    ret = l2_load(bs, offset, l2_offset, &l2_slice);
+    if (ret < 0) {
+        return ret;
+    }
+
+    *l2_entry = get_l2_entry(s, l2_slice, offset_to_l2_slice_index(s, offset));
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+
+    return 0;
+}
+
+/*
+ * Map the unallocated guest cluster at @offset to the existing data
+ * cluster at @host_offset, whose refcount the caller has increased.  If
+ * the data cluster was not shared before, @referrer is the guest offset
+ * that has been mapped to it so far, and its COPIED flag is cleared.
+ * Otherwise @referrer is -1.
+ *
+ * Returns 0 on success, -errno in error cases
+ */
+int coroutine_fn GRAPH_RDLOCK
+qcow2_dedup_link_l2(BlockDriverState *bs, uint64_t offset,
+                    uint64_t host_offset, int64_t referrer)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *l2_slice;
+    int l2_index, ret;
+
+    assert(!has_subclusters(s));
+
+    if (s->use_lazy_refcounts) {
+        qcow2_mark_dirty(bs);
+    }
+    if (qcow2_need_accurate_refcounts(s)) {
+        qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                   s->refcount_block_cache);
+    }
+
+    if (referrer >= 0) {
+        ret = get_cluster_table(bs, referrer, &l2_slice, &l2_index);
+        if (ret < 0) {
+            return ret;
+        }
+        qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+        set_l2_entry(s, l2_slice, l2_index,
+                     get_l2_entry(s, l2_slice, l2_index) & ~QCOW_OFLAG_COPIED);
+        qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+    }
+
+    ret = get_cluster_table(bs, offset, &l2_slice, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+    set_l2_entry(s, l2_slice, l2_index, host_offset);
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+
+    return 0;
+}
+
 static int coroutine_fn GRAPH_RDLOCK
 perform_cow(BlockDriverState *bs, QCowL2Meta *m)
 {
@@ -1620,8 +2003,7 @@ do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
     /* Allocate new clusters */
     trace_qcow2_cluster_alloc_phys(qemu_coroutine_self());
     if (*host_offset == INV_OFFSET) {
-        int64_t cluster_offset =
-            qcow2_alloc_clusters(bs, *nb_clusters * s->cluster_size);
+        int64_t cluster_offset = qcow2_alloc_clusters_zone(bs, nb_clusters);
         if (cluster_offset < 0) {
             return cluster_offset;
         }
@@ -0,0 +1,355 @@
+/*
+ * qcow2 deduplication of full cluster writes
+ *
+ * The deduplication table maps the hash of the data of a cluster to the
+ * host cluster that holds it.  When a full guest cluster that is not
+ * allocated yet is written with data whose hash is in the table, the
+ * existing host cluster is shared instead, in the same way as internal
+ * snapshots share clusters: its refcount is increased and none of the
+ * L2 entries that point to it have the COPIED flag, so that writing to
+ * it allocates a new cluster.
+ *
+ * The table is direct mapped and entries are simply replaced, so it is
+ * only a hint: the data of a candidate cluster is always compared before
+ * it is shared.  It is kept in memory while the image is open and stored
+ * in the image when it is closed, so that it can be used across runs.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/bswap.h"
+#include "qemu/host-utils.h"
+#include "qcow2.h"
+#include "block/block-io.h"
+#include "trace.h"
+
+static Qcow2DedupEntry *qcow2_dedup_slot(BDRVQcow2State *s,
+                                         const uint8_t *hash)
+{
+    return &s->dedup_table[ldq_be_p(hash) & (s->dedup_nb_entries - 1)];
+}
+
+/* Load the table from the image, or create an empty one */
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_dedup_table_get(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DedupEntry *table;
+    uint64_t nb_entries;
+    int ret;
+
+    if (s->dedup_table) {
+        return 0;
+    }
+
+    if (!s->dedup_table_offset) {
+        nb_entries = DIV_ROUND_UP(bs->total_sectors * BDRV_SECTOR_SIZE,
+                                  s->cluster_size);
+        nb_entries = pow2ceil(MAX(nb_entries, QCOW2_DEDUP_MIN_ENTRIES));
+        s->dedup_nb_entries = MIN(nb_entries, QCOW2_DEDUP_MAX_ENTRIES);
+    }
+
+    table = g_try_new0(Qcow2DedupEntry, s->dedup_nb_entries);
+    if (!table) {
+        return -ENOMEM;
+    }
+
+    if (s->dedup_table_offset) {
+        ret = bdrv_co_pread(bs->file, s->dedup_table_offset,
+                            s->dedup_nb_entries * sizeof(Qcow2DedupEntry),
+                            table, 0);
+        if (ret < 0) {
+            g_free(table);
+            return ret;
+        }
+    }
+
+    s->dedup_table = table;
+    return 0;
+}
+
+/*
+ * Wait until no deduplicating request is waiting for the data writes in
+ * flight to finish.  Called with s->lock held before a data write gets
+ * its host offset.
+ */
+void coroutine_fn qcow2_dedup_wait(BDRVQcow2State *s)
+{
+    while (s->dedup_barrier) {
+        qemu_co_queue_wait(&s->dedup_queue, &s->lock);
+    }
+}
+
+/* Called with s->lock held when a data write has finished */
+void qcow2_dedup_write_done(BDRVQcow2State *s)
+{
+    assert(s->nb_data_writes > 0);
+    if (--s->nb_data_writes == 0 && s->dedup_barrier) {
+        qemu_co_queue_restart_all(&s->dedup_queue);
+    }
+}
+
+/*
+ * Try to share an existing host cluster for the write of the full
+ * cluster at guest @offset with the data in @qiov at @qiov_offset.  The
+ * hash of the data is returned in @hash, for qcow2_dedup_insert() if the
+ * cluster is written normally after all.
+ *
+ * Returns 1 if the cluster has been shared and must not be written, 0 if
+ * it must be written normally, or -errno on error.
+ */
+int coroutine_fn GRAPH_RDLOCK
+qcow2_co_dedup_cluster(BlockDriverState *bs, uint64_t offset,
+                       QEMUIOVector *qiov, size_t qiov_offset, uint8_t *hash)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint8_t *data, *candidate = NULL;
+    uint64_t host_offset, l2_entry, refcount;
+    int64_t referrer;
+    Qcow2DedupEntry *e;
+    QCowL2Meta *m;
+    int ret;
+
+    data = qemu_try_blockalign(bs->file->bs, s->cluster_size);
+    if (!data) {
+        return -ENOMEM;
+    }
+    qemu_iovec_to_buf(qiov, qiov_offset, data, s->cluster_size);
+
+    ret = qcow2_co_dedup_hash(bs, data, s->cluster_size, hash);
+    if (ret < 0) {
+        qemu_vfree(data);
+        return ret;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+
+    ret = qcow2_dedup_table_get(bs);
+    if (ret < 0) {
+        goto out;
+    }
+
+retry:
+    ret = 0;
+    e = qcow2_dedup_slot(s, hash);
+    host_offset = be64_to_cpu(e->host_offset);
+    referrer = be64_to_cpu(e->guest_offset);
+    if (!host_offset || memcmp(e->hash, hash, QCOW2_DEDUP_HASH_SIZE)) {
+        goto out;
+    }
+
+    /* Only unallocated clusters are deduplicated, others are overwritten */
+    ret = qcow2_get_l2_entry(bs, offset, &l2_entry);
+    if (ret < 0) {
+        goto out;
+    }
+    if (l2_entry & (L2E_OFFSET_MASK | QCOW_OFLAG_COMPRESSED)) {
+        goto out;
+    }
+    QLIST_FOREACH(m, &s->cluster_allocs, next_in_flight) {
+        if (offset >= m->offset &&
+            offset < m->offset + (m->nb_clusters << s->cluster_bits)) {
+            goto out;
+        }
+    }
+
+    ret = qcow2_get_refcount(bs, host_offset >> s->cluster_bits, &refcount);
+    if (ret < 0) {
+        goto out;
+    }
+    if (refcount == 0 || refcount >= s->refcount_max) {
+        goto out;
+    }
+
+    if (refcount == 1) {
+        /*
+         * The cluster is not shared yet, so it may be written in place.
+         * Its only reference must be the one it was indexed with, which
+         * loses its COPIED flag, and no data write may be in flight that
+         * could still change it after it has been compared.
+         */
+        ret = qcow2_get_l2_entry(bs, referrer, &l2_entry);
+        if (ret < 0) {
+            goto out;
+        }
+        if (qcow2_get_cluster_type(bs, l2_entry) != QCOW2_CLUSTER_NORMAL ||
+            (l2_entry & L2E_OFFSET_MASK) != host_offset ||
+            !(l2_entry & QCOW_OFLAG_COPIED)) {
+            goto out;
+        }
+
+        if (s->nb_data_writes) {
+            s->dedup_barrier++;
+            while (s->nb_data_writes) {
+                qemu_co_queue_wait(&s->dedup_queue, &s->lock);
+            }
+            s->dedup_barrier--;
+            qemu_co_queue_restart_all(&s->dedup_queue);
+            goto retry;
+        }
+    } else {
+        referrer = -1;
+    }
+
+    if (!candidate) {
+        candidate = qemu_try_blockalign(bs->file->bs, s->cluster_size);
+        if (!candidate) {
+            ret = -ENOMEM;
+            goto out;
+        }
+    }
+
+    ret = bdrv_co_pread(s->data_file, host_offset, s->cluster_size,
+                        candidate, 0);
+    if (ret < 0) {
+        goto out;
+    }
+    if (memcmp(data, candidate, s->cluster_size)) {
+        goto out;
+    }
+
+    ret = qcow2_update_cluster_refcount(bs, host_offset >> s->cluster_bits,
+                                        1, false, QCOW2_DISCARD_NEVER);
+    if (ret < 0) {
+        goto out;
+    }
+
+    ret = qcow2_dedup_link_l2(bs, offset, host_offset, referrer);
+    if (ret < 0) {
+        goto out;
+    }
+
+    trace_qcow2_dedup_cluster(qemu_coroutine_self(), offset, host_offset,
+                              refcount + 1);
+    ret = 1;
+
+out:
+    qemu_co_mutex_unlock(&s->lock);
+    qemu_vfree(candidate);
+    qemu_vfree(data);
+    return ret;
+}
+
+/*
+ * Record that the full guest cluster at @offset is being written with
+ * data that has @hash, to the host cluster at @host_offset.  Called with
+ * s->lock held.
+ */
+void qcow2_dedup_insert(BlockDriverState *bs, const uint8_t *hash,
+                        uint64_t offset, uint64_t host_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DedupEntry *e;
+
+    if (!s->dedup_table) {
+        return;
+    }
+
+    e = qcow2_dedup_slot(s, hash);
+    memcpy(e->hash, hash, QCOW2_DEDUP_HASH_SIZE);
+    e->host_offset = cpu_to_be64(host_offset);
+    e->guest_offset = cpu_to_be64(offset);
+    s->dedup_table_dirty = true;
+}
+
+/*
+ * Write the deduplication table to the image if it has changed, and
+ * allocate it and add it to the image header first if there is none yet.
+ */
+int GRAPH_RDLOCK qcow2_store_dedup_table(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t size = s->dedup_nb_entries * sizeof(Qcow2DedupEntry);
+    int64_t offset;
+    int ret;
+
+    if (!s->dedup_table_dirty) {
+        return 0;
+    }
+
+    offset = s->dedup_table_offset;
+    if (!offset) {
+        offset = qcow2_alloc_clusters(bs, size);
+        if (offset < 0) {
+            error_setg_errno(errp, -offset, "Failed to allocate clusters "
+                             "for the deduplication table");
+            return offset;
+        }
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_DEDUP_TABLE, offset, size,
+                                        false);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Deduplication table overlaps with "
+                         "metadata");
+        goto fail;
+    }
+
+    ret = bdrv_pwrite(bs->file, offset, size, s->dedup_table, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to write the deduplication "
+                         "table");
+        goto fail;
+    }
+
+    if (!s->dedup_table_offset) {
+        /* The refcounts of the table must be stable before it is used */
+        ret = qcow2_flush_caches(bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to flush the refcounts of "
+                             "the deduplication table");
+            goto fail;
+        }
+
+        s->dedup_table_offset = offset;
+        s->autoclear_features |= QCOW2_AUTOCLEAR_DEDUP;
+        ret = qcow2_update_header(bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to add the deduplication "
+                             "table to the image header");
+            s->dedup_table_offset = 0;
+            s->autoclear_features &= ~(uint64_t)QCOW2_AUTOCLEAR_DEDUP;
+            goto fail;
+        }
+    }
+
+    s->dedup_table_dirty = false;
+    return 0;
+
+fail:
+    if (!s->dedup_table_offset) {
+        qcow2_free_clusters(bs, offset, size, QCOW2_DISCARD_OTHER);
+    }
+    return ret;
+}
+
+/* Remove the deduplication table from the image */
+int GRAPH_RDLOCK qcow2_remove_dedup_table(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t offset = s->dedup_table_offset;
+    int ret;
+
+    g_free(s->dedup_table);
+    s->dedup_table = NULL;
+    s->dedup_table_dirty = false;
+
+    if (!offset) {
+        return 0;
+    }
+
+    s->dedup_table_offset = 0;
+    s->autoclear_features &= ~(uint64_t)QCOW2_AUTOCLEAR_DEDUP;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    qcow2_free_clusters(bs, offset,
+                        s->dedup_nb_entries * sizeof(Qcow2DedupEntry),
+                        QCOW2_DISCARD_OTHER);
+    return 0;
+}
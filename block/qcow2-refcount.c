@@ -23,6 +23,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "block/aio_task.h"
 #include "block/block-io.h"
 #include "qapi/error.h"
 #include "qcow2.h"
@@ -1028,6 +1029,78 @@ int64_t qcow2_alloc_clusters(BlockDriverState *bs, uint64_t size)
     return offset;
 }
 
+/*
+ * Allocate up to *nb_clusters data clusters for a request of the current
+ * AioContext.  With alloc-zone-size set, each AioContext allocates from a
+ * zone of clusters of its own that was reserved at once, so that writers
+ * in different iothreads do not interleave their clusters and the
+ * refcounts are only updated once per zone.
+ *
+ * *nb_clusters is decreased if only part of the request could be
+ * allocated from the zone.  Returns the offset of the first cluster or
+ * -errno.
+ */
+int64_t qcow2_alloc_clusters_zone(BlockDriverState *bs, uint64_t *nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
+    uint64_t bytes = *nb_clusters << s->cluster_bits;
+    Qcow2AllocZone *z;
+    int64_t offset;
+
+    if (!s->alloc_zone_size || bytes >= s->alloc_zone_size) {
+        return qcow2_alloc_clusters(bs, bytes);
+    }
+
+    QLIST_FOREACH(z, &s->alloc_zones, next) {
+        if (z->ctx == ctx) {
+            break;
+        }
+    }
+    if (!z) {
+        z = g_new0(Qcow2AllocZone, 1);
+        z->ctx = ctx;
+        QLIST_INSERT_HEAD(&s->alloc_zones, z, next);
+    }
+
+    if (z->offset == z->end) {
+        offset = qcow2_alloc_clusters(bs, s->alloc_zone_size);
+        if (offset < 0) {
+            /* There may still be room for the request itself */
+            return qcow2_alloc_clusters(bs, bytes);
+        }
+        z->offset = offset;
+        z->end = offset + s->alloc_zone_size;
+        trace_qcow2_alloc_zone_reserve(bs, ctx, offset, s->alloc_zone_size);
+    }
+
+    bytes = MIN(bytes, z->end - z->offset);
+    offset = z->offset;
+    z->offset += bytes;
+    *nb_clusters = bytes >> s->cluster_bits;
+
+    return offset;
+}
+
+/*
+ * Give back the clusters that were reserved for allocation zones but not
+ * used yet.
+ */
+void qcow2_release_alloc_zones(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2AllocZone *z, *next_z;
+
+    QLIST_FOREACH_SAFE(z, &s->alloc_zones, next, next_z) {
+        if (z->offset < z->end) {
+            qcow2_free_clusters(bs, z->offset, z->end - z->offset,
+                                QCOW2_DISCARD_NEVER);
+        }
+        QLIST_REMOVE(z, next);
+        g_free(z);
+    }
+}
+
 int64_t coroutine_fn qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
                                              int64_t nb_clusters)
 {
@@ -1413,7 +1486,9 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                 l2_offset |= QCOW_OFLAG_COPIED;
             }
             if (l2_offset != old_l2_offset) {
+                qcow2_mapping_write_begin(s);
                 l1_table[i] = l2_offset;
+                qcow2_mapping_write_end(s);
                 l1_modified = 1;
             }
         }
@@ -1430,6 +1505,8 @@ fail:
 
     /* Update L1 only if it isn't deleted anyway (addend = -1) */
     if (ret == 0 && addend >= 0 && l1_modified) {
+        /* This may be the active L1 table, which is byte swapped for now */
+        qcow2_mapping_write_begin(s);
         for (i = 0; i < l1_size; i++) {
             cpu_to_be64s(&l1_table[i]);
         }
@@ -1440,6 +1517,7 @@ fail:
         for (i = 0; i < l1_size; i++) {
             be64_to_cpus(&l1_table[i]);
         }
+        qcow2_mapping_write_end(s);
     }
     if (l1_allocated)
         g_free(l1_table);
@@ -1590,6 +1668,9 @@ enum {
     CHECK_FRAG_INFO = 0x2,      /* update BlockFragInfo counters */
 };
 
+/* Number of L2 tables that check_refcounts_l1() reads concurrently */
+#define QCOW2_CHECK_L2_BATCH 16
+
 /*
  * Fix L2 entry by making it QCOW2_CLUSTER_ZERO_PLAIN (or making all its present
  * subclusters QCOW2_SUBCLUSTER_ZERO_PLAIN).
@@ -1653,8 +1734,8 @@ fail:
 
 /*
  * Increases the refcount in the given refcount table for the all clusters
- * referenced in the L2 table. While doing so, performs some checks on L2
- * entries.
+ * referenced in the L2 table @l2_table that was read from @l2_offset. While
+ * doing so, performs some checks on L2 entries.
  *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
@@ -1663,24 +1744,15 @@ static int coroutine_fn GRAPH_RDLOCK
 check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                    void **refcount_table,
                    int64_t *refcount_table_size, int64_t l2_offset,
+                   uint64_t *l2_table,
                    int flags, BdrvCheckMode fix, bool active)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t l2_entry, l2_bitmap;
     uint64_t next_contiguous_offset = 0;
     int i, ret;
-    size_t l2_size_bytes = s->l2_size * l2_entry_size(s);
-    g_autofree uint64_t *l2_table = g_malloc(l2_size_bytes);
     bool metadata_overlap;
 
-    /* Read L2 table from disk */
-    ret = bdrv_co_pread(bs->file, l2_offset, l2_size_bytes, l2_table, 0);
-    if (ret < 0) {
-        fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
-        res->check_errors++;
-        return ret;
-    }
-
     /* Do the actual checks */
     for (i = 0; i < s->l2_size; i++) {
         uint64_t coffset;
@@ -1851,6 +1923,28 @@ check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
     return 0;
 }
 
+typedef struct Qcow2CheckReadTask {
+    AioTask task;
+    BlockDriverState *bs;
+    uint64_t offset;
+    uint64_t bytes;
+    void *buf;
+    int *ret;
+} Qcow2CheckReadTask;
+
+/*
+ * This function can count as GRAPH_RDLOCK because check_refcounts_l1()
+ * holds the graph lock and waits for all tasks before it returns.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_check_read_task_entry(AioTask *task)
+{
+    Qcow2CheckReadTask *t = container_of(task, Qcow2CheckReadTask, task);
+
+    *t->ret = bdrv_co_pread(t->bs->file, t->offset, t->bytes, t->buf, 0);
+    return *t->ret;
+}
+
 /*
  * Increases the refcount for the L1 table, its L2 tables and all referenced
  * clusters in the given refcount table. While doing so, performs some checks
@@ -1867,14 +1961,24 @@ check_refcounts_l1(BlockDriverState *bs, BdrvCheckResult *res,
 {
     BDRVQcow2State *s = bs->opaque;
     size_t l1_size_bytes = l1_size * L1E_SIZE;
+    size_t l2_size_bytes = s->l2_size * l2_entry_size(s);
     g_autofree uint64_t *l1_table = NULL;
+    g_autofree uint8_t *l2_tables = NULL;
+    int l2_ret[QCOW2_CHECK_L2_BATCH];
+    int batch, nb_l2, i, j = 0, ret;
     uint64_t l2_offset;
-    int i, ret;
 
     if (!l1_size) {
         return 0;
     }
 
+    /*
+     * The L2 tables are read in batches, concurrently, and then checked one
+     * by one.  Repairing an L2 table may rewrite an entry in it, so it is
+     * only read after the previous L2 table has been checked then.
+     */
+    batch = fix & BDRV_FIX_ERRORS ? 1 : QCOW2_CHECK_L2_BATCH;
+
     /* Mark L1 table as used */
     ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, refcount_table_size,
                                    l1_table_offset, l1_size_bytes);
@@ -1883,7 +1987,8 @@ check_refcounts_l1(BlockDriverState *bs, BdrvCheckResult *res,
     }
 
     l1_table = g_try_malloc(l1_size_bytes);
-    if (l1_table == NULL) {
+    l2_tables = g_try_malloc(batch * l2_size_bytes);
+    if (l1_table == NULL || l2_tables == NULL) {
         res->check_errors++;
         return -ENOMEM;
     }
@@ -1901,11 +2006,39 @@ check_refcounts_l1(BlockDriverState *bs, BdrvCheckResult *res,
     }
 
     /* Do the actual checks */
-    for (i = 0; i < l1_size; i++) {
+    for (i = 0, nb_l2 = 0; i < l1_size; i++) {
         if (!l1_table[i]) {
             continue;
         }
 
+        if (!nb_l2) {
+            AioTaskPool *aio = aio_task_pool_new(batch);
+
+            for (j = i; j < l1_size && nb_l2 < batch; j++) {
+                Qcow2CheckReadTask *t;
+
+                if (!l1_table[j]) {
+                    continue;
+                }
+
+                t = g_new(Qcow2CheckReadTask, 1);
+                *t = (Qcow2CheckReadTask) {
+                    .task.func = qcow2_check_read_task_entry,
+                    .bs = bs,
+                    .offset = l1_table[j] & L1E_OFFSET_MASK,
+                    .bytes = l2_size_bytes,
+                    .buf = l2_tables + nb_l2 * l2_size_bytes,
+                    .ret = &l2_ret[nb_l2],
+                };
+                nb_l2++;
+                aio_task_pool_start_task(aio, &t->task);
+            }
+
+            aio_task_pool_wait_all(aio);
+            aio_task_pool_free(aio);
+            j = 0;
+        }
+
         if (l1_table[i] & L1E_RESERVED_MASK) {
             fprintf(stderr, "ERROR found L1 entry with reserved bits set: "
                     "%" PRIx64 "\n", l1_table[i]);
@@ -1930,12 +2063,22 @@ check_refcounts_l1(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         /* Process and check L2 entries */
+        if (l2_ret[j] < 0) {
+            fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
+            res->check_errors++;
+            return l2_ret[j];
+        }
         ret = check_refcounts_l2(bs, res, refcount_table,
-                                 refcount_table_size, l2_offset, flags,
-                                 fix, active);
+                                 refcount_table_size, l2_offset,
+                                 (uint64_t *)(l2_tables + j * l2_size_bytes),
+                                 flags, fix, active);
         if (ret < 0) {
             return ret;
         }
+
+        if (++j == nb_l2) {
+            nb_l2 = 0;
+        }
     }
 
     return 0;
@@ -1975,6 +2118,8 @@ check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode fix
         uint64_t l1_entry = s->l1_table[i];
         uint64_t l2_offset = l1_entry & L1E_OFFSET_MASK;
         int l2_dirty = 0;
+        /* Entries of l2_dirty that were not counted as corruptions */
+        int l2_restored = 0;
 
         if (!l2_offset) {
             continue;
@@ -1992,9 +2137,11 @@ check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode fix
                     "l1_entry=%" PRIx64 " refcount=%" PRIu64 "\n",
                     repair ? "Repairing" : "ERROR", i, l1_entry, refcount);
             if (repair) {
+                qcow2_mapping_write_begin(s);
                 s->l1_table[i] = refcount == 1
                                ? l1_entry |  QCOW_OFLAG_COPIED
                                : l1_entry & ~QCOW_OFLAG_COPIED;
+                qcow2_mapping_write_end(s);
                 ret = qcow2_write_l1_entry(bs, i);
                 if (ret < 0) {
                     res->check_errors++;
@@ -2032,7 +2179,25 @@ check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode fix
                         continue;
                     }
                 }
-                if ((refcount == 1) != ((l2_entry & QCOW_OFLAG_COPIED) != 0)) {
+                if (refcount == 1 && !(l2_entry & QCOW_OFLAG_COPIED) &&
+                    s->dedup_table_offset) {
+                    /*
+                     * A deduplicated cluster keeps the flag cleared when its
+                     * other references go away, which only costs a copy on
+                     * the next write to it.  This is no corruption, but set
+                     * the flag again when repairing anyway.
+                     */
+                    if (repair) {
+                        fprintf(stderr, "Repairing OFLAG_COPIED of formerly "
+                                "shared data cluster: l2_entry=%" PRIx64 "\n",
+                                l2_entry);
+                        set_l2_entry(s, l2_table, j,
+                                     l2_entry | QCOW_OFLAG_COPIED);
+                        l2_restored++;
+                        l2_dirty++;
+                    }
+                } else if ((refcount == 1) !=
+                           ((l2_entry & QCOW_OFLAG_COPIED) != 0)) {
                     res->corruptions++;
                     fprintf(stderr, "%s OFLAG_COPIED data cluster: "
                             "l2_entry=%" PRIx64 " refcount=%" PRIu64 "\n",
@@ -2066,7 +2231,7 @@ check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res, BdrvCheckMode fix
                 res->check_errors++;
                 goto fail;
             }
-            res->corruptions -= l2_dirty;
+            res->corruptions -= l2_dirty - l2_restored;
             res->corruptions_fixed += l2_dirty;
         }
     }
@@ -2293,6 +2458,17 @@ calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         return ret;
     }
 
+    /* deduplication table */
+    if (s->dedup_table_offset) {
+        ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                       s->dedup_table_offset,
+                                       s->dedup_nb_entries *
+                                       sizeof(Qcow2DedupEntry));
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     return check_refblocks(bs, res, fix, rebuild, refcount_table, nb_clusters);
 }
 
@@ -3040,6 +3216,12 @@ int qcow2_check_metadata_overlap(BlockDriverState *bs, int ign, int64_t offset,
         }
     }
 
+    if ((chk & QCOW2_OL_DEDUP_TABLE) && s->dedup_table_offset &&
+        overlaps_with(s->dedup_table_offset,
+                      s->dedup_nb_entries * sizeof(Qcow2DedupEntry))) {
+        return QCOW2_OL_DEDUP_TABLE;
+    }
+
     return 0;
 }
 
@@ -3053,6 +3235,7 @@ static const char *metadata_ol_names[] = {
     [QCOW2_OL_INACTIVE_L1_BITNR]        = "inactive L1 table",
     [QCOW2_OL_INACTIVE_L2_BITNR]        = "inactive L2 table",
     [QCOW2_OL_BITMAP_DIRECTORY_BITNR]   = "bitmap directory",
+    [QCOW2_OL_DEDUP_TABLE_BITNR]        = "deduplication table",
 };
 QEMU_BUILD_BUG_ON(QCOW2_OL_MAX_BITNR != ARRAY_SIZE(metadata_ol_names));
 
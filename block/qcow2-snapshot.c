@@ -873,9 +873,11 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
      * Now update the in-memory L1 table to be in sync with the on-disk one. We
      * need to do this even if updating refcounts failed.
      */
+    qcow2_mapping_write_begin(s);
     for(i = 0;i < s->l1_size; i++) {
         s->l1_table[i] = be64_to_cpu(sn_l1_table[i]);
     }
+    qcow2_mapping_write_end(s);
 
     if (ret < 0) {
         goto fail;
@@ -1061,16 +1063,18 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs,
         return ret;
     }
 
+    for(i = 0;i < sn->l1_size; i++) {
+        be64_to_cpus(&new_l1_table[i]);
+    }
+
     /* Switch the L1 table */
-    qemu_vfree(s->l1_table);
+    qcow2_free_l1_table(s->l1_table);
 
+    qcow2_mapping_write_begin(s);
     s->l1_size = sn->l1_size;
     s->l1_table_offset = sn->l1_table_offset;
-    s->l1_table = new_l1_table;
-
-    for(i = 0;i < s->l1_size; i++) {
-        be64_to_cpus(&s->l1_table[i]);
-    }
+    qatomic_rcu_set(&s->l1_table, new_l1_table);
+    qcow2_mapping_write_end(s);
 
     return 0;
 }
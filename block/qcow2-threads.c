@@ -37,6 +37,7 @@
 #include "block/block-io.h"
 #include "block/thread-pool.h"
 #include "crypto.h"
+#include "crypto/hash.h"
 
 static int coroutine_fn
 qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
@@ -45,7 +46,7 @@ qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
     BDRVQcow2State *s = bs->opaque;
 
     qemu_co_mutex_lock(&s->lock);
-    while (s->nb_threads >= QCOW2_MAX_THREADS) {
+    while (s->nb_threads >= s->max_threads) {
         qemu_co_queue_wait(&s->thread_task_queue, &s->lock);
     }
     s->nb_threads++;
@@ -525,3 +526,49 @@ qcow2_co_decrypt(BlockDriverState *bs, uint64_t host_offset,
     return qcow2_co_encdec(bs, host_offset, guest_offset, buf, len,
                            qcrypto_block_decrypt);
 }
+
+
+/*
+ * Hashing
+ */
+
+typedef struct Qcow2HashData {
+    const void *buf;
+    size_t len;
+    uint8_t *hash;
+} Qcow2HashData;
+
+static int qcow2_hash_pool_func(void *opaque)
+{
+    Qcow2HashData *data = opaque;
+    g_autofree uint8_t *result = NULL;
+    size_t result_len;
+
+    if (qcrypto_hash_bytes(QCRYPTO_HASH_ALG_SHA256, data->buf, data->len,
+                           &result, &result_len, NULL) < 0) {
+        return -EIO;
+    }
+
+    assert(result_len >= QCOW2_DEDUP_HASH_SIZE);
+    memcpy(data->hash, result, QCOW2_DEDUP_HASH_SIZE);
+    return 0;
+}
+
+/*
+ * qcow2_co_dedup_hash()
+ *
+ * Stores the first QCOW2_DEDUP_HASH_SIZE bytes of the SHA-256 hash of
+ * @len bytes at @buf in @hash
+ */
+int coroutine_fn
+qcow2_co_dedup_hash(BlockDriverState *bs, const void *buf, size_t len,
+                    uint8_t *hash)
+{
+    Qcow2HashData arg = {
+        .buf = buf,
+        .len = len,
+        .hash = hash,
+    };
+
+    return qcow2_co_process(bs, qcow2_hash_pool_func, &arg);
+}
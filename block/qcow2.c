@@ -73,6 +73,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_CRYPTO_HEADER 0x0537be77
 #define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 #define  QCOW2_EXT_MAGIC_DATA_FILE 0x44415441
+#define  QCOW2_EXT_MAGIC_DEDUP 0x44454455
 
 static int coroutine_fn
 qcow2_co_preadv_compressed(BlockDriverState *bs,
@@ -211,6 +212,7 @@ qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
     uint64_t offset;
     int ret;
     Qcow2BitmapHeaderExt bitmaps_ext;
+    Qcow2DedupHeaderExt dedup_ext;
 
     if (need_update_header != NULL) {
         *need_update_header = false;
@@ -417,6 +419,63 @@ qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
 #endif
             break;
 
+        case QCOW2_EXT_MAGIC_DEDUP:
+            if (ext.len != sizeof(dedup_ext)) {
+                error_setg(errp, "dedup_ext: Invalid extension length");
+                return -EINVAL;
+            }
+
+            if (!(s->autoclear_features & QCOW2_AUTOCLEAR_DEDUP)) {
+                /*
+                 * The clusters of the table may have been freed and reused
+                 * by a program that does not know about it, so it must not
+                 * be written to any more.
+                 */
+                warn_report("a program lacking deduplication support "
+                            "modified this file, so the deduplication table "
+                            "is dropped");
+                error_printf("Some clusters may be leaked, "
+                             "run 'qemu-img check -r' on the image "
+                             "file to fix.");
+                if (need_update_header != NULL) {
+                    *need_update_header = true;
+                }
+                break;
+            }
+
+            ret = bdrv_co_pread(bs->file, offset, ext.len, &dedup_ext, 0);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "dedup_ext: "
+                                 "Could not read ext header");
+                return ret;
+            }
+
+            dedup_ext.table_offset = be64_to_cpu(dedup_ext.table_offset);
+            dedup_ext.nb_entries = be32_to_cpu(dedup_ext.nb_entries);
+
+            if (dedup_ext.reserved32 != 0) {
+                error_setg(errp, "dedup_ext: Reserved field is not zero");
+                return -EINVAL;
+            }
+
+            if (!dedup_ext.table_offset ||
+                offset_into_cluster(s, dedup_ext.table_offset)) {
+                error_setg(errp, "dedup_ext: Invalid table offset");
+                return -EINVAL;
+            }
+
+            if (!is_power_of_2(dedup_ext.nb_entries) ||
+                dedup_ext.nb_entries < QCOW2_DEDUP_MIN_ENTRIES ||
+                dedup_ext.nb_entries > QCOW2_DEDUP_MAX_ENTRIES) {
+                error_setg(errp, "dedup_ext: Invalid number of table entries "
+                           "(%" PRIu32 ")", dedup_ext.nb_entries);
+                return -EINVAL;
+            }
+
+            s->dedup_table_offset = dedup_ext.table_offset;
+            s->dedup_nb_entries = dedup_ext.nb_entries;
+            break;
+
         case QCOW2_EXT_MAGIC_DATA_FILE:
         {
             s->image_data_file = g_malloc0(ext.len + 1);
@@ -614,6 +673,9 @@ qcow2_co_check_locked(BlockDriverState *bs, BdrvCheckResult *result,
 
     memset(result, 0, sizeof(*result));
 
+    /* Reserved clusters would be reported as leaked */
+    qcow2_release_alloc_zones(bs);
+
     ret = qcow2_check_read_snapshot_table(bs, &snapshot_res, fix);
     if (ret < 0) {
         qcow2_add_check_result(result, &snapshot_res, false);
@@ -696,11 +758,15 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_OVERLAP_INACTIVE_L1,
     QCOW2_OPT_OVERLAP_INACTIVE_L2,
     QCOW2_OPT_OVERLAP_BITMAP_DIRECTORY,
+    QCOW2_OPT_OVERLAP_DEDUP_TABLE,
     QCOW2_OPT_CACHE_SIZE,
     QCOW2_OPT_L2_CACHE_SIZE,
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_ALLOC_ZONE_SIZE,
+    QCOW2_OPT_L2_READAHEAD,
+    QCOW2_OPT_DEDUP,
     NULL
 };
 
@@ -791,6 +857,12 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "Check for unintended writes into the bitmap directory",
         },
+        {
+            .name = QCOW2_OPT_OVERLAP_DEDUP_TABLE,
+            .type = QEMU_OPT_BOOL,
+            .help = "Check for unintended writes into the deduplication "
+                    "table",
+        },
         {
             .name = QCOW2_OPT_CACHE_SIZE,
             .type = QEMU_OPT_SIZE,
@@ -817,6 +889,23 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_ALLOC_ZONE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Reserve data clusters in zones of this size per thread",
+        },
+        {
+            .name = QCOW2_OPT_L2_READAHEAD,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of L2 cache entries to read ahead of sequential "
+                    "requests",
+        },
+        {
+            .name = QCOW2_OPT_DEDUP,
+            .type = QEMU_OPT_BOOL,
+            .help = "Share existing clusters for full cluster writes of the "
+                    "same data",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -833,14 +922,31 @@ static const char *overlap_bool_option_names[QCOW2_OL_MAX_BITNR] = {
     [QCOW2_OL_INACTIVE_L1_BITNR]      = QCOW2_OPT_OVERLAP_INACTIVE_L1,
     [QCOW2_OL_INACTIVE_L2_BITNR]      = QCOW2_OPT_OVERLAP_INACTIVE_L2,
     [QCOW2_OL_BITMAP_DIRECTORY_BITNR] = QCOW2_OPT_OVERLAP_BITMAP_DIRECTORY,
+    [QCOW2_OL_DEDUP_TABLE_BITNR]      = QCOW2_OPT_OVERLAP_DEDUP_TABLE,
 };
 
-static void cache_clean_timer_cb(void *opaque)
+static void coroutine_fn qcow2_cache_clean_entry(void *opaque)
 {
     BlockDriverState *bs = opaque;
     BDRVQcow2State *s = bs->opaque;
+
+    /* Changing the caches must not race with requests in other threads */
+    qemu_co_mutex_lock(&s->lock);
     qcow2_cache_clean_unused(s->l2_table_cache);
     qcow2_cache_clean_unused(s->refcount_block_cache);
+    qemu_co_mutex_unlock(&s->lock);
+
+    bdrv_dec_in_flight(bs);
+}
+
+static void cache_clean_timer_cb(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcow2State *s = bs->opaque;
+
+    bdrv_inc_in_flight(bs);
+    aio_co_enter(bdrv_get_aio_context(bs),
+                 qemu_coroutine_create(qcow2_cache_clean_entry, bs));
     timer_mod(s->cache_clean_timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
               (int64_t) s->cache_clean_interval * 1000);
 }
@@ -979,6 +1085,9 @@ typedef struct Qcow2ReopenState {
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     bool discard_no_unref;
     uint64_t cache_clean_interval;
+    uint64_t alloc_zone_size;
+    uint64_t l2_readahead;
+    bool dedup;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -1051,10 +1160,12 @@ qcow2_update_options_prepare(BlockDriverState *bs, Qcow2ReopenState *r,
     }
 
     r->l2_slice_size = l2_cache_entry_size / l2_entry_size(s);
+    /* Only L2 slices are looked up without s->lock */
     r->l2_table_cache = qcow2_cache_create(bs, l2_cache_size,
-                                           l2_cache_entry_size);
+                                           l2_cache_entry_size,
+                                           &s->mapping_seqlock);
     r->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size,
-                                                 s->cluster_size);
+                                                 s->cluster_size, NULL);
     if (r->l2_table_cache == NULL || r->refcount_block_cache == NULL) {
         error_setg(errp, "Could not allocate metadata caches");
         ret = -ENOMEM;
@@ -1079,6 +1190,40 @@ qcow2_update_options_prepare(BlockDriverState *bs, Qcow2ReopenState *r,
         goto fail;
     }
 
+    r->alloc_zone_size = qemu_opt_get_size(opts, QCOW2_OPT_ALLOC_ZONE_SIZE, 0);
+    if (!QEMU_IS_ALIGNED(r->alloc_zone_size, s->cluster_size)) {
+        error_setg(errp, QCOW2_OPT_ALLOC_ZONE_SIZE " must be a multiple of "
+                   "the cluster size (%d)", s->cluster_size);
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (r->alloc_zone_size > QCOW_MAX_CLUSTER_OFFSET) {
+        error_setg(errp, QCOW2_OPT_ALLOC_ZONE_SIZE " must not exceed %"
+                   PRIu64, (uint64_t)QCOW_MAX_CLUSTER_OFFSET);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    r->l2_readahead = qemu_opt_get_number(opts, QCOW2_OPT_L2_READAHEAD, 0);
+    if (r->l2_readahead > l2_cache_size / 2) {
+        error_setg(errp, QCOW2_OPT_L2_READAHEAD " must not be more than half "
+                   "of the L2 cache entries (%" PRIu64 ")",
+                   l2_cache_size / 2);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    r->dedup = qemu_opt_get_bool(opts, QCOW2_OPT_DEDUP, false);
+    if (r->dedup && (s->qcow_version < 3 || s->crypt_method_header ||
+                     has_subclusters(s) ||
+                     (s->incompatible_features & QCOW2_INCOMPAT_DATA_FILE))) {
+        error_setg(errp, QCOW2_OPT_DEDUP " requires a qcow2 image with at "
+                   "least qemu 1.1 compatibility level, without encryption, "
+                   "external data file or extended L2 entries");
+        ret = -EINVAL;
+        goto fail;
+    }
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -1239,6 +1384,12 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
 
     s->discard_no_unref = r->discard_no_unref;
 
+    /* Zones that are already reserved are used up first */
+    s->alloc_zone_size = r->alloc_zone_size;
+
+    s->l2_readahead = r->l2_readahead;
+    s->dedup = r->dedup;
+
     if (s->cache_clean_interval != r->cache_clean_interval) {
         cache_clean_timer_del(bs);
         s->cache_clean_interval = r->cache_clean_interval;
@@ -1888,6 +2039,8 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
 #endif
 
     qemu_co_queue_init(&s->thread_task_queue);
+    s->max_threads = MAX(QCOW2_MAX_THREADS, g_get_num_processors());
+    qemu_co_queue_init(&s->dedup_queue);
 
     return ret;
 
@@ -1961,6 +2114,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
 
     /* Initialise locks */
     qemu_co_mutex_init(&s->lock);
+    seqlock_init(&s->mapping_seqlock);
 
     assert(!qemu_in_coroutine());
     assert(qemu_get_current_aio_context() == qemu_get_aio_context());
@@ -2011,6 +2165,13 @@ qcow2_reopen_prepare(BDRVReopenState *state,BlockReopenQueue *queue,
             goto fail;
         }
 
+        qcow2_release_alloc_zones(state->bs);
+
+        ret = qcow2_store_dedup_table(state->bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+
         ret = bdrv_flush(state->bs);
         if (ret < 0) {
             goto fail;
@@ -2395,6 +2556,8 @@ qcow2_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
     QCow2SubclusterType type;
     AioTaskPool *aio = NULL;
 
+    qcow2_l2_readahead(bs, offset, bytes, false);
+
     while (bytes != 0 && aio_task_pool_status(aio) == 0) {
         /* prepare next request */
         cur_bytes = MIN(bytes, INT_MAX);
@@ -2403,10 +2566,14 @@ qcow2_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
                             QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
         }
 
-        qemu_co_mutex_lock(&s->lock);
-        ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
-                                    &host_offset, &type);
-        qemu_co_mutex_unlock(&s->lock);
+        ret = qcow2_get_host_offset_lockless(bs, offset, &cur_bytes,
+                                             &host_offset, &type);
+        if (ret == -EAGAIN) {
+            qemu_co_mutex_lock(&s->lock);
+            ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
+                                        &host_offset, &type);
+            qemu_co_mutex_unlock(&s->lock);
+        }
         if (ret < 0) {
             goto out;
         }
@@ -2651,6 +2818,7 @@ out_unlocked:
 
 out_locked:
     qcow2_handle_l2meta(bs, &l2meta, false);
+    qcow2_dedup_write_done(s);
     qemu_co_mutex_unlock(&s->lock);
 
     qemu_vfree(crypt_buf);
@@ -2685,8 +2853,11 @@ qcow2_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
     uint64_t host_offset;
     QCowL2Meta *l2meta = NULL;
     AioTaskPool *aio = NULL;
+    uint8_t dedup_hash[QCOW2_DEDUP_HASH_SIZE];
+    bool dedup;
 
     trace_qcow2_writev_start_req(qemu_coroutine_self(), offset, bytes);
+    qcow2_l2_readahead(bs, offset, bytes, true);
 
     while (bytes != 0 && aio_task_pool_status(aio) == 0) {
 
@@ -2701,7 +2872,25 @@ qcow2_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
                             - offset_in_cluster);
         }
 
+        /* Full clusters are deduplicated one at a time */
+        dedup = s->dedup && offset_in_cluster == 0 &&
+                bytes >= s->cluster_size;
+        if (dedup) {
+            ret = qcow2_co_dedup_cluster(bs, offset, qiov, qiov_offset,
+                                         dedup_hash);
+            if (ret < 0) {
+                goto fail_nometa;
+            } else if (ret > 0) {
+                bytes -= s->cluster_size;
+                offset += s->cluster_size;
+                qiov_offset += s->cluster_size;
+                continue;
+            }
+            cur_bytes = s->cluster_size;
+        }
+
         qemu_co_mutex_lock(&s->lock);
+        qcow2_dedup_wait(s);
 
         ret = qcow2_alloc_host_offset(bs, offset, &cur_bytes,
                                       &host_offset, &l2meta);
@@ -2715,6 +2904,10 @@ qcow2_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
             goto out_locked;
         }
 
+        if (dedup && cur_bytes == s->cluster_size) {
+            qcow2_dedup_insert(bs, dedup_hash, offset, host_offset);
+        }
+        s->nb_data_writes++;
         qemu_co_mutex_unlock(&s->lock);
 
         if (!aio && cur_bytes != bytes) {
@@ -2762,6 +2955,8 @@ static int GRAPH_RDLOCK qcow2_inactivate(BlockDriverState *bs)
     int ret, result = 0;
     Error *local_err = NULL;
 
+    qcow2_release_alloc_zones(bs);
+
     qcow2_store_persistent_dirty_bitmaps(bs, true, &local_err);
     if (local_err != NULL) {
         result = -EINVAL;
@@ -2770,6 +2965,14 @@ static int GRAPH_RDLOCK qcow2_inactivate(BlockDriverState *bs)
                           bdrv_get_device_or_node_name(bs));
     }
 
+    ret = qcow2_store_dedup_table(bs, &local_err);
+    if (ret < 0) {
+        result = ret;
+        error_reportf_err(local_err, "Lost the deduplication table during "
+                          "inactivation of node '%s': ",
+                          bdrv_get_device_or_node_name(bs));
+    }
+
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret) {
         result = ret;
@@ -2814,6 +3017,8 @@ qcow2_do_close(BlockDriverState *bs, bool close_data_file)
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
 
+    g_free(s->dedup_table);
+
     g_free(s->image_data_file);
     g_free(s->image_backing_file);
     g_free(s->image_backing_format);
@@ -3096,6 +3301,11 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_AUTOCLEAR_DATA_FILE_RAW_BITNR,
                 .name = "raw external data",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+                .bit  = QCOW2_AUTOCLEAR_DEDUP_BITNR,
+                .name = "deduplication table",
+            },
         };
 
         ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -3126,6 +3336,21 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Deduplication table extension */
+    if (s->dedup_table_offset) {
+        Qcow2DedupHeaderExt dedup_header = {
+            .table_offset = cpu_to_be64(s->dedup_table_offset),
+            .nb_entries = cpu_to_be32(s->dedup_nb_entries),
+        };
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_DEDUP,
+                             &dedup_header, sizeof(dedup_header), buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Keep unknown header extensions */
     QLIST_FOREACH(uext, &s->unknown_header_ext, next) {
         ret = header_ext_add(buf, uext->magic, uext->data, uext->len, buflen);
@@ -4249,6 +4474,8 @@ qcow2_co_copy_range_to(BlockDriverState *bs,
 
         cur_bytes = MIN(bytes, INT_MAX);
 
+        qcow2_dedup_wait(s);
+
         /* TODO:
          * If src->bs == dst->bs, we could simply copy by incrementing
          * the refcnt, without copying user data.
@@ -4265,10 +4492,12 @@ qcow2_co_copy_range_to(BlockDriverState *bs,
             goto fail;
         }
 
+        s->nb_data_writes++;
         qemu_co_mutex_unlock(&s->lock);
         ret = bdrv_co_copy_range_to(src, src_offset, s->data_file, host_offset,
                                     cur_bytes, read_flags, write_flags);
         qemu_co_mutex_lock(&s->lock);
+        qcow2_dedup_write_done(s);
         if (ret < 0) {
             goto fail;
         }
@@ -4679,23 +4908,34 @@ qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
     BDRVQcow2State *s = bs->opaque;
     int ret;
     ssize_t out_len;
-    uint8_t *buf, *out_buf;
+    uint8_t *buf = NULL, *out_buf;
+    const void *src;
+    struct iovec *iov;
+    size_t head, tail;
+    int niov;
     uint64_t cluster_offset;
 
     assert(bytes == s->cluster_size || (bytes < s->cluster_size &&
            (offset + bytes == bs->total_sectors << BDRV_SECTOR_BITS)));
 
-    buf = qemu_blockalign(bs, s->cluster_size);
-    if (bytes < s->cluster_size) {
-        /* Zero-pad last write if image size is not cluster aligned */
-        memset(buf + bytes, 0, s->cluster_size - bytes);
+    iov = qemu_iovec_slice(qiov, qiov_offset, bytes, &head, &tail, &niov);
+    if (bytes == s->cluster_size && niov == 1) {
+        /* The cluster is contiguous in the request, compress it in place */
+        src = iov->iov_base + head;
+    } else {
+        buf = qemu_blockalign(bs, s->cluster_size);
+        if (bytes < s->cluster_size) {
+            /* Zero-pad last write if image size is not cluster aligned */
+            memset(buf + bytes, 0, s->cluster_size - bytes);
+        }
+        qemu_iovec_to_buf(qiov, qiov_offset, buf, bytes);
+        src = buf;
     }
-    qemu_iovec_to_buf(qiov, qiov_offset, buf, bytes);
 
     out_buf = g_malloc(s->cluster_size);
 
     out_len = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
-                                buf, s->cluster_size);
+                                src, s->cluster_size);
     if (out_len == -ENOMEM) {
         /* could not compress: write normal cluster */
         ret = qcow2_co_pwritev_part(bs, offset, bytes, qiov, qiov_offset, 0);
@@ -4794,7 +5034,13 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
         uint64_t chunk_size = MIN(bytes, s->cluster_size);
 
         if (!aio && chunk_size != bytes) {
-            aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
+            /*
+             * Allow twice as many clusters in flight as there are threads,
+             * so that all threads compress while other clusters are
+             * written
+             */
+            aio = aio_task_pool_new(MAX(QCOW2_MAX_WORKERS,
+                                        2 * s->max_threads));
         }
 
         ret = qcow2_add_task(bs, aio, qcow2_co_pwritev_compressed_task_entry,
@@ -5021,19 +5267,22 @@ static int GRAPH_RDLOCK qcow2_make_empty(BlockDriverState *bs)
 
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / L1E_SIZE);
 
+    qcow2_release_alloc_zones(bs);
+
     if (s->qcow_version >= 3 && !s->snapshots && !s->nb_bitmaps &&
+        !s->dedup_table_offset &&
         3 + l1_clusters <= s->refcount_block_size &&
         s->crypt_method_header != QCOW_CRYPT_LUKS &&
         !has_data_file(bs)) {
         /* The following function only works for qcow2 v3 images (it
          * requires the dirty flag) and only as long as there are no
          * features that reserve extra clusters (such as snapshots,
-         * LUKS header, or persistent bitmaps), because it completely
-         * empties the image.  Furthermore, the L1 table and three
-         * additional clusters (image header, refcount table, one
-         * refcount block) have to fit inside one refcount block. It
-         * only resets the image file, i.e. does not work with an
-         * external data file. */
+         * LUKS header, persistent bitmaps or the deduplication table),
+         * because it completely empties the image.  Furthermore, the
+         * L1 table and three additional clusters (image header,
+         * refcount table, one refcount block) have to fit inside one
+         * refcount block. It only resets the image file, i.e. does not
+         * work with an external data file. */
         return make_completely_empty(bs);
     }
 
@@ -5327,6 +5576,21 @@ qcow2_get_specific_info(BlockDriverState *bs, Error **errp)
     return spec_info;
 }
 
+static BlockStatsSpecific *qcow2_get_specific_stats(BlockDriverState *bs)
+{
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+    BDRVQcow2State *s = bs->opaque;
+
+    stats->driver = BLOCKDEV_DRIVER_QCOW2;
+    stats->u.qcow2 = (BlockStatsSpecificQcow2) {
+        .l2_cache_hits = stat64_get(&s->l2_cache_hits),
+        .l2_cache_misses = stat64_get(&s->l2_cache_misses),
+        .l2_readahead = stat64_get(&s->l2_readahead_slices),
+    };
+
+    return stats;
+}
+
 static int coroutine_mixed_fn GRAPH_RDLOCK
 qcow2_has_zero_init(BlockDriverState *bs)
 {
@@ -5508,6 +5772,15 @@ qcow2_downgrade(BlockDriverState *bs, int target_version,
     /* if lazy refcounts have been used, they have already been fixed through
      * clearing the dirty flag */
 
+    /* the deduplication table needs autoclear features to be valid */
+    s->dedup = false;
+    ret = qcow2_remove_dedup_table(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to remove the deduplication "
+                         "table");
+        return ret;
+    }
+
     /* clearing autoclear features is trivial */
     s->autoclear_features = 0;
 
@@ -6176,6 +6449,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_measure                       = qcow2_measure,
     .bdrv_co_get_info                   = qcow2_co_get_info,
     .bdrv_get_specific_info             = qcow2_get_specific_info,
+    .bdrv_get_specific_stats            = qcow2_get_specific_stats,
 
     .bdrv_co_save_vmstate               = qcow2_co_save_vmstate,
     .bdrv_co_load_vmstate               = qcow2_co_load_vmstate,
@@ -27,6 +27,8 @@
 
 #include "crypto/block.h"
 #include "qemu/coroutine.h"
+#include "qemu/seqlock.h"
+#include "qemu/stats64.h"
 #include "qemu/units.h"
 #include "block/block_int.h"
 
@@ -145,11 +147,15 @@
 #define QCOW2_OPT_OVERLAP_INACTIVE_L1 "overlap-check.inactive-l1"
 #define QCOW2_OPT_OVERLAP_INACTIVE_L2 "overlap-check.inactive-l2"
 #define QCOW2_OPT_OVERLAP_BITMAP_DIRECTORY "overlap-check.bitmap-directory"
+#define QCOW2_OPT_OVERLAP_DEDUP_TABLE "overlap-check.dedup-table"
 #define QCOW2_OPT_CACHE_SIZE "cache-size"
 #define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_ALLOC_ZONE_SIZE "alloc-zone-size"
+#define QCOW2_OPT_L2_READAHEAD "l2-readahead"
+#define QCOW2_OPT_DEDUP "dedup"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -281,11 +287,14 @@ enum {
 enum {
     QCOW2_AUTOCLEAR_BITMAPS_BITNR       = 0,
     QCOW2_AUTOCLEAR_DATA_FILE_RAW_BITNR = 1,
+    QCOW2_AUTOCLEAR_DEDUP_BITNR         = 2,
     QCOW2_AUTOCLEAR_BITMAPS             = 1 << QCOW2_AUTOCLEAR_BITMAPS_BITNR,
     QCOW2_AUTOCLEAR_DATA_FILE_RAW       = 1 << QCOW2_AUTOCLEAR_DATA_FILE_RAW_BITNR,
+    QCOW2_AUTOCLEAR_DEDUP               = 1 << QCOW2_AUTOCLEAR_DEDUP_BITNR,
 
     QCOW2_AUTOCLEAR_MASK                = QCOW2_AUTOCLEAR_BITMAPS
-                                        | QCOW2_AUTOCLEAR_DATA_FILE_RAW,
+                                        | QCOW2_AUTOCLEAR_DATA_FILE_RAW
+                                        | QCOW2_AUTOCLEAR_DEDUP,
 };
 
 enum qcow2_discard_type {
@@ -322,8 +331,41 @@ typedef struct Qcow2BitmapHeaderExt {
     uint64_t bitmap_directory_offset;
 } QEMU_PACKED Qcow2BitmapHeaderExt;
 
+typedef struct Qcow2DedupHeaderExt {
+    uint64_t table_offset;
+    uint32_t nb_entries;
+    uint32_t reserved32;
+} QEMU_PACKED Qcow2DedupHeaderExt;
+
+#define QCOW2_DEDUP_HASH_SIZE 16
+#define QCOW2_DEDUP_MIN_ENTRIES 1024
+#define QCOW2_DEDUP_MAX_ENTRIES (1 << 20)
+
+/* Entry of the deduplication table, kept in big endian also in memory */
+typedef struct Qcow2DedupEntry {
+    /* Leading bytes of the SHA-256 hash of the cluster data */
+    uint8_t hash[QCOW2_DEDUP_HASH_SIZE];
+    /* Host cluster with that data, or 0 if the entry is unused */
+    uint64_t host_offset;
+    /* Guest cluster that was first written with it */
+    uint64_t guest_offset;
+} QEMU_PACKED Qcow2DedupEntry;
+
+/*
+ * Minimum number of threads used for compression and encryption, the limit
+ * is raised to the number of host CPUs where there are more
+ */
 #define QCOW2_MAX_THREADS 4
 
+/* Data clusters reserved for the allocating writes of one AioContext */
+typedef struct Qcow2AllocZone {
+    AioContext *ctx;
+    /* The clusters from offset up to end are reserved but not used yet */
+    uint64_t offset;
+    uint64_t end;
+    QLIST_ENTRY(Qcow2AllocZone) next;
+} Qcow2AllocZone;
+
 typedef struct BDRVQcow2State {
     int cluster_bits;
     int cluster_size;
@@ -348,8 +390,24 @@ typedef struct BDRVQcow2State {
     QEMUTimer *cache_clean_timer;
     unsigned cache_clean_interval;
 
+    /* Number of L2 slices to read ahead of sequential requests, or 0 */
+    unsigned l2_readahead;
+    /* End of the last request, to detect sequential ones */
+    int64_t readahead_last_end;
+    /* Guest offset up to which L2 slices are being read ahead */
+    int64_t readahead_end;
+
+    /* Reported by query-blockstats */
+    Stat64 l2_cache_hits;
+    Stat64 l2_cache_misses;
+    Stat64 l2_readahead_slices;
+
     QLIST_HEAD(, QCowL2Meta) cluster_allocs;
 
+    /* Size of the data cluster zones reserved per AioContext, or 0 */
+    uint64_t alloc_zone_size;
+    QLIST_HEAD(, Qcow2AllocZone) alloc_zones;
+
     uint64_t *refcount_table;
     uint64_t refcount_table_offset;
     uint32_t refcount_table_size;
@@ -358,6 +416,12 @@ typedef struct BDRVQcow2State {
     uint64_t free_byte_offset;
 
     CoMutex lock;
+    /*
+     * Written, with lock held, around any change to the active L1 table or
+     * to the set and contents of the cached L2 slices, see
+     * qcow2_get_host_offset_lockless()
+     */
+    QemuSeqLock mapping_seqlock;
 
     Qcow2CryptoHeaderExtension crypto_header; /* QCow2 header extension */
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
@@ -374,6 +438,22 @@ typedef struct BDRVQcow2State {
     uint64_t bitmap_directory_size;
     uint64_t bitmap_directory_offset;
 
+    /* Whether full cluster writes share existing clusters with the same data */
+    bool dedup;
+    /* Deduplication table, as stored in the image (0 if there is none) */
+    uint64_t dedup_table_offset;
+    uint32_t dedup_nb_entries;
+    /* The table is loaded on first use and stored when the image is closed */
+    Qcow2DedupEntry *dedup_table;
+    bool dedup_table_dirty;
+    /*
+     * Data writes in flight, and deduplicating requests that wait for them
+     * to finish, see qcow2_co_dedup_cluster()
+     */
+    unsigned nb_data_writes;
+    unsigned dedup_barrier;
+    CoQueue dedup_queue;
+
     int flags;
     int qcow_version;
     bool use_lazy_refcounts;
@@ -410,6 +490,7 @@ typedef struct BDRVQcow2State {
 
     CoQueue thread_task_queue;
     int nb_threads;
+    int max_threads;
 
     BdrvChild *data_file;
 
@@ -557,8 +638,9 @@ typedef enum QCow2MetadataOverlap {
     QCOW2_OL_INACTIVE_L1_BITNR      = 6,
     QCOW2_OL_INACTIVE_L2_BITNR      = 7,
     QCOW2_OL_BITMAP_DIRECTORY_BITNR = 8,
+    QCOW2_OL_DEDUP_TABLE_BITNR      = 9,
 
-    QCOW2_OL_MAX_BITNR              = 9,
+    QCOW2_OL_MAX_BITNR              = 10,
 
     QCOW2_OL_NONE             = 0,
     QCOW2_OL_MAIN_HEADER      = (1 << QCOW2_OL_MAIN_HEADER_BITNR),
@@ -572,12 +654,14 @@ typedef enum QCow2MetadataOverlap {
      * reads. */
     QCOW2_OL_INACTIVE_L2      = (1 << QCOW2_OL_INACTIVE_L2_BITNR),
     QCOW2_OL_BITMAP_DIRECTORY = (1 << QCOW2_OL_BITMAP_DIRECTORY_BITNR),
+    QCOW2_OL_DEDUP_TABLE      = (1 << QCOW2_OL_DEDUP_TABLE_BITNR),
 } QCow2MetadataOverlap;
 
 /* Perform all overlap checks which can be done in constant time */
 #define QCOW2_OL_CONSTANT \
     (QCOW2_OL_MAIN_HEADER | QCOW2_OL_ACTIVE_L1 | QCOW2_OL_REFCOUNT_TABLE | \
-     QCOW2_OL_SNAPSHOT_TABLE | QCOW2_OL_BITMAP_DIRECTORY)
+     QCOW2_OL_SNAPSHOT_TABLE | QCOW2_OL_BITMAP_DIRECTORY | \
+     QCOW2_OL_DEDUP_TABLE)
 
 /* Perform all overlap checks which don't require disk access */
 #define QCOW2_OL_CACHED \
@@ -626,11 +710,23 @@ static inline uint64_t get_l2_bitmap(BDRVQcow2State *s, uint64_t *l2_slice,
     }
 }
 
+static inline void qcow2_mapping_write_begin(BDRVQcow2State *s)
+{
+    seqlock_write_begin(&s->mapping_seqlock);
+}
+
+static inline void qcow2_mapping_write_end(BDRVQcow2State *s)
+{
+    seqlock_write_end(&s->mapping_seqlock);
+}
+
 static inline void set_l2_entry(BDRVQcow2State *s, uint64_t *l2_slice,
                                 int idx, uint64_t entry)
 {
     idx *= l2_entry_size(s) / sizeof(uint64_t);
+    qcow2_mapping_write_begin(s);
     l2_slice[idx] = cpu_to_be64(entry);
+    qcow2_mapping_write_end(s);
 }
 
 static inline void set_l2_bitmap(BDRVQcow2State *s, uint64_t *l2_slice,
@@ -638,7 +734,9 @@ static inline void set_l2_bitmap(BDRVQcow2State *s, uint64_t *l2_slice,
 {
     assert(has_subclusters(s));
     idx *= l2_entry_size(s) / sizeof(uint64_t);
+    qcow2_mapping_write_begin(s);
     l2_slice[idx + 1] = cpu_to_be64(bitmap);
+    qcow2_mapping_write_end(s);
 }
 
 static inline bool GRAPH_RDLOCK has_data_file(BlockDriverState *bs)
@@ -869,6 +967,11 @@ qcow2_refcount_area(BlockDriverState *bs, uint64_t offset,
 int64_t GRAPH_RDLOCK
 qcow2_alloc_clusters(BlockDriverState *bs, uint64_t size);
 
+int64_t GRAPH_RDLOCK
+qcow2_alloc_clusters_zone(BlockDriverState *bs, uint64_t *nb_clusters);
+
+void GRAPH_RDLOCK qcow2_release_alloc_zones(BlockDriverState *bs);
+
 int64_t GRAPH_RDLOCK coroutine_fn
 qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
                         int64_t nb_clusters);
@@ -931,6 +1034,13 @@ int GRAPH_RDLOCK
 qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
                       unsigned int *bytes, uint64_t *host_offset,
                       QCow2SubclusterType *subcluster_type);
+int GRAPH_RDLOCK
+qcow2_get_host_offset_lockless(BlockDriverState *bs, uint64_t offset,
+                               unsigned int *bytes, uint64_t *host_offset,
+                               QCow2SubclusterType *subcluster_type);
+void qcow2_free_l1_table(uint64_t *l1_table);
+void coroutine_fn qcow2_l2_readahead(BlockDriverState *bs, uint64_t offset,
+                                     uint64_t bytes, bool write);
 
 int coroutine_fn GRAPH_RDLOCK
 qcow2_alloc_host_offset(BlockDriverState *bs, uint64_t offset,
@@ -947,6 +1057,12 @@ qcow2_parse_compressed_l2_entry(BlockDriverState *bs, uint64_t l2_entry,
 int coroutine_fn GRAPH_RDLOCK
 qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
 
+int GRAPH_RDLOCK
+qcow2_get_l2_entry(BlockDriverState *bs, uint64_t offset, uint64_t *l2_entry);
+int coroutine_fn GRAPH_RDLOCK
+qcow2_dedup_link_l2(BlockDriverState *bs, uint64_t offset,
+                    uint64_t host_offset, int64_t referrer);
+
 void coroutine_fn GRAPH_RDLOCK
 qcow2_alloc_cluster_abort(BlockDriverState *bs, QCowL2Meta *m);
 
@@ -996,7 +1112,8 @@ qcow2_check_fix_snapshot_table(BlockDriverState *bs, BdrvCheckResult *result,
 
 /* qcow2-cache.c functions */
 Qcow2Cache * GRAPH_RDLOCK
-qcow2_cache_create(BlockDriverState *bs, int num_tables, unsigned table_size);
+qcow2_cache_create(BlockDriverState *bs, int num_tables, unsigned table_size,
+                   QemuSeqLock *seqlock);
 
 int qcow2_cache_destroy(Qcow2Cache *c);
 
@@ -1020,6 +1137,7 @@ qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 
 void qcow2_cache_put(Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
+void *qcow2_cache_lookup_lockless(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
 
 /* qcow2-bitmap.c functions */
@@ -1058,6 +1176,19 @@ bool qcow2_supports_persistent_dirty_bitmap(BlockDriverState *bs);
 uint64_t qcow2_get_persistent_dirty_bitmap_size(BlockDriverState *bs,
                                                 uint32_t cluster_size);
 
+/* qcow2-dedup.c functions */
+void coroutine_fn qcow2_dedup_wait(BDRVQcow2State *s);
+void qcow2_dedup_write_done(BDRVQcow2State *s);
+
+int coroutine_fn GRAPH_RDLOCK
+qcow2_co_dedup_cluster(BlockDriverState *bs, uint64_t offset,
+                       QEMUIOVector *qiov, size_t qiov_offset, uint8_t *hash);
+void qcow2_dedup_insert(BlockDriverState *bs, const uint8_t *hash,
+                        uint64_t offset, uint64_t host_offset);
+
+int GRAPH_RDLOCK qcow2_store_dedup_table(BlockDriverState *bs, Error **errp);
+int GRAPH_RDLOCK qcow2_remove_dedup_table(BlockDriverState *bs);
+
 ssize_t coroutine_fn
 qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
                   const void *src, size_t src_size);
@@ -1070,5 +1201,8 @@ qcow2_co_encrypt(BlockDriverState *bs, uint64_t host_offset,
 int coroutine_fn
 qcow2_co_decrypt(BlockDriverState *bs, uint64_t host_offset,
                  uint64_t guest_offset, void *buf, size_t len);
+int coroutine_fn
+qcow2_co_dedup_hash(BlockDriverState *bs, const void *buf, size_t len,
+                    uint8_t *hash);
 
 #endif
@@ -0,0 +1,757 @@
+/*
+ * Read cache filter block driver
+ *
+ * The driver keeps the blocks that are read through it in host memory or
+ * in a store node, for example a file on a local SSD, so that reading them
+ * again does not go to its file child.  This helps with slow backends such
+ * as NBD, curl or rbd, where the same data is read over and over.
+ *
+ * Writes go to the file child and then drop the blocks they cover from the
+ * cache, so the cache never holds data that the file child does not.
+ *
+ * Blocks are evicted with a segmented LRU policy: blocks enter a probation
+ * segment and move to a protected segment when they are read again.  Only
+ * when the probation segment is empty are protected blocks evicted, so a
+ * large read that is never repeated does not wipe out the working set.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block-io.h"
+#include "block/block_int.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/memalign.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/queue.h"
+#include "qemu/stats64.h"
+#include "qemu/units.h"
+
+#define READ_CACHE_OPT_SIZE "size"
+#define READ_CACHE_OPT_BLOCK_SIZE "block-size"
+
+#define READ_CACHE_DEFAULT_SIZE (128 * MiB)
+#define READ_CACHE_DEFAULT_BLOCK_SIZE (64 * KiB)
+#define READ_CACHE_MIN_BLOCK_SIZE (4 * KiB)
+#define READ_CACHE_MAX_BLOCK_SIZE (2 * MiB)
+
+/* Largest number of missing blocks that are read from the file at once */
+#define READ_CACHE_MAX_FILL (1 * MiB)
+
+typedef enum {
+    READ_CACHE_FREE,
+    READ_CACHE_PROBATION,
+    READ_CACHE_PROTECTED,
+    /* Dropped from the cache while it was in use */
+    READ_CACHE_STALE,
+} ReadCacheList;
+
+typedef struct ReadCacheSlot {
+    /* Block of the image that the slot holds */
+    int64_t index;
+    ReadCacheList list;
+    /* Set while the block is read from the file child */
+    bool filling;
+    /* Number of requests that copy the block out of the slot */
+    int readers;
+    QTAILQ_ENTRY(ReadCacheSlot) next;
+} ReadCacheSlot;
+
+typedef QTAILQ_HEAD(, ReadCacheSlot) ReadCacheSlotList;
+
+typedef struct BDRVReadCacheState {
+    /* Node that holds the cached blocks, or NULL for host memory */
+    BdrvChild *store;
+    /* Cached blocks if they are kept in host memory */
+    uint8_t *data;
+
+    uint64_t block_size;
+    int block_bits;
+    int nb_slots;
+    int max_protected;
+    ReadCacheSlot *slots;
+
+    /* Protects everything below */
+    QemuMutex lock;
+    /* Maps block index to the slot that holds it */
+    GHashTable *index;
+    ReadCacheSlotList free;
+    ReadCacheSlotList probation;
+    ReadCacheSlotList protected;
+    int nb_protected;
+    /* Requests waiting for a block to be filled */
+    CoQueue fill_queue;
+
+    Stat64 hits;
+    Stat64 misses;
+    Stat64 evictions;
+} BDRVReadCacheState;
+
+static QemuOptsList read_cache_runtime_opts = {
+    .name = "read-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(read_cache_runtime_opts.head),
+    .desc = {
+        {
+            .name = READ_CACHE_OPT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "capacity of the cache, default 128M",
+        },
+        {
+            .name = READ_CACHE_OPT_BLOCK_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "granularity of the cache, default 64k",
+        },
+        { /* end of list */ }
+    },
+};
+
+static ReadCacheSlotList *read_cache_list(BDRVReadCacheState *s,
+                                          ReadCacheList list)
+{
+    switch (list) {
+    case READ_CACHE_FREE:
+        return &s->free;
+    case READ_CACHE_PROBATION:
+        return &s->probation;
+    case READ_CACHE_PROTECTED:
+        return &s->protected;
+    default:
+        return NULL;
+    }
+}
+
+/* Called with s->lock held */
+static void read_cache_move(BDRVReadCacheState *s, ReadCacheSlot *slot,
+                            ReadCacheList list)
+{
+    ReadCacheSlotList *from = read_cache_list(s, slot->list);
+    ReadCacheSlotList *to = read_cache_list(s, list);
+
+    if (from) {
+        QTAILQ_REMOVE(from, slot, next);
+    }
+    if (slot->list == READ_CACHE_PROTECTED) {
+        s->nb_protected--;
+    }
+
+    slot->list = list;
+    if (to) {
+        QTAILQ_INSERT_HEAD(to, slot, next);
+    }
+    if (list == READ_CACHE_PROTECTED) {
+        s->nb_protected++;
+    }
+}
+
+static bool read_cache_slot_busy(ReadCacheSlot *slot)
+{
+    return slot->filling || slot->readers;
+}
+
+/*
+ * Drop @slot from the cache.  A slot that is in use is only freed when
+ * its last user is done with it.  Called with s->lock held.
+ */
+static void read_cache_drop(BDRVReadCacheState *s, ReadCacheSlot *slot)
+{
+    if (slot->list != READ_CACHE_STALE) {
+        g_hash_table_remove(s->index, &slot->index);
+    }
+    read_cache_move(s, slot, read_cache_slot_busy(slot) ? READ_CACHE_STALE :
+                                                          READ_CACHE_FREE);
+}
+
+/* Called with s->lock held when a user of @slot is done with it */
+static void read_cache_put(BDRVReadCacheState *s, ReadCacheSlot *slot)
+{
+    if (slot->list == READ_CACHE_STALE && !read_cache_slot_busy(slot)) {
+        read_cache_move(s, slot, READ_CACHE_FREE);
+    }
+}
+
+/* Record a hit on @slot.  Called with s->lock held. */
+static void read_cache_touch(BDRVReadCacheState *s, ReadCacheSlot *slot)
+{
+    read_cache_move(s, slot, READ_CACHE_PROTECTED);
+
+    /* Protected blocks that were not read again get another chance */
+    if (s->nb_protected > s->max_protected) {
+        read_cache_move(s, QTAILQ_LAST(&s->protected), READ_CACHE_PROBATION);
+    }
+}
+
+static ReadCacheSlot *read_cache_evict_from(BDRVReadCacheState *s,
+                                            ReadCacheSlotList *list)
+{
+    ReadCacheSlot *slot;
+
+    QTAILQ_FOREACH_REVERSE(slot, list, next) {
+        if (!read_cache_slot_busy(slot)) {
+            g_hash_table_remove(s->index, &slot->index);
+            stat64_add(&s->evictions, 1);
+            return slot;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Get a slot for block @index, which is not in the cache, and mark it as
+ * being filled.  Returns NULL if no slot can be used, for example while
+ * the probation segment is filled by a large read.  Called with s->lock
+ * held.
+ */
+static ReadCacheSlot *read_cache_alloc(BDRVReadCacheState *s, int64_t index)
+{
+    ReadCacheSlot *slot;
+
+    slot = QTAILQ_FIRST(&s->free);
+    if (!slot) {
+        slot = read_cache_evict_from(s, &s->probation);
+    }
+    if (!slot && QTAILQ_EMPTY(&s->probation)) {
+        slot = read_cache_evict_from(s, &s->protected);
+    }
+    if (!slot) {
+        return NULL;
+    }
+
+    slot->index = index;
+    slot->filling = true;
+    read_cache_move(s, slot, READ_CACHE_PROBATION);
+    g_hash_table_insert(s->index, &slot->index, slot);
+
+    return slot;
+}
+
+static void read_cache_drop_all(BDRVReadCacheState *s)
+{
+    QEMU_LOCK_GUARD(&s->lock);
+
+    for (int i = 0; i < s->nb_slots; i++) {
+        ReadCacheSlot *slot = &s->slots[i];
+
+        if (slot->list != READ_CACHE_FREE && slot->list != READ_CACHE_STALE) {
+            read_cache_drop(s, slot);
+        }
+    }
+}
+
+/* Drop the blocks that a write to [@offset, @offset + @bytes) changes */
+static void read_cache_invalidate(BDRVReadCacheState *s, int64_t offset,
+                                  int64_t bytes)
+{
+    int64_t first = offset >> s->block_bits;
+    int64_t last = (offset + bytes - 1) >> s->block_bits;
+
+    if (!bytes) {
+        return;
+    }
+
+    QEMU_LOCK_GUARD(&s->lock);
+
+    if (last - first >= g_hash_table_size(s->index)) {
+        GHashTableIter iter;
+        ReadCacheSlot *slot;
+
+        g_hash_table_iter_init(&iter, s->index);
+        while (g_hash_table_iter_next(&iter, NULL, (void **)&slot)) {
+            if (slot->index >= first && slot->index <= last) {
+                g_hash_table_iter_remove(&iter);
+                read_cache_move(s, slot, read_cache_slot_busy(slot) ?
+                                READ_CACHE_STALE : READ_CACHE_FREE);
+            }
+        }
+        return;
+    }
+
+    for (int64_t i = first; i <= last; i++) {
+        ReadCacheSlot *slot = g_hash_table_lookup(s->index, &i);
+
+        if (slot) {
+            read_cache_drop(s, slot);
+        }
+    }
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_copy_out(BlockDriverState *bs, ReadCacheSlot *slot,
+                    int64_t offset_in_block, int64_t bytes,
+                    QEMUIOVector *qiov, size_t qiov_offset)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t slot_offset = (int64_t)(slot - s->slots) << s->block_bits;
+
+    if (!s->store) {
+        qemu_iovec_from_buf(qiov, qiov_offset,
+                            s->data + slot_offset + offset_in_block, bytes);
+        return 0;
+    }
+
+    return bdrv_co_preadv_part(s->store, slot_offset + offset_in_block, bytes,
+                               qiov, qiov_offset, 0);
+}
+
+/*
+ * Read the @nb_blocks blocks starting at @index from the file child into
+ * @slots, where a NULL slot is a block that is not cached, and copy the
+ * requested part into @qiov.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_fill(BlockDriverState *bs, int64_t index, int nb_blocks,
+                ReadCacheSlot **slots, int64_t offset, int64_t bytes,
+                QEMUIOVector *qiov, size_t qiov_offset)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t start = index << s->block_bits;
+    int64_t len = (int64_t)nb_blocks << s->block_bits;
+    int64_t file_len;
+    uint8_t *buf = NULL;
+    int ret;
+
+    /* The last block of the image may be partial */
+    file_len = bdrv_co_getlength(bs->file->bs);
+    if (file_len < 0) {
+        ret = file_len;
+        goto out;
+    }
+
+    buf = qemu_try_blockalign(bs->file->bs, len);
+    if (!buf) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    ret = bdrv_co_pread(bs->file, start, MIN(len, file_len - start), buf, 0);
+    if (ret < 0) {
+        goto out;
+    }
+    qemu_iovec_from_buf(qiov, qiov_offset, buf + offset - start, bytes);
+
+    for (int i = 0; i < nb_blocks; i++) {
+        int64_t slot_offset;
+
+        if (!slots[i]) {
+            continue;
+        }
+
+        slot_offset = (int64_t)(slots[i] - s->slots) << s->block_bits;
+        if (!s->store) {
+            memcpy(s->data + slot_offset, buf + (i << s->block_bits),
+                   s->block_size);
+        } else if (bdrv_co_pwrite(s->store, slot_offset, s->block_size,
+                                  buf + (i << s->block_bits), 0) < 0) {
+            /* The data was read fine, just don't keep the block */
+            WITH_QEMU_LOCK_GUARD(&s->lock) {
+                slots[i]->filling = false;
+                read_cache_drop(s, slots[i]);
+                read_cache_put(s, slots[i]);
+            }
+            slots[i] = NULL;
+        }
+    }
+
+out:
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        for (int i = 0; i < nb_blocks; i++) {
+            if (!slots[i]) {
+                continue;
+            }
+            slots[i]->filling = false;
+            if (ret < 0) {
+                read_cache_drop(s, slots[i]);
+            }
+            read_cache_put(s, slots[i]);
+        }
+        qemu_co_queue_restart_all(&s->fill_queue);
+    }
+    qemu_vfree(buf);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                          QEMUIOVector *qiov, size_t qiov_offset,
+                          BdrvRequestFlags flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int max_fill = MAX(READ_CACHE_MAX_FILL >> s->block_bits, 1);
+    g_autofree ReadCacheSlot **fill = g_new(ReadCacheSlot *, max_fill);
+    int ret;
+
+    while (bytes) {
+        int64_t index = offset >> s->block_bits;
+        int64_t offset_in_block = offset & (s->block_size - 1);
+        int64_t n = MIN(bytes, s->block_size - offset_in_block);
+        ReadCacheSlot *slot;
+        int nb_fill = 0;
+
+        qemu_mutex_lock(&s->lock);
+        slot = g_hash_table_lookup(s->index, &index);
+        if (slot && slot->filling) {
+            qemu_co_queue_wait(&s->fill_queue, &s->lock);
+            qemu_mutex_unlock(&s->lock);
+            continue;
+        }
+
+        if (slot) {
+            stat64_add(&s->hits, 1);
+            read_cache_touch(s, slot);
+            slot->readers++;
+            qemu_mutex_unlock(&s->lock);
+
+            ret = read_cache_copy_out(bs, slot, offset_in_block, n, qiov,
+                                      qiov_offset);
+
+            WITH_QEMU_LOCK_GUARD(&s->lock) {
+                slot->readers--;
+                if (ret < 0) {
+                    read_cache_drop(s, slot);
+                }
+                read_cache_put(s, slot);
+            }
+            if (ret < 0) {
+                /* Try the file child instead */
+                ret = bdrv_co_preadv_part(bs->file, offset, n, qiov,
+                                          qiov_offset, 0);
+                if (ret < 0) {
+                    return ret;
+                }
+            }
+        } else {
+            /* Read the following missing blocks of the request as well */
+            do {
+                fill[nb_fill] = read_cache_alloc(s, index + nb_fill);
+                stat64_add(&s->misses, 1);
+                n = MIN(bytes, ((int64_t)(nb_fill + 1) << s->block_bits) -
+                               offset_in_block);
+                nb_fill++;
+            } while (nb_fill < max_fill && n < bytes &&
+                     !g_hash_table_contains(s->index,
+                                            &(int64_t){index + nb_fill}));
+            qemu_mutex_unlock(&s->lock);
+
+            ret = read_cache_fill(bs, index, nb_fill, fill, offset, n, qiov,
+                                  qiov_offset);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        offset += n;
+        qiov_offset += n;
+        bytes -= n;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                           QEMUIOVector *qiov, size_t qiov_offset,
+                           BdrvRequestFlags flags)
+{
+    int ret;
+
+    ret = bdrv_co_pwritev_part(bs->file, offset, bytes, qiov, qiov_offset,
+                               flags);
+    read_cache_invalidate(bs->opaque, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
+                            int64_t bytes, BdrvRequestFlags flags)
+{
+    int ret;
+
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+    read_cache_invalidate(bs->opaque, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
+{
+    int ret;
+
+    ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+    read_cache_invalidate(bs->opaque, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_pwritev_compressed(BlockDriverState *bs, int64_t offset,
+                                 int64_t bytes, QEMUIOVector *qiov)
+{
+    int ret;
+
+    ret = bdrv_co_pwritev(bs->file, offset, bytes, qiov,
+                          BDRV_REQ_WRITE_COMPRESSED);
+    read_cache_invalidate(bs->opaque, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_truncate(BlockDriverState *bs, int64_t offset, bool exact,
+                       PreallocMode prealloc, BdrvRequestFlags flags,
+                       Error **errp)
+{
+    int ret;
+
+    ret = bdrv_co_truncate(bs->file, offset, exact, prealloc, flags, errp);
+    read_cache_drop_all(bs->opaque);
+    return ret;
+}
+
+static int64_t coroutine_fn GRAPH_RDLOCK
+read_cache_co_getlength(BlockDriverState *bs)
+{
+    return bdrv_co_getlength(bs->file->bs);
+}
+
+/*
+ * Another process may have changed the image while the node was inactive,
+ * for example the source of a migration.
+ */
+static void coroutine_fn GRAPH_RDLOCK
+read_cache_co_invalidate_cache(BlockDriverState *bs, Error **errp)
+{
+    read_cache_drop_all(bs->opaque);
+}
+
+static void coroutine_fn GRAPH_RDLOCK
+read_cache_co_eject(BlockDriverState *bs, bool eject_flag)
+{
+    read_cache_drop_all(bs->opaque);
+    bdrv_co_eject(bs->file->bs, eject_flag);
+}
+
+static void coroutine_fn GRAPH_RDLOCK
+read_cache_co_lock_medium(BlockDriverState *bs, bool locked)
+{
+    bdrv_co_lock_medium(bs->file->bs, locked);
+}
+
+#define PERM_PASSTHROUGH (BLK_PERM_CONSISTENT_READ \
+                          | BLK_PERM_WRITE \
+                          | BLK_PERM_RESIZE)
+#define PERM_UNCHANGED (BLK_PERM_ALL & ~PERM_PASSTHROUGH)
+
+static void read_cache_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                  BdrvChildRole role,
+                                  BlockReopenQueue *reopen_queue,
+                                  uint64_t perm, uint64_t shared,
+                                  uint64_t *nperm, uint64_t *nshared)
+{
+    if (!(role & BDRV_CHILD_FILTERED)) {
+        /* The store is private to the cache */
+        *nperm = BLK_PERM_CONSISTENT_READ;
+        if (!(bs->open_flags & BDRV_O_INACTIVE)) {
+            *nperm |= BLK_PERM_WRITE;
+        }
+        *nshared = BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE_UNCHANGED;
+        return;
+    }
+
+    /*
+     * Blocks are cached in full, so reads need consistent data from the
+     * file child even when the parents don't.  Writes with
+     * BDRV_REQ_WRITE_UNCHANGED, like those of copy-on-read, are passed on
+     * with the flag.
+     */
+    *nperm = (perm & (PERM_PASSTHROUGH | BLK_PERM_WRITE_UNCHANGED)) |
+             BLK_PERM_CONSISTENT_READ;
+    *nshared = (shared & PERM_PASSTHROUGH) | PERM_UNCHANGED;
+
+    /*
+     * Writes that don't go through the cache would leave stale blocks in it.
+     * An inactive cache is dropped when it is activated, so it can share.
+     */
+    if (!(bs->open_flags & BDRV_O_INACTIVE)) {
+        *nshared &= ~(BLK_PERM_WRITE | BLK_PERM_RESIZE);
+    }
+}
+
+static int GRAPH_UNLOCKED
+read_cache_open(BlockDriverState *bs, QDict *options, int flags, Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    uint64_t size;
+    int64_t store_len;
+    int ret;
+
+    GLOBAL_STATE_CODE();
+    ERRP_GUARD();
+
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->store = bdrv_open_child(NULL, options, "store", bs, &child_of_bds,
+                               BDRV_CHILD_METADATA, true, errp);
+    if (*errp) {
+        return -EINVAL;
+    }
+
+    opts = qemu_opts_create(&read_cache_runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    size = qemu_opt_get_size(opts, READ_CACHE_OPT_SIZE,
+                             READ_CACHE_DEFAULT_SIZE);
+    s->block_size = qemu_opt_get_size(opts, READ_CACHE_OPT_BLOCK_SIZE,
+                                      READ_CACHE_DEFAULT_BLOCK_SIZE);
+    qemu_opts_del(opts);
+
+    if (!is_power_of_2(s->block_size) ||
+        s->block_size < READ_CACHE_MIN_BLOCK_SIZE ||
+        s->block_size > READ_CACHE_MAX_BLOCK_SIZE) {
+        error_setg(errp, "block-size must be a power of two between %d and "
+                   "%d", READ_CACHE_MIN_BLOCK_SIZE, READ_CACHE_MAX_BLOCK_SIZE);
+        return -EINVAL;
+    }
+    if (size < s->block_size || size / s->block_size > INT_MAX) {
+        error_setg(errp, "size must hold between one and %d blocks",
+                   INT_MAX);
+        return -EINVAL;
+    }
+
+    s->block_bits = ctz64(s->block_size);
+    s->nb_slots = size / s->block_size;
+    /* Keep a fifth of the cache for blocks that have been read only once */
+    s->max_protected = MAX(s->nb_slots - s->nb_slots / 5, 1);
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    if (s->store) {
+        if (bdrv_is_read_only(s->store->bs)) {
+            error_setg(errp, "The store of the read cache must be writable");
+            return -EINVAL;
+        }
+
+        store_len = bdrv_getlength(s->store->bs);
+        if (store_len < 0) {
+            error_setg_errno(errp, -store_len, "Could not get the length of "
+                             "the store");
+            return store_len;
+        }
+        if (store_len < (int64_t)s->nb_slots << s->block_bits) {
+            error_setg(errp, "The store is smaller than the cache size "
+                       "(%" PRIu64 " bytes)",
+                       (uint64_t)s->nb_slots << s->block_bits);
+            return -EINVAL;
+        }
+    } else {
+        s->data = qemu_try_memalign(bdrv_opt_mem_align(bs->file->bs),
+                                    (size_t)s->nb_slots << s->block_bits);
+        if (!s->data) {
+            error_setg(errp, "Could not allocate the read cache");
+            return -ENOMEM;
+        }
+    }
+
+    s->slots = g_new0(ReadCacheSlot, s->nb_slots);
+    s->index = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&s->free);
+    QTAILQ_INIT(&s->probation);
+    QTAILQ_INIT(&s->protected);
+    for (int i = 0; i < s->nb_slots; i++) {
+        s->slots[i].list = READ_CACHE_FREE;
+        QTAILQ_INSERT_TAIL(&s->free, &s->slots[i], next);
+    }
+    qemu_mutex_init(&s->lock);
+    qemu_co_queue_init(&s->fill_queue);
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    return 0;
+}
+
+static void read_cache_close(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    if (s->index) {
+        g_hash_table_destroy(s->index);
+        qemu_mutex_destroy(&s->lock);
+    }
+    g_free(s->slots);
+    qemu_vfree(s->data);
+}
+
+static void GRAPH_RDLOCK read_cache_refresh_filename(BlockDriverState *bs)
+{
+    pstrcpy(bs->exact_filename, sizeof(bs->exact_filename),
+            bs->file->bs->filename);
+}
+
+static BlockStatsSpecific *read_cache_get_specific_stats(BlockDriverState *bs)
+{
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+    BDRVReadCacheState *s = bs->opaque;
+
+    stats->driver = BLOCKDEV_DRIVER_READ_CACHE;
+    stats->u.read_cache = (BlockStatsSpecificReadCache) {
+        .hits = stat64_get(&s->hits),
+        .misses = stat64_get(&s->misses),
+        .evictions = stat64_get(&s->evictions),
+    };
+
+    return stats;
+}
+
+static const char *const read_cache_strong_runtime_opts[] = {
+    READ_CACHE_OPT_SIZE,
+    READ_CACHE_OPT_BLOCK_SIZE,
+    "store",
+
+    NULL
+};
+
+static BlockDriver bdrv_read_cache = {
+    .format_name                        = "read-cache",
+    .instance_size                      = sizeof(BDRVReadCacheState),
+
+    .bdrv_open                          = read_cache_open,
+    .bdrv_close                         = read_cache_close,
+    .bdrv_child_perm                    = read_cache_child_perm,
+    .bdrv_refresh_filename              = read_cache_refresh_filename,
+
+    .bdrv_co_getlength                  = read_cache_co_getlength,
+    .bdrv_co_truncate                   = read_cache_co_truncate,
+
+    .bdrv_co_preadv_part                = read_cache_co_preadv_part,
+    .bdrv_co_pwritev_part               = read_cache_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes              = read_cache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                   = read_cache_co_pdiscard,
+    .bdrv_co_pwritev_compressed         = read_cache_co_pwritev_compressed,
+
+    .bdrv_co_invalidate_cache           = read_cache_co_invalidate_cache,
+    .bdrv_get_specific_stats            = read_cache_get_specific_stats,
+
+    .bdrv_co_eject                      = read_cache_co_eject,
+    .bdrv_co_lock_medium                = read_cache_co_lock_medium,
+
+    .is_filter                          = true,
+    .strong_runtime_opts                = read_cache_strong_runtime_opts,
+};
+
+static void bdrv_read_cache_init(void)
+{
+    bdrv_register(&bdrv_read_cache);
+}
+
+block_init(bdrv_read_cache_init);
@@ -704,6 +704,20 @@ const PropertyInfo qdev_prop_zero_page_detection = {
     .set_default_value = qdev_propinfo_set_default_value_enum,
 };
 
+/* --- MappedRamLoadMethod --- */
+
+QEMU_BUILD_BUG_ON(sizeof(MappedRamLoadMethod) != sizeof(int));
+
+const PropertyInfo qdev_prop_mapped_ram_load_method = {
+    .name = "MappedRamLoadMethod",
+    .description = "mapped_ram_load_method values, "
+                   "read,io-uring,mmap,lazy",
+    .enum_table = &MappedRamLoadMethod_lookup,
+    .get = qdev_propinfo_get_enum,
+    .set = qdev_propinfo_set_enum,
+    .set_default_value = qdev_propinfo_set_default_value_enum,
+};
+
 /* --- Reserved Region --- */
 
 /*
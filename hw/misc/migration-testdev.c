@@ -0,0 +1,286 @@
+/*
+ * Test device for device state transfer over multifd channels
+ *
+ * The device holds a block of state filled with a fixed pattern.  When
+ * multifd device state transfer is in use, a save thread sends the block
+ * in chunks that the destination loads with load_state_buffer; otherwise
+ * the block goes through the main migration stream.  Either way, the
+ * device section in the main stream carries a checksum of the block, and
+ * the destination fails the load if the block does not match it or if
+ * any chunk is still missing when the section is loaded.
+ *
+ * qemu-system-x86_64 -device migration-testdev,id=td ...
+ *
+ * The number of chunks loaded on the destination can be read from the
+ * "chunks-loaded" property.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/crc32c.h"
+#include "qemu/error-report.h"
+#include "qemu/lockable.h"
+#include "qemu/module.h"
+#include "qemu/units.h"
+#include "qapi/error.h"
+#include "hw/qdev-core.h"
+#include "hw/qdev-properties.h"
+#include "migration/misc.h"
+#include "migration/qemu-file-types.h"
+#include "migration/register.h"
+#include "migration/vmstate.h"
+#include "qom/object.h"
+
+#define TYPE_MIGRATION_TESTDEV "migration-testdev"
+OBJECT_DECLARE_SIMPLE_TYPE(MigrationTestdev, MIGRATION_TESTDEV)
+
+/* First word of each part of the device section */
+#define MIGRATION_TESTDEV_SETUP     1
+#define MIGRATION_TESTDEV_INLINE    2
+#define MIGRATION_TESTDEV_MULTIFD   3
+
+/* Each chunk starts with the offset and length of its data, big endian */
+#define MIGRATION_TESTDEV_CHUNK_HDR 8
+
+struct MigrationTestdev {
+    DeviceState parent_obj;
+
+    uint32_t size;
+    uint32_t chunk_size;
+    uint8_t *state;
+
+    /* Destination side, updated by the multifd receive threads */
+    QemuMutex lock;
+    uint32_t chunks_loaded;
+};
+
+static void migration_testdev_fill(MigrationTestdev *s)
+{
+    uint32_t i;
+
+    for (i = 0; i < s->size; i++) {
+        s->state[i] = i * 7 + (i >> 12);
+    }
+}
+
+static uint32_t migration_testdev_nr_chunks(MigrationTestdev *s)
+{
+    return DIV_ROUND_UP(s->size, s->chunk_size);
+}
+
+static int migration_testdev_save_setup(QEMUFile *f, void *opaque,
+                                        Error **errp)
+{
+    qemu_put_be32(f, MIGRATION_TESTDEV_SETUP);
+    return 0;
+}
+
+static bool migration_testdev_save_thread(char *idstr, uint32_t instance_id,
+                                          void *opaque, bool *abort_flag,
+                                          Error **errp)
+{
+    MigrationTestdev *s = opaque;
+    g_autofree char *buf = g_malloc(MIGRATION_TESTDEV_CHUNK_HDR +
+                                    s->chunk_size);
+    uint32_t offset, len;
+
+    for (offset = 0; offset < s->size; offset += len) {
+        if (qatomic_read(abort_flag)) {
+            return true;
+        }
+
+        len = MIN(s->chunk_size, s->size - offset);
+        stl_be_p(buf, offset);
+        stl_be_p(buf + 4, len);
+        memcpy(buf + MIGRATION_TESTDEV_CHUNK_HDR, s->state + offset, len);
+
+        if (!multifd_queue_device_state(idstr, instance_id, buf,
+                                        MIGRATION_TESTDEV_CHUNK_HDR + len)) {
+            error_setg(errp, "%s: failed to queue device state chunk", idstr);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static int migration_testdev_save_complete(QEMUFile *f, void *opaque)
+{
+    MigrationTestdev *s = opaque;
+
+    if (multifd_device_state_supported()) {
+        qemu_put_be32(f, MIGRATION_TESTDEV_MULTIFD);
+        qemu_put_be32(f, migration_testdev_nr_chunks(s));
+    } else {
+        qemu_put_be32(f, MIGRATION_TESTDEV_INLINE);
+        qemu_put_buffer(f, s->state, s->size);
+    }
+    qemu_put_be32(f, crc32c(0xffffffff, s->state, s->size));
+
+    return qemu_file_get_error(f);
+}
+
+static int migration_testdev_load_setup(QEMUFile *f, void *opaque,
+                                        Error **errp)
+{
+    MigrationTestdev *s = opaque;
+
+    memset(s->state, 0, s->size);
+    s->chunks_loaded = 0;
+
+    return 0;
+}
+
+static bool migration_testdev_load_state_buffer(void *opaque, char *buf,
+                                                size_t len, Error **errp)
+{
+    MigrationTestdev *s = opaque;
+    uint32_t offset, data_len;
+
+    if (len < MIGRATION_TESTDEV_CHUNK_HDR) {
+        error_setg(errp, "%s: chunk of %zu bytes is too short",
+                   TYPE_MIGRATION_TESTDEV, len);
+        return false;
+    }
+
+    offset = ldl_be_p(buf);
+    data_len = ldl_be_p(buf + 4);
+    if (data_len != len - MIGRATION_TESTDEV_CHUNK_HDR ||
+        offset > s->size || data_len > s->size - offset) {
+        error_setg(errp, "%s: invalid chunk at offset %" PRIu32
+                   " with %" PRIu32 " bytes", TYPE_MIGRATION_TESTDEV,
+                   offset, data_len);
+        return false;
+    }
+
+    QEMU_LOCK_GUARD(&s->lock);
+    memcpy(s->state + offset, buf + MIGRATION_TESTDEV_CHUNK_HDR, data_len);
+    s->chunks_loaded++;
+
+    return true;
+}
+
+static int migration_testdev_load_state(QEMUFile *f, void *opaque,
+                                        int version_id)
+{
+    MigrationTestdev *s = opaque;
+    uint32_t flag = qemu_get_be32(f);
+    uint32_t nr_chunks, crc;
+
+    switch (flag) {
+    case MIGRATION_TESTDEV_SETUP:
+        return qemu_file_get_error(f);
+    case MIGRATION_TESTDEV_INLINE:
+        qemu_get_buffer(f, s->state, s->size);
+        break;
+    case MIGRATION_TESTDEV_MULTIFD:
+        /* All chunks must have been loaded before this section is */
+        nr_chunks = qemu_get_be32(f);
+        WITH_QEMU_LOCK_GUARD(&s->lock) {
+            if (s->chunks_loaded != nr_chunks) {
+                error_report("%s: %" PRIu32 " of %" PRIu32 " chunks loaded "
+                             "before the device section",
+                             TYPE_MIGRATION_TESTDEV, s->chunks_loaded,
+                             nr_chunks);
+                return -EINVAL;
+            }
+        }
+        break;
+    default:
+        error_report("%s: unknown section flag %#" PRIx32,
+                     TYPE_MIGRATION_TESTDEV, flag);
+        return -EINVAL;
+    }
+
+    crc = qemu_get_be32(f);
+    if (qemu_file_get_error(f)) {
+        return qemu_file_get_error(f);
+    }
+    if (crc != crc32c(0xffffffff, s->state, s->size)) {
+        error_report("%s: state checksum mismatch", TYPE_MIGRATION_TESTDEV);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static const SaveVMHandlers savevm_migration_testdev_handlers = {
+    .save_setup = migration_testdev_save_setup,
+    .save_live_complete_precopy = migration_testdev_save_complete,
+    .save_live_complete_precopy_thread = migration_testdev_save_thread,
+    .load_setup = migration_testdev_load_setup,
+    .load_state = migration_testdev_load_state,
+    .load_state_buffer = migration_testdev_load_state_buffer,
+};
+
+static void migration_testdev_realize(DeviceState *dev, Error **errp)
+{
+    MigrationTestdev *s = MIGRATION_TESTDEV(dev);
+
+    if (!s->size || !s->chunk_size ||
+        s->chunk_size > MULTIFD_DEVICE_STATE_MAX_CHUNK -
+                        MIGRATION_TESTDEV_CHUNK_HDR) {
+        error_setg(errp, "%s: invalid size or chunk-size",
+                   TYPE_MIGRATION_TESTDEV);
+        return;
+    }
+
+    s->state = g_malloc(s->size);
+    migration_testdev_fill(s);
+    qemu_mutex_init(&s->lock);
+
+    register_savevm_live(TYPE_MIGRATION_TESTDEV, VMSTATE_INSTANCE_ID_ANY, 1,
+                         &savevm_migration_testdev_handlers, s);
+}
+
+static void migration_testdev_unrealize(DeviceState *dev)
+{
+    MigrationTestdev *s = MIGRATION_TESTDEV(dev);
+
+    unregister_savevm(NULL, TYPE_MIGRATION_TESTDEV, s);
+    qemu_mutex_destroy(&s->lock);
+    g_free(s->state);
+}
+
+static void migration_testdev_init(Object *obj)
+{
+    MigrationTestdev *s = MIGRATION_TESTDEV(obj);
+
+    object_property_add_uint32_ptr(obj, "chunks-loaded", &s->chunks_loaded,
+                                   OBJ_PROP_FLAG_READ);
+}
+
+static Property migration_testdev_properties[] = {
+    DEFINE_PROP_UINT32("size", MigrationTestdev, size, 4 * MiB),
+    DEFINE_PROP_UINT32("chunk-size", MigrationTestdev, chunk_size, 256 * KiB),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void migration_testdev_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->desc = "Device state transfer test device";
+    dc->realize = migration_testdev_realize;
+    dc->unrealize = migration_testdev_unrealize;
+    device_class_set_props(dc, migration_testdev_properties);
+    set_bit(DEVICE_CATEGORY_MISC, dc->categories);
+}
+
+static const TypeInfo migration_testdev_info = {
+    .name          = TYPE_MIGRATION_TESTDEV,
+    .parent        = TYPE_DEVICE,
+    .instance_size = sizeof(MigrationTestdev),
+    .instance_init = migration_testdev_init,
+    .class_init    = migration_testdev_class_init,
+};
+
+static void migration_testdev_register_types(void)
+{
+    type_register_static(&migration_testdev_info);
+}
+
+type_init(migration_testdev_register_types)
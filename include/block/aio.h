@@ -57,6 +57,14 @@ struct ThreadPool;
 struct LinuxAioState;
 typedef struct LuringState LuringState;
 
+/*
+ * Flags of the io_uring rings of an AioContext.  There is one ring for
+ * each combination of flags that is in use.
+ */
+#define LURING_SQPOLL   (1 << 0) /* a kernel thread polls for submissions */
+#define LURING_IOPOLL   (1 << 1) /* completions are polled for, O_DIRECT only */
+#define LURING_NR_RINGS (1 << 2)
+
 /* Is polling disabled? */
 bool aio_poll_disabled(AioContext *ctx);
 
@@ -212,7 +220,7 @@ struct AioContext {
     struct LinuxAioState *linux_aio;
 #endif
 #ifdef CONFIG_LINUX_IO_URING
-    LuringState *linux_io_uring;
+    LuringState *linux_io_uring[LURING_NR_RINGS];
 
     /* State for file descriptor monitoring using Linux io_uring */
     struct io_uring fdmon_io_uring;
@@ -227,6 +235,9 @@ struct AioContext {
     /* Number of AioHandlers without .io_poll() */
     int poll_disable_cnt;
 
+    /* Number of users of aio_context_set_busy_poll() */
+    int poll_busy_cnt;
+
     /* Polling mode parameters */
     int64_t poll_ns;        /* current polling time in nanoseconds */
     int64_t poll_max_ns;    /* maximum polling time in nanoseconds */
@@ -508,11 +519,12 @@ struct LinuxAioState *aio_setup_linux_aio(AioContext *ctx, Error **errp);
 /* Return the LinuxAioState bound to this AioContext */
 struct LinuxAioState *aio_get_linux_aio(AioContext *ctx);
 
-/* Setup the LuringState bound to this AioContext */
-LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp);
+/* Setup the LuringState with LURING_* @flags bound to this AioContext */
+LuringState *aio_setup_linux_io_uring(AioContext *ctx, unsigned int flags,
+                                      Error **errp);
 
-/* Return the LuringState bound to this AioContext */
-LuringState *aio_get_linux_io_uring(AioContext *ctx);
+/* Return the LuringState with LURING_* @flags bound to this AioContext */
+LuringState *aio_get_linux_io_uring(AioContext *ctx, unsigned int flags);
 /**
  * aio_timer_new_with_attrs:
  * @ctx: the aio context
@@ -704,6 +716,20 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
                                  int64_t grow, int64_t shrink,
                                  Error **errp);
 
+/**
+ * aio_context_set_busy_poll:
+ * @ctx: the aio context
+ * @busy: whether a user starts or stops needing busy polling
+ *
+ * Some completions don't make any file descriptor ready and can only be
+ * found by an .io_poll() handler, for example those of an io_uring set up
+ * with IORING_SETUP_IOPOLL.  While a user needs busy polling, the event loop
+ * calls the .io_poll() handlers on each iteration instead of blocking.
+ *
+ * Must be called from the AioContext's home thread.
+ */
+void aio_context_set_busy_poll(AioContext *ctx, bool busy);
+
 /**
  * aio_context_set_aio_params:
  * @ctx: the aio context
@@ -66,14 +66,30 @@ void laio_attach_aio_context(LinuxAioState *s, AioContext *new_context);
 #endif
 /* io_uring.c - Linux io_uring implementation */
 #ifdef CONFIG_LINUX_IO_URING
-LuringState *luring_init(Error **errp);
+LuringState *luring_init(unsigned int flags, Error **errp);
 void luring_cleanup(LuringState *s);
 
-/* luring_co_submit: submit I/O requests in the thread's current AioContext. */
-int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
-                                  QEMUIOVector *qiov, int type);
+/*
+ * luring_co_submit: submit I/O requests in the thread's current AioContext,
+ * to its ring with LURING_* @ring_flags.  @fd_index is the index of @fd
+ * from luring_register_file(), or -1.  @registered_buf tells that @qiov
+ * may point into buffers from luring_register_buf().
+ */
+int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, int fd_index,
+                                  uint64_t offset, QEMUIOVector *qiov,
+                                  int type, unsigned int ring_flags,
+                                  bool registered_buf);
 void luring_detach_aio_context(LuringState *s, AioContext *old_context);
 void luring_attach_aio_context(LuringState *s, AioContext *new_context);
+
+/*
+ * Files and buffers registered with all io_uring rings, so that requests
+ * need not look them up and pin the pages in the kernel one by one.
+ */
+int luring_register_file(int fd);
+void luring_unregister_file(int index);
+bool luring_register_buf(void *host, size_t size, Error **errp);
+void luring_unregister_buf(void *host, size_t size);
 #endif
 
 #ifdef _WIN32
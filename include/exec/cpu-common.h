@@ -175,6 +175,8 @@ int qemu_ram_foreach_block(RAMBlockIterFunc func, void *opaque);
 int ram_block_discard_range(RAMBlock *rb, uint64_t start, size_t length);
 int ram_block_discard_guest_memfd_range(RAMBlock *rb, uint64_t start,
                                         size_t length);
+void ram_block_setup_remapped_range(RAMBlock *rb, uint64_t offset,
+                                    size_t length);
 
 #endif
 
@@ -45,7 +45,8 @@ static inline long clear_bmap_size(uint64_t pages, uint8_t shift)
 
 /**
  * clear_bmap_set: set clear bitmap for the page range.  Must be with
- * bitmap_mutex held.
+ * bitmap_mutex held, but can be called concurrently for different page
+ * ranges of the same block by threads working on behalf of the holder.
  *
  * @rb: the ramblock to operate on
  * @start: the start page number
@@ -58,7 +59,8 @@ static inline void clear_bmap_set(RAMBlock *rb, uint64_t start,
 {
     uint8_t shift = rb->clear_bmap_shift;
 
-    bitmap_set(rb->clear_bmap, start >> shift, clear_bmap_size(npages, shift));
+    bitmap_set_atomic(rb->clear_bmap, start >> shift,
+                      clear_bmap_size(npages, shift));
 }
 
 /**
@@ -483,6 +485,7 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
     unsigned long word = BIT_WORD((start + rb->offset) >> TARGET_PAGE_BITS);
     uint64_t num_dirty = 0;
     unsigned long *dest = rb->bmap;
+    unsigned long *sync = rb->dirty_sync_bmap;
 
     /* start address and length is aligned at the start of a word? */
     if (((word * BITS_PER_LONG) << TARGET_PAGE_BITS) ==
@@ -506,6 +509,9 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
                 new_dirty = ~dest[k];
                 dest[k] |= bits;
                 new_dirty &= bits;
+                if (sync) {
+                    sync[k] |= bits;
+                }
                 num_dirty += ctpopl(new_dirty);
             }
 
@@ -542,6 +548,9 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
                 if (!test_and_set_bit(k, dest)) {
                     num_dirty++;
                 }
+                if (sync) {
+                    set_bit(k, sync);
+                }
             }
         }
     }
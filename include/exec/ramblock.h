@@ -57,6 +57,11 @@ struct RAMBlock {
      */
     off_t bitmap_offset;
     uint64_t pages_offset;
+    /*
+     * offset in the file of the header of this ramblock, kept after
+     * migration as the base of incremental snapshots.
+     */
+    uint64_t header_offset;
 
     /* Bitmap of already received pages.  Only used on destination side. */
     unsigned long *receivedmap;
@@ -80,6 +85,20 @@ struct RAMBlock {
     unsigned long *clear_bmap;
     uint8_t clear_bmap_shift;
 
+    /*
+     * Below fields are only used on the migration source when the
+     * hot-page-rounds parameter is set, and are protected by the
+     * global ram_state.bitmap_mutex.
+     */
+    /* bitmap of pages dirtied since the last dirty bitmap sync */
+    unsigned long *dirty_sync_bmap;
+    /*
+     * dirty_history[i] tracks the pages dirtied in each of the last
+     * i + 1 syncs, so the last of them holds the hot pages.
+     */
+    unsigned long **dirty_history;
+    uint8_t dirty_history_len;
+
     /*
      * RAM block length that corresponds to the used_length on the migration
      * source (after RAM block sizes were synchronized). Especially, after
@@ -280,15 +280,39 @@ typedef struct CPUTLBDesc {
     int64_t window_begin_ns;
     /* maximum number of entries observed in the window */
     size_t window_max_entries;
+    /* number of flushes of this tlb in the window */
+    size_t window_flushes;
     size_t n_used_entries;
+    /* number of entries evicted to the victim tlb since the last flush */
+    size_t n_evicted_entries;
     /* The next index to use in the tlb victim table.  */
     size_t vindex;
     /* The tlb victim table, in two parts.  */
     CPUTLBEntry vtable[CPU_VTLB_SIZE];
     CPUTLBEntryFull vfulltlb[CPU_VTLB_SIZE];
     CPUTLBEntryFull *fulltlb;
+    /*
+     * Statistics.  As with those in CPUTLBCommon, these are only written
+     * by the owning cpu, and are read and written atomically.
+     */
+    size_t fill_count;
+    size_t flush_count;
+    size_t resize_count;
+    size_t victim_hit_count;
 } CPUTLBDesc;
 
+/*
+ * A range flush, as queued by tlb_flush_range_by_mmuidx_all_cpus_synced.
+ */
+typedef struct CPUTLBFlushRange {
+    vaddr addr;
+    vaddr len;
+    uint16_t idxmap;
+    uint16_t bits;
+} CPUTLBFlushRange;
+
+#define CPU_TLB_PENDING_RANGES 8
+
 /*
  * Data elements that are shared between all MMU modes.
  */
@@ -301,6 +325,17 @@ typedef struct CPUTLBCommon {
      * Protected by tlb_c.lock.
      */
     uint16_t dirty;
+    /*
+     * Range flushes requested by other cpus, performed together by a
+     * single work item the next time this cpu processes queued work.
+     * Requests that do not fit in pending[] are accumulated in
+     * pending_full as mmu_idx to flush in their entirety.
+     * Protected by tlb_c.lock.
+     */
+    CPUTLBFlushRange pending[CPU_TLB_PENDING_RANGES];
+    unsigned n_pending;
+    uint16_t pending_full;
+    bool pending_queued;
     /*
      * Statistics.  These are not lock protected, but are read and
      * written atomically.  This allows the monitor to print a snapshot
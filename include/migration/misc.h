@@ -111,4 +111,14 @@ bool migration_in_bg_snapshot(void);
 /* migration/block-dirty-bitmap.c */
 void dirty_bitmap_mig_init(void);
 
+/* migration/multifd-device-state.c */
+bool multifd_device_state_supported(void);
+
+/* migration/multifd.c */
+/* This value bounds the size of a single device state chunk */
+#define MULTIFD_DEVICE_STATE_MAX_CHUNK (16 * 1024 * 1024)
+
+bool multifd_queue_device_state(char *idstr, uint32_t instance_id,
+                                char *data, size_t len);
+
 #endif
@@ -16,6 +16,26 @@
 
 #include "hw/vmstate-if.h"
 
+/**
+ * SaveLiveCompletePrecopyThreadHandler: device state save thread
+ *
+ * Called at the end of a precopy phase from a thread of its own, while
+ * the remaining RAM and other devices are being saved, when multifd
+ * device state transfer is in use.  The handler should send its state
+ * in chunks with multifd_queue_device_state(), and stop early once
+ * @abort_flag becomes true.
+ *
+ * @idstr: this device section idstr
+ * @instance_id: this device section instance_id
+ * @opaque: data pointer passed to register_savevm_live()
+ * @abort_flag: flag indicating that the migration is being aborted
+ * @errp: pointer to Error*, to store an error if it happens.
+ *
+ * Returns true to indicate success and false for errors.
+ */
+typedef bool (*SaveLiveCompletePrecopyThreadHandler)(char *idstr,
+    uint32_t instance_id, void *opaque, bool *abort_flag, Error **errp);
+
 /**
  * struct SaveVMHandlers: handler structure to finely control
  * migration of complex subsystems and devices, such as RAM, block and
@@ -103,6 +123,16 @@ typedef struct SaveVMHandlers {
      */
     int (*save_live_complete_precopy)(QEMUFile *f, void *opaque);
 
+    /**
+     * @save_live_complete_precopy_thread
+     *
+     * Sends the bulk of the device state over the multifd channels,
+     * see #SaveLiveCompletePrecopyThreadHandler.  Only used when
+     * multifd_device_state_supported() is true; the state sent this
+     * way is received by @load_state_buffer on the destination.
+     */
+    SaveLiveCompletePrecopyThreadHandler save_live_complete_precopy_thread;
+
     /* This runs both outside and inside the BQL.  */
 
     /**
@@ -251,6 +281,26 @@ typedef struct SaveVMHandlers {
      */
     int (*load_cleanup)(void *opaque);
 
+    /**
+     * @load_state_buffer
+     *
+     * Loads one chunk of device state sent by
+     * @save_live_complete_precopy_thread.  Called from multifd receive
+     * threads, so chunks of the same device may arrive concurrently and
+     * in any order; the handler must serialize them as it needs.  All
+     * chunks have been loaded before the device section in the main
+     * migration stream is.
+     *
+     * @opaque: data pointer passed to register_savevm_live()
+     * @buf: data buffer
+     * @len: data buffer length
+     * @errp: pointer to Error*, to store an error if it happens.
+     *
+     * Returns true to indicate success and false for errors.
+     */
+    bool (*load_state_buffer)(void *opaque, char *buf, size_t len,
+                              Error **errp);
+
     /**
      * @resume_prepare
      *
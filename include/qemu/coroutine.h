@@ -84,6 +84,17 @@ static inline coroutine_fn void qemu_co_mutex_assert_locked(CoMutex *mutex)
            mutex->holder == qemu_coroutine_self());
 }
 
+/**
+ * Return whether other coroutines are waiting for @mutex, which the
+ * current coroutine holds.  This is only a hint, because new waiters
+ * can arrive at any time.
+ */
+static inline coroutine_fn bool qemu_co_mutex_has_waiters(CoMutex *mutex)
+{
+    qemu_co_mutex_assert_locked(mutex);
+    return qatomic_read(&mutex->locked) > 1;
+}
+
 #include "qemu/lockable.h"
 
 /**
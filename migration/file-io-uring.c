@@ -0,0 +1,225 @@
+/*
+ * Loading of mapped-ram migration files with io_uring
+ *
+ * The pages of a RAMBlock are laid out in the migration file at fixed
+ * offsets, so they can be read straight into guest memory with large
+ * reads, many of them in flight at once, without bouncing through the
+ * multifd threads.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <liburing.h>
+#include "qemu/units.h"
+#include "qapi/error.h"
+#include "exec/ramblock.h"
+#include "exec/target_page.h"
+#include "io/channel-file.h"
+#include "file.h"
+#include "options.h"
+#include "trace.h"
+
+/* Number of reads kept in flight */
+#define FILE_IO_URING_QUEUE_DEPTH 64
+/* Largest read issued at once */
+#define FILE_IO_URING_READ_SIZE (8 * MiB)
+
+typedef struct {
+    struct iovec iov;
+    uint64_t file_offset;
+} FileIOUringRead;
+
+typedef struct {
+    struct io_uring ring;
+    int fd;
+    FileIOUringRead reads[FILE_IO_URING_QUEUE_DEPTH];
+    FileIOUringRead *free_reads[FILE_IO_URING_QUEUE_DEPTH];
+    unsigned int nfree;
+    unsigned int inflight;
+    uint64_t nreads;
+} FileIOUring;
+
+static void file_io_uring_queue(FileIOUring *u, FileIOUringRead *r)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+
+    /* There is never more than one sqe per read slot */
+    assert(sqe);
+    io_uring_prep_readv(sqe, u->fd, &r->iov, 1, r->file_offset);
+    io_uring_sqe_set_data(sqe, r);
+    u->inflight++;
+    u->nreads++;
+}
+
+/*
+ * Wait for at least one read to complete and handle all completions.
+ * Short reads are queued again for the remainder.
+ */
+static bool file_io_uring_complete(FileIOUring *u, Error **errp)
+{
+    struct io_uring_cqe *cqe;
+    bool ret = true;
+    int err;
+
+    err = io_uring_submit_and_wait(&u->ring, 1);
+    if (err < 0 && err != -EINTR) {
+        error_setg_errno(errp, -err, "io_uring submission failed");
+        /*
+         * Give up on the reads in flight, tearing down the ring waits
+         * for them.
+         */
+        u->inflight = 0;
+        return false;
+    }
+
+    while (io_uring_peek_cqe(&u->ring, &cqe) == 0) {
+        FileIOUringRead *r = io_uring_cqe_get_data(cqe);
+        int res = cqe->res;
+
+        io_uring_cqe_seen(&u->ring, cqe);
+        u->inflight--;
+
+        if (res == -EINTR || res == -EAGAIN) {
+            res = 0;
+        } else if (res < 0) {
+            if (ret) {
+                error_setg_errno(errp, -res, "failed to read pages at file "
+                                 "offset 0x%" PRIx64, r->file_offset);
+                ret = false;
+            }
+        } else if (res == 0) {
+            if (ret) {
+                error_setg(errp, "unexpected end of file at offset 0x%" PRIx64,
+                           r->file_offset);
+                ret = false;
+            }
+        }
+
+        if (res > 0) {
+            r->iov.iov_base = (uint8_t *)r->iov.iov_base + res;
+            r->iov.iov_len -= res;
+            r->file_offset += res;
+        }
+
+        if (ret && r->iov.iov_len) {
+            file_io_uring_queue(u, r);
+        } else {
+            u->free_reads[u->nfree++] = r;
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * Read the pages of @block that are set in @bitmap from the migration
+ * file behind @ioc into guest memory.
+ *
+ * Returns true on success, false on error with @errp set.
+ */
+bool file_read_ramblock_io_uring(QIOChannel *ioc, RAMBlock *block,
+                                 long num_pages, unsigned long *bitmap,
+                                 Error **errp)
+{
+    g_autofree FileIOUring *u = NULL;
+    QIOChannelFile *fioc;
+    unsigned long set_bit_idx, clear_bit_idx;
+    ram_addr_t offset = 0, end = 0;
+    uint64_t bytes = 0;
+    bool direct_io = migrate_direct_io();
+    int flags = 0;
+    bool ret = true;
+    int err;
+
+    fioc = (QIOChannelFile *)object_dynamic_cast(OBJECT(ioc),
+                                                 TYPE_QIO_CHANNEL_FILE);
+    if (!fioc) {
+        error_setg(errp, "io_uring loading needs a file migration channel");
+        return false;
+    }
+
+    u = g_new0(FileIOUring, 1);
+    u->fd = fioc->fd;
+    for (int i = 0; i < FILE_IO_URING_QUEUE_DEPTH; i++) {
+        u->free_reads[u->nfree++] = &u->reads[i];
+    }
+
+    err = io_uring_queue_init(FILE_IO_URING_QUEUE_DEPTH, &u->ring, 0);
+    if (err < 0) {
+        error_setg_errno(errp, -err, "failed to set up io_uring");
+        return false;
+    }
+
+    /*
+     * The channel is only used for the unaligned parts of the stream,
+     * by this same thread, so O_DIRECT can be enabled on it while the
+     * pages are read.
+     */
+    if (direct_io) {
+        flags = fcntl(u->fd, F_GETFL);
+        if (flags < 0 || fcntl(u->fd, F_SETFL, flags | O_DIRECT) < 0) {
+            error_setg_errno(errp, errno, "failed to enable O_DIRECT");
+            io_uring_queue_exit(&u->ring);
+            return false;
+        }
+    }
+
+    set_bit_idx = find_first_bit(bitmap, num_pages);
+
+    while (true) {
+        while (ret && u->nfree) {
+            FileIOUringRead *r;
+            size_t len;
+
+            if (offset == end) {
+                if (set_bit_idx >= num_pages) {
+                    break;
+                }
+                clear_bit_idx = find_next_zero_bit(bitmap, num_pages,
+                                                   set_bit_idx + 1);
+                offset = (ram_addr_t)set_bit_idx << TARGET_PAGE_BITS;
+                end = (ram_addr_t)clear_bit_idx << TARGET_PAGE_BITS;
+                set_bit_idx = find_next_bit(bitmap, num_pages,
+                                            clear_bit_idx + 1);
+
+                if (!offset_in_ramblock(block, end - 1)) {
+                    error_setg(errp, "page outside of ramblock %s range",
+                               block->idstr);
+                    ret = false;
+                    break;
+                }
+            }
+
+            len = MIN(end - offset, FILE_IO_URING_READ_SIZE);
+            r = u->free_reads[--u->nfree];
+            r->iov.iov_base = ramblock_ptr(block, offset);
+            r->iov.iov_len = len;
+            r->file_offset = block->pages_offset + offset;
+            file_io_uring_queue(u, r);
+
+            offset += len;
+            bytes += len;
+        }
+
+        if (!u->inflight) {
+            break;
+        }
+
+        /* Keep draining after an error, the reads point to guest memory */
+        if (!file_io_uring_complete(u, ret ? errp : NULL)) {
+            ret = false;
+        }
+    }
+
+    if (direct_io && fcntl(u->fd, F_SETFL, flags) < 0 && ret) {
+        error_setg_errno(errp, errno, "failed to disable O_DIRECT");
+        ret = false;
+    }
+
+    io_uring_queue_exit(&u->ring);
+    trace_file_io_uring_load(block->idstr, bytes, u->nreads, direct_io);
+
+    return ret;
+}
@@ -17,6 +17,7 @@
 #include "io/channel-socket.h"
 #include "io/channel-util.h"
 #include "options.h"
+#include "ram.h"
 #include "trace.h"
 
 #define OFFSET_OPTION ",offset="
@@ -25,6 +26,9 @@ static struct FileOutgoingArgs {
     char *fname;
 } outgoing_args;
 
+/* The file of the last incoming migration */
+static char *incoming_fname;
+
 /* Remove the offset option from @filespec and return it in @offsetp. */
 
 int file_parse_offset(char *filespec, uint64_t *offsetp, Error **errp)
@@ -44,6 +48,16 @@ int file_parse_offset(char *filespec, uint64_t *offsetp, Error **errp)
     return 0;
 }
 
+const char *file_get_outgoing_fname(void)
+{
+    return outgoing_args.fname;
+}
+
+const char *file_get_incoming_fname(void)
+{
+    return incoming_fname;
+}
+
 void file_cleanup_outgoing_migration(void)
 {
     g_free(outgoing_args.fname);
@@ -103,6 +117,11 @@ void file_start_outgoing_migration(MigrationState *s,
 
     trace_migration_file_outgoing(filename);
 
+    /* Check before the file is truncated */
+    if (!ram_mapped_ram_check_target(filename, errp)) {
+        return;
+    }
+
     fioc = qio_channel_file_new_path(filename, O_CREAT | O_WRONLY, 0600, errp);
     if (!fioc) {
         return;
@@ -188,6 +207,9 @@ void file_start_incoming_migration(FileMigrationArgs *file_args, Error **errp)
         return;
     }
 
+    g_free(incoming_fname);
+    incoming_fname = g_strdup(filename);
+
     if (offset &&
         qio_channel_io_seek(QIO_CHANNEL(fioc), offset, SEEK_SET, errp) < 0) {
         object_unref(OBJECT(fioc));
@@ -251,6 +273,53 @@ int file_write_ramblock_iov(QIOChannel *ioc, const struct iovec *iov,
     return (ret < 0) ? ret : 0;
 }
 
+/*
+ * Map @size bytes of the migration file at @offset privately over the
+ * guest memory at @host, so that the pages are only read from the file
+ * once the guest touches them.  @host, @size and @offset must be
+ * aligned to the host page size.
+ *
+ * Returns 1 if the pages were mapped, 0 if they have to be read instead
+ * and -1 on error, with @errp set.
+ */
+int file_map_pages(QIOChannel *ioc, void *host, size_t size, off_t offset,
+                   Error **errp)
+{
+#ifdef CONFIG_POSIX
+    QIOChannelFile *fioc;
+    void *addr;
+
+    fioc = (QIOChannelFile *)object_dynamic_cast(OBJECT(ioc),
+                                                 TYPE_QIO_CHANNEL_FILE);
+    if (!fioc) {
+        return 0;
+    }
+
+    addr = mmap(host, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                fioc->fd, offset);
+    if (addr != MAP_FAILED) {
+        trace_migration_file_map_pages(host, size, offset);
+        return 1;
+    }
+
+    trace_migration_file_map_pages_failed(host, size, offset, errno);
+
+    /*
+     * A failed MAP_FIXED may have already dropped the previous mapping,
+     * so put back anonymous memory where the pages can be read into.
+     */
+    addr = mmap(host, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    if (addr == MAP_FAILED) {
+        error_setg_errno(errp, errno, "failed to restore guest memory at %p",
+                         host);
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
 int multifd_file_recv_data(MultiFDRecvParams *p, Error **errp)
 {
     MultiFDRecvData *data = p->data;
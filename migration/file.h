@@ -19,8 +19,17 @@ void file_start_outgoing_migration(MigrationState *s,
                                    FileMigrationArgs *file_args, Error **errp);
 int file_parse_offset(char *filespec, uint64_t *offsetp, Error **errp);
 void file_cleanup_outgoing_migration(void);
+const char *file_get_outgoing_fname(void);
+const char *file_get_incoming_fname(void);
 bool file_send_channel_create(gpointer opaque, Error **errp);
 int file_write_ramblock_iov(QIOChannel *ioc, const struct iovec *iov,
                             int niov, RAMBlock *block, Error **errp);
+int file_map_pages(QIOChannel *ioc, void *host, size_t size, off_t offset,
+                   Error **errp);
 int multifd_file_recv_data(MultiFDRecvParams *p, Error **errp);
+#ifdef CONFIG_LINUX_IO_URING
+bool file_read_ramblock_io_uring(QIOChannel *ioc, RAMBlock *block,
+                                 long num_pages, unsigned long *bitmap,
+                                 Error **errp);
+#endif
 #endif
@@ -136,6 +136,14 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "postcopy ram: %" PRIu64 " kbytes\n",
                            info->ram->postcopy_bytes >> 10);
         }
+        if (info->ram->dedup_pages) {
+            monitor_printf(mon, "dedup: %" PRIu64 " pages\n",
+                           info->ram->dedup_pages);
+        }
+        if (info->ram->deferred_pages) {
+            monitor_printf(mon, "deferred: %" PRIu64 " pages\n",
+                           info->ram->deferred_pages);
+        }
         if (info->ram->dirty_sync_missed_zero_copy) {
             monitor_printf(mon,
                            "Zero-copy-send fallbacks happened: %" PRIu64 " times\n",
@@ -160,6 +168,25 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->overflow);
     }
 
+#ifdef CONFIG_ZSTD
+    if (info->multifd_adaptive) {
+        MultiFDAdaptiveMethodStats *m[] = {
+            info->multifd_adaptive->none,
+            info->multifd_adaptive->fast,
+            info->multifd_adaptive->strong,
+        };
+        const char *name[] = { "none", "fast", "strong" };
+
+        for (int i = 0; i < ARRAY_SIZE(m); i++) {
+            monitor_printf(mon, "multifd adaptive %s: %" PRIu64 " packets, "
+                           "%" PRIu64 " kbytes, %" PRIu64
+                           " kbytes transferred\n",
+                           name[i], m[i]->packets, m[i]->bytes >> 10,
+                           m[i]->transferred >> 10);
+        }
+    }
+#endif
+
     if (info->has_cpu_throttle_percentage) {
         monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
                        info->cpu_throttle_percentage);
@@ -358,6 +385,17 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
                                MIGRATION_PARAMETER_DIRECT_IO),
                            params->direct_io ? "on" : "off");
         }
+
+        assert(params->has_hot_page_rounds);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_HOT_PAGE_ROUNDS),
+            params->hot_page_rounds);
+
+        assert(params->has_mapped_ram_load_method);
+        monitor_printf(mon, "%s: %s\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_MAPPED_RAM_LOAD_METHOD),
+            qapi_enum_lookup(&MappedRamLoadMethod_lookup,
+                params->mapped_ram_load_method));
     }
 
     qapi_free_MigrationParameters(params);
@@ -635,6 +673,15 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_direct_io = true;
         visit_type_bool(v, param, &p->direct_io, &err);
         break;
+    case MIGRATION_PARAMETER_HOT_PAGE_ROUNDS:
+        p->has_hot_page_rounds = true;
+        visit_type_uint8(v, param, &p->hot_page_rounds, &err);
+        break;
+    case MIGRATION_PARAMETER_MAPPED_RAM_LOAD_METHOD:
+        p->has_mapped_ram_load_method = true;
+        visit_type_MappedRamLoadMethod(v, param, &p->mapped_ram_load_method,
+                                       &err);
+        break;
     default:
         assert(0);
     }
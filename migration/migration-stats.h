@@ -55,6 +55,16 @@ typedef struct {
      * copy.
      */
     Stat64 dirty_sync_missed_zero_copy;
+    /*
+     * Number of pages sent as references to a page in the multifd
+     * dedup cache.
+     */
+    Stat64 dedup_pages;
+    /*
+     * Number of hot pages left for the final stage, summed over the
+     * dirty bitmap syncs that deferred them.
+     */
+    Stat64 deferred_pages;
     /*
      * Number of bytes sent at migration completion stage while the
      * guest is stopped.
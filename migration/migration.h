@@ -432,6 +432,12 @@ struct MigrationState {
      * Default value is false. (since 8.1)
      */
     bool multifd_flush_after_each_section;
+    /*
+     * Let devices send their state over the multifd channels at the
+     * end of precopy.  Older QEMUs don't know about device state
+     * packets, so this is off for machine types before 9.1.
+     */
+    bool multifd_device_state;
     /*
      * This decides the size of guest memory chunk that will be used
      * to track dirty bitmap clearing.  The size of memory chunk will
@@ -442,6 +448,12 @@ struct MigrationState {
      */
     uint8_t clear_bitmap_shift;
 
+    /*
+     * Number of threads that help the migration thread with the dirty
+     * bitmap sync.  Zero picks one per 64 GiB of guest RAM, up to 16.
+     */
+    uint8_t dirty_sync_threads;
+
     /*
      * This save hostname when out-going migration starts
      */
@@ -495,7 +507,8 @@ void migrate_send_rp_pong(MigrationIncomingState *mis,
 int migrate_send_rp_req_pages(MigrationIncomingState *mis, RAMBlock *rb,
                               ram_addr_t start, uint64_t haddr);
 int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
-                                      RAMBlock *rb, ram_addr_t start);
+                                      RAMBlock *rb, ram_addr_t start,
+                                      size_t len);
 void migrate_send_rp_recv_bitmap(MigrationIncomingState *mis,
                                  char *block_name);
 void migrate_send_rp_resume_ack(MigrationIncomingState *mis, uint32_t value);
@@ -0,0 +1,623 @@
+/*
+ * Multifd adaptive compression implementation
+ *
+ * Each packet is sent either uncompressed, compressed with a fast
+ * (negative) zstd level, or compressed with multifd-zstd-level.  The
+ * send thread of each channel picks the method whose estimated cost
+ * per byte of guest memory is lowest, where the cost of a method is
+ * the CPU time it takes to compress plus the time it takes to put its
+ * output on the wire.
+ *
+ * The CPU time and compression ratio of each level, and the time the
+ * channel takes to write a byte, are tracked as moving averages.  The
+ * write time is measured on blocking writes, so it only reflects the
+ * link once the socket buffers are full; until then compression looks
+ * expensive and packets go out uncompressed, which quickly fills them.
+ *
+ * Every packet is a complete zstd frame, so that the level can change
+ * from one packet to the next.  The receive side does not care about
+ * the level and only needs to know whether a packet is compressed.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <zstd.h>
+#include "qemu/host-utils.h"
+#include "qemu/stats64.h"
+#include "qemu/timer.h"
+#include "exec/ramblock.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "trace.h"
+#include "options.h"
+#include "multifd.h"
+
+/* zstd level used by the fast method, in the lz4 speed range */
+#define ADAPTIVE_FAST_LEVEL (-5)
+
+/* Every this many packets, send one with the next method in turn */
+#define ADAPTIVE_PROBE_INTERVAL 64
+
+/* Weight of a new sample in the moving averages is 1 / 2^this */
+#define ADAPTIVE_EWMA_SHIFT 3
+
+/* Bytes sampled per packet to estimate entropy */
+#define ADAPTIVE_SAMPLE_CHUNK 64
+#define ADAPTIVE_SAMPLE_CHUNKS 32
+
+/*
+ * Packets whose sampled entropy is above this many bits per byte, in
+ * 1/256ths, are not worth compressing.  Uniformly random data gives
+ * about 7.9 with the sample size above.
+ */
+#define ADAPTIVE_ENTROPY_MAX (7 * 256 + 128)
+
+typedef enum {
+    ADAPTIVE_NONE,
+    ADAPTIVE_FAST,
+    ADAPTIVE_STRONG,
+    ADAPTIVE__MAX,
+} AdaptiveMethod;
+
+static const char *const adaptive_method_name[ADAPTIVE__MAX] = {
+    [ADAPTIVE_NONE] = "none",
+    [ADAPTIVE_FAST] = "fast",
+    [ADAPTIVE_STRONG] = "strong",
+};
+
+typedef struct {
+    Stat64 packets;
+    Stat64 bytes;
+    Stat64 transferred;
+} AdaptiveCounters;
+
+static AdaptiveCounters adaptive_counters[ADAPTIVE__MAX];
+
+struct adaptive_data {
+    /* stream for compression */
+    ZSTD_CStream *zcs;
+    /* stream for decompression */
+    ZSTD_DStream *zds;
+    /* buffers */
+    ZSTD_inBuffer in;
+    ZSTD_outBuffer out;
+    /* compressed buffer */
+    uint8_t *zbuff;
+    /* size of compressed buffer */
+    uint32_t zbuff_len;
+
+    /* send side only from here on */
+
+    /* zstd level of each compressed method */
+    int level[ADAPTIVE__MAX];
+    /* level the stream is currently set to */
+    int cur_level;
+    /* packets sent so far */
+    uint64_t packets;
+    /* next method to probe */
+    AdaptiveMethod probe;
+    /* bytes written for the previous packet */
+    uint64_t last_bytes;
+    /* ns to write a byte to the channel, times 1024 */
+    uint64_t link_cost;
+    /* ns to compress a byte with each method, times 1024 */
+    uint64_t cpu_cost[ADAPTIVE__MAX];
+    /* output size over input size for each method, times 1024 */
+    uint64_t ratio[ADAPTIVE__MAX];
+};
+
+static void adaptive_ewma(uint64_t *avg, uint64_t sample)
+{
+    if (!*avg) {
+        *avg = sample ?: 1;
+    } else {
+        *avg = *avg - (*avg >> ADAPTIVE_EWMA_SHIFT) +
+               (sample >> ADAPTIVE_EWMA_SHIFT);
+    }
+}
+
+/* log2(@x) in 1/256ths, with the mantissa linearly approximated */
+static uint32_t adaptive_log2(uint32_t x)
+{
+    int b = 31 - clz32(x);
+
+    return b * 256 + (((uint64_t)x << (32 - b)) >> 24 & 0xff);
+}
+
+/*
+ * Estimate the entropy of the normal pages of a packet, in 1/256ths of
+ * a bit per byte, by sampling a few chunks spread across them.
+ */
+static uint32_t adaptive_entropy(MultiFDSendParams *p)
+{
+    MultiFDPages_t *pages = p->pages;
+    uint32_t count[256] = { };
+    uint32_t n = 0;
+    uint64_t sum = 0;
+    int i, j;
+
+    for (i = 0; i < ADAPTIVE_SAMPLE_CHUNKS; i++) {
+        uint32_t page = i * pages->normal_num / ADAPTIVE_SAMPLE_CHUNKS;
+        uint32_t off = (i * 1031 * ADAPTIVE_SAMPLE_CHUNK) %
+                       (p->page_size - ADAPTIVE_SAMPLE_CHUNK + 1);
+        const uint8_t *buf = pages->block->host + pages->offset[page] + off;
+
+        for (j = 0; j < ADAPTIVE_SAMPLE_CHUNK; j++) {
+            count[buf[j]]++;
+        }
+        n += ADAPTIVE_SAMPLE_CHUNK;
+    }
+
+    for (i = 0; i < 256; i++) {
+        if (count[i]) {
+            sum += (uint64_t)count[i] * adaptive_log2(count[i]);
+        }
+    }
+
+    return adaptive_log2(n) - sum / n;
+}
+
+static AdaptiveMethod adaptive_choose(MultiFDSendParams *p,
+                                      struct adaptive_data *a)
+{
+    AdaptiveMethod best = ADAPTIVE_NONE;
+    uint64_t best_cost = a->link_cost;
+    AdaptiveMethod m;
+
+    /* Measure the link first, then each compression level once */
+    if (!a->link_cost) {
+        return ADAPTIVE_NONE;
+    }
+    for (m = ADAPTIVE_FAST; m < ADAPTIVE__MAX; m++) {
+        if (!a->cpu_cost[m]) {
+            return m;
+        }
+    }
+
+    /* Keep the estimates of the methods we don't use up to date */
+    if (++a->packets % ADAPTIVE_PROBE_INTERVAL == 0) {
+        a->probe = (a->probe + 1) % ADAPTIVE__MAX;
+        return a->probe;
+    }
+
+    if (adaptive_entropy(p) > ADAPTIVE_ENTROPY_MAX) {
+        return ADAPTIVE_NONE;
+    }
+
+    for (m = ADAPTIVE_FAST; m < ADAPTIVE__MAX; m++) {
+        uint64_t cost = a->cpu_cost[m] + (a->ratio[m] * a->link_cost >> 10);
+
+        if (cost < best_cost) {
+            best = m;
+            best_cost = cost;
+        }
+    }
+
+    return best;
+}
+
+/* Multifd adaptive compression */
+
+/**
+ * adaptive_send_setup: setup send side
+ *
+ * Setup each channel with a zstd stream for the compressed methods.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int adaptive_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    struct adaptive_data *a = g_new0(struct adaptive_data, 1);
+    size_t res;
+
+    a->level[ADAPTIVE_FAST] = MAX(ADAPTIVE_FAST_LEVEL, ZSTD_minCLevel());
+    a->level[ADAPTIVE_STRONG] = migrate_multifd_zstd_level();
+
+    a->zcs = ZSTD_createCStream();
+    if (!a->zcs) {
+        g_free(a);
+        error_setg(errp, "multifd %u: zstd createCStream failed", p->id);
+        return -1;
+    }
+
+    res = ZSTD_initCStream(a->zcs, a->level[ADAPTIVE_STRONG]);
+    if (ZSTD_isError(res)) {
+        ZSTD_freeCStream(a->zcs);
+        g_free(a);
+        error_setg(errp, "multifd %u: initCStream failed with error %s",
+                   p->id, ZSTD_getErrorName(res));
+        return -1;
+    }
+    a->cur_level = a->level[ADAPTIVE_STRONG];
+
+    /* This is the maximum size of the compressed buffer */
+    a->zbuff_len = ZSTD_compressBound(MULTIFD_PACKET_SIZE);
+    a->zbuff = g_try_malloc(a->zbuff_len);
+    if (!a->zbuff) {
+        ZSTD_freeCStream(a->zcs);
+        g_free(a);
+        error_setg(errp, "multifd %u: out of memory for zbuff", p->id);
+        return -1;
+    }
+    p->compress_data = a;
+
+    /* Channels are set up one after the other by the migration thread */
+    if (p->id == 0) {
+        for (int m = 0; m < ADAPTIVE__MAX; m++) {
+            stat64_set(&adaptive_counters[m].packets, 0);
+            stat64_set(&adaptive_counters[m].bytes, 0);
+            stat64_set(&adaptive_counters[m].transferred, 0);
+        }
+    }
+
+    /* Uncompressed packets need one IOV per page plus the header */
+    p->iov = g_new0(struct iovec, p->page_count + 1);
+    return 0;
+}
+
+/**
+ * adaptive_send_cleanup: cleanup send side
+ *
+ * Close the channel and return memory.
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static void adaptive_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    struct adaptive_data *a = p->compress_data;
+
+    ZSTD_freeCStream(a->zcs);
+    a->zcs = NULL;
+    g_free(a->zbuff);
+    a->zbuff = NULL;
+    g_free(p->compress_data);
+    p->compress_data = NULL;
+
+    g_free(p->iov);
+    p->iov = NULL;
+}
+
+static int adaptive_compress(MultiFDSendParams *p, struct adaptive_data *a,
+                             int level, Error **errp)
+{
+    MultiFDPages_t *pages = p->pages;
+    size_t ret;
+    uint32_t i;
+
+    if (level != a->cur_level) {
+        /* Takes effect at the start of the next frame, i.e. this packet */
+        ret = ZSTD_CCtx_setParameter(a->zcs, ZSTD_c_compressionLevel, level);
+        if (ZSTD_isError(ret)) {
+            error_setg(errp, "multifd %u: setting level %d failed with %s",
+                       p->id, level, ZSTD_getErrorName(ret));
+            return -1;
+        }
+        a->cur_level = level;
+    }
+
+    a->out.dst = a->zbuff;
+    a->out.size = a->zbuff_len;
+    a->out.pos = 0;
+
+    for (i = 0; i < pages->normal_num; i++) {
+        ZSTD_EndDirective flush = ZSTD_e_continue;
+
+        if (i == pages->normal_num - 1) {
+            flush = ZSTD_e_end;
+        }
+        a->in.src = pages->block->host + pages->offset[i];
+        a->in.size = p->page_size;
+        a->in.pos = 0;
+
+        /*
+         * Same loop as zstd_send_prepare(), except that ending the
+         * frame must also flush everything out.
+         */
+        do {
+            ret = ZSTD_compressStream2(a->zcs, &a->out, &a->in, flush);
+        } while (ret > 0 && (a->in.size - a->in.pos > 0 ||
+                             flush == ZSTD_e_end)
+                         && (a->out.size - a->out.pos > 0));
+        if (ret > 0 && (a->in.size - a->in.pos > 0 || flush == ZSTD_e_end)) {
+            error_setg(errp, "multifd %u: compressStream buffer too small",
+                       p->id);
+            return -1;
+        }
+        if (ZSTD_isError(ret)) {
+            error_setg(errp, "multifd %u: compressStream error %s",
+                       p->id, ZSTD_getErrorName(ret));
+            return -1;
+        }
+    }
+
+    p->iov[p->iovs_num].iov_base = a->zbuff;
+    p->iov[p->iovs_num].iov_len = a->out.pos;
+    p->iovs_num++;
+    p->next_packet_size = a->out.pos;
+    return 0;
+}
+
+/**
+ * adaptive_send_prepare: prepare date to be able to send
+ *
+ * Pick a method for the pages that we are going to send, and
+ * compress them with it if needed.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int adaptive_send_prepare(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDPages_t *pages = p->pages;
+    struct adaptive_data *a = p->compress_data;
+    uint64_t in_size = (uint64_t)pages->normal_num * p->page_size;
+    AdaptiveMethod m = ADAPTIVE_NONE;
+
+    /* Account for the write of the previous packet */
+    if (a->last_bytes && p->write_ns) {
+        adaptive_ewma(&a->link_cost, (p->write_ns << 10) / a->last_bytes);
+    }
+
+    if (!multifd_send_prepare_common(p)) {
+        p->flags |= MULTIFD_FLAG_NOCOMP;
+        goto out;
+    }
+
+    m = adaptive_choose(p, a);
+    if (m == ADAPTIVE_NONE) {
+        for (int i = 0; i < pages->normal_num; i++) {
+            p->iov[p->iovs_num].iov_base = pages->block->host +
+                                           pages->offset[i];
+            p->iov[p->iovs_num].iov_len = p->page_size;
+            p->iovs_num++;
+        }
+        p->next_packet_size = in_size;
+        p->flags |= MULTIFD_FLAG_NOCOMP;
+    } else {
+        int64_t start = get_clock();
+
+        if (adaptive_compress(p, a, a->level[m], errp)) {
+            return -1;
+        }
+        adaptive_ewma(&a->cpu_cost[m],
+                      ((get_clock() - start) << 10) / in_size);
+        adaptive_ewma(&a->ratio[m], ((uint64_t)p->next_packet_size << 10) /
+                                    in_size);
+        p->flags |= MULTIFD_FLAG_ZSTD;
+    }
+
+    stat64_add(&adaptive_counters[m].packets, 1);
+    stat64_add(&adaptive_counters[m].bytes, in_size);
+    stat64_add(&adaptive_counters[m].transferred, p->next_packet_size);
+    trace_multifd_adaptive_send(p->id, adaptive_method_name[m], a->link_cost,
+                                a->cpu_cost[m], a->ratio[m],
+                                p->next_packet_size);
+
+out:
+    a->last_bytes = p->packet_len + p->next_packet_size;
+    multifd_send_fill_packet(p);
+    return 0;
+}
+
+/**
+ * adaptive_recv_setup: setup receive side
+ *
+ * Create the decompression stream and buffer.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int adaptive_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    struct adaptive_data *a = g_new0(struct adaptive_data, 1);
+    size_t ret;
+
+    p->compress_data = a;
+    a->zds = ZSTD_createDStream();
+    if (!a->zds) {
+        g_free(a);
+        p->compress_data = NULL;
+        error_setg(errp, "multifd %u: zstd createDStream failed", p->id);
+        return -1;
+    }
+
+    ret = ZSTD_initDStream(a->zds);
+    if (ZSTD_isError(ret)) {
+        ZSTD_freeDStream(a->zds);
+        g_free(a);
+        p->compress_data = NULL;
+        error_setg(errp, "multifd %u: initDStream failed with error %s",
+                   p->id, ZSTD_getErrorName(ret));
+        return -1;
+    }
+
+    /* To be safe, we reserve twice the size of the packet */
+    a->zbuff_len = MULTIFD_PACKET_SIZE * 2;
+    a->zbuff = g_try_malloc(a->zbuff_len);
+    if (!a->zbuff) {
+        ZSTD_freeDStream(a->zds);
+        g_free(a);
+        p->compress_data = NULL;
+        error_setg(errp, "multifd %u: out of memory for zbuff", p->id);
+        return -1;
+    }
+
+    p->iov = g_new0(struct iovec, p->page_count);
+    return 0;
+}
+
+/**
+ * adaptive_recv_cleanup: cleanup receive side
+ *
+ * @p: Params for the channel that we are using
+ */
+static void adaptive_recv_cleanup(MultiFDRecvParams *p)
+{
+    struct adaptive_data *a = p->compress_data;
+
+    if (a) {
+        ZSTD_freeDStream(a->zds);
+        a->zds = NULL;
+        g_free(a->zbuff);
+        a->zbuff = NULL;
+        g_free(p->compress_data);
+        p->compress_data = NULL;
+    }
+
+    g_free(p->iov);
+    p->iov = NULL;
+}
+
+static int adaptive_recv_pages(MultiFDRecvParams *p, Error **errp)
+{
+    if (p->next_packet_size != p->normal_num * p->page_size) {
+        error_setg(errp, "multifd %u: packet size received %u size expected %u",
+                   p->id, p->next_packet_size,
+                   p->normal_num * p->page_size);
+        return -1;
+    }
+
+    for (int i = 0; i < p->normal_num; i++) {
+        p->iov[i].iov_base = p->host + p->normal[i];
+        p->iov[i].iov_len = p->page_size;
+        ramblock_recv_bitmap_set_offset(p->block, p->normal[i]);
+    }
+    return qio_channel_readv_all(p->c, p->iov, p->normal_num, errp);
+}
+
+static int adaptive_recv_zstd(MultiFDRecvParams *p, Error **errp)
+{
+    struct adaptive_data *a = p->compress_data;
+    uint32_t in_size = p->next_packet_size;
+    uint32_t out_size = 0;
+    uint32_t expected_size = p->normal_num * p->page_size;
+    size_t ret;
+    int i;
+
+    if (in_size > a->zbuff_len) {
+        error_setg(errp, "multifd %u: compressed packet too large: %u",
+                   p->id, in_size);
+        return -1;
+    }
+
+    if (qio_channel_read_all(p->c, (void *)a->zbuff, in_size, errp)) {
+        return -1;
+    }
+
+    a->in.src = a->zbuff;
+    a->in.size = in_size;
+    a->in.pos = 0;
+
+    for (i = 0; i < p->normal_num; i++) {
+        ramblock_recv_bitmap_set_offset(p->block, p->normal[i]);
+        a->out.dst = p->host + p->normal[i];
+        a->out.size = p->page_size;
+        a->out.pos = 0;
+
+        /* Same loop as zstd_recv() */
+        do {
+            ret = ZSTD_decompressStream(a->zds, &a->out, &a->in);
+        } while (ret > 0 && (a->in.size - a->in.pos > 0)
+                         && (a->out.pos < p->page_size));
+        if (ret > 0 && (a->out.pos < p->page_size)) {
+            error_setg(errp, "multifd %u: decompressStream buffer too small",
+                       p->id);
+            return -1;
+        }
+        if (ZSTD_isError(ret)) {
+            error_setg(errp, "multifd %u: decompressStream returned %s",
+                       p->id, ZSTD_getErrorName(ret));
+            return -1;
+        }
+        out_size += a->out.pos;
+    }
+    if (out_size != expected_size) {
+        error_setg(errp, "multifd %u: packet size received %u size expected %u",
+                   p->id, out_size, expected_size);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * adaptive_recv: read the data from the channel into actual pages
+ *
+ * Depending on the packet flags, either read the pages as they are, or
+ * read the compressed buffer and uncompress it into the pages.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int adaptive_recv(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+
+    if (flags != MULTIFD_FLAG_NOCOMP && flags != MULTIFD_FLAG_ZSTD) {
+        error_setg(errp, "multifd %u: flags received %x flags expected "
+                   "%x or %x", p->id, flags, MULTIFD_FLAG_NOCOMP,
+                   MULTIFD_FLAG_ZSTD);
+        return -1;
+    }
+
+    multifd_recv_zero_page_process(p);
+
+    if (!p->normal_num) {
+        assert(p->next_packet_size == 0);
+        return 0;
+    }
+
+    if (flags == MULTIFD_FLAG_NOCOMP) {
+        return adaptive_recv_pages(p, errp);
+    }
+    return adaptive_recv_zstd(p, errp);
+}
+
+static void adaptive_fill_stats(MultiFDAdaptiveMethodStats *stats,
+                                AdaptiveMethod m)
+{
+    stats->packets = stat64_get(&adaptive_counters[m].packets);
+    stats->bytes = stat64_get(&adaptive_counters[m].bytes);
+    stats->transferred = stat64_get(&adaptive_counters[m].transferred);
+}
+
+void multifd_adaptive_populate_info(MigrationInfo *info)
+{
+    MultiFDAdaptiveStats *stats = g_new0(MultiFDAdaptiveStats, 1);
+
+    stats->none = g_new0(MultiFDAdaptiveMethodStats, 1);
+    adaptive_fill_stats(stats->none, ADAPTIVE_NONE);
+    stats->fast = g_new0(MultiFDAdaptiveMethodStats, 1);
+    adaptive_fill_stats(stats->fast, ADAPTIVE_FAST);
+    stats->strong = g_new0(MultiFDAdaptiveMethodStats, 1);
+    adaptive_fill_stats(stats->strong, ADAPTIVE_STRONG);
+
+    info->multifd_adaptive = stats;
+}
+
+static MultiFDMethods multifd_adaptive_ops = {
+    .send_setup = adaptive_send_setup,
+    .send_cleanup = adaptive_send_cleanup,
+    .send_prepare = adaptive_send_prepare,
+    .recv_setup = adaptive_recv_setup,
+    .recv_cleanup = adaptive_recv_cleanup,
+    .recv = adaptive_recv
+};
+
+static void multifd_adaptive_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_ADAPTIVE, &multifd_adaptive_ops);
+}
+
+migration_init(multifd_adaptive_register);
@@ -0,0 +1,362 @@
+/*
+ * Multifd page deduplication
+ *
+ * Each multifd channel pair keeps a cache of the last pages sent over
+ * it.  Both sides hold their content, and the source also a 128-bit
+ * hash of each together with an index from hash to cache slot.  Pages
+ * whose hash is found in the index, and whose content matches the one
+ * in that slot byte for byte, are sent as the slot number instead of
+ * their content.  The hash is not cryptographic, so it only serves to
+ * find candidates: a collision costs a comparison, never a wrong page.
+ *
+ * Since both sides of a channel see its packets in the same order, the
+ * source can mirror the state of the destination cache exactly without
+ * any feedback.  For each packet, references are resolved against the
+ * cache as it was at the start of the packet, and the normal pages of
+ * the packet are then added to it in order, replacing the oldest slots.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/bitops.h"
+#include "qapi/error.h"
+#include "exec/ramblock.h"
+#include "multifd.h"
+
+/* Size of the per-channel cache kept by the destination */
+#define MULTIFD_DEDUP_CACHE_SIZE (16 * MiB)
+
+#define DEDUP_PRIME64_1 0x9E3779B185EBCA87ULL
+#define DEDUP_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define DEDUP_PRIME64_3 0x165667B19E3779F9ULL
+#define DEDUP_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define DEDUP_PRIME64_5 0x27D4EB2F165667C5ULL
+
+typedef struct {
+    uint64_t lo;
+    uint64_t hi;
+} MultiFDDedupHash;
+
+typedef struct {
+    /* number of slots in the destination cache */
+    uint32_t n_slots;
+    /* number of slots filled so far */
+    uint32_t filled;
+    /* slot the next normal page goes to */
+    uint32_t next_slot;
+    /* page content for each slot, same as on the destination */
+    uint8_t *cache;
+    /* hash of the page in each slot */
+    MultiFDDedupHash *slot_hash;
+    /* hash -> slot + 1, keyed by pointers into slot_hash */
+    GHashTable *index;
+
+    /* per packet scratch space */
+
+    /* copy of the normal pages, as hashed and sent */
+    uint8_t *bounce;
+    /* hash of each normal page */
+    MultiFDDedupHash *hash;
+    /* offsets of the dedup pages */
+    ram_addr_t *dedup_offset;
+    /* slot of each dedup page, big endian */
+    uint32_t *slots;
+} MultiFDSendDedup;
+
+typedef struct {
+    /* number of slots in the cache */
+    uint32_t n_slots;
+    /* number of slots filled so far */
+    uint32_t filled;
+    /* slot the next normal page goes to */
+    uint32_t next_slot;
+    /* page content for each slot */
+    uint8_t *cache;
+    /* slot of each dedup page, big endian */
+    uint32_t *slots;
+} MultiFDRecvDedup;
+
+static inline uint64_t dedup_round(uint64_t acc, uint64_t input)
+{
+    acc += input * DEDUP_PRIME64_2;
+    acc = rol64(acc, 31);
+    return acc * DEDUP_PRIME64_1;
+}
+
+static inline uint64_t dedup_avalanche(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= DEDUP_PRIME64_2;
+    h ^= h >> 29;
+    h *= DEDUP_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+/*
+ * A fast non-cryptographic 128-bit hash of a page, along the lines of
+ * xxHash64 with the four lanes folded two different ways.  The hash is
+ * only ever computed on the source, so host endianness does not matter.
+ */
+static void multifd_dedup_hash(const void *buf, size_t len,
+                               MultiFDDedupHash *h)
+{
+    const uint64_t *p = buf;
+    uint64_t v1 = DEDUP_PRIME64_1 + DEDUP_PRIME64_2;
+    uint64_t v2 = DEDUP_PRIME64_2;
+    uint64_t v3 = 0;
+    uint64_t v4 = -DEDUP_PRIME64_1;
+    size_t i;
+
+    /* Pages are a multiple of 32 bytes, and suitably aligned. */
+    for (i = 0; i < len / sizeof(uint64_t); i += 4) {
+        v1 = dedup_round(v1, p[i]);
+        v2 = dedup_round(v2, p[i + 1]);
+        v3 = dedup_round(v3, p[i + 2]);
+        v4 = dedup_round(v4, p[i + 3]);
+    }
+
+    h->lo = dedup_avalanche(rol64(v1, 1) + rol64(v2, 7) +
+                            rol64(v3, 12) + rol64(v4, 18) + len);
+    h->hi = dedup_avalanche((v1 ^ rol64(v3, 29)) * DEDUP_PRIME64_4 +
+                            (v2 ^ rol64(v4, 43)) * DEDUP_PRIME64_5);
+}
+
+static guint multifd_dedup_hash_hash(gconstpointer key)
+{
+    const MultiFDDedupHash *h = key;
+
+    return h->lo;
+}
+
+static gboolean multifd_dedup_hash_equal(gconstpointer a, gconstpointer b)
+{
+    const MultiFDDedupHash *ha = a, *hb = b;
+
+    return ha->lo == hb->lo && ha->hi == hb->hi;
+}
+
+static uint32_t multifd_dedup_n_slots(uint32_t page_size)
+{
+    return MULTIFD_DEDUP_CACHE_SIZE / page_size;
+}
+
+void multifd_send_dedup_setup(MultiFDSendParams *p)
+{
+    MultiFDSendDedup *d = g_new0(MultiFDSendDedup, 1);
+
+    d->n_slots = multifd_dedup_n_slots(p->page_size);
+    d->cache = g_malloc((size_t)d->n_slots * p->page_size);
+    d->slot_hash = g_new0(MultiFDDedupHash, d->n_slots);
+    d->index = g_hash_table_new(multifd_dedup_hash_hash,
+                                multifd_dedup_hash_equal);
+    d->bounce = g_malloc(p->page_count * p->page_size);
+    d->hash = g_new0(MultiFDDedupHash, p->page_count);
+    d->dedup_offset = g_new0(ram_addr_t, p->page_count);
+    d->slots = g_new0(uint32_t, p->page_count);
+
+    p->dedup_data = d;
+}
+
+void multifd_send_dedup_cleanup(MultiFDSendParams *p)
+{
+    MultiFDSendDedup *d = p->dedup_data;
+
+    if (!d) {
+        return;
+    }
+
+    g_hash_table_destroy(d->index);
+    g_free(d->cache);
+    g_free(d->slot_hash);
+    g_free(d->bounce);
+    g_free(d->hash);
+    g_free(d->dedup_offset);
+    g_free(d->slots);
+    g_free(d);
+    p->dedup_data = NULL;
+}
+
+static void multifd_send_dedup_insert(MultiFDSendDedup *d,
+                                      uint32_t page_size, const uint8_t *buf,
+                                      const MultiFDDedupHash *h)
+{
+    uint32_t slot = d->next_slot;
+    MultiFDDedupHash *key = &d->slot_hash[slot];
+
+    if (slot < d->filled) {
+        /*
+         * Evict the old content of the slot, unless a more recent slot
+         * has the same hash, in which case the index already points
+         * there and does not use @key.
+         */
+        if (GPOINTER_TO_UINT(g_hash_table_lookup(d->index, key)) ==
+            slot + 1) {
+            g_hash_table_remove(d->index, key);
+        }
+    } else {
+        d->filled++;
+    }
+
+    memcpy(d->cache + (size_t)slot * page_size, buf, page_size);
+    *key = *h;
+    g_hash_table_replace(d->index, key, GUINT_TO_POINTER(slot + 1));
+    d->next_slot = (slot + 1) % d->n_slots;
+}
+
+/**
+ * multifd_send_dedup_detect: Find pages already in the dedup cache.
+ *
+ * Must be called after zero page detection.  Copies and hashes each
+ * normal page, turns those found in the cache with the same content
+ * into dedup pages, and adds the others to the cache.  On return p->pages->offset holds the
+ * normal pages, then the zero pages, then the dedup pages.
+ *
+ * The copy makes sure that the content added to the cache is exactly
+ * the one sent, even if the guest writes to the page meanwhile.
+ *
+ * @param p A pointer to the send params.
+ */
+void multifd_send_dedup_detect(MultiFDSendParams *p)
+{
+    MultiFDSendDedup *d = p->dedup_data;
+    MultiFDPages_t *pages = p->pages;
+    uint32_t zero_num = pages->num - pages->normal_num;
+    uint32_t normal_num = 0, dedup_num = 0;
+    uint32_t i;
+
+    for (i = 0; i < pages->normal_num; i++) {
+        ram_addr_t offset = pages->offset[i];
+        uint8_t *buf = d->bounce + (size_t)normal_num * p->page_size;
+        MultiFDDedupHash *h = &d->hash[normal_num];
+        uint32_t slot;
+
+        memcpy(buf, pages->block->host + offset, p->page_size);
+        multifd_dedup_hash(buf, p->page_size, h);
+
+        slot = GPOINTER_TO_UINT(g_hash_table_lookup(d->index, h));
+        if (slot &&
+            !memcmp(buf, d->cache + (size_t)(slot - 1) * p->page_size,
+                    p->page_size)) {
+            d->dedup_offset[dedup_num] = offset;
+            d->slots[dedup_num] = cpu_to_be32(slot - 1);
+            dedup_num++;
+        } else {
+            /* normal_num <= i, so this never overwrites unread entries */
+            pages->offset[normal_num++] = offset;
+        }
+    }
+
+    for (i = 0; i < normal_num; i++) {
+        multifd_send_dedup_insert(d, p->page_size,
+                                  d->bounce + (size_t)i * p->page_size,
+                                  &d->hash[i]);
+    }
+
+    memmove(&pages->offset[normal_num], &pages->offset[pages->normal_num],
+            zero_num * sizeof(ram_addr_t));
+    memcpy(&pages->offset[normal_num + zero_num], d->dedup_offset,
+           dedup_num * sizeof(ram_addr_t));
+    pages->normal_num = normal_num;
+    pages->dedup_num = dedup_num;
+}
+
+/*
+ * Same as multifd_send_prepare_iovs(), but sends the copies made by
+ * multifd_send_dedup_detect() followed by the dedup slots.
+ */
+void multifd_send_dedup_prepare_iovs(MultiFDSendParams *p)
+{
+    MultiFDSendDedup *d = p->dedup_data;
+    MultiFDPages_t *pages = p->pages;
+
+    for (int i = 0; i < pages->normal_num; i++) {
+        p->iov[p->iovs_num].iov_base = d->bounce + (size_t)i * p->page_size;
+        p->iov[p->iovs_num].iov_len = p->page_size;
+        p->iovs_num++;
+    }
+    p->next_packet_size = pages->normal_num * p->page_size;
+
+    if (pages->dedup_num) {
+        p->iov[p->iovs_num].iov_base = d->slots;
+        p->iov[p->iovs_num].iov_len = pages->dedup_num * sizeof(uint32_t);
+        p->iovs_num++;
+        p->next_packet_size += pages->dedup_num * sizeof(uint32_t);
+    }
+}
+
+void multifd_recv_dedup_setup(MultiFDRecvParams *p)
+{
+    MultiFDRecvDedup *d = g_new0(MultiFDRecvDedup, 1);
+
+    d->n_slots = multifd_dedup_n_slots(p->page_size);
+    d->cache = g_malloc((size_t)d->n_slots * p->page_size);
+    d->slots = g_new0(uint32_t, p->page_count);
+
+    p->dedup_data = d;
+}
+
+void multifd_recv_dedup_cleanup(MultiFDRecvParams *p)
+{
+    MultiFDRecvDedup *d = p->dedup_data;
+
+    if (!d) {
+        return;
+    }
+
+    g_free(d->cache);
+    g_free(d->slots);
+    g_free(d);
+    p->dedup_data = NULL;
+}
+
+/* Point @iov at the buffer receiving the slots of the dedup pages */
+void multifd_recv_dedup_prepare_iov(MultiFDRecvParams *p, struct iovec *iov)
+{
+    MultiFDRecvDedup *d = p->dedup_data;
+
+    iov->iov_base = d->slots;
+    iov->iov_len = p->dedup_num * sizeof(uint32_t);
+}
+
+/**
+ * multifd_recv_dedup_process: Fill in dedup pages and update the cache.
+ *
+ * Must be called once the normal pages and the dedup slots of the
+ * packet have been read.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+int multifd_recv_dedup_process(MultiFDRecvParams *p, Error **errp)
+{
+    MultiFDRecvDedup *d = p->dedup_data;
+    uint32_t i;
+
+    for (i = 0; i < p->dedup_num; i++) {
+        uint32_t slot = be32_to_cpu(d->slots[i]);
+
+        if (slot >= d->filled) {
+            error_setg(errp, "multifd %u: received dedup slot %u, "
+                       "but only %u are in use", p->id, slot, d->filled);
+            return -1;
+        }
+        memcpy(p->host + p->dedup[i],
+               d->cache + (size_t)slot * p->page_size, p->page_size);
+        ramblock_recv_bitmap_set_offset(p->block, p->dedup[i]);
+    }
+
+    for (i = 0; i < p->normal_num; i++) {
+        memcpy(d->cache + (size_t)d->next_slot * p->page_size,
+               p->host + p->normal[i], p->page_size);
+        d->filled = MAX(d->filled, d->next_slot + 1);
+        d->next_slot = (d->next_slot + 1) % d->n_slots;
+    }
+
+    return 0;
+}
@@ -0,0 +1,181 @@
+/*
+ * Multifd device state migration
+ *
+ * Device state that is too large to go through the main migration
+ * stream during downtime is split by the device into chunks, which
+ * are sent as packets of their own over the multifd channels.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/rcu.h"
+#include "qapi/error.h"
+#include "io/channel.h"
+#include "migration.h"
+#include "migration/misc.h"
+#include "migration-stats.h"
+#include "multifd.h"
+#include "options.h"
+#include "savevm.h"
+#include "trace.h"
+
+typedef struct {
+    SaveLiveCompletePrecopyThreadHandler hdlr;
+    char *idstr;
+    uint32_t instance_id;
+    void *opaque;
+    QemuThread thread;
+    bool ret;
+    Error *err;
+} MultiFDDeviceStateSaveThread;
+
+/*
+ * The save threads are only spawned and joined by the migration thread,
+ * so the list needs no locking.
+ */
+static GSList *device_state_save_threads;
+static bool device_state_save_abort;
+
+bool multifd_device_state_supported(void)
+{
+    return migrate_multifd() && !migrate_mapped_ram() &&
+           migrate_multifd_device_state();
+}
+
+int multifd_send_device_state(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDDeviceState_t *device_state = p->device_state;
+    MultiFDPacketDeviceState_t *packet = p->packet_device_state;
+    struct iovec iov[2];
+    int ret;
+
+    packet->hdr.flags = cpu_to_be32(MULTIFD_FLAG_DEVICE_STATE);
+    strncpy(packet->idstr, device_state->idstr, sizeof(packet->idstr));
+    packet->instance_id = cpu_to_be32(device_state->instance_id);
+    packet->next_packet_size = cpu_to_be32(device_state->buf_len);
+
+    iov[0].iov_base = packet;
+    iov[0].iov_len = sizeof(*packet);
+    iov[1].iov_base = device_state->buf;
+    iov[1].iov_len = device_state->buf_len;
+
+    trace_multifd_send_device_state(p->id, device_state->idstr,
+                                    device_state->instance_id,
+                                    device_state->buf_len);
+
+    /*
+     * The buffer is freed right after, so never use zero copy here even
+     * if it is enabled for pages.
+     */
+    ret = qio_channel_writev_all(p->c, iov, device_state->buf_len ? 2 : 1,
+                                 errp);
+    if (ret == 0) {
+        stat64_add(&mig_stats.multifd_bytes,
+                   sizeof(*packet) + device_state->buf_len);
+        p->packets_sent++;
+    }
+
+    g_free(device_state->idstr);
+    g_free(device_state->buf);
+    g_free(device_state);
+    p->device_state = NULL;
+
+    return ret;
+}
+
+int multifd_recv_device_state(MultiFDRecvParams *p, Error **errp)
+{
+    MultiFDPacketDeviceState_t *packet = p->packet_device_state;
+    g_autofree char *buf = g_malloc(p->next_packet_size);
+
+    if (qio_channel_read_all(p->c, buf, p->next_packet_size, errp)) {
+        return -1;
+    }
+
+    trace_multifd_recv_device_state(p->id, packet->idstr,
+                                    packet->instance_id,
+                                    p->next_packet_size);
+
+    if (!qemu_loadvm_load_state_buffer(packet->idstr, packet->instance_id,
+                                       buf, p->next_packet_size, errp)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *multifd_device_state_save_thread(void *opaque)
+{
+    MultiFDDeviceStateSaveThread *t = opaque;
+
+    rcu_register_thread();
+    t->ret = t->hdlr(t->idstr, t->instance_id, t->opaque,
+                     &device_state_save_abort, &t->err);
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+void multifd_spawn_device_state_save_thread(
+    SaveLiveCompletePrecopyThreadHandler hdlr,
+    char *idstr, uint32_t instance_id, void *opaque)
+{
+    MultiFDDeviceStateSaveThread *t = g_new0(MultiFDDeviceStateSaveThread, 1);
+
+    assert(multifd_device_state_supported());
+
+    if (!device_state_save_threads) {
+        qatomic_set(&device_state_save_abort, false);
+    }
+
+    t->hdlr = hdlr;
+    t->idstr = g_strdup(idstr);
+    t->instance_id = instance_id;
+    t->opaque = opaque;
+
+    device_state_save_threads = g_slist_prepend(device_state_save_threads, t);
+    qemu_thread_create(&t->thread, "mig/src/devstate",
+                       multifd_device_state_save_thread, t,
+                       QEMU_THREAD_JOINABLE);
+}
+
+void multifd_abort_device_state_save_threads(void)
+{
+    qatomic_set(&device_state_save_abort, true);
+}
+
+/*
+ * Wait for all device state save threads to finish.  Must be done
+ * before the final multifd sync, so that the destination has loaded
+ * all device state once it sees the sync.
+ *
+ * Returns true if all of them succeeded (or none were running).
+ */
+bool multifd_join_device_state_save_threads(void)
+{
+    MigrationState *s = migrate_get_current();
+    bool ret = true;
+    GSList *l;
+
+    for (l = device_state_save_threads; l; l = l->next) {
+        MultiFDDeviceStateSaveThread *t = l->data;
+
+        qemu_thread_join(&t->thread);
+        if (!t->ret) {
+            if (t->err) {
+                migrate_set_error(s, t->err);
+                error_free(t->err);
+            }
+            ret = false;
+        }
+        g_free(t->idstr);
+        g_free(t);
+    }
+
+    g_slist_free(device_state_save_threads);
+    device_state_save_threads = NULL;
+
+    return ret;
+}
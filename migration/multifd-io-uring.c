@@ -0,0 +1,285 @@
+/*
+ * Multifd receive with io_uring
+ *
+ * Guest memory is registered with the io_uring of each receiving
+ * channel as fixed buffers, and the pages of each packet are read from
+ * the socket straight into it.  The kernel then copies the data out of
+ * the socket buffers into pages it already holds, instead of looking
+ * up, and on first touch faulting in, every guest page of every read.
+ * Adjacent pages of a packet are read at once, and all the reads of a
+ * packet are submitted together as a linked chain.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <liburing.h>
+#include "qemu/units.h"
+#include "qapi/error.h"
+#include "exec/memory.h"
+#include "exec/ramblock.h"
+#include "io/channel-socket.h"
+#include "multifd.h"
+#include "trace.h"
+
+/* Largest fixed buffer the kernel accepts */
+#define MULTIFD_IO_URING_BUF_SIZE (1 * GiB)
+
+typedef struct {
+    RAMBlock *block;
+    /* Fixed buffer that covers the start of the block */
+    unsigned int first_buf;
+} MultiFDIOUringBlock;
+
+typedef struct {
+    uint8_t *host;
+    size_t len;
+    unsigned int buf_index;
+} MultiFDIOUringRead;
+
+typedef struct {
+    struct io_uring ring;
+    /* Whether guest memory is registered with the ring */
+    bool registered;
+    MultiFDIOUringBlock *blocks;
+    unsigned int nblocks;
+    /* One read per run of adjacent pages of a packet */
+    MultiFDIOUringRead *reads;
+} MultiFDIOUring;
+
+int multifd_recv_io_uring_setup(MultiFDRecvParams *p, Error **errp)
+{
+    MultiFDIOUring *u = g_new0(MultiFDIOUring, 1);
+    int ret;
+
+    ret = io_uring_queue_init(p->page_count, &u->ring, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "multifd %u: failed to set up io_uring",
+                         p->id);
+        g_free(u);
+        return -1;
+    }
+
+    u->reads = g_new0(MultiFDIOUringRead, p->page_count);
+    p->io_uring_data = u;
+
+    return 0;
+}
+
+void multifd_recv_io_uring_cleanup(MultiFDRecvParams *p)
+{
+    MultiFDIOUring *u = p->io_uring_data;
+
+    if (!u) {
+        return;
+    }
+
+    /* This drops the registered buffers as well */
+    io_uring_queue_exit(&u->ring);
+    if (u->registered) {
+        ram_block_discard_disable(false);
+    }
+
+    g_free(u->blocks);
+    g_free(u->reads);
+    g_free(u);
+    p->io_uring_data = NULL;
+}
+
+/*
+ * Register all of guest memory with the ring.  This pins it, so it is
+ * done by the channel thread when the first pages arrive rather than
+ * when the channel is set up.
+ */
+static bool multifd_io_uring_register(MultiFDRecvParams *p, MultiFDIOUring *u,
+                                      Error **errp)
+{
+    g_autofree struct iovec *iov = NULL;
+    unsigned int niov = 0, nblocks = 0;
+    uint64_t bytes = 0;
+    RAMBlock *block;
+    int ret;
+
+    /*
+     * The ring keeps referencing the pages it pinned, so a discarded
+     * page would silently stop being the one that is read into.
+     */
+    if (ram_block_discard_disable(true)) {
+        error_setg(errp, "multifd %u: io_uring receive cannot be used while "
+                   "a device relies on discarding guest RAM", p->id);
+        return false;
+    }
+
+    RCU_READ_LOCK_GUARD();
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        niov += DIV_ROUND_UP(block->max_length, MULTIFD_IO_URING_BUF_SIZE);
+        nblocks++;
+    }
+
+    iov = g_new(struct iovec, niov);
+    u->blocks = g_new(MultiFDIOUringBlock, nblocks);
+    niov = 0;
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        MultiFDIOUringBlock *b = &u->blocks[u->nblocks++];
+
+        b->block = block;
+        b->first_buf = niov;
+        for (ram_addr_t offset = 0; offset < block->max_length;
+             offset += MULTIFD_IO_URING_BUF_SIZE) {
+            iov[niov].iov_base = block->host + offset;
+            iov[niov].iov_len = MIN(block->max_length - offset,
+                                    MULTIFD_IO_URING_BUF_SIZE);
+            niov++;
+        }
+        bytes += block->max_length;
+    }
+
+    ret = io_uring_register_buffers(&u->ring, iov, niov);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "multifd %u: failed to register guest "
+                         "memory with io_uring", p->id);
+        ram_block_discard_disable(false);
+        return false;
+    }
+
+    u->registered = true;
+    trace_multifd_recv_io_uring_register(p->id, niov, bytes);
+
+    return true;
+}
+
+/*
+ * Read the normal pages of the packet received on @p into guest memory.
+ *
+ * Returns 0 for success or -1 for error
+ */
+int multifd_recv_io_uring_pages(MultiFDRecvParams *p, Error **errp)
+{
+    MultiFDIOUring *u = p->io_uring_data;
+    QIOChannelSocket *sioc;
+    unsigned int first_buf = 0, nreads = 0, next = 0;
+    bool found = false;
+    int ret = 0;
+
+    sioc = (QIOChannelSocket *)object_dynamic_cast(OBJECT(p->c),
+                                                   TYPE_QIO_CHANNEL_SOCKET);
+    if (!sioc) {
+        error_setg(errp, "multifd %u: io_uring receive needs a socket "
+                   "migration channel", p->id);
+        return -1;
+    }
+
+    if (!u->registered && !multifd_io_uring_register(p, u, errp)) {
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < u->nblocks; i++) {
+        if (u->blocks[i].block == p->block) {
+            first_buf = u->blocks[i].first_buf;
+            found = true;
+            break;
+        }
+    }
+    if (!found) {
+        error_setg(errp, "multifd %u: ramblock %s is not registered with "
+                   "io_uring", p->id, p->block->idstr);
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < p->normal_num; i++) {
+        ram_addr_t offset = p->normal[i];
+        unsigned int buf_index = first_buf +
+                                 offset / MULTIFD_IO_URING_BUF_SIZE;
+        MultiFDIOUringRead *r = nreads ? &u->reads[nreads - 1] : NULL;
+
+        ramblock_recv_bitmap_set_offset(p->block, offset);
+
+        if (r && r->buf_index == buf_index &&
+            r->host + r->len == p->host + offset) {
+            r->len += p->page_size;
+            continue;
+        }
+
+        r = &u->reads[nreads++];
+        r->host = p->host + offset;
+        r->len = p->page_size;
+        r->buf_index = buf_index;
+    }
+
+    /*
+     * The chain is cut at the first short read, which is usual on a
+     * socket, and the remainder is submitted again.
+     */
+    while (!ret && next < nreads) {
+        unsigned int queued = 0;
+
+        for (unsigned int i = next; i < nreads; i++) {
+            MultiFDIOUringRead *r = &u->reads[i];
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+
+            /* The ring has an entry for each page of a packet */
+            assert(sqe);
+            io_uring_prep_read_fixed(sqe, sioc->fd, r->host, r->len, 0,
+                                     r->buf_index);
+            io_uring_sqe_set_data(sqe, r);
+            if (i + 1 < nreads) {
+                sqe->flags |= IOSQE_IO_LINK;
+            }
+            queued++;
+        }
+
+        ret = io_uring_submit(&u->ring);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "multifd %u: io_uring submission "
+                             "failed", p->id);
+            return -1;
+        }
+        ret = 0;
+
+        while (queued) {
+            struct io_uring_cqe *cqe;
+            MultiFDIOUringRead *r;
+            int res;
+
+            res = io_uring_wait_cqe(&u->ring, &cqe);
+            if (res == -EINTR) {
+                continue;
+            } else if (res < 0) {
+                error_setg_errno(errp, -res, "multifd %u: failed to wait "
+                                 "for io_uring completion", p->id);
+                return -1;
+            }
+
+            r = io_uring_cqe_get_data(cqe);
+            res = cqe->res;
+            io_uring_cqe_seen(&u->ring, cqe);
+            queued--;
+
+            if (res > 0) {
+                r->host += res;
+                r->len -= res;
+            } else if (res == 0) {
+                if (!ret) {
+                    error_setg(errp, "multifd %u: unexpected end of stream",
+                               p->id);
+                    ret = -1;
+                }
+            } else if (res != -ECANCELED && res != -EINTR && res != -EAGAIN) {
+                if (!ret) {
+                    error_setg_errno(errp, -res, "multifd %u: failed to "
+                                     "read pages", p->id);
+                    ret = -1;
+                }
+            }
+        }
+
+        while (next < nreads && !u->reads[next].len) {
+            next++;
+        }
+    }
+
+    return ret;
+}
@@ -20,7 +20,9 @@
 
 static bool multifd_zero_page_enabled(void)
 {
-    return migrate_zero_page_detection() == ZERO_PAGE_DETECTION_MULTIFD;
+    /* Incremental snapshots have to save pages that became zero */
+    return migrate_zero_page_detection() == ZERO_PAGE_DETECTION_MULTIFD &&
+           !ram_mapped_ram_delta();
 }
 
 static void swap_page_offset(ram_addr_t *pages_offset, int a, int b)
@@ -13,6 +13,7 @@
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
 #include "qemu/rcu.h"
+#include "qemu/timer.h"
 #include "exec/target_page.h"
 #include "sysemu/sysemu.h"
 #include "exec/ramblock.h"
@@ -20,6 +21,7 @@
 #include "qapi/error.h"
 #include "file.h"
 #include "migration.h"
+#include "migration/misc.h"
 #include "migration-stats.h"
 #include "socket.h"
 #include "tls.h"
@@ -71,6 +73,11 @@ struct {
     QemuSemaphore channels_created;
     /* send channels ready */
     QemuSemaphore channels_ready;
+    /*
+     * Serializes handing jobs to the channels between the migration
+     * thread (pages) and the device state save threads.
+     */
+    QemuMutex queue_job_mutex;
     /*
      * Have we already run terminate threads.  There is a race when it
      * happens that we got one error while we are exiting.
@@ -138,8 +145,11 @@ static int nocomp_send_setup(MultiFDSendParams *p, Error **errp)
     }
 
     if (multifd_use_packets()) {
-        /* We need one extra place for the packet header */
-        p->iov = g_new0(struct iovec, p->page_count + 1);
+        /*
+         * We need one extra place for the packet header, and one for
+         * the dedup slots.
+         */
+        p->iov = g_new0(struct iovec, p->page_count + 2);
     } else {
         p->iov = g_new0(struct iovec, p->page_count);
     }
@@ -193,6 +203,10 @@ static int nocomp_send_prepare(MultiFDSendParams *p, Error **errp)
 
     multifd_send_zero_page_detect(p);
 
+    if (p->dedup_data) {
+        multifd_send_dedup_detect(p);
+    }
+
     if (!multifd_use_packets()) {
         multifd_send_prepare_iovs(p);
         multifd_set_file_bitmap(p);
@@ -208,7 +222,11 @@ static int nocomp_send_prepare(MultiFDSendParams *p, Error **errp)
         multifd_send_prepare_header(p);
     }
 
-    multifd_send_prepare_iovs(p);
+    if (p->dedup_data) {
+        multifd_send_dedup_prepare_iovs(p);
+    } else {
+        multifd_send_prepare_iovs(p);
+    }
     p->flags |= MULTIFD_FLAG_NOCOMP;
 
     multifd_send_fill_packet(p);
@@ -237,7 +255,14 @@ static int nocomp_send_prepare(MultiFDSendParams *p, Error **errp)
  */
 static int nocomp_recv_setup(MultiFDRecvParams *p, Error **errp)
 {
-    p->iov = g_new0(struct iovec, p->page_count);
+    /* One extra place for the dedup slots */
+    p->iov = g_new0(struct iovec, p->page_count + 1);
+
+#ifdef CONFIG_LINUX_IO_URING
+    if (migrate_io_uring_recv()) {
+        return multifd_recv_io_uring_setup(p, errp);
+    }
+#endif
     return 0;
 }
 
@@ -250,6 +275,9 @@ static int nocomp_recv_setup(MultiFDRecvParams *p, Error **errp)
  */
 static void nocomp_recv_cleanup(MultiFDRecvParams *p)
 {
+#ifdef CONFIG_LINUX_IO_URING
+    multifd_recv_io_uring_cleanup(p);
+#endif
     g_free(p->iov);
     p->iov = NULL;
 }
@@ -267,6 +295,7 @@ static void nocomp_recv_cleanup(MultiFDRecvParams *p)
 static int nocomp_recv(MultiFDRecvParams *p, Error **errp)
 {
     uint32_t flags;
+    int iovs_num;
 
     if (!multifd_use_packets()) {
         return multifd_file_recv_data(p, errp);
@@ -282,16 +311,39 @@ static int nocomp_recv(MultiFDRecvParams *p, Error **errp)
 
     multifd_recv_zero_page_process(p);
 
-    if (!p->normal_num) {
+    if (!p->normal_num && !p->dedup_num) {
         return 0;
     }
 
-    for (int i = 0; i < p->normal_num; i++) {
-        p->iov[i].iov_base = p->host + p->normal[i];
-        p->iov[i].iov_len = p->page_size;
-        ramblock_recv_bitmap_set_offset(p->block, p->normal[i]);
+    iovs_num = 0;
+#ifdef CONFIG_LINUX_IO_URING
+    if (p->io_uring_data) {
+        if (multifd_recv_io_uring_pages(p, errp)) {
+            return -1;
+        }
+    } else
+#endif
+    {
+        for (int i = 0; i < p->normal_num; i++) {
+            p->iov[i].iov_base = p->host + p->normal[i];
+            p->iov[i].iov_len = p->page_size;
+            ramblock_recv_bitmap_set_offset(p->block, p->normal[i]);
+        }
+        iovs_num = p->normal_num;
+    }
+
+    if (p->dedup_num) {
+        multifd_recv_dedup_prepare_iov(p, &p->iov[iovs_num++]);
+    }
+
+    if (iovs_num && qio_channel_readv_all(p->c, p->iov, iovs_num, errp)) {
+        return -1;
+    }
+
+    if (p->dedup_data) {
+        return multifd_recv_dedup_process(p, errp);
     }
-    return qio_channel_readv_all(p->c, p->iov, p->normal_num, errp);
+    return 0;
 }
 
 static MultiFDMethods multifd_nocomp_ops = {
@@ -322,6 +374,7 @@ static void multifd_pages_reset(MultiFDPages_t *pages)
      */
     pages->num = 0;
     pages->normal_num = 0;
+    pages->dedup_num = 0;
     pages->block = NULL;
 }
 
@@ -413,13 +466,14 @@ void multifd_send_fill_packet(MultiFDSendParams *p)
     MultiFDPacket_t *packet = p->packet;
     MultiFDPages_t *pages = p->pages;
     uint64_t packet_num;
-    uint32_t zero_num = pages->num - pages->normal_num;
+    uint32_t zero_num = pages->num - pages->normal_num - pages->dedup_num;
     int i;
 
-    packet->flags = cpu_to_be32(p->flags);
+    packet->hdr.flags = cpu_to_be32(p->flags);
     packet->pages_alloc = cpu_to_be32(p->pages->allocated);
     packet->normal_pages = cpu_to_be32(pages->normal_num);
     packet->zero_pages = cpu_to_be32(zero_num);
+    packet->dedup_pages = cpu_to_be32(pages->dedup_num);
     packet->next_packet_size = cpu_to_be32(p->next_packet_size);
 
     packet_num = qatomic_fetch_inc(&multifd_send_state->packet_num);
@@ -444,28 +498,55 @@ void multifd_send_fill_packet(MultiFDSendParams *p)
                        p->flags, p->next_packet_size);
 }
 
-static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
+static int multifd_recv_unfill_packet_header(MultiFDPacketHdr_t *hdr,
+                                            Error **errp)
 {
-    MultiFDPacket_t *packet = p->packet;
-    int i;
-
-    packet->magic = be32_to_cpu(packet->magic);
-    if (packet->magic != MULTIFD_MAGIC) {
+    hdr->magic = be32_to_cpu(hdr->magic);
+    if (hdr->magic != MULTIFD_MAGIC) {
         error_setg(errp, "multifd: received packet "
                    "magic %x and expected magic %x",
-                   packet->magic, MULTIFD_MAGIC);
+                   hdr->magic, MULTIFD_MAGIC);
         return -1;
     }
 
-    packet->version = be32_to_cpu(packet->version);
-    if (packet->version != MULTIFD_VERSION) {
+    hdr->version = be32_to_cpu(hdr->version);
+    if (hdr->version != MULTIFD_VERSION) {
         error_setg(errp, "multifd: received packet "
                    "version %u and expected version %u",
-                   packet->version, MULTIFD_VERSION);
+                   hdr->version, MULTIFD_VERSION);
+        return -1;
+    }
+
+    hdr->flags = be32_to_cpu(hdr->flags);
+
+    return 0;
+}
+
+static int multifd_recv_unfill_packet_device_state(MultiFDRecvParams *p,
+                                                   Error **errp)
+{
+    MultiFDPacketDeviceState_t *packet = p->packet_device_state;
+
+    packet->instance_id = be32_to_cpu(packet->instance_id);
+    p->next_packet_size = be32_to_cpu(packet->next_packet_size);
+    if (p->next_packet_size > MULTIFD_DEVICE_STATE_MAX_CHUNK) {
+        error_setg(errp, "multifd: received device state packet "
+                   "with size %u and maximum size %u",
+                   p->next_packet_size, MULTIFD_DEVICE_STATE_MAX_CHUNK);
         return -1;
     }
 
-    p->flags = be32_to_cpu(packet->flags);
+    /* make sure that idstr is 0 terminated */
+    packet->idstr[sizeof(packet->idstr) - 1] = 0;
+    p->packets_recved++;
+
+    return 0;
+}
+
+static int multifd_recv_unfill_packet_ram(MultiFDRecvParams *p, Error **errp)
+{
+    MultiFDPacket_t *packet = p->packet;
+    int i;
 
     packet->pages_alloc = be32_to_cpu(packet->pages_alloc);
     /*
@@ -495,6 +576,20 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
+    p->dedup_num = be32_to_cpu(packet->dedup_pages);
+    if (p->dedup_num > packet->pages_alloc - p->normal_num - p->zero_num) {
+        error_setg(errp, "multifd: received packet with %u dedup pages "
+                   "and expected maximum dedup pages are %u",
+                   p->dedup_num,
+                   packet->pages_alloc - p->normal_num - p->zero_num);
+        return -1;
+    }
+    if (p->dedup_num && !p->dedup_data) {
+        error_setg(errp, "multifd: received dedup pages but "
+                   "multifd-dedup is not enabled");
+        return -1;
+    }
+
     p->next_packet_size = be32_to_cpu(packet->next_packet_size);
     p->packet_num = be64_to_cpu(packet->packet_num);
     p->packets_recved++;
@@ -504,7 +599,7 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
     trace_multifd_recv(p->id, p->packet_num, p->normal_num, p->zero_num,
                        p->flags, p->next_packet_size);
 
-    if (p->normal_num == 0 && p->zero_num == 0) {
+    if (p->normal_num == 0 && p->zero_num == 0 && p->dedup_num == 0) {
         return 0;
     }
 
@@ -542,6 +637,19 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         p->zero[i] = offset;
     }
 
+    for (i = 0; i < p->dedup_num; i++) {
+        uint64_t offset = be64_to_cpu(packet->offset[p->normal_num +
+                                                     p->zero_num + i]);
+
+        if (offset > (p->block->used_length - p->page_size)) {
+            error_setg(errp, "multifd: offset too long %" PRIu64
+                       " (max " RAM_ADDR_FMT ")",
+                       offset, p->block->used_length);
+            return -1;
+        }
+        p->dedup[i] = offset;
+    }
+
     return 0;
 }
 
@@ -568,33 +676,18 @@ static void multifd_send_kick_main(MultiFDSendParams *p)
 }
 
 /*
- * How we use multifd_send_state->pages and channel->pages?
- *
- * We create a pages for each channel, and a main one.  Each time that
- * we need to send a batch of pages we interchange the ones between
- * multifd_send_state and the channel that is sending it.  There are
- * two reasons for that:
- *    - to not have to do so many mallocs during migration
- *    - to make easier to know what to free at the end of migration
- *
- * This way we always know who is the owner of each "pages" struct,
- * and we don't need any locking.  It belongs to the migration thread
- * or to the channel thread.  Switching is safe because the migration
- * thread is using the channel mutex when changing it, and the channel
- * have to had finish with its own, otherwise pending_job can't be
- * false.
- *
- * Returns true if succeed, false otherwise.
+ * Wait until a channel is idle and return it, or NULL if multifd is
+ * exiting.  Called with queue_job_mutex held, which the caller keeps
+ * until it has handed the channel its job.
  */
-static bool multifd_send_pages(void)
+static MultiFDSendParams *multifd_send_get_idle_channel(void)
 {
     int i;
     static int next_channel;
     MultiFDSendParams *p = NULL; /* make happy gcc */
-    MultiFDPages_t *pages = multifd_send_state->pages;
 
     if (multifd_send_should_exit()) {
-        return false;
+        return NULL;
     }
 
     /* We wait here, until at least one channel is ready */
@@ -608,7 +701,7 @@ static bool multifd_send_pages(void)
     next_channel %= migrate_multifd_channels();
     for (i = next_channel;; i = (i + 1) % migrate_multifd_channels()) {
         if (multifd_send_should_exit()) {
-            return false;
+            return NULL;
         }
         p = &multifd_send_state->params[i];
         /*
@@ -626,7 +719,43 @@ static bool multifd_send_pages(void)
      * qatomic_store_release() in multifd_send_thread().
      */
     smp_mb_acquire();
+
+    return p;
+}
+
+/*
+ * How we use multifd_send_state->pages and channel->pages?
+ *
+ * We create a pages for each channel, and a main one.  Each time that
+ * we need to send a batch of pages we interchange the ones between
+ * multifd_send_state and the channel that is sending it.  There are
+ * two reasons for that:
+ *    - to not have to do so many mallocs during migration
+ *    - to make easier to know what to free at the end of migration
+ *
+ * This way we always know who is the owner of each "pages" struct,
+ * and we don't need any locking.  It belongs to the migration thread
+ * or to the channel thread.  Switching is safe because the migration
+ * thread is using the channel mutex when changing it, and the channel
+ * have to had finish with its own, otherwise pending_job can't be
+ * false.
+ *
+ * Returns true if succeed, false otherwise.
+ */
+static bool multifd_send_pages(void)
+{
+    MultiFDSendParams *p;
+    MultiFDPages_t *pages = multifd_send_state->pages;
+
+    QEMU_LOCK_GUARD(&multifd_send_state->queue_job_mutex);
+
+    p = multifd_send_get_idle_channel();
+    if (!p) {
+        return false;
+    }
+
     assert(!p->pages->num);
+    assert(!p->device_state);
     multifd_send_state->pages = p->pages;
     p->pages = pages;
     /*
@@ -689,6 +818,53 @@ retry:
     return true;
 }
 
+/*
+ * Queue @len bytes of device state at @data for the section identified
+ * by @idstr and @instance_id.  The data is copied, and sent by the first
+ * idle channel as a packet of its own.  This can be called concurrently
+ * from the device state save threads and the migration thread.
+ *
+ * Returns true if queued successfully, false otherwise.
+ */
+bool multifd_queue_device_state(char *idstr, uint32_t instance_id,
+                                char *data, size_t len)
+{
+    MultiFDDeviceState_t *device_state;
+    MultiFDSendParams *p;
+
+    assert(multifd_device_state_supported());
+    assert(strlen(idstr) < sizeof_field(MultiFDPacketDeviceState_t, idstr));
+    assert(len <= MULTIFD_DEVICE_STATE_MAX_CHUNK);
+
+    device_state = g_new0(MultiFDDeviceState_t, 1);
+    device_state->idstr = g_strdup(idstr);
+    device_state->instance_id = instance_id;
+    device_state->buf = g_memdup2(data, len);
+    device_state->buf_len = len;
+
+    QEMU_LOCK_GUARD(&multifd_send_state->queue_job_mutex);
+
+    p = multifd_send_get_idle_channel();
+    if (!p) {
+        g_free(device_state->idstr);
+        g_free(device_state->buf);
+        g_free(device_state);
+        return false;
+    }
+
+    assert(!p->device_state);
+    p->device_state = device_state;
+    /*
+     * Making sure p->device_state is setup before marking
+     * pending_job=true. Pairs with the qatomic_load_acquire() in
+     * multifd_send_thread().
+     */
+    qatomic_store_release(&p->pending_job, true);
+    qemu_sem_post(&p->sem);
+
+    return true;
+}
+
 /* Multifd send side hit an error; remember it and prepare to quit */
 static void multifd_send_set_error(Error *err)
 {
@@ -795,6 +971,15 @@ static bool multifd_send_cleanup_channel(MultiFDSendParams *p, Error **errp)
     p->packet_len = 0;
     g_free(p->packet);
     p->packet = NULL;
+    g_free(p->packet_device_state);
+    p->packet_device_state = NULL;
+    multifd_send_dedup_cleanup(p);
+    if (p->device_state) {
+        g_free(p->device_state->idstr);
+        g_free(p->device_state->buf);
+        g_free(p->device_state);
+        p->device_state = NULL;
+    }
     multifd_send_state->ops->send_cleanup(p, errp);
 
     return *errp == NULL;
@@ -806,6 +991,7 @@ static void multifd_send_cleanup_state(void)
     socket_cleanup_outgoing_migration();
     qemu_sem_destroy(&multifd_send_state->channels_created);
     qemu_sem_destroy(&multifd_send_state->channels_ready);
+    qemu_mutex_destroy(&multifd_send_state->queue_job_mutex);
     g_free(multifd_send_state->params);
     multifd_send_state->params = NULL;
     multifd_pages_clear(multifd_send_state->pages);
@@ -915,6 +1101,7 @@ static void *multifd_send_thread(void *opaque)
     Error *local_err = NULL;
     int ret = 0;
     bool use_packets = multifd_use_packets();
+    bool pending_job;
 
     thread = migration_threads_add(p->name, qemu_get_thread_id());
 
@@ -937,11 +1124,26 @@ static void *multifd_send_thread(void *opaque)
         }
 
         /*
-         * Read pending_job flag before p->pages.  Pairs with the
-         * qatomic_store_release() in multifd_send_pages().
+         * Read pending_job flag before p->pages and p->device_state.
+         * Pairs with the qatomic_store_release() in multifd_send_pages()
+         * and multifd_queue_device_state().
          */
-        if (qatomic_load_acquire(&p->pending_job)) {
+        pending_job = qatomic_load_acquire(&p->pending_job);
+        if (pending_job && p->device_state) {
+            ret = multifd_send_device_state(p, &local_err);
+            if (ret != 0) {
+                break;
+            }
+
+            /*
+             * Making sure p->device_state is cleared before saying
+             * "we're free".  Pairs with the smp_mb_acquire() in
+             * multifd_send_get_idle_channel().
+             */
+            qatomic_store_release(&p->pending_job, false);
+        } else if (pending_job) {
             MultiFDPages_t *pages = p->pages;
+            int64_t write_start;
 
             p->iovs_num = 0;
             assert(pages->num);
@@ -951,6 +1153,7 @@ static void *multifd_send_thread(void *opaque)
                 break;
             }
 
+            write_start = get_clock();
             if (migrate_mapped_ram()) {
                 ret = file_write_ramblock_iov(p->c, p->iov, p->iovs_num,
                                               p->pages->block, &local_err);
@@ -963,11 +1166,14 @@ static void *multifd_send_thread(void *opaque)
             if (ret != 0) {
                 break;
             }
+            p->write_ns = get_clock() - write_start;
 
             stat64_add(&mig_stats.multifd_bytes,
                        p->next_packet_size + p->packet_len);
             stat64_add(&mig_stats.normal_pages, pages->normal_num);
-            stat64_add(&mig_stats.zero_pages, pages->num - pages->normal_num);
+            stat64_add(&mig_stats.zero_pages,
+                       pages->num - pages->normal_num - pages->dedup_num);
+            stat64_add(&mig_stats.dedup_pages, pages->dedup_num);
 
             multifd_pages_reset(p->pages);
             p->next_packet_size = 0;
@@ -975,7 +1181,7 @@ static void *multifd_send_thread(void *opaque)
             /*
              * Making sure p->pages is published before saying "we're
              * free".  Pairs with the smp_mb_acquire() in
-             * multifd_send_pages().
+             * multifd_send_get_idle_channel().
              */
             qatomic_store_release(&p->pending_job, false);
         } else {
@@ -1172,6 +1378,7 @@ bool multifd_send_setup(void)
     multifd_send_state->pages = multifd_pages_init(page_count);
     qemu_sem_init(&multifd_send_state->channels_created, 0);
     qemu_sem_init(&multifd_send_state->channels_ready, 0);
+    qemu_mutex_init(&multifd_send_state->queue_job_mutex);
     qatomic_set(&multifd_send_state->exiting, 0);
     multifd_send_state->ops = multifd_ops[migrate_multifd_compression()];
 
@@ -1187,14 +1394,24 @@ bool multifd_send_setup(void)
             p->packet_len = sizeof(MultiFDPacket_t)
                           + sizeof(uint64_t) * page_count;
             p->packet = g_malloc0(p->packet_len);
-            p->packet->magic = cpu_to_be32(MULTIFD_MAGIC);
-            p->packet->version = cpu_to_be32(MULTIFD_VERSION);
+            p->packet->hdr.magic = cpu_to_be32(MULTIFD_MAGIC);
+            p->packet->hdr.version = cpu_to_be32(MULTIFD_VERSION);
+
+            p->packet_device_state =
+                g_new0(MultiFDPacketDeviceState_t, 1);
+            p->packet_device_state->hdr.magic = cpu_to_be32(MULTIFD_MAGIC);
+            p->packet_device_state->hdr.version =
+                cpu_to_be32(MULTIFD_VERSION);
         }
         p->name = g_strdup_printf("mig/src/send_%d", i);
         p->page_size = qemu_target_page_size();
         p->page_count = page_count;
         p->write_flags = 0;
 
+        if (migrate_multifd_dedup()) {
+            multifd_send_dedup_setup(p);
+        }
+
         if (!multifd_new_send_channel_create(p, &local_err)) {
             return false;
         }
@@ -1358,10 +1575,15 @@ static void multifd_recv_cleanup_channel(MultiFDRecvParams *p)
     p->packet_len = 0;
     g_free(p->packet);
     p->packet = NULL;
+    g_free(p->packet_device_state);
+    p->packet_device_state = NULL;
     g_free(p->normal);
     p->normal = NULL;
     g_free(p->zero);
     p->zero = NULL;
+    g_free(p->dedup);
+    p->dedup = NULL;
+    multifd_recv_dedup_cleanup(p);
     multifd_recv_state->ops->recv_cleanup(p);
 }
 
@@ -1472,21 +1694,52 @@ static void *multifd_recv_thread(void *opaque)
     while (true) {
         uint32_t flags = 0;
         bool has_data = false;
+        bool is_device_state = false;
         p->normal_num = 0;
 
         if (use_packets) {
+            MultiFDPacketHdr_t hdr;
+            void *pkt_buf;
+            size_t pkt_len;
+
             if (multifd_recv_should_exit()) {
                 break;
             }
 
-            ret = qio_channel_read_all_eof(p->c, (void *)p->packet,
-                                           p->packet_len, &local_err);
+            ret = qio_channel_read_all_eof(p->c, (void *)&hdr,
+                                           sizeof(hdr), &local_err);
             if (ret == 0 || ret == -1) {   /* 0: EOF  -1: Error */
                 break;
             }
 
+            ret = multifd_recv_unfill_packet_header(&hdr, &local_err);
+            if (ret) {
+                break;
+            }
+
+            is_device_state = hdr.flags & MULTIFD_FLAG_DEVICE_STATE;
+            if (is_device_state) {
+                pkt_buf = (char *)p->packet_device_state + sizeof(hdr);
+                pkt_len = sizeof(*p->packet_device_state) - sizeof(hdr);
+            } else {
+                pkt_buf = (char *)p->packet + sizeof(hdr);
+                pkt_len = p->packet_len - sizeof(hdr);
+            }
+
+            ret = qio_channel_read_all(p->c, pkt_buf, pkt_len, &local_err);
+            if (ret) {
+                break;
+            }
+
             qemu_mutex_lock(&p->mutex);
-            ret = multifd_recv_unfill_packet(p, &local_err);
+            p->flags = hdr.flags;
+            if (is_device_state) {
+                ret = multifd_recv_unfill_packet_device_state(p, &local_err);
+                has_data = !!p->next_packet_size;
+            } else {
+                ret = multifd_recv_unfill_packet_ram(p, &local_err);
+                has_data = p->normal_num || p->zero_num || p->dedup_num;
+            }
             if (ret) {
                 qemu_mutex_unlock(&p->mutex);
                 break;
@@ -1495,7 +1748,6 @@ static void *multifd_recv_thread(void *opaque)
             flags = p->flags;
             /* recv methods don't know how to handle the SYNC flag */
             p->flags &= ~MULTIFD_FLAG_SYNC;
-            has_data = p->normal_num || p->zero_num;
             qemu_mutex_unlock(&p->mutex);
         } else {
             /*
@@ -1524,7 +1776,11 @@ static void *multifd_recv_thread(void *opaque)
         }
 
         if (has_data) {
-            ret = multifd_recv_state->ops->recv(p, &local_err);
+            if (is_device_state) {
+                ret = multifd_recv_device_state(p, &local_err);
+            } else {
+                ret = multifd_recv_state->ops->recv(p, &local_err);
+            }
             if (ret != 0) {
                 break;
             }
@@ -1603,12 +1859,18 @@ int multifd_recv_setup(Error **errp)
             p->packet_len = sizeof(MultiFDPacket_t)
                 + sizeof(uint64_t) * page_count;
             p->packet = g_malloc0(p->packet_len);
+            p->packet_device_state = g_new0(MultiFDPacketDeviceState_t, 1);
         }
         p->name = g_strdup_printf("mig/dst/recv_%d", i);
         p->normal = g_new0(ram_addr_t, page_count);
         p->zero = g_new0(ram_addr_t, page_count);
+        p->dedup = g_new0(ram_addr_t, page_count);
         p->page_count = page_count;
         p->page_size = qemu_target_page_size();
+
+        if (migrate_multifd_dedup()) {
+            multifd_recv_dedup_setup(p);
+        }
     }
 
     for (i = 0; i < thread_count; i++) {
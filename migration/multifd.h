@@ -14,6 +14,7 @@
 #define QEMU_MIGRATION_MULTIFD_H
 
 #include "ram.h"
+#include "migration/register.h"
 
 typedef struct MultiFDRecvData MultiFDRecvData;
 
@@ -31,6 +32,12 @@ bool multifd_queue_page(RAMBlock *block, ram_addr_t offset);
 bool multifd_recv(void);
 MultiFDRecvData *multifd_get_recv_data(void);
 
+void multifd_spawn_device_state_save_thread(
+    SaveLiveCompletePrecopyThreadHandler hdlr,
+    char *idstr, uint32_t instance_id, void *opaque);
+void multifd_abort_device_state_save_threads(void);
+bool multifd_join_device_state_save_threads(void);
+
 /* Multifd Compression flags */
 #define MULTIFD_FLAG_SYNC (1 << 0)
 
@@ -43,6 +50,9 @@ MultiFDRecvData *multifd_get_recv_data(void);
 #define MULTIFD_FLAG_QPL (4 << 1)
 #define MULTIFD_FLAG_UADK (8 << 1)
 
+/* The packet carries device state rather than RAM pages */
+#define MULTIFD_FLAG_DEVICE_STATE (1 << 5)
+
 /* This value needs to be a multiple of qemu_target_page_size() */
 #define MULTIFD_PACKET_SIZE (512 * 1024)
 
@@ -50,6 +60,10 @@ typedef struct {
     uint32_t magic;
     uint32_t version;
     uint32_t flags;
+} __attribute__((packed)) MultiFDPacketHdr_t;
+
+typedef struct {
+    MultiFDPacketHdr_t hdr;
     /* maximum number of allocated pages */
     uint32_t pages_alloc;
     /* non zero pages */
@@ -59,22 +73,37 @@ typedef struct {
     uint64_t packet_num;
     /* zero pages */
     uint32_t zero_pages;
-    uint32_t unused32[1];    /* Reserved for future use */
+    /* pages sent as a reference into the dedup cache */
+    uint32_t dedup_pages;
     uint64_t unused64[3];    /* Reserved for future use */
     char ramblock[256];
     /*
      * This array contains the pointers to:
      *  - normal pages (initial normal_pages entries)
      *  - zero pages (following zero_pages entries)
+     *  - dedup pages (following dedup_pages entries)
+     *
+     * The data of the packet is the normal pages, followed by the
+     * dedup cache slot of each dedup page as a big endian uint32_t.
      */
     uint64_t offset[];
 } __attribute__((packed)) MultiFDPacket_t;
 
+typedef struct {
+    MultiFDPacketHdr_t hdr;
+    char idstr[256];
+    uint32_t instance_id;
+    /* size of the next packet that contains the actual data */
+    uint32_t next_packet_size;
+} __attribute__((packed)) MultiFDPacketDeviceState_t;
+
 typedef struct {
     /* number of used pages */
     uint32_t num;
     /* number of normal pages */
     uint32_t normal_num;
+    /* number of dedup pages, at the end of offset[] */
+    uint32_t dedup_num;
     /* number of allocated pages */
     uint32_t allocated;
     /* offset of each page */
@@ -82,6 +111,14 @@ typedef struct {
     RAMBlock *block;
 } MultiFDPages_t;
 
+/* A chunk of device state queued with multifd_queue_device_state() */
+typedef struct {
+    char *idstr;
+    uint32_t instance_id;
+    char *buf;
+    size_t buf_len;
+} MultiFDDeviceState_t;
+
 struct MultiFDRecvData {
     void *opaque;
     size_t size;
@@ -137,11 +174,18 @@ typedef struct {
      * pending_job != 0 -> multifd_channel can use it.
      */
     MultiFDPages_t *pages;
+    /*
+     * Device state to send instead of 'pages'.  Owned the same way as
+     * 'pages', and NULL when the pending job is a batch of pages.
+     */
+    MultiFDDeviceState_t *device_state;
 
     /* thread local variables. No locking required */
 
     /* pointer to the packet */
     MultiFDPacket_t *packet;
+    /* pointer to the device state packet */
+    MultiFDPacketDeviceState_t *packet_device_state;
     /* size of the next packet that contains pages */
     uint32_t next_packet_size;
     /* packets sent through this channel */
@@ -156,6 +200,10 @@ typedef struct {
     uint32_t iovs_num;
     /* used for compression methods */
     void *compress_data;
+    /* used for deduplication */
+    void *dedup_data;
+    /* time it took to write the last packet, in ns */
+    uint64_t write_ns;
 }  MultiFDSendParams;
 
 typedef struct {
@@ -198,7 +246,9 @@ typedef struct {
 
     /* pointer to the packet */
     MultiFDPacket_t *packet;
-    /* size of the next packet that contains pages */
+    /* pointer to the device state packet */
+    MultiFDPacketDeviceState_t *packet_device_state;
+    /* size of the next packet that contains pages or device state */
     uint32_t next_packet_size;
     /* packets received through this channel */
     uint64_t packets_recved;
@@ -220,8 +270,16 @@ typedef struct {
     ram_addr_t *zero;
     /* num of zero pages */
     uint32_t zero_num;
+    /* Pages that are copies of a page in the dedup cache */
+    ram_addr_t *dedup;
+    /* num of dedup pages */
+    uint32_t dedup_num;
     /* used for de-compression methods */
     void *compress_data;
+    /* used for deduplication */
+    void *dedup_data;
+    /* used for receiving pages with io_uring */
+    void *io_uring_data;
 } MultiFDRecvParams;
 
 typedef struct {
@@ -244,6 +302,22 @@ void multifd_send_fill_packet(MultiFDSendParams *p);
 bool multifd_send_prepare_common(MultiFDSendParams *p);
 void multifd_send_zero_page_detect(MultiFDSendParams *p);
 void multifd_recv_zero_page_process(MultiFDRecvParams *p);
+void multifd_send_dedup_setup(MultiFDSendParams *p);
+void multifd_send_dedup_cleanup(MultiFDSendParams *p);
+void multifd_send_dedup_detect(MultiFDSendParams *p);
+void multifd_send_dedup_prepare_iovs(MultiFDSendParams *p);
+void multifd_recv_dedup_setup(MultiFDRecvParams *p);
+void multifd_recv_dedup_cleanup(MultiFDRecvParams *p);
+void multifd_recv_dedup_prepare_iov(MultiFDRecvParams *p, struct iovec *iov);
+int multifd_recv_dedup_process(MultiFDRecvParams *p, Error **errp);
+int multifd_send_device_state(MultiFDSendParams *p, Error **errp);
+void multifd_adaptive_populate_info(MigrationInfo *info);
+int multifd_recv_device_state(MultiFDRecvParams *p, Error **errp);
+#ifdef CONFIG_LINUX_IO_URING
+int multifd_recv_io_uring_setup(MultiFDRecvParams *p, Error **errp);
+void multifd_recv_io_uring_cleanup(MultiFDRecvParams *p);
+int multifd_recv_io_uring_pages(MultiFDRecvParams *p, Error **errp);
+#endif
 
 static inline void multifd_send_prepare_header(MultiFDSendParams *p)
 {
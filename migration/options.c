@@ -78,6 +78,11 @@
 #define DEFAULT_MIGRATE_VCPU_DIRTY_LIMIT_PERIOD     1000    /* milliseconds */
 #define DEFAULT_MIGRATE_VCPU_DIRTY_LIMIT            1       /* MB/s */
 
+/* Hot page tracking is disabled by default */
+#define DEFAULT_MIGRATE_HOT_PAGE_ROUNDS 0
+#define MIGRATE_HOT_PAGE_ROUNDS_MIN 2
+#define MIGRATE_HOT_PAGE_ROUNDS_MAX 8
+
 Property migration_properties[] = {
     DEFINE_PROP_BOOL("store-global-state", MigrationState,
                      store_global_state, true),
@@ -89,8 +94,12 @@ Property migration_properties[] = {
                       multifd_flush_after_each_section, false),
     DEFINE_PROP_UINT8("x-clear-bitmap-shift", MigrationState,
                       clear_bitmap_shift, CLEAR_BITMAP_SHIFT_DEFAULT),
+    DEFINE_PROP_UINT8("x-dirty-sync-threads", MigrationState,
+                      dirty_sync_threads, 0),
     DEFINE_PROP_BOOL("x-preempt-pre-7-2", MigrationState,
                      preempt_pre_7_2, false),
+    DEFINE_PROP_BOOL("x-multifd-device-state", MigrationState,
+                     multifd_device_state, true),
 
     /* Migration parameters */
     DEFINE_PROP_UINT8("x-throttle-trigger-threshold", MigrationState,
@@ -162,6 +171,13 @@ Property migration_properties[] = {
     DEFINE_PROP_ZERO_PAGE_DETECTION("zero-page-detection", MigrationState,
                        parameters.zero_page_detection,
                        ZERO_PAGE_DETECTION_MULTIFD),
+    DEFINE_PROP_UINT8("x-hot-page-rounds", MigrationState,
+                      parameters.hot_page_rounds,
+                      DEFAULT_MIGRATE_HOT_PAGE_ROUNDS),
+    DEFINE_PROP_MAPPED_RAM_LOAD_METHOD("mapped-ram-load-method",
+                      MigrationState,
+                      parameters.mapped_ram_load_method,
+                      MAPPED_RAM_LOAD_METHOD_READ),
 
     /* Migration capabilities */
     DEFINE_PROP_MIG_CAP("x-xbzrle", MIGRATION_CAPABILITY_XBZRLE),
@@ -186,6 +202,14 @@ Property migration_properties[] = {
                         MIGRATION_CAPABILITY_SWITCHOVER_ACK),
     DEFINE_PROP_MIG_CAP("x-dirty-limit", MIGRATION_CAPABILITY_DIRTY_LIMIT),
     DEFINE_PROP_MIG_CAP("mapped-ram", MIGRATION_CAPABILITY_MAPPED_RAM),
+    DEFINE_PROP_MIG_CAP("x-multifd-dedup", MIGRATION_CAPABILITY_MULTIFD_DEDUP),
+    DEFINE_PROP_MIG_CAP("x-postcopy-prefetch",
+                        MIGRATION_CAPABILITY_POSTCOPY_PREFETCH),
+#ifdef CONFIG_LINUX_IO_URING
+    DEFINE_PROP_MIG_CAP("x-io-uring-recv", MIGRATION_CAPABILITY_IO_URING_RECV),
+#endif
+    DEFINE_PROP_MIG_CAP("x-mapped-ram-incremental",
+                        MIGRATION_CAPABILITY_MAPPED_RAM_INCREMENTAL),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -231,6 +255,13 @@ bool migrate_events(void)
     return s->capabilities[MIGRATION_CAPABILITY_EVENTS];
 }
 
+bool migrate_io_uring_recv(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_IO_URING_RECV];
+}
+
 bool migrate_mapped_ram(void)
 {
     MigrationState *s = migrate_get_current();
@@ -238,6 +269,13 @@ bool migrate_mapped_ram(void)
     return s->capabilities[MIGRATION_CAPABILITY_MAPPED_RAM];
 }
 
+bool migrate_mapped_ram_incremental(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_MAPPED_RAM_INCREMENTAL];
+}
+
 bool migrate_ignore_shared(void)
 {
     MigrationState *s = migrate_get_current();
@@ -259,6 +297,13 @@ bool migrate_multifd(void)
     return s->capabilities[MIGRATION_CAPABILITY_MULTIFD];
 }
 
+bool migrate_multifd_dedup(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_MULTIFD_DEDUP];
+}
+
 bool migrate_pause_before_switchover(void)
 {
     MigrationState *s = migrate_get_current();
@@ -280,6 +325,13 @@ bool migrate_postcopy_preempt(void)
     return s->capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT];
 }
 
+bool migrate_postcopy_prefetch(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREFETCH];
+}
+
 bool migrate_postcopy_ram(void)
 {
     MigrationState *s = migrate_get_current();
@@ -352,6 +404,13 @@ bool migrate_multifd_flush_after_each_section(void)
     return s->multifd_flush_after_each_section;
 }
 
+bool migrate_multifd_device_state(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->multifd_device_state;
+}
+
 bool migrate_postcopy(void)
 {
     return migrate_postcopy_ram() || migrate_dirty_bitmaps();
@@ -426,7 +485,8 @@ INITIALIZE_MIGRATE_CAPS_SET(check_caps_background_snapshot,
     MIGRATION_CAPABILITY_XBZRLE,
     MIGRATION_CAPABILITY_X_COLO,
     MIGRATION_CAPABILITY_VALIDATE_UUID,
-    MIGRATION_CAPABILITY_ZERO_COPY_SEND);
+    MIGRATION_CAPABILITY_ZERO_COPY_SEND,
+    MIGRATION_CAPABILITY_MAPPED_RAM_INCREMENTAL);
 
 static bool migrate_incoming_started(void)
 {
@@ -530,6 +590,27 @@ bool migrate_caps_check(bool *old_caps, bool *new_caps, Error **errp)
     }
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (new_caps[MIGRATION_CAPABILITY_IO_URING_RECV] &&
+        (!new_caps[MIGRATION_CAPABILITY_MULTIFD] ||
+         new_caps[MIGRATION_CAPABILITY_MAPPED_RAM] ||
+         new_caps[MIGRATION_CAPABILITY_POSTCOPY_RAM] ||
+         migrate_multifd_compression() ||
+         migrate_tls())) {
+        error_setg(errp,
+                   "io_uring receive only available for non-compressed "
+                   "non-TLS multifd migration without mapped-ram or postcopy");
+        return false;
+    }
+#else
+    if (new_caps[MIGRATION_CAPABILITY_IO_URING_RECV]) {
+        error_setg(errp,
+                   "io_uring receive currently only available on Linux "
+                   "with io_uring support");
+        return false;
+    }
+#endif
+
     if (new_caps[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT]) {
         if (!new_caps[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
             error_setg(errp, "Postcopy preempt requires postcopy-ram");
@@ -543,6 +624,12 @@ bool migrate_caps_check(bool *old_caps, bool *new_caps, Error **errp)
         }
     }
 
+    if (new_caps[MIGRATION_CAPABILITY_POSTCOPY_PREFETCH] &&
+        !new_caps[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+        error_setg(errp, "Postcopy prefetch requires postcopy-ram");
+        return false;
+    }
+
     if (new_caps[MIGRATION_CAPABILITY_MULTIFD]) {
         if (migrate_incoming_started()) {
             error_setg(errp, "Multifd must be set before incoming starts");
@@ -592,6 +679,24 @@ bool migrate_caps_check(bool *old_caps, bool *new_caps, Error **errp)
         }
     }
 
+    if (new_caps[MIGRATION_CAPABILITY_MAPPED_RAM_INCREMENTAL] &&
+        !new_caps[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+        error_setg(errp, "Capability 'mapped-ram-incremental' requires "
+                   "capability 'mapped-ram'");
+        return false;
+    }
+
+    if (new_caps[MIGRATION_CAPABILITY_MULTIFD_DEDUP] &&
+        (!new_caps[MIGRATION_CAPABILITY_MULTIFD] ||
+         new_caps[MIGRATION_CAPABILITY_MAPPED_RAM] ||
+         new_caps[MIGRATION_CAPABILITY_ZERO_COPY_SEND] ||
+         migrate_multifd_compression())) {
+        error_setg(errp,
+                   "Multifd dedup only available for non-compressed, "
+                   "non-zero-copy multifd migration without mapped-ram");
+        return false;
+    }
+
     return true;
 }
 
@@ -656,6 +761,11 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
     for (cap = params; cap; cap = cap->next) {
         s->capabilities[cap->value->capability] = cap->value->state;
     }
+
+    /* Stop tracking dirty pages for the next incremental snapshot */
+    if (!migrate_mapped_ram_incremental()) {
+        ram_mapped_ram_incremental_reset();
+    }
 }
 
 /* parameters */
@@ -714,11 +824,13 @@ bool migrate_direct_io(void)
      *
      * multifd is needed to keep the unaligned portion of the stream
      * isolated to the main migration thread while multifd channels
-     * process the aligned data with O_DIRECT enabled.
+     * process the aligned data with O_DIRECT enabled.  Loading with
+     * io_uring only issues aligned reads, so it doesn't need multifd.
      */
     return s->parameters.direct_io &&
         s->capabilities[MIGRATION_CAPABILITY_MAPPED_RAM] &&
-        s->capabilities[MIGRATION_CAPABILITY_MULTIFD];
+        (s->capabilities[MIGRATION_CAPABILITY_MULTIFD] ||
+         migrate_mapped_ram_io_uring());
 }
 
 uint64_t migrate_downtime_limit(void)
@@ -728,6 +840,38 @@ uint64_t migrate_downtime_limit(void)
     return s->parameters.downtime_limit;
 }
 
+uint8_t migrate_hot_page_rounds(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.hot_page_rounds;
+}
+
+MappedRamLoadMethod migrate_mapped_ram_load_method(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.mapped_ram_load_method;
+}
+
+bool migrate_mapped_ram_io_uring(void)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    return migrate_mapped_ram_load_method() == MAPPED_RAM_LOAD_METHOD_IO_URING;
+#else
+    return false;
+#endif
+}
+
+bool migrate_mapped_ram_lazy(void)
+{
+#ifdef CONFIG_LINUX
+    return migrate_mapped_ram_load_method() == MAPPED_RAM_LOAD_METHOD_LAZY;
+#else
+    return false;
+#endif
+}
+
 uint8_t migrate_max_cpu_throttle(void)
 {
     MigrationState *s = migrate_get_current();
@@ -926,6 +1070,10 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->zero_page_detection = s->parameters.zero_page_detection;
     params->has_direct_io = true;
     params->direct_io = s->parameters.direct_io;
+    params->has_hot_page_rounds = true;
+    params->hot_page_rounds = s->parameters.hot_page_rounds;
+    params->has_mapped_ram_load_method = true;
+    params->mapped_ram_load_method = s->parameters.mapped_ram_load_method;
 
     return params;
 }
@@ -959,6 +1107,8 @@ void migrate_params_init(MigrationParameters *params)
     params->has_mode = true;
     params->has_zero_page_detection = true;
     params->has_direct_io = true;
+    params->has_hot_page_rounds = true;
+    params->has_mapped_ram_load_method = true;
 }
 
 /*
@@ -1109,6 +1259,22 @@ bool migrate_params_check(MigrationParameters *params, Error **errp)
     }
 #endif
 
+    if (migrate_io_uring_recv() &&
+        ((params->has_multifd_compression && params->multifd_compression) ||
+         (params->tls_creds && *params->tls_creds))) {
+        error_setg(errp,
+                   "io_uring receive only available for non-compressed "
+                   "non-TLS multifd migration");
+        return false;
+    }
+
+    if (migrate_multifd_dedup() &&
+        params->has_multifd_compression && params->multifd_compression) {
+        error_setg(errp,
+                   "Multifd dedup only available for non-compressed multifd migration");
+        return false;
+    }
+
     if (migrate_mapped_ram() &&
         (migrate_multifd_compression() || migrate_tls())) {
         error_setg(errp,
@@ -1137,6 +1303,17 @@ bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+    if (params->has_hot_page_rounds && params->hot_page_rounds &&
+        (params->hot_page_rounds < MIGRATE_HOT_PAGE_ROUNDS_MIN ||
+         params->hot_page_rounds > MIGRATE_HOT_PAGE_ROUNDS_MAX)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "hot_page_rounds",
+                   "0, or an integer in the range of "
+                   stringify(MIGRATE_HOT_PAGE_ROUNDS_MIN) " to "
+                   stringify(MIGRATE_HOT_PAGE_ROUNDS_MAX));
+        return false;
+    }
+
     return true;
 }
 
@@ -1247,6 +1424,14 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_direct_io) {
         dest->direct_io = params->direct_io;
     }
+
+    if (params->has_hot_page_rounds) {
+        dest->hot_page_rounds = params->hot_page_rounds;
+    }
+
+    if (params->has_mapped_ram_load_method) {
+        dest->mapped_ram_load_method = params->mapped_ram_load_method;
+    }
 }
 
 static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
@@ -1376,6 +1561,14 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     if (params->has_direct_io) {
         s->parameters.direct_io = params->direct_io;
     }
+
+    if (params->has_hot_page_rounds) {
+        s->parameters.hot_page_rounds = params->hot_page_rounds;
+    }
+
+    if (params->has_mapped_ram_load_method) {
+        s->parameters.mapped_ram_load_method = params->mapped_ram_load_method;
+    }
 }
 
 void qmp_migrate_set_parameters(MigrateSetParameters *params, Error **errp)
@@ -38,6 +38,10 @@
 #include "qemu/userfaultfd.h"
 #include "qemu/mmap-alloc.h"
 #include "options.h"
+#include "qemu/units.h"
+#include "qemu/timer.h"
+#include "io/channel-file.h"
+#include "sysemu/runstate.h"
 
 /* Arbitrary limit on size of each discard command,
  * keeps them around ~200 bytes
@@ -819,6 +823,136 @@ static int get_mem_fault_cpu_index(uint32_t pid)
     return -1;
 }
 
+/*
+ * Prefetch: once the faults of a vCPU have hit pages at the same
+ * distance from each other twice in a row, request the next pages
+ * along that stride before the vCPU faults on them.  The window grows
+ * as long as the pattern holds.
+ */
+#define POSTCOPY_PREFETCH_MIN_WINDOW  4
+#define POSTCOPY_PREFETCH_MAX_WINDOW  64
+/* Largest stride followed, in host pages of the RAMBlock */
+#define POSTCOPY_PREFETCH_MAX_STRIDE  16
+
+typedef struct {
+    RAMBlock *rb;
+    /* Offset of the last fault */
+    ram_addr_t last;
+    /* Distance between the last two faults */
+    int64_t stride;
+    /* How many times in a row the stride was the same */
+    unsigned int hits;
+    /* Farthest offset already requested along the stride */
+    ram_addr_t ahead;
+} PostcopyPrefetchVCPU;
+
+typedef struct {
+    /* One per vCPU, plus one for faults we can't map to a vCPU */
+    PostcopyPrefetchVCPU *vcpu;
+    unsigned int nr;
+} PostcopyPrefetch;
+
+static PostcopyPrefetch *postcopy_prefetch_new(void)
+{
+    MachineState *ms = MACHINE(qdev_get_machine());
+    PostcopyPrefetch *pf = g_new0(PostcopyPrefetch, 1);
+
+    pf->nr = ms->smp.max_cpus + 1;
+    pf->vcpu = g_new0(PostcopyPrefetchVCPU, pf->nr);
+    return pf;
+}
+
+static void postcopy_prefetch_free(PostcopyPrefetch *pf)
+{
+    if (pf) {
+        g_free(pf->vcpu);
+        g_free(pf);
+    }
+}
+
+/* Ask the source for [@start, @end) of @rb, returns false on error */
+static bool postcopy_prefetch_request(MigrationIncomingState *mis,
+                                      RAMBlock *rb, ram_addr_t start,
+                                      ram_addr_t end)
+{
+    if (start == end) {
+        return true;
+    }
+    trace_postcopy_prefetch_request(qemu_ram_get_idstr(rb), start,
+                                    end - start);
+    return !migrate_send_rp_message_req_pages(mis, rb, start, end - start);
+}
+
+/*
+ * Called by the fault thread for every fault on @rb at @offset, after
+ * the faulting page itself has been requested.
+ */
+static void postcopy_prefetch_fault(MigrationIncomingState *mis,
+                                    PostcopyPrefetch *pf, uint32_t ptid,
+                                    RAMBlock *rb, ram_addr_t offset)
+{
+    int cpu = ptid ? get_mem_fault_cpu_index(ptid) : -1;
+    PostcopyPrefetchVCPU *v;
+    size_t page_size = qemu_ram_pagesize(rb);
+    ram_addr_t run_start = 0, run_end = 0;
+    unsigned int window, i;
+    int64_t stride;
+
+    v = &pf->vcpu[cpu >= 0 && cpu < pf->nr - 1 ? cpu : pf->nr - 1];
+    stride = (int64_t)offset - (int64_t)v->last;
+
+    if (v->rb == rb && stride && stride == v->stride) {
+        v->hits++;
+    } else {
+        v->rb = rb;
+        v->stride = stride;
+        v->hits = 0;
+        v->ahead = offset;
+    }
+    v->last = offset;
+
+    if (!v->hits ||
+        ABS(v->stride) > POSTCOPY_PREFETCH_MAX_STRIDE * (int64_t)page_size) {
+        return;
+    }
+
+    window = MIN(POSTCOPY_PREFETCH_MIN_WINDOW << MIN(v->hits - 1, 8),
+                 POSTCOPY_PREFETCH_MAX_WINDOW);
+
+    for (i = 1; i <= window; i++) {
+        int64_t addr = (int64_t)offset + i * v->stride;
+
+        if (addr < 0 || addr + page_size > rb->used_length) {
+            break;
+        }
+        /* Already requested by an earlier fault of the same pattern */
+        if (v->stride > 0 ? addr <= v->ahead : addr >= v->ahead) {
+            continue;
+        }
+        v->ahead = addr;
+
+        if (ramblock_recv_bitmap_test_byte_offset(rb, addr) ||
+            ramblock_page_is_discarded(rb, addr)) {
+            continue;
+        }
+
+        /* Merge adjacent pages into a single request */
+        if (run_end != run_start && addr == run_end) {
+            run_end += page_size;
+        } else if (run_end != run_start && addr + page_size == run_start) {
+            run_start = addr;
+        } else {
+            if (!postcopy_prefetch_request(mis, rb, run_start, run_end)) {
+                return;
+            }
+            run_start = addr;
+            run_end = addr + page_size;
+        }
+    }
+
+    postcopy_prefetch_request(mis, rb, run_start, run_end);
+}
+
 static uint32_t get_low_time_offset(PostcopyBlocktimeContext *dc)
 {
     int64_t start_time_offset = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
@@ -968,8 +1102,12 @@ static void *postcopy_ram_fault_thread(void *opaque)
     int ret;
     size_t index;
     RAMBlock *rb = NULL;
+    PostcopyPrefetch *prefetch = NULL;
 
     trace_postcopy_ram_fault_thread_entry();
+    if (migrate_postcopy_prefetch()) {
+        prefetch = postcopy_prefetch_new();
+    }
     rcu_register_thread();
     mis->last_rb = NULL; /* last RAMBlock we sent part of */
     qemu_sem_post(&mis->thread_sync_sem);
@@ -1092,6 +1230,12 @@ retry:
                 postcopy_pause_fault_thread(mis);
                 goto retry;
             }
+
+            if (prefetch) {
+                postcopy_prefetch_fault(mis, prefetch,
+                                        msg.arg.pagefault.feat.ptid,
+                                        rb, rb_offset);
+            }
         }
 
         /* Now handle any requests from external processes on shared memory */
@@ -1152,6 +1296,7 @@ retry:
     }
     rcu_unregister_thread();
     trace_postcopy_ram_fault_thread_exit();
+    postcopy_prefetch_free(prefetch);
     g_free(pfd);
     return NULL;
 }
@@ -1391,6 +1536,489 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
     }
 }
 
+/*
+ * Lazy loading of mapped-ram migration files
+ *
+ * Instead of reading all of guest memory from the file before the
+ * guest starts, the ramblocks are registered with userfaultfd and the
+ * guest is allowed to run right away.  Pages the guest touches are
+ * read from the file on demand by a fault thread, while a fill thread
+ * reads all remaining pages in the background.  Once everything is in
+ * place the ramblocks are unregistered and both threads go away.
+ */
+
+/* Amount of memory placed at once by the fill thread */
+#define POSTCOPY_LAZY_FILL_SIZE (1 * MiB)
+
+typedef struct {
+    RAMBlock *rb;
+    /* Pages present in the migration file, in target pages */
+    unsigned long *file_bmap;
+    /* Host pages already placed, in units of the ramblock page size */
+    unsigned long *placed_bmap;
+    unsigned long nr_pages;
+    uint64_t pages_offset;
+} PostcopyLazyBlock;
+
+static struct {
+    /* Migration file, the channel goes away once loading is done */
+    int file_fd;
+    int userfault_fd;
+    /* Tells the fault thread to quit */
+    int quit_fd;
+    PostcopyLazyBlock *blocks;
+    int nblocks;
+    size_t max_page_size;
+    QemuThread fault_thread;
+    QemuThread fill_thread;
+    /* Whether the fill thread was started and not joined yet */
+    bool fill_running;
+    /* Set once the fill thread has to stop early */
+    bool stop;
+} postcopy_lazy = {
+    .file_fd = -1,
+    .userfault_fd = -1,
+    .quit_fd = -1,
+};
+
+static int postcopy_lazy_ioctl(RAMBlock *rb, void *host, void *from,
+                               size_t len)
+{
+    int ret;
+
+    if (from) {
+        struct uffdio_copy copy_struct;
+
+        copy_struct.dst = (uint64_t)(uintptr_t)host;
+        copy_struct.src = (uint64_t)(uintptr_t)from;
+        copy_struct.len = len;
+        copy_struct.mode = 0;
+        ret = ioctl(postcopy_lazy.userfault_fd, UFFDIO_COPY, &copy_struct);
+    } else {
+        struct uffdio_zeropage zero_struct;
+
+        zero_struct.range.start = (uint64_t)(uintptr_t)host;
+        zero_struct.range.len = len;
+        zero_struct.mode = 0;
+        ret = ioctl(postcopy_lazy.userfault_fd, UFFDIO_ZEROPAGE, &zero_struct);
+    }
+
+    return ret ? -errno : 0;
+}
+
+/*
+ * Read @len bytes of the pages of @lb at @offset into @buf.  Target
+ * pages not present in the file are zero, whatever the file holds.
+ */
+static int postcopy_lazy_read(PostcopyLazyBlock *lb, ram_addr_t offset,
+                              size_t len, uint8_t *buf)
+{
+    int bits = qemu_target_page_bits();
+    unsigned long first = offset >> bits;
+    unsigned long end = (offset + len) >> bits;
+    unsigned long page;
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t ret = pread(postcopy_lazy.file_fd, buf + done, len - done,
+                            lb->pages_offset + offset + done);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret < 0) {
+            return -errno;
+        } else if (ret == 0) {
+            return -EIO;
+        }
+        done += ret;
+    }
+
+    for (page = find_next_zero_bit(lb->file_bmap, end, first); page < end;
+         page = find_next_zero_bit(lb->file_bmap, end, page + 1)) {
+        memset(buf + ((page - first) << bits), 0, 1 << bits);
+    }
+
+    return 0;
+}
+
+/*
+ * Place @npages host pages of @lb starting at @index, using @buf as
+ * bounce buffer.  Pages that were placed concurrently by the other
+ * thread are skipped.
+ *
+ * Returns 0 on success, -errno on failure.
+ */
+static int postcopy_lazy_place(PostcopyLazyBlock *lb, unsigned long index,
+                               unsigned long npages, uint8_t *buf)
+{
+    RAMBlock *rb = lb->rb;
+    size_t pagesize = qemu_ram_pagesize(rb);
+    ram_addr_t offset = (ram_addr_t)index * pagesize;
+    size_t len = npages * pagesize;
+    int bits = qemu_target_page_bits();
+    unsigned long first = offset >> bits;
+    unsigned long end = (offset + len) >> bits;
+    void *host = qemu_ram_get_host_addr(rb) + offset;
+    void *from = buf;
+    int ret;
+
+    if (find_next_bit(lb->file_bmap, end, first) >= end &&
+        qemu_ram_is_uf_zeroable(rb)) {
+        from = NULL;
+    } else {
+        ret = postcopy_lazy_read(lb, offset, len, buf);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    ret = postcopy_lazy_ioctl(rb, host, from, len);
+    if (ret == -EEXIST && npages > 1) {
+        /* Some of the pages are there already, place the others one by one */
+        for (unsigned long i = 0; i < npages; i++) {
+            if (!test_bit(index + i, lb->placed_bmap)) {
+                ret = postcopy_lazy_place(lb, index + i, 1,
+                                          buf + i * pagesize);
+                if (ret) {
+                    return ret;
+                }
+            }
+        }
+        return 0;
+    } else if (ret == -EEXIST) {
+        /* Placed by the other thread, which also woke up any waiters */
+        trace_postcopy_lazy_load_exists(qemu_ram_get_idstr(rb), offset);
+    } else if (ret) {
+        return ret;
+    }
+
+    bitmap_set_atomic(lb->placed_bmap, index, npages);
+    return 0;
+}
+
+static void postcopy_lazy_error(PostcopyLazyBlock *lb, ram_addr_t offset,
+                                int err)
+{
+    error_report("Failed to load page " RAM_ADDR_FMT " of %s from the "
+                 "migration file: %s", offset, qemu_ram_get_idstr(lb->rb),
+                 strerror(-err));
+    /* Whoever touches the page would hang, stop the guest instead */
+    qemu_system_vmstop_request_prepare();
+    qemu_system_vmstop_request(RUN_STATE_IO_ERROR);
+}
+
+static PostcopyLazyBlock *postcopy_lazy_find_block(uint64_t addr)
+{
+    for (int i = 0; i < postcopy_lazy.nblocks; i++) {
+        PostcopyLazyBlock *lb = &postcopy_lazy.blocks[i];
+        uint64_t host = (uintptr_t)qemu_ram_get_host_addr(lb->rb);
+
+        if (addr >= host && addr - host < lb->rb->used_length) {
+            return lb;
+        }
+    }
+
+    return NULL;
+}
+
+static void *postcopy_lazy_fault_thread(void *opaque)
+{
+    g_autofree uint8_t *buf = g_malloc(postcopy_lazy.max_page_size);
+    struct uffd_msg msgs[16];
+
+    rcu_register_thread();
+
+    while (true) {
+        struct pollfd pfd[2] = {
+            { .fd = postcopy_lazy.userfault_fd, .events = POLLIN },
+            { .fd = postcopy_lazy.quit_fd, .events = POLLIN },
+        };
+        int n;
+
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("%s: poll failed: %s", __func__, strerror(errno));
+            break;
+        }
+
+        if (pfd[1].revents) {
+            break;
+        }
+        if (!(pfd[0].revents & POLLIN)) {
+            continue;
+        }
+
+        n = uffd_read_events(postcopy_lazy.userfault_fd, msgs,
+                             ARRAY_SIZE(msgs));
+        for (int i = 0; i < n; i++) {
+            uint64_t addr = msgs[i].arg.pagefault.address;
+            PostcopyLazyBlock *lb;
+            unsigned long index;
+            uint64_t host;
+            int ret;
+
+            if (msgs[i].event != UFFD_EVENT_PAGEFAULT) {
+                error_report("%s: Unexpected msg event: %d", __func__,
+                             msgs[i].event);
+                continue;
+            }
+
+            lb = postcopy_lazy_find_block(addr);
+            if (!lb) {
+                error_report("%s: Fault outside of lazily loaded RAM: 0x%"
+                             PRIx64, __func__, addr);
+                continue;
+            }
+
+            host = (uintptr_t)qemu_ram_get_host_addr(lb->rb);
+            index = (addr - host) / qemu_ram_pagesize(lb->rb);
+            trace_postcopy_lazy_load_fault(qemu_ram_get_idstr(lb->rb),
+                                           addr - host);
+
+            ret = postcopy_lazy_place(lb, index, 1, buf);
+            if (ret) {
+                postcopy_lazy_error(lb, addr - host, ret);
+            }
+        }
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void postcopy_lazy_cleanup(void)
+{
+    for (int i = 0; i < postcopy_lazy.nblocks; i++) {
+        PostcopyLazyBlock *lb = &postcopy_lazy.blocks[i];
+
+        uffd_unregister_memory(postcopy_lazy.userfault_fd,
+                               qemu_ram_get_host_addr(lb->rb),
+                               lb->rb->used_length);
+        g_free(lb->file_bmap);
+        g_free(lb->placed_bmap);
+    }
+    g_free(postcopy_lazy.blocks);
+    postcopy_lazy.blocks = NULL;
+    postcopy_lazy.nblocks = 0;
+    postcopy_lazy.max_page_size = 0;
+
+    uffd_close_fd(postcopy_lazy.userfault_fd);
+    postcopy_lazy.userfault_fd = -1;
+    close(postcopy_lazy.file_fd);
+    postcopy_lazy.file_fd = -1;
+    if (postcopy_lazy.quit_fd >= 0) {
+        close(postcopy_lazy.quit_fd);
+        postcopy_lazy.quit_fd = -1;
+    }
+
+    ram_block_discard_disable(false);
+}
+
+static void *postcopy_lazy_fill_thread(void *opaque)
+{
+    size_t bufsize = MAX(POSTCOPY_LAZY_FILL_SIZE, postcopy_lazy.max_page_size);
+    g_autofree uint8_t *buf = g_malloc(bufsize);
+    uint64_t start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    uint64_t val = 1;
+
+    rcu_register_thread();
+
+    for (int i = 0; i < postcopy_lazy.nblocks; i++) {
+        PostcopyLazyBlock *lb = &postcopy_lazy.blocks[i];
+        size_t pagesize = qemu_ram_pagesize(lb->rb);
+        unsigned long chunk = bufsize / pagesize;
+        unsigned long index = 0;
+
+        while (!qatomic_read(&postcopy_lazy.stop)) {
+            unsigned long end;
+            int ret;
+
+            index = find_next_zero_bit(lb->placed_bmap, lb->nr_pages, index);
+            if (index >= lb->nr_pages) {
+                break;
+            }
+            end = find_next_bit(lb->placed_bmap,
+                                MIN(lb->nr_pages, index + chunk), index);
+
+            ret = postcopy_lazy_place(lb, index, end - index, buf);
+            if (ret) {
+                postcopy_lazy_error(lb, (ram_addr_t)index * pagesize, ret);
+                qatomic_set(&postcopy_lazy.stop, true);
+                break;
+            }
+            index = end;
+        }
+    }
+
+    if (!qatomic_read(&postcopy_lazy.stop)) {
+        trace_postcopy_lazy_load_done(qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                                      start);
+    }
+
+    /*
+     * All pages are in place, so faults can't come anymore.  After an
+     * error, the fault thread keeps serving faults until QEMU exits.
+     */
+    if (!qatomic_read(&postcopy_lazy.stop)) {
+        if (write(postcopy_lazy.quit_fd, &val, sizeof(val)) != sizeof(val)) {
+            error_report("%s: failed to notify fault thread: %s", __func__,
+                         strerror(errno));
+        } else {
+            qemu_thread_join(&postcopy_lazy.fault_thread);
+            postcopy_lazy_cleanup();
+        }
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+int postcopy_lazy_load_add_block(QIOChannel *ioc, RAMBlock *rb,
+                                 long num_pages, unsigned long *bitmap,
+                                 Error **errp)
+{
+    QIOChannelFile *fioc;
+    PostcopyLazyBlock *lb;
+    struct uffdio_register reg_struct;
+    void *host = qemu_ram_get_host_addr(rb);
+    size_t pagesize = qemu_ram_pagesize(rb);
+
+    fioc = (QIOChannelFile *)object_dynamic_cast(OBJECT(ioc),
+                                                 TYPE_QIO_CHANNEL_FILE);
+    if (!fioc || !QEMU_IS_ALIGNED(rb->used_length, pagesize)) {
+        return 0;
+    }
+
+    /*
+     * Discarding shared or file backed memory would drop its contents
+     * for other users of the memory too, so load those eagerly as the
+     * mmap load method does.
+     */
+    if (qemu_ram_is_shared(rb) || rb->fd >= 0) {
+        return 0;
+    }
+
+    if (postcopy_lazy.userfault_fd < 0) {
+        /*
+         * A discarded page would fault again and be loaded from the file
+         * once more, instead of reading as zero.
+         */
+        if (ram_block_discard_disable(true)) {
+            warn_report("Cannot disable RAM discard, loading %s eagerly",
+                        qemu_ram_get_idstr(rb));
+            return 0;
+        }
+
+        postcopy_lazy.userfault_fd = uffd_create_fd(0, false);
+        if (postcopy_lazy.userfault_fd < 0) {
+            ram_block_discard_disable(false);
+            return 0;
+        }
+
+        postcopy_lazy.file_fd = dup(fioc->fd);
+        if (postcopy_lazy.file_fd < 0) {
+            error_setg_errno(errp, errno, "failed to dup migration file");
+            uffd_close_fd(postcopy_lazy.userfault_fd);
+            postcopy_lazy.userfault_fd = -1;
+            ram_block_discard_disable(false);
+            return -1;
+        }
+    }
+
+    /* Make sure all pages fault, whatever was there before */
+    if (ram_block_discard_range(rb, 0, rb->used_length)) {
+        return 0;
+    }
+
+    reg_struct.range.start = (uintptr_t)host;
+    reg_struct.range.len = rb->used_length;
+    reg_struct.mode = UFFDIO_REGISTER_MODE_MISSING;
+    if (ioctl(postcopy_lazy.userfault_fd, UFFDIO_REGISTER, &reg_struct)) {
+        trace_postcopy_lazy_load_skip(qemu_ram_get_idstr(rb), errno);
+        return 0;
+    }
+    if (!(reg_struct.ioctls & (1ULL << _UFFDIO_COPY))) {
+        uffd_unregister_memory(postcopy_lazy.userfault_fd, host,
+                               rb->used_length);
+        trace_postcopy_lazy_load_skip(qemu_ram_get_idstr(rb), EOPNOTSUPP);
+        return 0;
+    }
+    if (reg_struct.ioctls & (1ULL << _UFFDIO_ZEROPAGE)) {
+        qemu_ram_set_uf_zeroable(rb);
+    }
+
+    postcopy_lazy.blocks = g_renew(PostcopyLazyBlock, postcopy_lazy.blocks,
+                                   postcopy_lazy.nblocks + 1);
+    lb = &postcopy_lazy.blocks[postcopy_lazy.nblocks++];
+    lb->rb = rb;
+    lb->file_bmap = bitmap_new(num_pages);
+    bitmap_copy(lb->file_bmap, bitmap, num_pages);
+    lb->nr_pages = rb->used_length / pagesize;
+    lb->placed_bmap = bitmap_new(lb->nr_pages);
+    lb->pages_offset = rb->pages_offset;
+    postcopy_lazy.max_page_size = MAX(postcopy_lazy.max_page_size, pagesize);
+
+    trace_postcopy_lazy_load_add_block(qemu_ram_get_idstr(rb),
+                                       rb->used_length);
+    return 1;
+}
+
+bool postcopy_lazy_load_start(Error **errp)
+{
+    if (!postcopy_lazy.nblocks) {
+        if (postcopy_lazy.userfault_fd >= 0) {
+            postcopy_lazy_cleanup();
+        }
+        return true;
+    }
+
+    postcopy_lazy.quit_fd = eventfd(0, EFD_CLOEXEC);
+    if (postcopy_lazy.quit_fd < 0) {
+        error_setg_errno(errp, errno, "failed to create eventfd");
+        return false;
+    }
+
+    postcopy_lazy.stop = false;
+    qemu_thread_create(&postcopy_lazy.fault_thread, "mig/dst/lazy",
+                       postcopy_lazy_fault_thread, NULL,
+                       QEMU_THREAD_JOINABLE);
+    qemu_thread_create(&postcopy_lazy.fill_thread, "mig/dst/fill",
+                       postcopy_lazy_fill_thread, NULL,
+                       QEMU_THREAD_JOINABLE);
+    postcopy_lazy.fill_running = true;
+
+    return true;
+}
+
+void postcopy_lazy_load_stop(void)
+{
+    uint64_t val = 1;
+
+    if (postcopy_lazy.fill_running) {
+        qatomic_set(&postcopy_lazy.stop, true);
+        qemu_thread_join(&postcopy_lazy.fill_thread);
+        postcopy_lazy.fill_running = false;
+    }
+
+    /* Nothing left if the fill thread finished and cleaned up */
+    if (postcopy_lazy.userfault_fd < 0) {
+        return;
+    }
+
+    trace_postcopy_lazy_load_stop();
+    if (postcopy_lazy.quit_fd >= 0) {
+        if (write(postcopy_lazy.quit_fd, &val, sizeof(val)) != sizeof(val)) {
+            /* Can't happen short of an eventfd counter overflow */
+            error_report("%s: failed to notify fault thread: %s", __func__,
+                         strerror(errno));
+            abort();
+        }
+        qemu_thread_join(&postcopy_lazy.fault_thread);
+    }
+    postcopy_lazy_cleanup();
+}
+
 #else
 /* No target OS support, stubs just fail */
 void fill_destination_postcopy_migration_info(MigrationInfo *info)
@@ -1455,6 +2083,23 @@ int postcopy_wake_shared(struct PostCopyFD *pcfd,
     assert(0);
     return -1;
 }
+
+int postcopy_lazy_load_add_block(QIOChannel *ioc, RAMBlock *rb,
+                                 long num_pages, unsigned long *bitmap,
+                                 Error **errp)
+{
+    /* Load the pages eagerly */
+    return 0;
+}
+
+bool postcopy_lazy_load_start(Error **errp)
+{
+    return true;
+}
+
+void postcopy_lazy_load_stop(void)
+{
+}
 #endif
 
 /* ------------------------------------------------------------------------- */
@@ -14,6 +14,7 @@
 #define QEMU_POSTCOPY_RAM_H
 
 #include "qapi/qapi-types-migration.h"
+#include "io/channel.h"
 
 /* Return true if the host supports everything we need to do postcopy-ram */
 bool postcopy_ram_supported_by_host(MigrationIncomingState *mis,
@@ -197,4 +198,22 @@ void postcopy_preempt_setup(MigrationState *s);
 int postcopy_preempt_establish_channel(MigrationState *s);
 bool postcopy_is_paused(MigrationStatus status);
 
+/*
+ * Register @rb to be loaded lazily from the mapped-ram migration file
+ * behind @ioc, with the pages present in the file set in @bitmap.
+ *
+ * Returns 1 if the block will be loaded lazily, 0 if its pages have to
+ * be read now and -1 on error.
+ */
+int postcopy_lazy_load_add_block(QIOChannel *ioc, RAMBlock *rb,
+                                 long num_pages, unsigned long *bitmap,
+                                 Error **errp);
+/* Start serving faults and filling the blocks registered so far */
+bool postcopy_lazy_load_start(Error **errp);
+/*
+ * Stop loading lazily, leaving the pages not loaded yet as zero pages.
+ * Must be called with the guest stopped.
+ */
+void postcopy_lazy_load_stop(void);
+
 #endif
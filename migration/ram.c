@@ -28,6 +28,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/madvise.h"
@@ -56,11 +57,15 @@
 #include "savevm.h"
 #include "qemu/iov.h"
 #include "multifd.h"
+#include "file.h"
+#include "io/channel-file.h"
 #include "sysemu/runstate.h"
 #include "rdma.h"
 #include "options.h"
 #include "sysemu/dirtylimit.h"
+#include "sysemu/hostmem.h"
 #include "sysemu/kvm.h"
+#include "qemu/uuid.h"
 
 #include "hw/boards.h" /* for machine_dump_guest_core() */
 
@@ -110,6 +115,14 @@
  */
 #define MAPPED_RAM_LOAD_BUF_SIZE 0x100000
 
+/*
+ * When loading mapped-ram migration with mmap, runs of pages smaller
+ * than this are read rather than mapped, and at most this many runs
+ * are mapped per ramblock, to keep the number of mappings reasonable.
+ */
+#define MAPPED_RAM_MMAP_MIN_SIZE 0x100000
+#define MAPPED_RAM_MMAP_MAX_RUNS 16384
+
 XBZRLECacheStats xbzrle_counters;
 
 /* used by the search for pages to send */
@@ -351,6 +364,44 @@ struct RAMSrcPageRequest {
     QSIMPLEQ_ENTRY(RAMSrcPageRequest) next_req;
 };
 
+/*
+ * For large guests, the dirty bitmap sync is split into chunks that a
+ * pool of worker threads processes together with the migration thread.
+ * Chunks are a power of two between the min and max size, and start on
+ * a word of the dirty bitmap for any target page size.
+ */
+#define RAM_SYNC_CHUNK_SIZE      (1 * GiB)
+#define RAM_SYNC_MIN_CHUNK_SIZE  (16 * MiB)
+#define RAM_SYNC_RAM_PER_THREAD  (64 * GiB)
+#define RAM_SYNC_MAX_THREADS     16
+
+typedef struct {
+    RAMBlock *block;
+    ram_addr_t start;
+    ram_addr_t length;
+} RAMSyncChunk;
+
+typedef struct {
+    QemuThread *threads;
+    int nthreads;
+    ram_addr_t chunk_size;
+    /* Posted once per worker to start a sync, or to make them quit */
+    QemuSemaphore start_sem;
+    /* Posted by each worker once there are no chunks left */
+    QemuSemaphore done_sem;
+    bool quit;
+    /* Chunks of the current sync */
+    RAMSyncChunk *chunks;
+    unsigned int nchunks;
+    unsigned int nchunks_alloc;
+    /* Next chunk to be picked by a thread */
+    unsigned int next_chunk;
+    /* Newly dirtied pages found by all threads */
+    Stat64 new_dirty_pages;
+    /* Hot pages found by all threads */
+    Stat64 hot_pages;
+} RAMSyncPool;
+
 /* State of RAM for migration */
 struct RAMState {
     /*
@@ -394,6 +445,12 @@ struct RAMState {
     uint64_t target_page_count;
     /* number of dirty bits in the bitmap */
     uint64_t migration_dirty_pages;
+    /* Threads helping with the dirty bitmap sync, NULL if none */
+    RAMSyncPool *sync_pool;
+    /* number of pages dirtied in each of the last hot-page-rounds syncs */
+    uint64_t hot_pages;
+    /* Whether the hot pages are left for the final stage */
+    bool defer_hot_pages;
     /*
      * Protects:
      * - dirty/clear bitmap
@@ -403,6 +460,13 @@ struct RAMState {
     QemuMutex bitmap_mutex;
     /* The RAMBlock used in the last src_page_requests */
     RAMBlock *last_req_rb;
+    /*
+     * With postcopy preempt, where the background search should resume:
+     * right after the last page sent on request.  Protected by the
+     * bitmap_mutex.
+     */
+    RAMBlock *last_req_sent_rb;
+    unsigned long last_req_sent_page;
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
     QSIMPLEQ_HEAD(, RAMSrcPageRequest) src_page_requests;
@@ -421,6 +485,31 @@ static RAMState *ram_state;
 
 static NotifierWithReturnList precopy_notifier_list;
 
+/*
+ * Incremental mapped-ram snapshots.  @mapped_ram_base is the file
+ * written by the last successful migration with mapped-ram-incremental,
+ * and dirty logging is kept enabled from then on, so that the next one
+ * only has to save the pages dirtied since, on top of that file.
+ * @mapped_ram_target is the file written by the current migration.
+ *
+ * Each file is identified by a UUID stored in its headers, and a file
+ * records the UUID and the size of its base, so that loading it fails
+ * rather than mixing in pages of a base that was replaced since.
+ * @mapped_ram_chain holds the real paths of the base and of its own
+ * bases, which must not be overwritten by the next migration.
+ * @mapped_ram_base_ref is the path of the base as the current file
+ * records it.
+ */
+static char *mapped_ram_base;
+static char *mapped_ram_base_ref;
+static QemuUUID mapped_ram_base_uuid;
+static uint64_t mapped_ram_base_size;
+static GSList *mapped_ram_chain;
+static char *mapped_ram_target;
+static QemuUUID mapped_ram_uuid;
+/* The current migration only saves the pages dirtied since the base */
+static bool mapped_ram_delta;
+
 /* Whether postcopy has queued requests? */
 static bool postcopy_has_request(RAMState *rs)
 {
@@ -698,6 +787,40 @@ static int save_xbzrle_page(RAMState *rs, PageSearchStatus *pss,
     return 1;
 }
 
+/*
+ * Whether pages dirtied in each of the last hot-page-rounds syncs are
+ * skipped, so that they are only sent once in the final stage instead
+ * of in every iteration.  Called with bitmap_mutex held.
+ */
+static bool ram_defer_hot_pages(RAMState *rs)
+{
+    return rs->defer_hot_pages && !migration_in_postcopy();
+}
+
+/* Like find_next_bit(), but skips the bits that are also set in @skip */
+static unsigned long find_next_bit_andnot(const unsigned long *addr,
+                                          const unsigned long *skip,
+                                          unsigned long size,
+                                          unsigned long offset)
+{
+    unsigned long idx = BIT_WORD(offset);
+    unsigned long tmp;
+
+    if (offset >= size) {
+        return size;
+    }
+
+    tmp = addr[idx] & ~skip[idx] & BITMAP_FIRST_WORD_MASK(offset);
+    while (!tmp) {
+        if (++idx * BITS_PER_LONG >= size) {
+            return size;
+        }
+        tmp = addr[idx] & ~skip[idx];
+    }
+
+    return MIN(idx * BITS_PER_LONG + ctzl(tmp), size);
+}
+
 /**
  * pss_find_next_dirty: find the next dirty page of current ramblock
  *
@@ -705,7 +828,8 @@ static int save_xbzrle_page(RAMState *rs, PageSearchStatus *pss,
  * within the ramblock to migrate, or the end of ramblock when nothing
  * found.  Note that when pss->host_page_sending==true it means we're
  * during sending a host page, so we won't look for dirty page that is
- * outside the host page boundary.
+ * outside the host page boundary.  Otherwise, hot pages are skipped
+ * while they are being deferred.
  *
  * @pss: the current page search status
  */
@@ -728,6 +852,11 @@ static void pss_find_next_dirty(PageSearchStatus *pss)
     if (pss->host_page_sending) {
         assert(pss->host_page_end);
         size = MIN(size, pss->host_page_end);
+    } else if (ram_defer_hot_pages(ram_state) && rb->dirty_history) {
+        unsigned long *hot = rb->dirty_history[rb->dirty_history_len - 1];
+
+        pss->page = find_next_bit_andnot(bitmap, hot, size, pss->page);
+        return;
     }
 
     pss->page = find_next_bit(bitmap, size, pss->page);
@@ -912,6 +1041,44 @@ bool ramblock_page_is_discarded(RAMBlock *rb, ram_addr_t start)
     return false;
 }
 
+/*
+ * Move the pages of @rb dirtied since the last sync into its dirty
+ * history, for the range of @length bytes at @start, which must be
+ * aligned to a word of the bitmaps.
+ *
+ * Returns the number of hot pages in the range.
+ */
+static uint64_t ramblock_update_dirty_history(RAMBlock *rb, ram_addr_t start,
+                                              ram_addr_t length)
+{
+    unsigned long **history = rb->dirty_history;
+    int last = rb->dirty_history_len - 1;
+    unsigned long first_page = start >> TARGET_PAGE_BITS;
+    unsigned long end_page = (start + length) >> TARGET_PAGE_BITS;
+    uint64_t hot_pages = 0;
+    unsigned long k;
+
+    if (!history) {
+        return 0;
+    }
+
+    assert(!(first_page % BITS_PER_LONG));
+
+    for (k = BIT_WORD(first_page); k < BITS_TO_LONGS(end_page); k++) {
+        unsigned long dirty = rb->dirty_sync_bmap[k];
+        int i;
+
+        rb->dirty_sync_bmap[k] = 0;
+        for (i = last; i > 0; i--) {
+            history[i][k] = history[i - 1][k] & dirty;
+        }
+        history[0][k] = dirty;
+        hot_pages += ctpopl(history[last][k]);
+    }
+
+    return hot_pages;
+}
+
 /* Called with RCU critical section */
 static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
 {
@@ -920,6 +1087,164 @@ static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
 
     rs->migration_dirty_pages += new_dirty_pages;
     rs->num_dirty_pages_period += new_dirty_pages;
+    rs->hot_pages += ramblock_update_dirty_history(rb, 0, rb->used_length);
+}
+
+/* Process chunks of the current sync until there are none left */
+static void ram_sync_pool_work(RAMSyncPool *pool)
+{
+    uint64_t new_dirty_pages = 0;
+    uint64_t hot_pages = 0;
+    unsigned int i;
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        while ((i = qatomic_fetch_inc(&pool->next_chunk)) < pool->nchunks) {
+            RAMSyncChunk *chunk = &pool->chunks[i];
+
+            new_dirty_pages +=
+                cpu_physical_memory_sync_dirty_bitmap(chunk->block,
+                                                      chunk->start,
+                                                      chunk->length);
+            hot_pages += ramblock_update_dirty_history(chunk->block,
+                                                       chunk->start,
+                                                       chunk->length);
+        }
+    }
+
+    stat64_add(&pool->new_dirty_pages, new_dirty_pages);
+    stat64_add(&pool->hot_pages, hot_pages);
+}
+
+static void *ram_sync_pool_thread(void *opaque)
+{
+    RAMSyncPool *pool = opaque;
+
+    rcu_register_thread();
+
+    while (true) {
+        qemu_sem_wait(&pool->start_sem);
+        if (qatomic_read(&pool->quit)) {
+            break;
+        }
+        ram_sync_pool_work(pool);
+        qemu_sem_post(&pool->done_sem);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/*
+ * Returns a pool of threads to help with the dirty bitmap sync of
+ * @ram_bytes of guest memory, or NULL if it's not worth it.  The
+ * x-dirty-sync-threads property overrides the number of threads.
+ */
+static RAMSyncPool *ram_sync_pool_new(uint64_t ram_bytes)
+{
+    MigrationState *ms = migrate_get_current();
+    RAMSyncPool *pool;
+    int nthreads;
+
+    if (ms->dirty_sync_threads) {
+        nthreads = ms->dirty_sync_threads;
+    } else {
+        nthreads = MIN(ram_bytes / RAM_SYNC_RAM_PER_THREAD,
+                       RAM_SYNC_MAX_THREADS);
+        /* The migration thread takes part as well */
+        nthreads = MIN(nthreads, g_get_num_processors() - 1);
+    }
+    if (nthreads < 1) {
+        return NULL;
+    }
+
+    pool = g_new0(RAMSyncPool, 1);
+    pool->nthreads = nthreads;
+    /* At least four chunks per thread, so that they balance out */
+    pool->chunk_size = pow2floor(ram_bytes / (nthreads + 1) / 4);
+    pool->chunk_size = MIN(MAX(pool->chunk_size, RAM_SYNC_MIN_CHUNK_SIZE),
+                           RAM_SYNC_CHUNK_SIZE);
+    pool->threads = g_new0(QemuThread, nthreads);
+    qemu_sem_init(&pool->start_sem, 0);
+    qemu_sem_init(&pool->done_sem, 0);
+
+    for (int i = 0; i < nthreads; i++) {
+        qemu_thread_create(&pool->threads[i], "mig/src/sync",
+                           ram_sync_pool_thread, pool, QEMU_THREAD_JOINABLE);
+    }
+    trace_ram_sync_pool_new(nthreads, pool->chunk_size);
+
+    return pool;
+}
+
+static void ram_sync_pool_free(RAMSyncPool *pool)
+{
+    if (!pool) {
+        return;
+    }
+
+    qatomic_set(&pool->quit, true);
+    for (int i = 0; i < pool->nthreads; i++) {
+        qemu_sem_post(&pool->start_sem);
+    }
+    for (int i = 0; i < pool->nthreads; i++) {
+        qemu_thread_join(&pool->threads[i]);
+    }
+
+    qemu_sem_destroy(&pool->start_sem);
+    qemu_sem_destroy(&pool->done_sem);
+    g_free(pool->threads);
+    g_free(pool->chunks);
+    g_free(pool);
+}
+
+/*
+ * Sync the dirty bitmap of all blocks using the sync pool.  Called
+ * with RCU critical section and bitmap_mutex held.
+ */
+static void ram_sync_dirty_bitmap_parallel(RAMState *rs)
+{
+    RAMSyncPool *pool = rs->sync_pool;
+    uint64_t new_dirty_pages;
+    RAMBlock *block;
+
+    pool->nchunks = 0;
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        ram_addr_t start;
+
+        for (start = 0; start < block->used_length;
+             start += pool->chunk_size) {
+            RAMSyncChunk *chunk;
+
+            if (pool->nchunks == pool->nchunks_alloc) {
+                pool->nchunks_alloc = MAX(pool->nchunks_alloc * 2, 64);
+                pool->chunks = g_renew(RAMSyncChunk, pool->chunks,
+                                       pool->nchunks_alloc);
+            }
+            chunk = &pool->chunks[pool->nchunks++];
+            chunk->block = block;
+            chunk->start = start;
+            chunk->length = MIN(pool->chunk_size,
+                                block->used_length - start);
+        }
+    }
+
+    pool->next_chunk = 0;
+    stat64_set(&pool->new_dirty_pages, 0);
+    stat64_set(&pool->hot_pages, 0);
+
+    /* qemu_sem_post() orders the setup above before the workers start */
+    for (int i = 0; i < pool->nthreads; i++) {
+        qemu_sem_post(&pool->start_sem);
+    }
+    ram_sync_pool_work(pool);
+    for (int i = 0; i < pool->nthreads; i++) {
+        qemu_sem_wait(&pool->done_sem);
+    }
+
+    new_dirty_pages = stat64_get(&pool->new_dirty_pages);
+    rs->migration_dirty_pages += new_dirty_pages;
+    rs->num_dirty_pages_period += new_dirty_pages;
+    rs->hot_pages += stat64_get(&pool->hot_pages);
 }
 
 /**
@@ -1056,12 +1381,30 @@ static void migration_bitmap_sync(RAMState *rs, bool last_stage)
     memory_global_dirty_log_sync(last_stage);
 
     WITH_QEMU_LOCK_GUARD(&rs->bitmap_mutex) {
+        rs->hot_pages = 0;
         WITH_RCU_READ_LOCK_GUARD() {
-            RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-                ramblock_sync_dirty_bitmap(rs, block);
+            if (rs->sync_pool) {
+                ram_sync_dirty_bitmap_parallel(rs);
+            } else {
+                RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+                    ramblock_sync_dirty_bitmap(rs, block);
+                }
             }
             stat64_set(&mig_stats.dirty_bytes_last_sync, ram_bytes_remaining());
         }
+
+        /*
+         * Only defer the hot pages as long as they can all be sent
+         * within the downtime limit, otherwise we would never converge.
+         */
+        rs->defer_hot_pages = rs->hot_pages && !last_stage &&
+            !migration_in_colo_state() &&
+            rs->hot_pages * TARGET_PAGE_SIZE <=
+            migrate_get_current()->threshold_size;
+        if (rs->defer_hot_pages) {
+            stat64_add(&mig_stats.deferred_pages, rs->hot_pages);
+        }
+        trace_migration_bitmap_sync_hot(rs->hot_pages, rs->defer_hot_pages);
     }
 
     memory_global_after_dirty_log_sync();
@@ -1133,7 +1476,12 @@ static int save_zero_page(RAMState *rs, PageSearchStatus *pss,
     QEMUFile *file = pss->pss_channel;
     int len = 0;
 
-    if (migrate_zero_page_detection() == ZERO_PAGE_DETECTION_NONE) {
+    /*
+     * Pages that became zero since the base snapshot must be saved as
+     * well, a page missing from the file means it did not change.
+     */
+    if (migrate_zero_page_detection() == ZERO_PAGE_DETECTION_NONE ||
+        mapped_ram_delta) {
         return 0;
     }
 
@@ -1966,6 +2314,11 @@ int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len,
              */
             len -= page_size;
         };
+
+        if (!ret) {
+            rs->last_req_sent_rb = ramblock;
+            rs->last_req_sent_page = pss->page;
+        }
         qemu_mutex_unlock(&rs->bitmap_mutex);
 
         return ret;
@@ -2260,6 +2613,18 @@ static int ram_find_and_save_block(RAMState *rs)
 
     pss_init(pss, rs->last_seen_block, rs->last_page);
 
+    if (rs->last_req_sent_rb) {
+        /*
+         * Same as get_queued_page() does for the pages it unqueues: the
+         * guest is likely to want pages near the ones it just requested,
+         * even if the return path thread already sent those.
+         */
+        pss->block = rs->last_req_sent_rb;
+        pss->page = rs->last_req_sent_page;
+        pss->complete_round = false;
+        rs->last_req_sent_rb = NULL;
+    }
+
     while (true){
         if (!get_queued_page(rs, pss)) {
             /* priority queue empty, so just search for something dirty */
@@ -2327,6 +2692,7 @@ static void xbzrle_load_cleanup(void)
 static void ram_state_cleanup(RAMState **rsp)
 {
     if (*rsp) {
+        ram_sync_pool_free((*rsp)->sync_pool);
         migration_page_queue_free(*rsp);
         qemu_mutex_destroy(&(*rsp)->bitmap_mutex);
         qemu_mutex_destroy(&(*rsp)->src_page_req_mutex);
@@ -2362,19 +2728,141 @@ static void ram_bitmaps_destroy(void)
         block->bmap = NULL;
         g_free(block->file_bmap);
         block->file_bmap = NULL;
+        if (block->dirty_history) {
+            for (int i = 0; i < block->dirty_history_len; i++) {
+                g_free(block->dirty_history[i]);
+            }
+            g_free(block->dirty_history);
+            block->dirty_history = NULL;
+            block->dirty_history_len = 0;
+        }
+        g_free(block->dirty_sync_bmap);
+        block->dirty_sync_bmap = NULL;
     }
 }
 
+/*
+ * Once a migration with mapped-ram-incremental is over, make the file it
+ * wrote the base of the next one if it succeeded.  Otherwise the pages
+ * dirtied since the previous base are lost, and the next one has to
+ * save all pages again.
+ */
+static void mapped_ram_incremental_finish(void)
+{
+    MigrationState *s = migrate_get_current();
+    g_autofree char *target = g_steal_pointer(&mapped_ram_target);
+    char *real_target;
+    struct stat st;
+
+    g_free(mapped_ram_base);
+    mapped_ram_base = NULL;
+    g_free(mapped_ram_base_ref);
+    mapped_ram_base_ref = NULL;
+    if (s->state != MIGRATION_STATUS_COMPLETED || !mapped_ram_delta) {
+        g_slist_free_full(g_steal_pointer(&mapped_ram_chain), g_free);
+    }
+    mapped_ram_delta = false;
+
+    if (s->state != MIGRATION_STATUS_COMPLETED || !target) {
+        return;
+    }
+
+    real_target = realpath(target, NULL);
+    if (!real_target || stat(real_target, &st)) {
+        warn_report("mapped-ram: can't find %s, the next migration saves "
+                    "all pages", target);
+        g_free(real_target);
+        g_slist_free_full(g_steal_pointer(&mapped_ram_chain), g_free);
+        return;
+    }
+
+    mapped_ram_base = g_canonicalize_filename(target, NULL);
+    mapped_ram_base_uuid = mapped_ram_uuid;
+    mapped_ram_base_size = st.st_size;
+    mapped_ram_chain = g_slist_prepend(mapped_ram_chain, real_target);
+}
+
+/*
+ * The path by which a file saved to @target refers to the base: relative
+ * to the directory of @target if the base is in the same one, so that
+ * both can be moved together, and absolute otherwise.
+ */
+static char *mapped_ram_base_ref_new(const char *target)
+{
+    g_autofree char *base_dir = g_path_get_dirname(mapped_ram_base);
+    g_autofree char *target_path = NULL;
+    g_autofree char *target_dir = NULL;
+
+    if (target) {
+        target_path = g_canonicalize_filename(target, NULL);
+        target_dir = g_path_get_dirname(target_path);
+        if (!strcmp(base_dir, target_dir)) {
+            return g_path_get_basename(mapped_ram_base);
+        }
+    }
+
+    return g_strdup(mapped_ram_base);
+}
+
+bool ram_mapped_ram_check_target(const char *fname, Error **errp)
+{
+    g_autofree char *real_fname = NULL;
+
+    if (!migrate_mapped_ram_incremental() || !mapped_ram_base) {
+        return true;
+    }
+
+    /* A file that does not exist yet can't be one of the bases */
+    real_fname = realpath(fname, NULL);
+    if (!real_fname) {
+        return true;
+    }
+
+    if (g_slist_find_custom(mapped_ram_chain, real_fname,
+                            (GCompareFunc)strcmp)) {
+        error_setg(errp, "Migration file %s is a base of the next "
+                   "incremental mapped-ram file and can't be overwritten",
+                   fname);
+        return false;
+    }
+
+    return true;
+}
+
+void ram_mapped_ram_incremental_reset(void)
+{
+    if (!mapped_ram_base) {
+        return;
+    }
+
+    g_free(mapped_ram_base);
+    mapped_ram_base = NULL;
+    g_slist_free_full(g_steal_pointer(&mapped_ram_chain), g_free);
+    if (global_dirty_tracking & GLOBAL_DIRTY_MIGRATION) {
+        memory_global_dirty_log_stop(GLOBAL_DIRTY_MIGRATION);
+    }
+}
+
+bool ram_mapped_ram_delta(void)
+{
+    return mapped_ram_delta;
+}
+
 static void ram_save_cleanup(void *opaque)
 {
     RAMState **rsp = opaque;
 
     /* We don't use dirty log with background snapshots */
     if (!migrate_background_snapshot()) {
+        if (migrate_mapped_ram_incremental()) {
+            mapped_ram_incremental_finish();
+        }
+
         /* caller have hold BQL or is in a bh, so there is
          * no writing race against the migration bitmap
          */
-        if (global_dirty_tracking & GLOBAL_DIRTY_MIGRATION) {
+        if (!mapped_ram_base &&
+            (global_dirty_tracking & GLOBAL_DIRTY_MIGRATION)) {
             /*
              * do not stop dirty log without starting it, since
              * memory_global_dirty_log_stop will assert that
@@ -2711,6 +3199,11 @@ static bool ram_state_init(RAMState **rsp, Error **errp)
     (*rsp)->migration_dirty_pages = (*rsp)->ram_bytes_total >> TARGET_PAGE_BITS;
     ram_state_reset(*rsp);
 
+    /* We don't use dirty log with background snapshots */
+    if (!migrate_background_snapshot()) {
+        (*rsp)->sync_pool = ram_sync_pool_new((*rsp)->ram_bytes_total);
+    }
+
     return true;
 }
 
@@ -2720,6 +3213,9 @@ static void ram_list_init_bitmaps(void)
     RAMBlock *block;
     unsigned long pages;
     uint8_t shift;
+    /* Background snapshots don't use the dirty log */
+    uint8_t hot_page_rounds = migrate_background_snapshot() ?
+                              0 : migrate_hot_page_rounds();
 
     /* Skip setting bitmap if there is no RAM */
     if (ram_bytes_total()) {
@@ -2744,14 +3240,27 @@ static void ram_list_init_bitmaps(void)
              * new migration after a failed migration, ram_list.
              * dirty_memory[DIRTY_MEMORY_MIGRATION] don't include the whole
              * guest memory.
+             * Incremental snapshots only save the pages dirtied since the
+             * base, which the first sync picks up from the dirty log.
              */
             block->bmap = bitmap_new(pages);
-            bitmap_set(block->bmap, 0, pages);
+            if (!mapped_ram_delta) {
+                bitmap_set(block->bmap, 0, pages);
+            }
             if (migrate_mapped_ram()) {
                 block->file_bmap = bitmap_new(pages);
             }
             block->clear_bmap_shift = shift;
             block->clear_bmap = bitmap_new(clear_bmap_size(pages, shift));
+            if (hot_page_rounds) {
+                block->dirty_sync_bmap = bitmap_new(pages);
+                block->dirty_history = g_new(unsigned long *,
+                                             hot_page_rounds);
+                for (int i = 0; i < hot_page_rounds; i++) {
+                    block->dirty_history[i] = bitmap_new(pages);
+                }
+                block->dirty_history_len = hot_page_rounds;
+            }
         }
     }
 }
@@ -2783,7 +3292,14 @@ static bool ram_init_bitmaps(RAMState *rs, Error **errp)
             if (!ret) {
                 goto out_unlock;
             }
+            if (mapped_ram_delta) {
+                rs->migration_dirty_pages = 0;
+            }
             migration_bitmap_sync_precopy(rs, false);
+            if (mapped_ram_delta) {
+                trace_ram_save_mapped_ram_delta(mapped_ram_base,
+                                                rs->migration_dirty_pages);
+            }
         }
     }
 out_unlock:
@@ -2900,7 +3416,12 @@ void qemu_guest_free_page_hint(void *addr, size_t len)
     }
 }
 
-#define MAPPED_RAM_HDR_VERSION 1
+/* Longest path of the base of an incremental mapped-ram file, with NUL */
+#define MAPPED_RAM_BASE_MAX 1024
+/* Longest chain of bases followed when loading */
+#define MAPPED_RAM_BASE_MAX_DEPTH 64
+
+#define MAPPED_RAM_HDR_VERSION 2
 struct MappedRamHeader {
     uint32_t version;
     /*
@@ -2918,9 +3439,24 @@ struct MappedRamHeader {
      * are stored.
      */
     uint64_t pages_offset;
+    /*
+     * Version 2 onwards: the file that holds the pages missing from
+     * this one, and the offset of the header of this ramblock there.
+     * Empty for files that hold all pages.  A relative path is relative
+     * to the directory of this file.
+     */
+    uint64_t base_header_offset;
+    /* The size, and the UUID of the base, as a check that it is the same */
+    uint64_t base_size;
+    QemuUUID base_uuid;
+    /* Identifies this file once it is the base of another one */
+    QemuUUID uuid;
+    char base[MAPPED_RAM_BASE_MAX];
 } QEMU_PACKED;
 typedef struct MappedRamHeader MappedRamHeader;
 
+#define MAPPED_RAM_HDR_V1_SIZE offsetof(MappedRamHeader, base_header_offset)
+
 static void mapped_ram_setup_ramblock(QEMUFile *file, RAMBlock *block)
 {
     g_autofree MappedRamHeader *header = NULL;
@@ -2928,7 +3464,9 @@ static void mapped_ram_setup_ramblock(QEMUFile *file, RAMBlock *block)
     long num_pages;
 
     header = g_new0(MappedRamHeader, 1);
-    header_size = sizeof(MappedRamHeader);
+    /* Only files that are or can become a base need the newer header */
+    header_size = migrate_mapped_ram_incremental() ? sizeof(MappedRamHeader) :
+                                                     MAPPED_RAM_HDR_V1_SIZE;
 
     num_pages = block->used_length >> TARGET_PAGE_BITS;
     bitmap_size = BITS_TO_LONGS(num_pages) * sizeof(unsigned long);
@@ -2943,10 +3481,24 @@ static void mapped_ram_setup_ramblock(QEMUFile *file, RAMBlock *block)
                                    bitmap_size,
                                    MAPPED_RAM_FILE_OFFSET_ALIGNMENT);
 
-    header->version = cpu_to_be32(MAPPED_RAM_HDR_VERSION);
+    header->version = cpu_to_be32(migrate_mapped_ram_incremental() ?
+                                  MAPPED_RAM_HDR_VERSION : 1);
     header->page_size = cpu_to_be64(TARGET_PAGE_SIZE);
     header->bitmap_offset = cpu_to_be64(block->bitmap_offset);
     header->pages_offset = cpu_to_be64(block->pages_offset);
+    header->uuid = mapped_ram_uuid;
+
+    /*
+     * Ramblocks added since the base have no header there, but all of
+     * their pages are dirty.
+     */
+    if (mapped_ram_delta && block->header_offset) {
+        header->base_header_offset = cpu_to_be64(block->header_offset);
+        header->base_size = cpu_to_be64(mapped_ram_base_size);
+        header->base_uuid = mapped_ram_base_uuid;
+        pstrcpy(header->base, sizeof(header->base), mapped_ram_base_ref);
+    }
+    block->header_offset = qemu_get_offset(file);
 
     qemu_put_buffer(file, (uint8_t *) header, header_size);
 
@@ -2954,10 +3506,47 @@ static void mapped_ram_setup_ramblock(QEMUFile *file, RAMBlock *block)
     qemu_set_offset(file, block->pages_offset + block->used_length, SEEK_SET);
 }
 
+/*
+ * Check the version of @header, of which only the version 1 fields
+ * were read so far.  Returns the size of the fields that follow them
+ * in this version, or -1 on error.
+ */
+static ssize_t mapped_ram_header_check(MappedRamHeader *header, Error **errp)
+{
+    /* migration stream is big-endian */
+    header->version = be32_to_cpu(header->version);
+
+    if (header->version > MAPPED_RAM_HDR_VERSION) {
+        error_setg(errp, "Migration mapped-ram capability version not "
+                   "supported (expected <= %d, got %d)", MAPPED_RAM_HDR_VERSION,
+                   header->version);
+        return -1;
+    }
+
+    if (header->version < 2) {
+        memset((uint8_t *)header + MAPPED_RAM_HDR_V1_SIZE, 0,
+               sizeof(MappedRamHeader) - MAPPED_RAM_HDR_V1_SIZE);
+        return 0;
+    }
+
+    return sizeof(MappedRamHeader) - MAPPED_RAM_HDR_V1_SIZE;
+}
+
+static void mapped_ram_header_to_cpu(MappedRamHeader *header)
+{
+    header->page_size = be64_to_cpu(header->page_size);
+    header->bitmap_offset = be64_to_cpu(header->bitmap_offset);
+    header->pages_offset = be64_to_cpu(header->pages_offset);
+    header->base_header_offset = be64_to_cpu(header->base_header_offset);
+    header->base_size = be64_to_cpu(header->base_size);
+    header->base[sizeof(header->base) - 1] = 0;
+}
+
 static bool mapped_ram_read_header(QEMUFile *file, MappedRamHeader *header,
                                    Error **errp)
 {
-    size_t ret, header_size = sizeof(MappedRamHeader);
+    size_t ret, header_size = MAPPED_RAM_HDR_V1_SIZE;
+    ssize_t ext_size;
 
     ret = qemu_get_buffer(file, (uint8_t *)header, header_size);
     if (ret != header_size) {
@@ -2966,19 +3555,20 @@ static bool mapped_ram_read_header(QEMUFile *file, MappedRamHeader *header,
         return false;
     }
 
-    /* migration stream is big-endian */
-    header->version = be32_to_cpu(header->version);
+    ext_size = mapped_ram_header_check(header, errp);
+    if (ext_size < 0) {
+        return false;
+    }
 
-    if (header->version > MAPPED_RAM_HDR_VERSION) {
-        error_setg(errp, "Migration mapped-ram capability version not "
-                   "supported (expected <= %d, got %d)", MAPPED_RAM_HDR_VERSION,
-                   header->version);
+    ret = qemu_get_buffer(file, (uint8_t *)header + header_size, ext_size);
+    if (ret != ext_size) {
+        error_setg(errp, "Could not read whole mapped-ram migration header "
+                   "(expected %zd, got %zd bytes)", header_size + ext_size,
+                   header_size + ret);
         return false;
     }
 
-    header->page_size = be64_to_cpu(header->page_size);
-    header->bitmap_offset = be64_to_cpu(header->bitmap_offset);
-    header->pages_offset = be64_to_cpu(header->pages_offset);
+    mapped_ram_header_to_cpu(header);
 
     return true;
 }
@@ -3005,6 +3595,29 @@ static int ram_save_setup(QEMUFile *f, void *opaque, Error **errp)
     RAMBlock *block;
     int ret, max_hg_page_size;
 
+    if (migrate_mapped_ram_incremental()) {
+        const char *fname = file_get_outgoing_fname();
+
+        /*
+         * The dirty log only covers the time since the base if it was
+         * kept enabled all along.
+         */
+        mapped_ram_delta = mapped_ram_base &&
+                           (global_dirty_tracking & GLOBAL_DIRTY_MIGRATION);
+        /* Files not opened by path can't be the base of the next one */
+        mapped_ram_target = fname ? g_strdup(fname) : NULL;
+        qemu_uuid_generate(&mapped_ram_uuid);
+
+        if (mapped_ram_delta) {
+            mapped_ram_base_ref = mapped_ram_base_ref_new(fname);
+            if (strlen(mapped_ram_base_ref) >= MAPPED_RAM_BASE_MAX) {
+                warn_report("mapped-ram: path of base file %s is too long, "
+                            "saving all pages", mapped_ram_base);
+                mapped_ram_delta = false;
+            }
+        }
+    }
+
     /* migration has already setup the bitmap, reuse it. */
     if (!migration_in_colo_state()) {
         if (ram_init_all(rsp, errp) != 0) {
@@ -3283,6 +3896,15 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         }
     }
 
+    /*
+     * Device state sent over multifd must all be queued before the
+     * final sync, so that the destination has loaded it once the sync
+     * is seen.
+     */
+    if (!multifd_join_device_state_save_threads()) {
+        return -EINVAL;
+    }
+
     ret = multifd_send_sync_main();
     if (ret < 0) {
         return ret;
@@ -3620,6 +4242,8 @@ void colo_release_ram_cache(void)
  */
 static int ram_load_setup(QEMUFile *f, void *opaque, Error **errp)
 {
+    /* All of RAM is loaded again, don't let an older file fill it in */
+    postcopy_lazy_load_stop();
     xbzrle_load_setup();
     ramblock_recv_map_init();
 
@@ -3906,15 +4530,84 @@ static size_t ram_load_multifd_pages(void *host_addr, size_t size,
     return size;
 }
 
+/*
+ * Whether the pages of @block can be loaded by mapping the migration
+ * file over them.  That's only possible for private anonymous memory
+ * that QEMU allocated itself, everything else has to keep its own
+ * backing.  Memory backends are left out too: their memory policy,
+ * preallocation and the like apply to the mapping, and would be lost.
+ */
+static bool mapped_ram_can_mmap(RAMBlock *block)
+{
+    return migrate_mapped_ram_load_method() == MAPPED_RAM_LOAD_METHOD_MMAP &&
+        block->fd < 0 && block->guest_memfd < 0 &&
+        !qemu_ram_is_shared(block) &&
+        !(block->flags & RAM_PREALLOC) &&
+        !object_dynamic_cast(block->mr->owner, TYPE_MEMORY_BACKEND) &&
+        block->page_size == qemu_real_host_page_size();
+}
+
+/*
+ * Returns 1 if the @size bytes of pages at @offset were mapped from the
+ * migration file, 0 if they have to be read instead and -1 on error.
+ */
+static int mapped_ram_mmap_pages(QEMUFile *f, RAMBlock *block,
+                                 ram_addr_t offset, size_t size,
+                                 Error **errp)
+{
+    uint64_t file_offset = block->pages_offset + offset;
+    int ret;
+
+    if (size < MAPPED_RAM_MMAP_MIN_SIZE ||
+        !QEMU_IS_ALIGNED(offset | size | file_offset,
+                         qemu_real_host_page_size()) ||
+        !offset_in_ramblock(block, offset + size - 1)) {
+        return 0;
+    }
+
+    ret = file_map_pages(qemu_file_get_ioc(f), block->host + offset, size,
+                         file_offset, errp);
+    if (ret >= 0) {
+        /*
+         * Whether the file got mapped or anonymous memory was put back
+         * after failing to, the new mapping needs the advice again.
+         */
+        ram_block_setup_remapped_range(block, offset, size);
+    }
+    return ret;
+}
+
+/*
+ * Read the pages of @block that are set in @bitmap from @f.  @lazy tells
+ * whether they may be loaded lazily, which is not the case for files
+ * that only hold some of the pages.
+ */
 static bool read_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
                                      long num_pages, unsigned long *bitmap,
-                                     Error **errp)
+                                     bool lazy, Error **errp)
 {
     ERRP_GUARD();
     unsigned long set_bit_idx, clear_bit_idx;
     ram_addr_t offset;
     void *host;
     size_t read, unread, size;
+    bool use_mmap = mapped_ram_can_mmap(block);
+    unsigned int mapped_runs = 0;
+
+    if (lazy && migrate_mapped_ram_lazy()) {
+        int ret = postcopy_lazy_load_add_block(qemu_file_get_ioc(f), block,
+                                               num_pages, bitmap, errp);
+        if (ret) {
+            return ret > 0;
+        }
+    }
+
+#ifdef CONFIG_LINUX_IO_URING
+    if (migrate_mapped_ram_io_uring()) {
+        return file_read_ramblock_io_uring(qemu_file_get_ioc(f), block,
+                                           num_pages, bitmap, errp);
+    }
+#endif
 
     for (set_bit_idx = find_first_bit(bitmap, num_pages);
          set_bit_idx < num_pages;
@@ -3925,6 +4618,19 @@ static bool read_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
         unread = TARGET_PAGE_SIZE * (clear_bit_idx - set_bit_idx);
         offset = set_bit_idx << TARGET_PAGE_BITS;
 
+        if (use_mmap) {
+            int ret = mapped_ram_mmap_pages(f, block, offset, unread, errp);
+
+            if (ret < 0) {
+                return false;
+            } else if (ret) {
+                if (++mapped_runs == MAPPED_RAM_MMAP_MAX_RUNS) {
+                    use_mmap = false;
+                }
+                continue;
+            }
+        }
+
         while (unread > 0) {
             host = host_from_ram_block_offset(block, offset);
             if (!host) {
@@ -3961,6 +4667,178 @@ err:
     return false;
 }
 
+static bool mapped_ram_pread(QIOChannel *ioc, void *buf, size_t len,
+                             off_t offset, Error **errp)
+{
+    while (len) {
+        ssize_t ret = qio_channel_pread(ioc, buf, len, offset, errp);
+
+        if (ret < 0) {
+            return false;
+        } else if (ret == 0) {
+            error_setg(errp, "unexpected end of file at offset 0x%" PRIx64,
+                       (uint64_t)offset);
+            return false;
+        }
+        buf = (uint8_t *)buf + ret;
+        len -= ret;
+        offset += ret;
+    }
+
+    return true;
+}
+
+/*
+ * Load the pages of @block that are in the base file @path, whose header
+ * for the ramblock is at @header_offset, but not yet set in @loaded.
+ * The file must have the @size and @uuid recorded by the file that
+ * refers to it.  @loaded is updated with all pages of the file, and
+ * @header is filled with the header found there.
+ */
+static bool mapped_ram_load_base_file(RAMBlock *block, long num_pages,
+                                      unsigned long *loaded, const char *path,
+                                      uint64_t header_offset, uint64_t size,
+                                      const QemuUUID *uuid,
+                                      MappedRamHeader *header, Error **errp)
+{
+    size_t bitmap_size = BITS_TO_LONGS(num_pages) * sizeof(unsigned long);
+    g_autofree unsigned long *bitmap = bitmap_new(num_pages);
+    g_autofree unsigned long *todo = bitmap_new(num_pages);
+    g_autoptr(QIOChannelFile) fioc = NULL;
+    unsigned long set_bit_idx, clear_bit_idx;
+    QIOChannel *ioc;
+    ssize_t ext_size;
+    struct stat st;
+
+    fioc = qio_channel_file_new_path(path, O_RDONLY, 0, errp);
+    if (!fioc) {
+        return false;
+    }
+    ioc = QIO_CHANNEL(fioc);
+
+    if (fstat(fioc->fd, &st)) {
+        error_setg_errno(errp, errno, "failed to get file size");
+        return false;
+    }
+    if (st.st_size != size) {
+        error_setg(errp, "file size %" PRId64 " does not match the size "
+                   "%" PRIu64 " it was saved with, it changed since",
+                   (int64_t)st.st_size, size);
+        return false;
+    }
+
+    if (!mapped_ram_pread(ioc, header, MAPPED_RAM_HDR_V1_SIZE, header_offset,
+                          errp)) {
+        return false;
+    }
+    ext_size = mapped_ram_header_check(header, errp);
+    if (ext_size < 0 ||
+        !mapped_ram_pread(ioc, (uint8_t *)header + MAPPED_RAM_HDR_V1_SIZE,
+                          ext_size, header_offset + MAPPED_RAM_HDR_V1_SIZE,
+                          errp)) {
+        return false;
+    }
+    mapped_ram_header_to_cpu(header);
+
+    if (memcmp(&header->uuid, uuid, sizeof(*uuid))) {
+        error_setg(errp, "file is not the one that was saved as the base");
+        return false;
+    }
+
+    if (header->page_size != TARGET_PAGE_SIZE) {
+        error_setg(errp, "page size %" PRIu64 " does not match",
+                   header->page_size);
+        return false;
+    }
+
+    if (!mapped_ram_pread(ioc, bitmap, bitmap_size, header->bitmap_offset,
+                          errp)) {
+        return false;
+    }
+    bitmap_andnot(todo, bitmap, loaded, num_pages);
+    bitmap_or(loaded, loaded, bitmap, num_pages);
+
+    for (set_bit_idx = find_first_bit(todo, num_pages);
+         set_bit_idx < num_pages;
+         set_bit_idx = find_next_bit(todo, num_pages, clear_bit_idx + 1)) {
+        ram_addr_t offset = set_bit_idx << TARGET_PAGE_BITS;
+        size_t size;
+
+        clear_bit_idx = find_next_zero_bit(todo, num_pages, set_bit_idx + 1);
+        size = (clear_bit_idx - set_bit_idx) << TARGET_PAGE_BITS;
+
+        if (!offset_in_ramblock(block, offset + size - 1)) {
+            error_setg(errp, "page outside of ramblock range");
+            return false;
+        }
+        if (!mapped_ram_pread(ioc, block->host + offset, size,
+                              header->pages_offset + offset, errp)) {
+            return false;
+        }
+    }
+
+    trace_mapped_ram_load_base(block->idstr, path,
+                               bitmap_count_one(todo, num_pages));
+    return true;
+}
+
+/*
+ * Load the pages of @block that are not set in @loaded from the chain
+ * of base files of @header, each from the newest file that has it.
+ * Relative base paths are relative to the directory of the file that
+ * refers to them, starting with the migration file @fname if known.
+ */
+static bool mapped_ram_load_base(RAMBlock *block, long num_pages,
+                                 unsigned long *loaded, const char *fname,
+                                 const MappedRamHeader *header, Error **errp)
+{
+    g_autofree MappedRamHeader *base = g_memdup2(header, sizeof(*header));
+    g_autofree char *from = g_strdup(fname);
+    int depth = 0;
+
+    while (base->base[0]) {
+        g_autofree char *path = NULL;
+        g_autofree char *real_path = NULL;
+        g_autofree char *real_from = NULL;
+        QemuUUID uuid = base->base_uuid;
+
+        if (++depth > MAPPED_RAM_BASE_MAX_DEPTH) {
+            error_setg(errp, "(%s) more than %d base files", block->idstr,
+                       MAPPED_RAM_BASE_MAX_DEPTH);
+            return false;
+        }
+
+        if (from && !g_path_is_absolute(base->base)) {
+            g_autofree char *dir = g_path_get_dirname(from);
+
+            path = g_build_filename(dir, base->base, NULL);
+        } else {
+            path = g_strdup(base->base);
+        }
+
+        real_path = realpath(path, NULL);
+        real_from = from ? realpath(from, NULL) : NULL;
+        if (real_path && real_from && !strcmp(real_path, real_from)) {
+            error_setg(errp, "(%s) file %s is its own base", block->idstr,
+                       from);
+            return false;
+        }
+
+        if (!mapped_ram_load_base_file(block, num_pages, loaded, path,
+                                       base->base_header_offset,
+                                       base->base_size, &uuid, base, errp)) {
+            error_prepend(errp, "(%s) failed to load pages from base file "
+                          "%s: ", block->idstr, path);
+            return false;
+        }
+
+        g_free(from);
+        from = g_steal_pointer(&path);
+    }
+
+    return true;
+}
+
 static void parse_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
                                       ram_addr_t length, Error **errp)
 {
@@ -3998,7 +4876,22 @@ static void parse_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
         return;
     }
 
-    if (!read_ramblock_mapped_ram(f, block, num_pages, bitmap, errp)) {
+    /*
+     * An incremental file only holds the pages dirtied since its base,
+     * the others come from the chain of bases.
+     */
+    if (header.base[0]) {
+        g_autofree unsigned long *loaded = bitmap_new(num_pages);
+
+        bitmap_copy(loaded, bitmap, num_pages);
+        if (!mapped_ram_load_base(block, num_pages, loaded,
+                                  file_get_incoming_fname(), &header, errp)) {
+            return;
+        }
+    }
+
+    if (!read_ramblock_mapped_ram(f, block, num_pages, bitmap,
+                                  !header.base[0], errp)) {
         return;
     }
 
@@ -4118,6 +5011,7 @@ static int ram_load_precopy(QEMUFile *f)
 {
     MigrationIncomingState *mis = migration_incoming_get_current();
     int flags = 0, ret = 0, invalid_flags = 0, i = 0;
+    Error *local_err = NULL;
 
     if (migrate_mapped_ram()) {
         invalid_flags |= (RAM_SAVE_FLAG_HOOK | RAM_SAVE_FLAG_MULTIFD_FLUSH |
@@ -4211,6 +5105,15 @@ static int ram_load_precopy(QEMUFile *f)
              */
             if (migrate_mapped_ram()) {
                 multifd_recv_sync_main();
+
+                /*
+                 * Pages of lazily loaded ramblocks are only read once the
+                 * guest or the device state loading touches them.
+                 */
+                if (!ret && !postcopy_lazy_load_start(&local_err)) {
+                    error_report_err(local_err);
+                    ret = -EINVAL;
+                }
             }
             break;
 
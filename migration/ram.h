@@ -78,6 +78,9 @@ void postcopy_preempt_shutdown_file(MigrationState *s);
 void *postcopy_preempt_thread(void *opaque);
 void ramblock_set_file_bmap_atomic(RAMBlock *block, ram_addr_t offset,
                                    bool set);
+void ram_mapped_ram_incremental_reset(void);
+bool ram_mapped_ram_check_target(const char *fname, Error **errp);
+bool ram_mapped_ram_delta(void);
 
 /* ram cache */
 int colo_init_ram_cache(void);
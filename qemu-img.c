@@ -86,6 +86,7 @@ enum {
     OPTION_BITMAPS = 275,
     OPTION_FORCE = 276,
     OPTION_SKIP_BROKEN = 277,
+    OPTION_DEDUP = 278,
 };
 
 typedef enum OutputFormat {
@@ -1273,6 +1274,31 @@ static int is_allocated_sectors_min(const uint8_t *buf, int n, int *pnum,
     return 1;
 }
 
+/*
+ * Like is_allocated_sectors, but in units of whole clusters of
+ * 'cluster_sectors' sectors, because a compressed cluster can only be left
+ * out if it is zero as a whole.  The last cluster may be shorter.
+ */
+static int is_allocated_clusters(const uint8_t *buf, int n, int *pnum,
+                                 int cluster_sectors)
+{
+    bool is_zero;
+    int i;
+
+    is_zero = buffer_is_zero(buf, MIN(n, cluster_sectors) * BDRV_SECTOR_SIZE);
+    for (i = cluster_sectors; i < n; i += cluster_sectors) {
+        int len = MIN(n - i, cluster_sectors);
+
+        if (is_zero != buffer_is_zero(buf + i * BDRV_SECTOR_SIZE,
+                                      len * BDRV_SECTOR_SIZE)) {
+            break;
+        }
+    }
+
+    *pnum = MIN(i, n);
+    return !is_zero;
+}
+
 /*
  * Compares two buffers chunk by chunk, where @chsize is the chunk size.
  * If @chsize is 0, default chunk size of BDRV_SECTOR_SIZE is used.
@@ -1315,39 +1341,218 @@ static int compare_buffers(const uint8_t *buf1, const uint8_t *buf2,
  *
  * Intended for use by 'qemu-img compare': Returns 0 in case sectors are
  * filled with 0, 1 if sectors contain non-zero data (this is a comparison
- * failure), and 4 on error (the exit status for read errors), after emitting
- * an error message.
+ * failure), and 4 on error (the exit status for read errors), after setting
+ * @errp.
  *
  * @param blk:  BlockBackend for the image
  * @param offset: Starting offset to check
  * @param bytes: Number of bytes to check
  * @param filename: Name of disk file we are checking (logging purpose)
  * @param buffer: Allocated buffer for storing read data
- * @param quiet: Flag for quiet mode
+ * @param mismatch: Set to the offset of the first non-zero byte
+ * @param errp: Set on error
  */
-static int check_empty_sectors(BlockBackend *blk, int64_t offset,
-                               int64_t bytes, const char *filename,
-                               uint8_t *buffer, bool quiet)
+static int coroutine_mixed_fn
+check_empty_sectors(BlockBackend *blk, int64_t offset, int64_t bytes,
+                    const char *filename, uint8_t *buffer, int64_t *mismatch,
+                    Error **errp)
 {
     int ret = 0;
     int64_t idx;
 
     ret = blk_pread(blk, offset, bytes, buffer, 0);
     if (ret < 0) {
-        error_report("Error while reading offset %" PRId64 " of %s: %s",
-                     offset, filename, strerror(-ret));
+        error_setg(errp, "Error while reading offset %" PRId64 " of %s: %s",
+                   offset, filename, strerror(-ret));
         return 4;
     }
     idx = find_nonzero(buffer, bytes);
     if (idx >= 0) {
-        qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                offset + idx);
+        *mismatch = offset + idx;
         return 1;
     }
 
     return 0;
 }
 
+#define MAX_COROUTINES 16
+
+typedef struct ImgCompareState {
+    BlockBackend *blk1, *blk2;
+    const char *filename1, *filename2;
+    int64_t total_size1, total_size2;
+    int64_t total_size;
+    int64_t progress_base;
+    bool strict;
+    long num_coroutines;
+    int running_coroutines;
+    CoMutex lock;
+    /* Next offset whose block status is looked up */
+    int64_t offset;
+    /* Lowest offset at which the images were found to differ, or -1 */
+    int64_t mismatch_offset;
+    /* Whether that is a block status mismatch in strict mode */
+    bool status_mismatch;
+    /* Lowest offset at which an error occurred, or -1 */
+    int64_t error_offset;
+    /* That error and the exit status for it */
+    Error *err;
+    int ret;
+} ImgCompareState;
+
+/*
+ * Record that the images differ at @offset.  The chunks are compared out
+ * of order, so only the lowest offset is kept to be reported at the end.
+ */
+static void compare_set_mismatch(ImgCompareState *s, int64_t offset,
+                                 bool status_mismatch)
+{
+    if (s->mismatch_offset < 0 || offset < s->mismatch_offset) {
+        s->mismatch_offset = offset;
+        s->status_mismatch = status_mismatch;
+    }
+}
+
+/*
+ * Record an error at @offset, with @ret as the exit status.  Like a
+ * mismatch, it is only reported at the end, and only if neither a mismatch
+ * nor an error was found at a lower offset.
+ */
+static void compare_set_error(ImgCompareState *s, int64_t offset, int ret,
+                              Error *err)
+{
+    if (s->error_offset < 0 || offset < s->error_offset) {
+        error_free(s->err);
+        s->error_offset = offset;
+        s->err = err;
+        s->ret = ret;
+    } else {
+        error_free(err);
+    }
+}
+
+/* Chunks after the first mismatch or error don't need to be compared */
+static bool compare_done(ImgCompareState *s)
+{
+    int64_t end = s->total_size;
+
+    if (s->mismatch_offset >= 0) {
+        end = MIN(end, s->mismatch_offset);
+    }
+    if (s->error_offset >= 0) {
+        end = MIN(end, s->error_offset);
+    }
+    return s->offset >= end;
+}
+
+/*
+ * Compare the common part of the images.  Each coroutine looks up the
+ * block status of the next chunk and then reads and compares it while the
+ * other coroutines continue with the following chunks.
+ */
+static void coroutine_fn compare_co_do_compare(void *opaque)
+{
+    ImgCompareState *s = opaque;
+    uint8_t *buf1, *buf2;
+
+    s->running_coroutines++;
+    buf1 = blk_blockalign(s->blk1, IO_BUF_SIZE);
+    buf2 = blk_blockalign(s->blk2, IO_BUF_SIZE);
+
+    while (1) {
+        int64_t offset, chunk, pnum1, pnum2, pnum, mismatch;
+        int status1, status2, allocated1, allocated2;
+        Error *err = NULL;
+        int ret;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (compare_done(s)) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        offset = s->offset;
+
+        WITH_GRAPH_RDLOCK_GUARD() {
+            status1 = bdrv_block_status_above(blk_bs(s->blk1), NULL, offset,
+                                              s->total_size1 - offset, &pnum1,
+                                              NULL, NULL);
+            status2 = status1 < 0 ? 0 :
+                      bdrv_block_status_above(blk_bs(s->blk2), NULL, offset,
+                                              s->total_size2 - offset, &pnum2,
+                                              NULL, NULL);
+        }
+        if (status1 < 0 || status2 < 0) {
+            error_setg(&err, "Sector allocation test failed for %s",
+                       status1 < 0 ? s->filename1 : s->filename2);
+            compare_set_error(s, offset, 3, err);
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        allocated1 = status1 & BDRV_BLOCK_ALLOCATED;
+        allocated2 = status2 & BDRV_BLOCK_ALLOCATED;
+
+        assert(pnum1 && pnum2);
+        chunk = MIN(pnum1, pnum2);
+
+        if (s->strict && status1 != status2) {
+            compare_set_mismatch(s, offset, true);
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        if ((status1 & BDRV_BLOCK_ZERO) && (status2 & BDRV_BLOCK_ZERO)) {
+            allocated1 = allocated2 = 0;
+        } else if (allocated1 || allocated2) {
+            chunk = MIN(chunk, IO_BUF_SIZE);
+        }
+        s->offset += chunk;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (!allocated1 && !allocated2) {
+            /* nothing to do */
+        } else if (allocated1 == allocated2) {
+            ret = blk_co_pread(s->blk1, offset, chunk, buf1, 0);
+            if (ret < 0) {
+                error_setg(&err, "Error while reading offset %" PRId64
+                           " of %s: %s", offset, s->filename1, strerror(-ret));
+                compare_set_error(s, offset, 4, err);
+                break;
+            }
+            ret = blk_co_pread(s->blk2, offset, chunk, buf2, 0);
+            if (ret < 0) {
+                error_setg(&err, "Error while reading offset %" PRId64
+                           " of %s: %s", offset, s->filename2, strerror(-ret));
+                compare_set_error(s, offset, 4, err);
+                break;
+            }
+            ret = compare_buffers(buf1, buf2, chunk, 0, &pnum);
+            if (ret || pnum != chunk) {
+                compare_set_mismatch(s, offset + (ret ? 0 : pnum), false);
+                break;
+            }
+        } else {
+            if (allocated1) {
+                ret = check_empty_sectors(s->blk1, offset, chunk,
+                                          s->filename1, buf1, &mismatch, &err);
+            } else {
+                ret = check_empty_sectors(s->blk2, offset, chunk,
+                                          s->filename2, buf1, &mismatch, &err);
+            }
+            if (ret == 1) {
+                compare_set_mismatch(s, mismatch, false);
+                break;
+            } else if (ret) {
+                compare_set_error(s, offset, ret, err);
+                break;
+            }
+        }
+        qemu_progress_print(((float) chunk / s->progress_base) * 100, 100);
+    }
+
+    qemu_vfree(buf1);
+    qemu_vfree(buf2);
+    s->running_coroutines--;
+}
+
 /*
  * Compares two images. Exit codes:
  *
@@ -1359,22 +1564,22 @@ static int img_compare(int argc, char **argv)
 {
     const char *fmt1 = NULL, *fmt2 = NULL, *cache, *filename1, *filename2;
     BlockBackend *blk1, *blk2;
-    BlockDriverState *bs1, *bs2;
+    ImgCompareState s;
     int64_t total_size1, total_size2;
-    uint8_t *buf1 = NULL, *buf2 = NULL;
-    int64_t pnum1, pnum2;
-    int allocated1, allocated2;
+    uint8_t *buf1 = NULL;
     int ret = 0; /* return value - 0 Ident, 1 Different, >1 Error */
     bool progress = false, quiet = false, strict = false;
     int flags;
     bool writethrough;
     int64_t total_size;
-    int64_t offset = 0;
-    int64_t chunk;
-    int c;
+    int64_t offset;
+    int64_t chunk, mismatch;
+    int c, i;
     uint64_t progress_base;
     bool image_opts = false;
     bool force_share = false;
+    long num_coroutines = 8;
+    Error *err = NULL;
 
     cache = BDRV_DEFAULT_CACHE;
     for (;;) {
@@ -1385,7 +1590,7 @@ static int img_compare(int argc, char **argv)
             {"force-share", no_argument, 0, 'U'},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, ":hf:F:T:pqsU",
+        c = getopt_long(argc, argv, ":hf:F:T:m:pqsU",
                         long_options, NULL);
         if (c == -1) {
             break;
@@ -1409,6 +1614,14 @@ static int img_compare(int argc, char **argv)
         case 'T':
             cache = optarg;
             break;
+        case 'm':
+            if (qemu_strtol(optarg, NULL, 0, &num_coroutines) ||
+                num_coroutines < 1 || num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d", MAX_COROUTINES);
+                return 2;
+            }
+            break;
         case 'p':
             progress = true;
             break;
@@ -1478,11 +1691,7 @@ static int img_compare(int argc, char **argv)
         ret = 2;
         goto out2;
     }
-    bs1 = blk_bs(blk1);
-    bs2 = blk_bs(blk2);
-
     buf1 = blk_blockalign(blk1, IO_BUF_SIZE);
-    buf2 = blk_blockalign(blk2, IO_BUF_SIZE);
     total_size1 = blk_getlength(blk1);
     if (total_size1 < 0) {
         error_report("Can't get size of %s: %s",
@@ -1508,87 +1717,47 @@ static int img_compare(int argc, char **argv)
         goto out;
     }
 
-    while (offset < total_size) {
-        int status1, status2;
-
-        status1 = bdrv_block_status_above(bs1, NULL, offset,
-                                          total_size1 - offset, &pnum1, NULL,
-                                          NULL);
-        if (status1 < 0) {
-            ret = 3;
-            error_report("Sector allocation test failed for %s", filename1);
-            goto out;
-        }
-        allocated1 = status1 & BDRV_BLOCK_ALLOCATED;
-
-        status2 = bdrv_block_status_above(bs2, NULL, offset,
-                                          total_size2 - offset, &pnum2, NULL,
-                                          NULL);
-        if (status2 < 0) {
-            ret = 3;
-            error_report("Sector allocation test failed for %s", filename2);
-            goto out;
-        }
-        allocated2 = status2 & BDRV_BLOCK_ALLOCATED;
-
-        assert(pnum1 && pnum2);
-        chunk = MIN(pnum1, pnum2);
-
-        if (strict) {
-            if (status1 != status2) {
-                ret = 1;
-                qprintf(quiet, "Strict mode: Offset %" PRId64
-                        " block status mismatch!\n", offset);
-                goto out;
-            }
-        }
-        if ((status1 & BDRV_BLOCK_ZERO) && (status2 & BDRV_BLOCK_ZERO)) {
-            /* nothing to do */
-        } else if (allocated1 == allocated2) {
-            if (allocated1) {
-                int64_t pnum;
+    s = (ImgCompareState) {
+        .blk1            = blk1,
+        .blk2            = blk2,
+        .filename1       = filename1,
+        .filename2       = filename2,
+        .total_size1     = total_size1,
+        .total_size2     = total_size2,
+        .total_size      = total_size,
+        .progress_base   = progress_base,
+        .strict          = strict,
+        .num_coroutines  = num_coroutines,
+        .mismatch_offset = -1,
+        .error_offset    = -1,
+    };
+    qemu_co_mutex_init(&s.lock);
+    for (i = 0; i < s.num_coroutines; i++) {
+        qemu_coroutine_enter(qemu_coroutine_create(compare_co_do_compare, &s));
+    }
+    while (s.running_coroutines) {
+        main_loop_wait(false);
+    }
 
-                chunk = MIN(chunk, IO_BUF_SIZE);
-                ret = blk_pread(blk1, offset, chunk, buf1, 0);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s",
-                                 offset, filename1, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = blk_pread(blk2, offset, chunk, buf2, 0);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s",
-                                 offset, filename2, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = compare_buffers(buf1, buf2, chunk, 0, &pnum);
-                if (ret || pnum != chunk) {
-                    qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                            offset + (ret ? 0 : pnum));
-                    ret = 1;
-                    goto out;
-                }
-            }
+    if (s.error_offset >= 0 &&
+        (s.mismatch_offset < 0 || s.error_offset < s.mismatch_offset)) {
+        error_report_err(s.err);
+        ret = s.ret;
+        goto out;
+    }
+    error_free(s.err);
+    if (s.mismatch_offset >= 0) {
+        if (s.status_mismatch) {
+            qprintf(quiet, "Strict mode: Offset %" PRId64
+                    " block status mismatch!\n", s.mismatch_offset);
         } else {
-            chunk = MIN(chunk, IO_BUF_SIZE);
-            if (allocated1) {
-                ret = check_empty_sectors(blk1, offset, chunk,
-                                          filename1, buf1, quiet);
-            } else {
-                ret = check_empty_sectors(blk2, offset, chunk,
-                                          filename2, buf1, quiet);
-            }
-            if (ret) {
-                goto out;
-            }
+            qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
+                    s.mismatch_offset);
         }
-        offset += chunk;
-        qemu_progress_print(((float) chunk / progress_base) * 100, 100);
+        ret = 1;
+        goto out;
     }
+    offset = total_size;
 
     if (total_size1 != total_size2) {
         BlockBackend *blk_over;
@@ -1617,7 +1786,14 @@ static int img_compare(int argc, char **argv)
             if (ret & BDRV_BLOCK_ALLOCATED && !(ret & BDRV_BLOCK_ZERO)) {
                 chunk = MIN(chunk, IO_BUF_SIZE);
                 ret = check_empty_sectors(blk_over, offset, chunk,
-                                          filename_over, buf1, quiet);
+                                          filename_over, buf1, &mismatch,
+                                          &err);
+                if (ret == 1) {
+                    qprintf(quiet, "Content mismatch at offset %" PRId64
+                            "!\n", mismatch);
+                } else if (ret) {
+                    error_report_err(err);
+                }
                 if (ret) {
                     goto out;
                 }
@@ -1632,7 +1808,6 @@ static int img_compare(int argc, char **argv)
 
 out:
     qemu_vfree(buf1);
-    qemu_vfree(buf2);
     blk_unref(blk2);
 out2:
     blk_unref(blk1);
@@ -1664,7 +1839,7 @@ enum ImgConvertBlockStatus {
     BLK_BACKING_FILE,
 };
 
-#define MAX_COROUTINES 16
+#define MAX_BUF_SECTORS 32768
 #define CONVERT_THROTTLE_GROUP "img_convert"
 
 typedef struct ImgConvertState {
@@ -1897,14 +2072,14 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
              * is real non-zero data, we must write it. Otherwise we can treat
              * it as zero sectors.
              * Compressed clusters need to be written as a whole, so in that
-             * case we can only save the write if the buffer is completely
-             * zeroed. */
+             * case we can only save the write of clusters that are
+             * completely zeroed. */
             if (!s->min_sparse ||
                 (!s->compressed &&
                  is_allocated_sectors_min(buf, n, &n, s->min_sparse,
                                           sector_num, s->alignment)) ||
                 (s->compressed &&
-                 !buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)))
+                 is_allocated_clusters(buf, n, &n, s->cluster_sectors)))
             {
                 ret = blk_co_pwrite(s->target, sector_num << BDRV_SECTOR_BITS,
                                     n << BDRV_SECTOR_BITS, buf, flags);
@@ -2105,14 +2280,22 @@ static int convert_do_copy(ImgConvertState *s)
         bdrv_graph_rdunlock_main_loop();
     }
 
-    /* Allocate buffer for copied data. For compressed images, only one cluster
-     * can be copied at a time. */
+    /*
+     * Allocate buffer for copied data. For compressed images, the buffer
+     * must hold whole clusters.  The clusters of a request are compressed
+     * in parallel by the format driver, so make it large enough to keep
+     * all host CPUs busy while the writes of the coroutines are kept in
+     * order.
+     */
     if (s->compressed) {
         if (s->cluster_sectors <= 0 || s->cluster_sectors > s->buf_sectors) {
             error_report("invalid cluster size");
             return -EINVAL;
         }
-        s->buf_sectors = s->cluster_sectors;
+        s->buf_sectors = MIN(MAX_BUF_SECTORS,
+                             MAX(s->buf_sectors, s->cluster_sectors * 2 *
+                                                 g_get_num_processors()));
+        s->buf_sectors = QEMU_ALIGN_DOWN(s->buf_sectors, s->cluster_sectors);
     }
 
     while (sector_num < s->total_sectors) {
@@ -2218,8 +2401,6 @@ static int convert_copy_bitmaps(BlockDriverState *src, BlockDriverState *dst,
     return 0;
 }
 
-#define MAX_BUF_SECTORS 32768
-
 static void set_rate_limit(BlockBackend *blk, int64_t rate_limit)
 {
     ThrottleConfig cfg;
@@ -2253,6 +2434,7 @@ static int img_convert(int argc, char **argv)
     bool explict_min_sparse = false;
     bool bitmaps = false;
     bool skip_broken = false;
+    bool dedup = false;
     int64_t rate_limit = 0;
 
     ImgConvertState s = (ImgConvertState) {
@@ -2275,6 +2457,7 @@ static int img_convert(int argc, char **argv)
             {"target-is-zero", no_argument, 0, OPTION_TARGET_IS_ZERO},
             {"bitmaps", no_argument, 0, OPTION_BITMAPS},
             {"skip-broken-bitmaps", no_argument, 0, OPTION_SKIP_BROKEN},
+            {"dedup", no_argument, 0, OPTION_DEDUP},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hf:O:B:CcF:o:l:S:pt:T:qnm:WUr:",
@@ -2409,6 +2592,9 @@ static int img_convert(int argc, char **argv)
         case OPTION_SKIP_BROKEN:
             skip_broken = true;
             break;
+        case OPTION_DEDUP:
+            dedup = true;
+            break;
         }
     }
 
@@ -2436,6 +2622,22 @@ static int img_convert(int argc, char **argv)
         goto fail_getopt;
     }
 
+    if (dedup && s.compressed) {
+        error_report("Cannot deduplicate when -c is used");
+        goto fail_getopt;
+    }
+
+    if (dedup && s.copy_range) {
+        error_report("Cannot enable copy offloading when --dedup is used");
+        goto fail_getopt;
+    }
+
+    if (dedup && skip_create) {
+        error_report("--dedup cannot be used with -n, use "
+                     "--target-image-opts with dedup=on instead");
+        goto fail_getopt;
+    }
+
     if (tgt_image_opts && !skip_create) {
         error_report("--target-image-opts requires use of -n flag");
         goto fail_getopt;
@@ -2702,6 +2904,9 @@ static int img_convert(int argc, char **argv)
          * That has to wait for bdrv_create to be improved
          * to allow filenames in option syntax
          */
+        if (dedup) {
+            qdict_put_bool(open_opts, "dedup", true);
+        }
         s.target = img_open_file(out_filename, open_opts, out_fmt,
                                  flags, writethrough, s.quiet, false);
         open_opts = NULL; /* blk_new_open will have freed it */
@@ -4490,9 +4695,11 @@ static void bench_cb(void *opaque, int ret)
         b->offset += b->step;
         b->offset %= b->image_size;
         if (b->write) {
-            acb = blk_aio_pwritev(b->blk, offset, b->qiov, 0, bench_cb, b);
+            acb = blk_aio_pwritev(b->blk, offset, b->qiov,
+                                  BDRV_REQ_REGISTERED_BUF, bench_cb, b);
         } else {
-            acb = blk_aio_preadv(b->blk, offset, b->qiov, 0, bench_cb, b);
+            acb = blk_aio_preadv(b->blk, offset, b->qiov,
+                                 BDRV_REQ_REGISTERED_BUF, bench_cb, b);
         }
         if (!acb) {
             error_report("Failed to issue request");
@@ -187,6 +187,7 @@ DEF("accel", HAS_ARG, QEMU_OPTION_accel,
     "                one-insn-per-tb=on|off (one guest instruction per TCG translation block)\n"
     "                split-wx=on|off (enable TCG split w^x mapping)\n"
     "                tb-size=n (TCG translation block cache size)\n"
+    "                tlb-min-bits=n,tlb-max-bits=n (bounds of the TCG softmmu TLB size)\n"
     "                dirty-ring-size=n (KVM dirty ring GFN count, default 0)\n"
     "                eager-split-size=n (KVM Eager Page Split chunk size, default 0, disabled. ARM only)\n"
     "                notify-vmexit=run|internal-error|disable,notify-window=n (enable notify VM exit and set notify window, x86 only)\n"
@@ -230,6 +231,14 @@ SRST
     ``tb-size=n``
         Controls the size (in MiB) of the TCG translation block cache.
 
+    ``tlb-min-bits=n,tlb-max-bits=n``
+        Bound the size of the TCG softmmu TLB of each MMU mode to between
+        2^tlb-min-bits and 2^tlb-max-bits entries. The TLB is resized
+        dynamically within these bounds based on its use rate, conflict
+        misses and flush frequency. The bounds can only be narrowed from
+        the defaults, which depend on the target; values above the
+        target's maximum are rejected.
+
     ``thread=single|multi``
         Controls number of TCG threads. When the TCG is multi-threaded
         there will be one thread per vCPU therefore taking advantage of
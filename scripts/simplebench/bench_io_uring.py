@@ -0,0 +1,137 @@
+#!/usr/bin/env python3
+#
+# Benchmark the io_uring AIO backend of file-posix against Linux AIO
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+
+import sys
+import subprocess
+import re
+import json
+
+import simplebench
+from results_to_text import results_to_text
+
+
+def qemu_img_bench(args):
+    p = subprocess.run(args, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                       universal_newlines=True)
+
+    if p.returncode == 0:
+        try:
+            m = re.search(r'Run completed in (\d+.\d+) seconds.', p.stdout)
+            return {'seconds': float(m.group(1))}
+        except Exception:
+            return {'error': f'failed to parse qemu-img output: {p.stdout}'}
+    else:
+        return {'error': f'qemu-img failed: {p.returncode}: {p.stdout}'}
+
+
+def bench_func(env, case):
+    opts = ('driver=raw,file.driver=file,'
+            f"file.filename={case['filename']},{env['opts']}")
+
+    args = [env['qemu-img-binary'], 'bench', '-c', str(case['count']),
+            '-d', str(case['depth']), '-s', case['block-size'], '-t', 'none',
+            '--image-opts', opts]
+    if case['write']:
+        args.append('-w')
+
+    return qemu_img_bench(args)
+
+
+def auto_count_bench_func(env, case):
+    case['count'] = 1000
+    while True:
+        res = bench_func(env, case)
+        if 'error' in res:
+            return res
+
+        if res['seconds'] >= 1:
+            break
+
+        case['count'] *= 10
+
+    if res['seconds'] < 5:
+        case['count'] = round(case['count'] * 5 / res['seconds'])
+        res = bench_func(env, case)
+        if 'error' in res:
+            return res
+
+    res['iops'] = case['count'] / res['seconds']
+    return res
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2:
+        print(f'USAGE: {sys.argv[0]} <qemu-img binary> '
+              'DISK_NAME:FILE_OR_DEVICE ...')
+        print('All data on the given files or devices is overwritten.')
+        exit(1)
+
+    qemu_img = sys.argv[1]
+
+    envs = [
+        {
+            'id': 'linux-aio',
+            'opts': 'file.aio=native',
+        },
+        {
+            'id': 'io_uring',
+            'opts': 'file.aio=io_uring',
+        },
+        {
+            'id': 'io_uring, fixed buffers',
+            'opts': 'file.aio=io_uring,file.io-uring-fixed-buffers=on',
+        },
+        {
+            'id': 'io_uring, fixed buffers, sqpoll',
+            'opts': 'file.aio=io_uring,file.io-uring-fixed-buffers=on,'
+                    'file.io-uring-sqpoll=on',
+        },
+        {
+            'id': 'io_uring, fixed buffers, iopoll',
+            'opts': 'file.aio=io_uring,file.io-uring-fixed-buffers=on,'
+                    'file.io-uring-iopoll=on',
+        },
+    ]
+    for env in envs:
+        env['qemu-img-binary'] = qemu_img
+
+    cases = []
+    for disk in sys.argv[2:]:
+        name, path = disk.split(':')
+        for write in (False, True):
+            op = 'write' if write else 'read'
+            cases.append({
+                'id': f'{name}, {op} 4k, depth 1',
+                'filename': path,
+                'block-size': '4k',
+                'depth': 1,
+                'write': write,
+            })
+            cases.append({
+                'id': f'{name}, {op} 4k, depth 64',
+                'filename': path,
+                'block-size': '4k',
+                'depth': 64,
+                'write': write,
+            })
+
+    result = simplebench.bench(auto_count_bench_func, envs, cases, count=5)
+    print(results_to_text(result))
+    with open('results.json', 'w') as f:
+        json.dump(result, f, indent=4)
@@ -1700,6 +1700,24 @@ static int memory_try_enable_merging(void *addr, size_t len)
     return qemu_madvise(addr, len, QEMU_MADV_MERGEABLE);
 }
 
+/*
+ * Give the @length bytes at @offset of @rb, which have just been mapped
+ * anew over anonymous memory that QEMU allocated itself, the same host
+ * memory advice as when the block was allocated.
+ */
+void ram_block_setup_remapped_range(RAMBlock *rb, uint64_t offset,
+                                    size_t length)
+{
+    void *host = ramblock_ptr(rb, offset);
+
+    memory_try_enable_merging(host, length);
+    qemu_ram_setup_dump(host, length);
+    qemu_madvise(host, length, QEMU_MADV_HUGEPAGE);
+    if (!qtest_enabled()) {
+        qemu_madvise(host, length, QEMU_MADV_DONTFORK);
+    }
+}
+
 /*
  * Resizing RAM while migrating can result in the migration being canceled.
  * Care has to be taken if the guest might have already detected the memory.
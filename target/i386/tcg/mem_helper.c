@@ -55,3 +55,146 @@ void helper_boundl(CPUX86State *env, target_ulong a0, int v)
         raise_exception_ra(env, EXCP05_BOUND, GETPC());
     }
 }
+
+/*
+ * The bulk of REP MOVS and REP STOS is done here on host memory, one
+ * page at a time, leaving the last iteration to the translated loop.
+ * This does nothing, and leaves all iterations to the translated loop,
+ * whenever the fast path does not apply: backwards direction, MMIO,
+ * watchpoints or pages that are not mapped yet.
+ */
+
+/* Number of elements that can be accessed at ADDR with register REG. */
+static target_ulong rep_string_limit(CPUX86State *env, MemOp aflag,
+                                     MemOp ot, target_ulong addr, int reg)
+{
+    target_ulong mask = MAKE_64BIT_MASK(0, 8 << aflag);
+    target_ulong page_left = -(addr | TARGET_PAGE_MASK) >> ot;
+    target_ulong reg_left = (mask - (env->regs[reg] & mask)) >> ot;
+
+    return MIN(page_left, reg_left);
+}
+
+static void rep_string_add_reg(CPUX86State *env, MemOp aflag,
+                               int reg, target_ulong val)
+{
+    target_ulong r = env->regs[reg] + val;
+
+    switch (aflag) {
+    case MO_16:
+        env->regs[reg] = (env->regs[reg] & ~0xffff) | (r & 0xffff);
+        break;
+    case MO_32:
+        env->regs[reg] = (uint32_t)r;
+        break;
+    default:
+        env->regs[reg] = r;
+        break;
+    }
+}
+
+/* Number of iterations to do in bulk, or 0 if the fast path is disabled. */
+static target_ulong rep_string_count(CPUX86State *env, MemOp aflag)
+{
+    target_ulong mask = MAKE_64BIT_MASK(0, 8 << aflag);
+    target_ulong count = env->regs[R_ECX] & mask;
+
+    if (env->df != 1 || count <= 1) {
+        return 0;
+    }
+    return count - 1;
+}
+
+void helper_rep_movs(CPUX86State *env, target_ulong src, target_ulong dst,
+                     uint32_t desc)
+{
+    MemOp ot = extract32(desc, 0, 2);
+    MemOp aflag = extract32(desc, 2, 2);
+    int mmu_idx = cpu_mmu_index(env_cpu(env), false);
+    uintptr_t ra = GETPC();
+    target_ulong n, len;
+    void *hsrc, *hdst;
+
+    n = rep_string_count(env, aflag);
+    n = MIN(n, rep_string_limit(env, aflag, ot, src, R_ESI));
+    n = MIN(n, rep_string_limit(env, aflag, ot, dst, R_EDI));
+    if (n == 0) {
+        return;
+    }
+
+    len = n << ot;
+    if (probe_access_flags(env, src, len, MMU_DATA_LOAD, mmu_idx,
+                           true, &hsrc, ra)
+        || probe_access_flags(env, dst, len, MMU_DATA_STORE, mmu_idx,
+                              true, &hdst, ra)) {
+        return;
+    }
+    /*
+     * A forward element-by-element copy replicates the source when
+     * the destination starts within it; memmove would not.
+     */
+    if (hdst > hsrc && hdst < hsrc + len) {
+        return;
+    }
+
+    /*
+     * In user-only mode the page may still be write protected because it
+     * holds translated code, so a fault here must be attributed to RA.
+     */
+    set_helper_retaddr(ra);
+    memmove(hdst, hsrc, len);
+    clear_helper_retaddr();
+    rep_string_add_reg(env, aflag, R_ESI, len);
+    rep_string_add_reg(env, aflag, R_EDI, len);
+    rep_string_add_reg(env, aflag, R_ECX, -n);
+}
+
+void helper_rep_stos(CPUX86State *env, target_ulong dst, target_ulong val,
+                     uint32_t desc)
+{
+    MemOp ot = extract32(desc, 0, 2);
+    MemOp aflag = extract32(desc, 2, 2);
+    int mmu_idx = cpu_mmu_index(env_cpu(env), false);
+    uintptr_t ra = GETPC();
+    target_ulong n, i, len;
+    void *hdst;
+
+    n = rep_string_count(env, aflag);
+    n = MIN(n, rep_string_limit(env, aflag, ot, dst, R_EDI));
+    if (n == 0) {
+        return;
+    }
+
+    len = n << ot;
+    if (probe_access_flags(env, dst, len, MMU_DATA_STORE, mmu_idx,
+                           true, &hdst, ra)) {
+        return;
+    }
+
+    set_helper_retaddr(ra);
+    switch (ot) {
+    case MO_8:
+        memset(hdst, val, len);
+        break;
+    case MO_16:
+        for (i = 0; i < len; i += 2) {
+            stw_le_p(hdst + i, val);
+        }
+        break;
+    case MO_32:
+        for (i = 0; i < len; i += 4) {
+            stl_le_p(hdst + i, val);
+        }
+        break;
+    case MO_64:
+        for (i = 0; i < len; i += 8) {
+            stq_le_p(hdst + i, val);
+        }
+        break;
+    default:
+        g_assert_not_reached();
+    }
+    clear_helper_retaddr();
+    rep_string_add_reg(env, aflag, R_EDI, len);
+    rep_string_add_reg(env, aflag, R_ECX, -n);
+}
@@ -795,6 +795,26 @@ static void gen_movs(DisasContext *s, MemOp ot)
     gen_op_add_reg(s, s->aflag, R_EDI, dshift);
 }
 
+/*
+ * REP MOVS first lets a helper do the bulk of the iterations on host
+ * memory, up to the end of the current source or destination page.
+ * The helper leaves at least one iteration to the generic loop, which
+ * also covers any case the helper cannot handle.
+ */
+static void gen_rep_movs(DisasContext *s, MemOp ot)
+{
+    if (!(s->flags & HF_TF_MASK)) {
+        TCGv src = tcg_temp_new();
+
+        gen_string_movl_A0_ESI(s);
+        tcg_gen_mov_tl(src, s->A0);
+        gen_string_movl_A0_EDI(s);
+        gen_helper_rep_movs(tcg_env, src, s->A0,
+                            tcg_constant_i32(ot | s->aflag << 2));
+    }
+    gen_movs(s, ot);
+}
+
 /* compute all eflags to reg */
 static void gen_mov_eflags(DisasContext *s, TCGv reg)
 {
@@ -1187,6 +1207,17 @@ static void gen_stos(DisasContext *s, MemOp ot)
     gen_op_add_reg(s, s->aflag, R_EDI, gen_compute_Dshift(s, ot));
 }
 
+/* As gen_rep_movs, for REP STOS. */
+static void gen_rep_stos(DisasContext *s, MemOp ot)
+{
+    if (!(s->flags & HF_TF_MASK)) {
+        gen_string_movl_A0_EDI(s);
+        gen_helper_rep_stos(tcg_env, s->A0, s->T0,
+                            tcg_constant_i32(ot | s->aflag << 2));
+    }
+    gen_stos(s, ot);
+}
+
 static void gen_lods(DisasContext *s, MemOp ot)
 {
     gen_string_movl_A0_ESI(s);
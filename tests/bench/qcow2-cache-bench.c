@@ -0,0 +1,95 @@
+/*
+ * QEMU qcow2 metadata cache lookup speed benchmark
+ *
+ * Reads unallocated clusters of a qcow2 image whose L2 cache covers the
+ * whole image, so that every read is an L2 cache hit and no data is read
+ * from the file.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/main-loop.h"
+#include "qemu/units.h"
+#include "block/block.h"
+#include "sysemu/block-backend.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+
+/* Small clusters keep the number of L2 tables high for a small file */
+#define CLUSTER_SIZE        512
+#define CLUSTERS_PER_L2     (CLUSTER_SIZE / sizeof(uint64_t))
+#define L2_COVERAGE         (CLUSTERS_PER_L2 * CLUSTER_SIZE)
+
+static void test(const void *opaque)
+{
+    int num_l2 = GPOINTER_TO_INT(opaque);
+    uint64_t image_size = (uint64_t)num_l2 * L2_COVERAGE;
+    g_autofree char *path = NULL;
+    g_autofree char *create_opts = NULL;
+    g_autofree char *cache_size = NULL;
+    g_autofree void *buf = g_malloc0(CLUSTER_SIZE);
+    g_autoptr(GRand) rand = g_rand_new_with_seed(1);
+    BlockBackend *blk;
+    QDict *options;
+    uint64_t reads = 0;
+    int fd;
+
+    fd = g_file_open_tmp("qemu-qcow2-cache-bench.XXXXXX", &path, NULL);
+    g_assert(fd >= 0);
+    close(fd);
+
+    create_opts = g_strdup_printf("cluster_size=%d", CLUSTER_SIZE);
+    bdrv_img_create(path, "qcow2", NULL, NULL, create_opts, image_size, 0,
+                    true, &error_abort);
+
+    cache_size = g_strdup_printf("%d", num_l2 * CLUSTER_SIZE);
+    options = qdict_new();
+    qdict_put_str(options, "driver", "qcow2");
+    qdict_put_str(options, "l2-cache-size", cache_size);
+    qdict_put_str(options, "cache-clean-interval", "0");
+    blk = blk_new_open(path, NULL, options, BDRV_O_RDWR, &error_abort);
+
+    /* Allocate every L2 table by writing the first cluster it maps */
+    for (int i = 0; i < num_l2; i++) {
+        g_assert(blk_pwrite(blk, (int64_t)i * L2_COVERAGE, CLUSTER_SIZE,
+                            buf, 0) == 0);
+    }
+
+    g_test_timer_start();
+    do {
+        for (int i = 0; i < 1000; i++) {
+            int64_t offset = (int64_t)g_rand_int_range(rand, 0, num_l2) *
+                             L2_COVERAGE +
+                             g_rand_int_range(rand, 1, CLUSTERS_PER_L2) *
+                             CLUSTER_SIZE;
+
+            g_assert(blk_pread(blk, offset, CLUSTER_SIZE, buf, 0) == 0);
+        }
+        reads += 1000;
+    } while (g_test_timer_elapsed() < 1.0);
+
+    g_test_message("qcow2 cache: %6d L2 tables %8.0f reads/sec",
+                   num_l2, reads / g_test_timer_last());
+
+    blk_unref(blk);
+    unlink(path);
+}
+
+int main(int argc, char **argv)
+{
+    static const int sizes[] = { 256, 4096, 65536 };
+
+    bdrv_init();
+    qemu_init_main_loop(&error_abort);
+
+    g_test_init(&argc, &argv, NULL);
+    for (int i = 0; i < ARRAY_SIZE(sizes); i++) {
+        g_autofree char *name = g_strdup_printf("/qcow2/cache/lookup/%d",
+                                                sizes[i]);
+
+        g_test_add_data_func(name, GINT_TO_POINTER(sizes[i]), test);
+    }
+    return g_test_run();
+}
@@ -18,6 +18,7 @@
 #include "qemu/option.h"
 #include "qemu/range.h"
 #include "qemu/sockets.h"
+#include "qemu/units.h"
 #include "chardev/char.h"
 #include "crypto/tlscredspsk.h"
 #include "qapi/qmp/qlist.h"
@@ -68,6 +69,7 @@ static QTestMigrationState dst_state;
 
 #define QEMU_VM_FILE_MAGIC 0x5145564d
 #define FILE_TEST_FILENAME "migfile"
+#define FILE_TEST_BASE_FILENAME "migfile.base"
 #define FILE_TEST_OFFSET 0x1000
 #define FILE_TEST_MARKER 'X'
 #define QEMU_ENV_SRC "QTEST_QEMU_BINARY_SRC"
@@ -89,6 +91,11 @@ typedef enum PostcopyRecoveryFailStage {
 #include <sys/vfs.h>
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+#include <sys/resource.h>
+#include <linux/io_uring.h>
+#endif
+
 #if defined(__linux__) && defined(__NR_userfaultfd) && defined(CONFIG_EVENTFD)
 #include <sys/eventfd.h>
 #include <sys/ioctl.h>
@@ -704,6 +711,7 @@ typedef struct {
     /* Postcopy specific fields */
     void *postcopy_data;
     bool postcopy_preempt;
+    bool postcopy_prefetch;
     PostcopyRecoveryFailStage postcopy_recovery_fail_stage;
 } MigrateCommon;
 
@@ -905,6 +913,7 @@ static void test_migrate_end(QTestState *from, QTestState *to, bool test_dest)
     cleanup("src_serial");
     cleanup("dest_serial");
     cleanup(FILE_TEST_FILENAME);
+    cleanup(FILE_TEST_BASE_FILENAME);
 }
 
 #ifdef CONFIG_GNUTLS
@@ -1266,6 +1275,10 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
         migrate_set_capability(to, "postcopy-preempt", true);
     }
 
+    if (args->postcopy_prefetch) {
+        migrate_set_capability(to, "postcopy-prefetch", true);
+    }
+
     migrate_ensure_non_converge(from);
 
     migrate_prepare_for_dirty_mem(from);
@@ -1352,6 +1365,25 @@ static void test_postcopy_preempt(void)
     test_postcopy_common(&args);
 }
 
+static void test_postcopy_prefetch(void)
+{
+    MigrateCommon args = {
+        .postcopy_prefetch = true,
+    };
+
+    test_postcopy_common(&args);
+}
+
+static void test_postcopy_preempt_prefetch(void)
+{
+    MigrateCommon args = {
+        .postcopy_preempt = true,
+        .postcopy_prefetch = true,
+    };
+
+    test_postcopy_common(&args);
+}
+
 #ifdef CONFIG_GNUTLS
 static void test_postcopy_tls_psk(void)
 {
@@ -1993,6 +2025,27 @@ static void test_precopy_unix_plain(void)
     test_precopy_common(&args);
 }
 
+static void test_precopy_unix_dirty_sync_threads(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateCommon args = {
+        .start = {
+            /* The guest is far below the size that would get threads */
+            .opts_source = "-global migration.x-dirty-sync-threads=3",
+        },
+        .listen_uri = uri,
+        .connect_uri = uri,
+        /*
+         * The guest keeps dirtying memory, so that pages found by all
+         * sync threads must make it to the destination.
+         */
+        .live = true,
+        .iterations = 3,
+    };
+
+    test_precopy_common(&args);
+}
+
 static void test_precopy_unix_suspend_live(void)
 {
     g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
@@ -2156,6 +2209,66 @@ static void test_precopy_unix_xbzrle(void)
     test_precopy_common(&args);
 }
 
+/*
+ * The guest dirties all of its test memory all the time, so all of it
+ * becomes hot.  The test also dirties two other regions of RAM, taking
+ * turns between passes.  Their pages are never dirtied in two syncs in a
+ * row, so they never become hot.  But they keep the dirty memory above
+ * the threshold size, which is set just above the size of the hot
+ * memory.  Migration must then defer the hot pages instead of sending
+ * them again in every pass.
+ */
+#define HOT_PAGES_COLD_START    (104 * 1024 * 1024)
+#define HOT_PAGES_COLD_SIZE     (22 * 1024 * 1024)
+#define HOT_PAGES_THRESHOLD     (100LL * 1024 * 1024)
+
+static void test_precopy_unix_hot_pages(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart args = {};
+    QTestState *from, *to;
+    int i;
+
+    if (test_migrate_start(&from, &to, uri, &args)) {
+        return;
+    }
+
+    migrate_set_parameter_int(from, "hot-page-rounds", 2);
+    /* Slow enough for the guest to dirty all its memory in each pass */
+    migrate_set_parameter_int(from, "max-bandwidth", 30 * 1000 * 1000);
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+
+    wait_for_serial("src_serial");
+    migrate_qmp(from, to, uri, NULL, "{}");
+
+    /* The guest memory is not hot yet after the first pass */
+    wait_for_migration_pass(from);
+    g_assert_cmpint(read_ram_property_int(from, "deferred-pages"), ==, 0);
+
+    /* Threshold size is the switchover bandwidth times 1ms */
+    migrate_set_parameter_int(from, "avail-switchover-bandwidth",
+                              HOT_PAGES_THRESHOLD * 1000);
+
+    for (i = 0; i < 4; i++) {
+        uint64_t cold = HOT_PAGES_COLD_START + (i % 2) * HOT_PAGES_COLD_SIZE;
+
+        qtest_memset(from, cold, i + 1, HOT_PAGES_COLD_SIZE);
+        wait_for_migration_pass(from);
+        g_assert_false(src_state.stop_seen);
+    }
+
+    g_assert_cmpint(read_ram_property_int(from, "deferred-pages"), >, 0);
+
+    /* Now only the hot pages are left, and they are sent at the end */
+    migrate_ensure_converge(from);
+    wait_for_migration_complete(from);
+    wait_for_stop(from, &src_state);
+    wait_for_resume(to, &dst_state);
+    wait_for_serial("dest_serial");
+
+    test_migrate_end(from, to, true);
+}
+
 static void test_precopy_file(void)
 {
     g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
@@ -2301,6 +2414,113 @@ static void test_precopy_file_mapped_ram(void)
     test_file_common(&args, true);
 }
 
+static void *migrate_mapped_ram_mmap_start(QTestState *from, QTestState *to)
+{
+    migrate_mapped_ram_start(from, to);
+
+    migrate_set_parameter_str(to, "mapped-ram-load-method", "mmap");
+
+    return NULL;
+}
+
+static void test_precopy_file_mapped_ram_mmap(void)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
+                                           FILE_TEST_FILENAME);
+    MigrateCommon args = {
+        .connect_uri = uri,
+        .listen_uri = "defer",
+        .start_hook = migrate_mapped_ram_mmap_start,
+    };
+
+    test_file_common(&args, true);
+}
+
+static void *migrate_mapped_ram_incremental_start(QTestState *from,
+                                                  QTestState *to)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
+                                           FILE_TEST_BASE_FILENAME);
+
+    migrate_mapped_ram_start(from, to);
+    migrate_set_capability(from, "mapped-ram-incremental", true);
+
+    /*
+     * Take the base snapshot and let the guest run again, the snapshot
+     * loaded by the test then only holds the pages dirtied since.
+     */
+    migrate_ensure_converge(from);
+    migrate_qmp(from, to, uri, NULL, "{}");
+    wait_for_migration_complete(from);
+    qtest_qmp_assert_success(from, "{ 'execute' : 'cont'}");
+    qtest_qmp_eventwait(from, "RESUME");
+
+    /* The next snapshot can't overwrite the base it refers to */
+    migrate_qmp_fail(from, uri, NULL, "{}");
+
+    return NULL;
+}
+
+static void test_precopy_file_mapped_ram_incremental(void)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
+                                           FILE_TEST_FILENAME);
+    MigrateCommon args = {
+        .connect_uri = uri,
+        .listen_uri = "defer",
+        .start_hook = migrate_mapped_ram_incremental_start,
+    };
+
+    test_file_common(&args, false);
+}
+
+static void *migrate_mapped_ram_lazy_start(QTestState *from, QTestState *to)
+{
+    migrate_mapped_ram_start(from, to);
+
+    migrate_set_parameter_str(to, "mapped-ram-load-method", "lazy");
+
+    return NULL;
+}
+
+static void test_precopy_file_mapped_ram_lazy(void)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
+                                           FILE_TEST_FILENAME);
+    MigrateCommon args = {
+        .connect_uri = uri,
+        .listen_uri = "defer",
+        .start_hook = migrate_mapped_ram_lazy_start,
+    };
+
+    test_file_common(&args, true);
+}
+
+#ifdef CONFIG_LINUX_IO_URING
+static void *migrate_mapped_ram_io_uring_start(QTestState *from,
+                                               QTestState *to)
+{
+    migrate_mapped_ram_start(from, to);
+
+    migrate_set_parameter_str(to, "mapped-ram-load-method", "io-uring");
+
+    return NULL;
+}
+
+static void test_precopy_file_mapped_ram_io_uring(void)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
+                                           FILE_TEST_FILENAME);
+    MigrateCommon args = {
+        .connect_uri = uri,
+        .listen_uri = "defer",
+        .start_hook = migrate_mapped_ram_io_uring_start,
+    };
+
+    test_file_common(&args, true);
+}
+#endif
+
 static void *migrate_multifd_mapped_ram_start(QTestState *from, QTestState *to)
 {
     migrate_mapped_ram_start(from, to);
@@ -2957,6 +3177,16 @@ test_migrate_precopy_tcp_multifd_start_zero_page_legacy(QTestState *from,
     return NULL;
 }
 
+static void *
+test_migrate_precopy_tcp_multifd_start_dedup(QTestState *from,
+                                             QTestState *to)
+{
+    test_migrate_precopy_tcp_multifd_start_common(from, to, "none");
+    migrate_set_capability(from, "multifd-dedup", true);
+    migrate_set_capability(to, "multifd-dedup", true);
+    return NULL;
+}
+
 static void *
 test_migration_precopy_tcp_multifd_start_no_zero_page(QTestState *from,
                                                       QTestState *to)
@@ -2990,6 +3220,14 @@ test_migrate_precopy_tcp_multifd_zstd_start(QTestState *from,
 
     return test_migrate_precopy_tcp_multifd_start_common(from, to, "zstd");
 }
+
+static void *
+test_migrate_precopy_tcp_multifd_adaptive_start(QTestState *from,
+                                                QTestState *to)
+{
+    return test_migrate_precopy_tcp_multifd_start_common(from, to,
+                                                         "adaptive");
+}
 #endif /* CONFIG_ZSTD */
 
 #ifdef CONFIG_QPL
@@ -3024,6 +3262,214 @@ static void test_multifd_tcp_uri_none(void)
     test_precopy_common(&args);
 }
 
+static void test_multifd_tcp_dedup(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_start_dedup,
+        /*
+         * The dedup cache must stay in sync on both sides even if the
+         * guest changes pages while they are hashed and sent.
+         */
+        .live = true,
+    };
+    test_precopy_common(&args);
+}
+
+#ifdef CONFIG_LINUX_IO_URING
+/* Each receive channel pins all of guest RAM */
+#define IO_URING_RECV_CHANNELS 2
+
+static bool io_uring_recv_supported(void)
+{
+    struct io_uring_params params = {};
+    struct rlimit rlim;
+    int fd;
+
+    fd = syscall(__NR_io_uring_setup, 1, &params);
+    if (fd < 0) {
+        g_test_message("Skipping test: io_uring not available");
+        return false;
+    }
+    close(fd);
+
+    if (geteuid() && (getrlimit(RLIMIT_MEMLOCK, &rlim) ||
+                      (rlim.rlim_cur != RLIM_INFINITY &&
+                       rlim.rlim_cur < IO_URING_RECV_CHANNELS * GiB))) {
+        g_test_message("Skipping test: guest RAM can't be locked");
+        return false;
+    }
+
+    return true;
+}
+
+static void *
+test_migrate_precopy_tcp_multifd_io_uring_start(QTestState *from,
+                                                QTestState *to)
+{
+    migrate_set_parameter_int(from, "multifd-channels",
+                              IO_URING_RECV_CHANNELS);
+    migrate_set_parameter_int(to, "multifd-channels",
+                              IO_URING_RECV_CHANNELS);
+
+    migrate_set_capability(from, "multifd", true);
+    migrate_set_capability(to, "multifd", true);
+    /* Only the destination uses it */
+    migrate_set_capability(to, "io-uring-recv", true);
+
+    migrate_incoming_qmp(to, "tcp:127.0.0.1:0", "{}");
+
+    return NULL;
+}
+
+static void test_multifd_tcp_io_uring(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_io_uring_start,
+        .live = true,
+    };
+
+    if (!io_uring_recv_supported()) {
+        g_test_skip("io_uring receive not usable on this host");
+        return;
+    }
+
+    test_precopy_common(&args);
+}
+
+static void migrate_set_capability_fails(QTestState *who,
+                                         const char *capability)
+{
+    QDict *rsp;
+
+    rsp = qtest_qmp_assert_failure_ref(who,
+        "{ 'execute': 'migrate-set-capabilities',"
+        "'arguments': { "
+        "'capabilities': [ { "
+        "'capability': %s, 'state': true } ] } }",
+        capability);
+    qobject_unref(rsp);
+}
+
+static void migrate_set_parameter_str_fails(QTestState *who,
+                                            const char *parameter,
+                                            const char *value)
+{
+    QDict *rsp;
+
+    rsp = qtest_qmp_assert_failure_ref(who,
+        "{ 'execute': 'migrate-set-parameters',"
+        "'arguments': { %s: %s } }",
+        parameter, value);
+    qobject_unref(rsp);
+}
+
+static void test_multifd_tcp_io_uring_incompatible(void)
+{
+    MigrateStart args = {
+        .hide_stderr = true,
+    };
+    QTestState *from, *to;
+
+    if (test_migrate_start(&from, &to, "defer", &args)) {
+        return;
+    }
+
+    migrate_set_capability(to, "multifd", true);
+
+    /* Not with a compression method or TLS set before */
+    migrate_set_parameter_str(to, "multifd-compression", "zlib");
+    migrate_set_capability_fails(to, "io-uring-recv");
+    migrate_set_parameter_str(to, "multifd-compression", "none");
+
+    migrate_set_parameter_str(to, "tls-creds", "tlscredsx509server0");
+    migrate_set_capability_fails(to, "io-uring-recv");
+    migrate_set_parameter_str(to, "tls-creds", "");
+
+    /* Nor with mapped-ram, whichever is set first */
+    migrate_set_capability(to, "mapped-ram", true);
+    migrate_set_capability_fails(to, "io-uring-recv");
+    migrate_set_capability(to, "mapped-ram", false);
+
+    migrate_set_capability(to, "io-uring-recv", true);
+    migrate_set_capability_fails(to, "mapped-ram");
+
+    /* Nor with a compression method or TLS set after */
+    migrate_set_parameter_str_fails(to, "multifd-compression", "zlib");
+    migrate_set_parameter_str_fails(to, "tls-creds", "tlscredsx509server0");
+
+    test_migrate_end(from, to, false);
+}
+#endif /* CONFIG_LINUX_IO_URING */
+
+/* 4 MiB of test device state in 256 KiB chunks, see migration-testdev.c */
+#define DEVSTATE_TESTDEV_OPTS "-device migration-testdev,id=devstate"
+#define DEVSTATE_TESTDEV_CHUNKS 16
+
+static int64_t devstate_chunks_loaded(QTestState *who)
+{
+    QDict *rsp;
+    int64_t ret;
+
+    rsp = qtest_qmp_assert_success_ref(who,
+        "{ 'execute': 'qom-get', 'arguments': {"
+        "  'path': '/machine/peripheral/devstate',"
+        "  'property': 'chunks-loaded' } }");
+    ret = qdict_get_int(rsp, "return");
+    qobject_unref(rsp);
+    return ret;
+}
+
+static void test_multifd_device_state_end(QTestState *from, QTestState *to,
+                                          void *opaque)
+{
+    g_assert_cmpint(devstate_chunks_loaded(to), ==, DEVSTATE_TESTDEV_CHUNKS);
+}
+
+static void test_multifd_device_state_compat_end(QTestState *from,
+                                                 QTestState *to,
+                                                 void *opaque)
+{
+    /* The state went through the main stream */
+    g_assert_cmpint(devstate_chunks_loaded(to), ==, 0);
+}
+
+static void test_multifd_tcp_device_state(void)
+{
+    MigrateCommon args = {
+        .start = {
+            .opts_source = DEVSTATE_TESTDEV_OPTS,
+            .opts_target = DEVSTATE_TESTDEV_OPTS,
+        },
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_start,
+        .finish_hook = test_multifd_device_state_end,
+        /*
+         * The device checks that all chunks were loaded before its
+         * section in the main stream, and fails the load otherwise.
+         */
+        .live = true,
+    };
+    test_precopy_common(&args);
+}
+
+static void test_multifd_tcp_device_state_compat(void)
+{
+    MigrateCommon args = {
+        .start = {
+            .opts_source = DEVSTATE_TESTDEV_OPTS
+                           " -global migration.x-multifd-device-state=off",
+            .opts_target = DEVSTATE_TESTDEV_OPTS,
+        },
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_start,
+        .finish_hook = test_multifd_device_state_compat_end,
+        .live = true,
+    };
+    test_precopy_common(&args);
+}
+
 static void test_multifd_tcp_zero_page_legacy(void)
 {
     MigrateCommon args = {
@@ -3087,6 +3533,17 @@ static void test_multifd_tcp_zstd(void)
     };
     test_precopy_common(&args);
 }
+
+static void test_multifd_tcp_adaptive(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_adaptive_start,
+        /* Mix compressed and uncompressed packets while pages change */
+        .live = true,
+    };
+    test_precopy_common(&args);
+}
 #endif
 
 #ifdef CONFIG_QPL
@@ -3838,6 +4295,10 @@ int main(int argc, char **argv)
                            test_postcopy_preempt);
         migration_test_add("/migration/postcopy/preempt/recovery/plain",
                            test_postcopy_preempt_recovery);
+        migration_test_add("/migration/postcopy/prefetch/plain",
+                           test_postcopy_prefetch);
+        migration_test_add("/migration/postcopy/preempt/prefetch/plain",
+                           test_postcopy_preempt_prefetch);
         migration_test_add("/migration/postcopy/recovery/double-failures/handshake",
                            test_postcopy_recovery_fail_handshake);
         migration_test_add("/migration/postcopy/recovery/double-failures/reconnect",
@@ -3852,6 +4313,12 @@ int main(int argc, char **argv)
                        test_precopy_unix_plain);
     migration_test_add("/migration/precopy/unix/xbzrle",
                        test_precopy_unix_xbzrle);
+    if (is_x86) {
+        migration_test_add("/migration/precopy/unix/hot-pages",
+                           test_precopy_unix_hot_pages);
+    }
+    migration_test_add("/migration/precopy/unix/dirty-sync-threads",
+                       test_precopy_unix_dirty_sync_threads);
     migration_test_add("/migration/precopy/file",
                        test_precopy_file);
     migration_test_add("/migration/precopy/file/offset",
@@ -3875,6 +4342,18 @@ int main(int argc, char **argv)
                        test_precopy_file_mapped_ram);
     migration_test_add("/migration/precopy/file/mapped-ram/live",
                        test_precopy_file_mapped_ram_live);
+    migration_test_add("/migration/precopy/file/mapped-ram/mmap",
+                       test_precopy_file_mapped_ram_mmap);
+    migration_test_add("/migration/precopy/file/mapped-ram/incremental",
+                       test_precopy_file_mapped_ram_incremental);
+#ifdef CONFIG_LINUX_IO_URING
+    migration_test_add("/migration/precopy/file/mapped-ram/io-uring",
+                       test_precopy_file_mapped_ram_io_uring);
+#endif
+    if (has_uffd) {
+        migration_test_add("/migration/precopy/file/mapped-ram/lazy",
+                           test_precopy_file_mapped_ram_lazy);
+    }
 
     migration_test_add("/migration/multifd/file/mapped-ram",
                        test_multifd_file_mapped_ram);
@@ -3984,6 +4463,20 @@ int main(int argc, char **argv)
                        test_multifd_tcp_zero_page_legacy);
     migration_test_add("/migration/multifd/tcp/plain/zero-page/none",
                        test_multifd_tcp_no_zero_page);
+    migration_test_add("/migration/multifd/tcp/plain/dedup",
+                       test_multifd_tcp_dedup);
+#ifdef CONFIG_LINUX_IO_URING
+    migration_test_add("/migration/multifd/tcp/plain/io-uring",
+                       test_multifd_tcp_io_uring);
+    migration_test_add("/migration/multifd/tcp/plain/io-uring/incompatible",
+                       test_multifd_tcp_io_uring_incompatible);
+#endif
+    if (qtest_has_device("migration-testdev")) {
+        migration_test_add("/migration/multifd/tcp/plain/device-state",
+                           test_multifd_tcp_device_state);
+        migration_test_add("/migration/multifd/tcp/plain/device-state/compat",
+                           test_multifd_tcp_device_state_compat);
+    }
     migration_test_add("/migration/multifd/tcp/plain/cancel",
                        test_multifd_tcp_cancel);
     migration_test_add("/migration/multifd/tcp/plain/zlib",
@@ -3991,6 +4484,8 @@ int main(int argc, char **argv)
 #ifdef CONFIG_ZSTD
     migration_test_add("/migration/multifd/tcp/plain/zstd",
                        test_multifd_tcp_zstd);
+    migration_test_add("/migration/multifd/tcp/plain/adaptive",
+                       test_multifd_tcp_adaptive);
 #endif
 #ifdef CONFIG_QPL
     migration_test_add("/migration/multifd/tcp/plain/qpl",
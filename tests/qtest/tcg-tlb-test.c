@@ -0,0 +1,171 @@
+/*
+ * QTest testcase for the softmmu TLB statistics of TCG
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
+#include "qapi/qmp/qnum.h"
+
+static const char *const tlb_stats[] = {
+    "tlb-fills", "tlb-flushes", "tlb-resizes", "tlb-victim-hits",
+};
+
+static QTestState *tcg_tlb_start(void)
+{
+    return qtest_init("-machine pc -smp 2 "
+                      "-accel tcg,tlb-min-bits=6,tlb-max-bits=8");
+}
+
+/* Query all statistics, or only @name if it is not NULL */
+static QList *query_tcg_stats(QTestState *qts, const char *name)
+{
+    QDict *rsp;
+    QList *ret;
+
+    if (name) {
+        rsp = qtest_qmp_assert_success_ref(qts,
+            "{ 'execute': 'query-stats', 'arguments': {"
+            "  'target': 'vcpu',"
+            "  'providers': [ { 'provider': 'tcg', 'names': [ %s ] } ] } }",
+            name);
+    } else {
+        rsp = qtest_qmp_assert_success_ref(qts,
+            "{ 'execute': 'query-stats', 'arguments': {"
+            "  'target': 'vcpu',"
+            "  'providers': [ { 'provider': 'tcg' } ] } }");
+    }
+    ret = qdict_get_qlist(rsp, "return");
+    qobject_ref(ret);
+    qobject_unref(rsp);
+    return ret;
+}
+
+/* Sum of the values of statistic @name over all vCPUs and MMU modes */
+static uint64_t tcg_stat_sum(QList *results, const char *name)
+{
+    uint64_t sum = 0;
+    QListEntry *r, *s, *v;
+
+    QLIST_FOREACH_ENTRY(results, r) {
+        QDict *result = qobject_to(QDict, qlist_entry_obj(r));
+
+        g_assert_cmpstr(qdict_get_str(result, "provider"), ==, "tcg");
+        QLIST_FOREACH_ENTRY(qdict_get_qlist(result, "stats"), s) {
+            QDict *stat = qobject_to(QDict, qlist_entry_obj(s));
+
+            if (strcmp(qdict_get_str(stat, "name"), name)) {
+                continue;
+            }
+            QLIST_FOREACH_ENTRY(qdict_get_qlist(stat, "value"), v) {
+                sum += qnum_get_uint(qobject_to(QNum, qlist_entry_obj(v)));
+            }
+        }
+    }
+    return sum;
+}
+
+static void test_tcg_tlb_stats(void)
+{
+    QTestState *qts = tcg_tlb_start();
+    gint64 deadline = g_get_monotonic_time() + 30 * G_USEC_PER_SEC;
+    QList *results;
+    QListEntry *r, *s;
+    size_t nb_results = 0;
+
+    /* The firmware fills the TLB as soon as it runs */
+    for (;;) {
+        results = query_tcg_stats(qts, NULL);
+        if (tcg_stat_sum(results, "tlb-fills")) {
+            break;
+        }
+        g_assert_cmpint(g_get_monotonic_time(), <, deadline);
+        qobject_unref(results);
+        g_usleep(10 * 1000);
+    }
+
+    /* One result per vCPU, each with all statistics for all MMU modes */
+    QLIST_FOREACH_ENTRY(results, r) {
+        QDict *result = qobject_to(QDict, qlist_entry_obj(r));
+        QList *stats = qdict_get_qlist(result, "stats");
+        size_t nb_modes = 0;
+        int i = 0;
+
+        g_assert(qdict_haskey(result, "qom-path"));
+        g_assert_cmpint(qlist_size(stats), ==, ARRAY_SIZE(tlb_stats));
+        QLIST_FOREACH_ENTRY(stats, s) {
+            QDict *stat = qobject_to(QDict, qlist_entry_obj(s));
+            QList *value = qdict_get_qlist(stat, "value");
+
+            g_assert_cmpstr(qdict_get_str(stat, "name"), ==, tlb_stats[i]);
+            g_assert(value);
+            i++;
+            if (!nb_modes) {
+                nb_modes = qlist_size(value);
+                g_assert_cmpint(nb_modes, >, 0);
+            }
+            g_assert_cmpint(qlist_size(value), ==, nb_modes);
+        }
+        nb_results++;
+    }
+    g_assert_cmpint(nb_results, ==, 2);
+    qobject_unref(results);
+
+    /* Filtering by name */
+    results = query_tcg_stats(qts, "tlb-flushes");
+    QLIST_FOREACH_ENTRY(results, r) {
+        QDict *result = qobject_to(QDict, qlist_entry_obj(r));
+        QList *stats = qdict_get_qlist(result, "stats");
+        QDict *stat = qobject_to(QDict, qlist_peek(stats));
+
+        g_assert_cmpint(qlist_size(stats), ==, 1);
+        g_assert_cmpstr(qdict_get_str(stat, "name"), ==, "tlb-flushes");
+    }
+    qobject_unref(results);
+
+    qtest_quit(qts);
+}
+
+static void test_tcg_tlb_schemas(void)
+{
+    QTestState *qts = tcg_tlb_start();
+    QListEntry *e;
+    QDict *rsp;
+    bool found = false;
+
+    rsp = qtest_qmp_assert_success_ref(qts,
+        "{ 'execute': 'query-stats-schemas',"
+        "  'arguments': { 'provider': 'tcg' } }");
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(rsp, "return"), e) {
+        QDict *schema = qobject_to(QDict, qlist_entry_obj(e));
+
+        g_assert_cmpstr(qdict_get_str(schema, "provider"), ==, "tcg");
+        g_assert_cmpstr(qdict_get_str(schema, "target"), ==, "vcpu");
+        g_assert_cmpint(qlist_size(qdict_get_qlist(schema, "stats")), ==,
+                        ARRAY_SIZE(tlb_stats));
+        found = true;
+    }
+    g_assert(found);
+    qobject_unref(rsp);
+
+    qtest_quit(qts);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    if (!qtest_has_accel("tcg")) {
+        g_test_skip("TCG is not available");
+        return g_test_run();
+    }
+
+    qtest_add_func("tcg-tlb/stats", test_tcg_tlb_stats);
+    qtest_add_func("tcg-tlb/schemas", test_tcg_tlb_schemas);
+
+    return g_test_run();
+}
@@ -0,0 +1,140 @@
+/*
+ * TLB invalidation by range
+ *
+ * Map a region with 4k pages, cache its translations in the TLB, remap
+ * a range of it and invalidate exactly that range with TLBI RVAE1IS or
+ * RVAE1.  The remapped pages must use the new mapping at once, whether
+ * the range is small or covers more pages than the TLB holds.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <minilib.h>
+
+#define PAGE_SIZE   4096
+#define NPAGES      128
+
+/* boot.S only maps the GB of RAM that the test is loaded in */
+#define TEST_VA     (2ull << 30)
+
+/* Page descriptor: AF, page, UXN/PXN, attr index 0, EL1 read/write */
+#define PTE_ATTRS   ((3ull << 53) | 0x403)
+
+/* The tables must be in the identity mapped data block, like boot.S's */
+static uint64_t l2[512]
+    __attribute__((section(".data"), aligned(PAGE_SIZE)));
+static uint64_t l3[512]
+    __attribute__((section(".data"), aligned(PAGE_SIZE)));
+
+/* Only accessed through TEST_VA */
+static uint8_t pages[2][NPAGES][PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+
+static int errors;
+
+static volatile uint64_t *test_page(int i)
+{
+    return (volatile uint64_t *)(uintptr_t)(TEST_VA + (uint64_t)i * PAGE_SIZE);
+}
+
+static void map_page(int i, int set)
+{
+    l3[i] = (uintptr_t)pages[set][i] | PTE_ATTRS;
+}
+
+static void flush_all(void)
+{
+    asm volatile("dsb ishst\n\t"
+                 "tlbi vmalle1is\n\t"
+                 "dsb ish\n\t"
+                 "isb" : : : "memory");
+}
+
+/* TLBI RVA* operand for 4k pages: (num + 1) << (5 * scale + 1) pages */
+static uint64_t range_arg(int first, int scale, int num)
+{
+    uint64_t va = TEST_VA + (uint64_t)first * PAGE_SIZE;
+
+    return (1ull << 46) | ((uint64_t)scale << 44) | ((uint64_t)num << 39) |
+           ((va >> 12) & ((1ull << 37) - 1));
+}
+
+static void tlbi_range(uint64_t arg, bool inner_shareable)
+{
+    asm volatile("dsb ishst" : : : "memory");
+    if (inner_shareable) {
+        /* TLBI RVAE1IS */
+        asm volatile("sys #0, c8, c2, #1, %0" : : "r"(arg) : "memory");
+    } else {
+        /* TLBI RVAE1 */
+        asm volatile("sys #0, c8, c6, #1, %0" : : "r"(arg) : "memory");
+    }
+    asm volatile("dsb ish\n\tisb" : : : "memory");
+}
+
+static void test_range(int first, int scale, int num, bool inner_shareable)
+{
+    int count = (num + 1) << (5 * scale + 1);
+    int i;
+
+    for (i = 0; i < NPAGES; i++) {
+        map_page(i, 0);
+    }
+    flush_all();
+
+    /* Cache all translations */
+    for (i = 0; i < NPAGES; i++) {
+        (void)*test_page(i);
+    }
+
+    for (i = first; i < first + count; i++) {
+        map_page(i, 1);
+    }
+    tlbi_range(range_arg(first, scale, num), inner_shareable);
+
+    for (i = 0; i < NPAGES; i++) {
+        bool in_range = i >= first && i < first + count;
+        uint64_t expected = in_range ? 1000 + i : i;
+        uint64_t val = *test_page(i);
+
+        if (val != expected) {
+            ml_printf("FAIL: range %d+%d%s page %d: %ld, expected %ld\n",
+                      first, count, inner_shareable ? " (IS)" : "", i,
+                      val, expected);
+            errors++;
+        }
+    }
+}
+
+int main(void)
+{
+    uint64_t ttbr0, *l1;
+    int i, set;
+
+    asm volatile("mrs %0, ttbr0_el1" : "=r"(ttbr0));
+    l1 = (uint64_t *)(uintptr_t)(ttbr0 & ~0xfffull);
+    l1[TEST_VA >> 30] = (uintptr_t)l2 | 3;
+    l2[0] = (uintptr_t)l3 | 3;
+
+    /* Tag each page of both sets with its own value */
+    for (set = 0; set < 2; set++) {
+        for (i = 0; i < NPAGES; i++) {
+            map_page(i, set);
+        }
+        flush_all();
+        for (i = 0; i < NPAGES; i++) {
+            *test_page(i) = set * 1000 + i;
+        }
+    }
+
+    test_range(3, 0, 0, true);          /* 2 pages */
+    test_range(10, 0, 7, true);         /* 16 pages */
+    test_range(64, 1, 0, true);         /* 64 pages */
+    test_range(0, 1, 1, true);          /* all 128 pages */
+    test_range(5, 0, 2, false);         /* 6 pages, this cpu only */
+    test_range(0, 1, 1, false);
+
+    ml_printf("%s\n", errors ? "FAIL" : "PASS");
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,131 @@
+/*
+ * Vector compares and compare-based selects
+ *
+ * With an AVX-512 host, these are translated with VPCMP/VPCMPU into an
+ * opmask, and SSHL/USHL select between shift directions with a merge
+ * masked VPBLENDM.  Check all conditions and element sizes, including
+ * the values at the signed and unsigned boundaries.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <arm_neon.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static const uint64_t values[] = {
+    0, 1, 2, 0x7f, 0x80, 0xff, 0x7fff, 0x8000, 0xffff,
+    0x7fffffff, 0x80000000, 0xffffffff,
+    0x7fffffffffffffffull, 0x8000000000000000ull, 0xffffffffffffffffull,
+    0x0123456789abcdefull, 0xfedcba9876543210ull,
+};
+#define NVALUES (sizeof(values) / sizeof(values[0]))
+
+static int errors;
+
+static void check(const char *insn, int esize, int i, uint64_t a, uint64_t b,
+                  uint64_t got, uint64_t expected)
+{
+    if (got != expected) {
+        printf("%s.%d lane %d: a=0x%" PRIx64 " b=0x%" PRIx64
+               " got 0x%" PRIx64 " expected 0x%" PRIx64 "\n",
+               insn, esize, i, a, b, got, expected);
+        errors++;
+    }
+}
+
+#define CHECK_CMP(INSN, OP, A, B)                                           \
+    for (int i = 0; i < N; i++) {                                           \
+        check(INSN, sizeof(UT) * 8, i, ua[i], ub[i], r[i],                  \
+              A[i] OP B[i] ? (UT)-1 : 0);                                   \
+    }
+
+#define TEST_CMP(ESIZE, UT, ST)                                             \
+static void test_cmp##ESIZE(uint64_t a0, uint64_t b0)                       \
+{                                                                           \
+    enum { N = 16 / sizeof(UT) };                                           \
+    UT ua[N], ub[N], r[N];                                                  \
+    ST *sa = (ST *)ua, *sb = (ST *)ub;                                      \
+                                                                            \
+    for (int i = 0; i < N; i++) {                                           \
+        /* Mix the operands so that each lane sees another pair */          \
+        ua[i] = (UT)(i & 1 ? b0 : a0);                                      \
+        ub[i] = (UT)(i & 2 ? a0 : b0);                                      \
+    }                                                                       \
+                                                                            \
+    vst1q_u##ESIZE(r, vcgtq_u##ESIZE(vld1q_u##ESIZE(ua), vld1q_u##ESIZE(ub))); \
+    CHECK_CMP("cmhi", >, ua, ub)                                            \
+    vst1q_u##ESIZE(r, vcgeq_u##ESIZE(vld1q_u##ESIZE(ua), vld1q_u##ESIZE(ub))); \
+    CHECK_CMP("cmhs", >=, ua, ub)                                           \
+    vst1q_u##ESIZE(r, vcltq_u##ESIZE(vld1q_u##ESIZE(ua), vld1q_u##ESIZE(ub))); \
+    CHECK_CMP("cmlo", <, ua, ub)                                            \
+    vst1q_u##ESIZE(r, vceqq_u##ESIZE(vld1q_u##ESIZE(ua), vld1q_u##ESIZE(ub))); \
+    CHECK_CMP("cmeq", ==, ua, ub)                                           \
+    vst1q_u##ESIZE(r, vcgtq_s##ESIZE(vld1q_s##ESIZE(sa), vld1q_s##ESIZE(sb))); \
+    CHECK_CMP("cmgt", >, sa, sb)                                            \
+    vst1q_u##ESIZE(r, vcgeq_s##ESIZE(vld1q_s##ESIZE(sa), vld1q_s##ESIZE(sb))); \
+    CHECK_CMP("cmge", >=, sa, sb)                                           \
+    vst1q_u##ESIZE(r, vcleq_s##ESIZE(vld1q_s##ESIZE(sa), vld1q_s##ESIZE(sb))); \
+    CHECK_CMP("cmle", <=, sa, sb)                                           \
+}
+
+TEST_CMP(8, uint8_t, int8_t)
+TEST_CMP(16, uint16_t, int16_t)
+TEST_CMP(32, uint32_t, int32_t)
+TEST_CMP(64, uint64_t, int64_t)
+
+/* USHL shifts left for positive and right for negative shift counts */
+static void test_ushl(uint64_t a0)
+{
+    uint32_t a[4], r[4];
+    int32_t sh[4] = { 3, -3, 31, -31 };
+
+    for (int i = 0; i < 4; i++) {
+        a[i] = (uint32_t)a0 ^ (i * 0x01010101u);
+    }
+    vst1q_u32(r, vshlq_u32(vld1q_u32(a), vld1q_s32(sh)));
+    for (int i = 0; i < 4; i++) {
+        uint32_t expected = sh[i] >= 0 ? a[i] << sh[i] : a[i] >> -sh[i];
+        check("ushl", 32, i, a[i], sh[i], r[i], expected);
+    }
+}
+
+/* SSHL shifts right arithmetically for negative shift counts */
+static void test_sshl(uint64_t a0)
+{
+    int16_t a[8], r[8];
+    int16_t sh[8] = { 1, -1, 7, -7, 15, -15, 0, -16 };
+
+    for (int i = 0; i < 8; i++) {
+        a[i] = (int16_t)(a0 >> (i * 4));
+    }
+    vst1q_s16(r, vshlq_s16(vld1q_s16(a), vld1q_s16(sh)));
+    for (int i = 0; i < 8; i++) {
+        int16_t expected = sh[i] >= 0 ? (int16_t)((uint16_t)a[i] << sh[i])
+                                      : a[i] >> -sh[i];
+        check("sshl", 16, i, (uint16_t)a[i], sh[i], (uint16_t)r[i],
+              (uint16_t)expected);
+    }
+}
+
+int main(void)
+{
+    for (int i = 0; i < NVALUES; i++) {
+        for (int j = 0; j < NVALUES; j++) {
+            test_cmp8(values[i], values[j]);
+            test_cmp16(values[i], values[j]);
+            test_cmp32(values[i], values[j]);
+            test_cmp64(values[i], values[j]);
+        }
+        test_ushl(values[i]);
+        test_sshl(values[i]);
+    }
+
+    if (errors) {
+        printf("%d errors\n", errors);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
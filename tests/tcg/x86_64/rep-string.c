@@ -0,0 +1,122 @@
+/*
+ * REP MOVS and REP STOS across pages, with overlapping operands and
+ * into a page that holds translated code.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static void rep_movsb(void *dst, const void *src, size_t n)
+{
+    asm volatile("rep movsb" : "+D"(dst), "+S"(src), "+c"(n) : : "memory");
+}
+
+static void rep_stos(void *dst, uint64_t val, size_t n, int size)
+{
+    switch (size) {
+    case 1:
+        asm volatile("rep stosb" : "+D"(dst), "+c"(n) : "a"(val) : "memory");
+        break;
+    case 2:
+        asm volatile("rep stosw" : "+D"(dst), "+c"(n) : "a"(val) : "memory");
+        break;
+    case 4:
+        asm volatile("rep stosl" : "+D"(dst), "+c"(n) : "a"(val) : "memory");
+        break;
+    case 8:
+        asm volatile("rep stosq" : "+D"(dst), "+c"(n) : "a"(val) : "memory");
+        break;
+    }
+}
+
+static void test_movs(uint8_t *buf, size_t page)
+{
+    uint8_t *src = buf + 100, *dst = buf + 2 * page - 50;
+    size_t n = page + 123;
+
+    for (size_t i = 0; i < n; i++) {
+        src[i] = i * 7;
+    }
+    rep_movsb(dst, src, n);
+    for (size_t i = 0; i < n; i++) {
+        assert(dst[i] == (uint8_t)(i * 7));
+    }
+
+    /* A forward copy onto itself shifted by one replicates the first byte */
+    src = buf + page - 10;
+    memset(src, 0, 64);
+    src[0] = 0x5a;
+    rep_movsb(src + 1, src, 40);
+    for (size_t i = 0; i <= 40; i++) {
+        assert(src[i] == 0x5a);
+    }
+    assert(src[41] == 0);
+}
+
+static void test_stos(uint8_t *buf, size_t page)
+{
+    static const uint64_t val = 0x0123456789abcdefull;
+
+    for (int size = 1; size <= 8; size *= 2) {
+        uint8_t *dst = buf + page - 3 * size;
+        size_t n = (page + 17 * size) / size;
+
+        memset(buf, 0, 3 * page);
+        rep_stos(dst, val, n, size);
+        for (size_t i = 0; i < n * size; i++) {
+            assert(dst[i] == (uint8_t)(val >> (i % size * 8)));
+        }
+        assert(dst[-1] == 0 && dst[n * size] == 0);
+    }
+}
+
+/* mov $imm, %eax; ret */
+static void make_func(uint8_t *code, uint32_t ret)
+{
+    code[0] = 0xb8;
+    memcpy(code + 1, &ret, 4);
+    code[5] = 0xc3;
+}
+
+static void test_smc(size_t page)
+{
+    uint8_t *code = mmap(NULL, page, PROT_READ | PROT_WRITE | PROT_EXEC,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    int (*func)(void) = (int (*)(void))code;
+    uint8_t new_code[64];
+
+    assert(code != MAP_FAILED);
+    make_func(code, 1);
+    assert(func() == 1);
+
+    /* Overwrite the code that has been translated with REP MOVS */
+    memset(new_code, 0x90, sizeof(new_code));
+    make_func(new_code, 2);
+    rep_movsb(code, new_code, sizeof(new_code));
+    assert(func() == 2);
+
+    /* And with REP STOS */
+    rep_stos(code, 0x90, 32, 1);
+    make_func(code + 32, 3);
+    assert(func() == 3);
+
+    munmap(code, page);
+}
+
+int main(void)
+{
+    size_t page = getpagesize();
+    uint8_t *buf = mmap(NULL, 3 * page, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    assert(buf != MAP_FAILED);
+    test_movs(buf, page);
+    test_stos(buf, page);
+    test_smc(page);
+    return 0;
+}
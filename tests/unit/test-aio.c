@@ -98,6 +98,37 @@ static void event_ready_cb(EventNotifier *e)
     }
 }
 
+#ifndef _WIN32
+typedef struct {
+    EventNotifier e;
+    int n_poll;
+    int n_ready;
+    bool pending;   /* a completion that only polling finds */
+} BusyPollTestData;
+
+static bool busy_poll_cb(void *opaque)
+{
+    BusyPollTestData *data = container_of(opaque, BusyPollTestData, e);
+    data->n_poll++;
+    return data->pending;
+}
+
+static void busy_poll_ready_cb(EventNotifier *e)
+{
+    BusyPollTestData *data = container_of(e, BusyPollTestData, e);
+    data->pending = false;
+    data->n_ready++;
+}
+
+static void set_busy_poll_notifier(BusyPollTestData *data)
+{
+    /* The event notifier is never set, only polling can find anything */
+    event_notifier_init(&data->e, false);
+    aio_set_event_notifier(ctx, &data->e, dummy_io_handler_read,
+                           busy_poll_cb, busy_poll_ready_cb);
+}
+#endif
+
 /* Tests using aio_*.  */
 
 static void set_event_notifier(AioContext *nctx, EventNotifier *notifier,
@@ -424,6 +455,63 @@ static void test_timer_schedule(void)
     timer_del(&data.timer);
 }
 
+#ifndef _WIN32
+static void test_busy_poll(void)
+{
+    BusyPollTestData data = { .n_poll = 0 };
+    TimerTestData timer = { .n = 0, .ctx = ctx, .ns = SCALE_MS * 10LL,
+                            .max = 1,
+                            .clock_type = QEMU_CLOCK_REALTIME };
+    int n_poll;
+
+    set_busy_poll_notifier(&data);
+    do {} while (aio_poll(ctx, false));
+
+    /* The handler's fd has never been ready and poll-max-ns is 0 */
+    g_assert_cmpint(data.n_poll, ==, 0);
+
+    aio_context_set_busy_poll(ctx, true);
+
+    /* Blocking calls poll the handler instead of sleeping */
+    g_assert(!aio_poll(ctx, true));
+    g_assert_cmpint(data.n_poll, >, 0);
+    g_assert_cmpint(data.n_ready, ==, 0);
+
+    data.pending = true;
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n_ready, ==, 1);
+    g_assert(!data.pending);
+
+    /* Busy polling goes on while any user still needs it */
+    aio_context_set_busy_poll(ctx, true);
+    aio_context_set_busy_poll(ctx, false);
+    n_poll = data.n_poll;
+    g_assert(!aio_poll(ctx, true));
+    g_assert_cmpint(data.n_poll, >, n_poll);
+
+    aio_context_set_busy_poll(ctx, false);
+
+    /* Without busy polling, blocking waits for the timer again */
+    aio_timer_init(ctx, &timer.timer, timer.clock_type,
+                   SCALE_NS, timer_test_cb, &timer);
+    timer_mod(&timer.timer,
+              qemu_clock_get_ns(timer.clock_type) + timer.ns);
+    do {} while (aio_poll(ctx, false));
+
+    n_poll = data.n_poll;
+    data.pending = true;
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(timer.n, ==, 1);
+    g_assert_cmpint(data.n_poll, ==, n_poll);
+    g_assert_cmpint(data.n_ready, ==, 1);
+
+    set_event_notifier(ctx, &data.e, NULL);
+    event_notifier_cleanup(&data.e);
+
+    timer_del(&timer.timer);
+}
+#endif
+
 /* Now the same tests, using the context as a GSource.  They are
  * very similar to the ones above, with g_main_context_iteration
  * replacing aio_poll.  However:
@@ -742,6 +830,43 @@ static void test_source_timer_schedule(void)
     timer_del(&data.timer);
 }
 
+#ifndef _WIN32
+static void test_source_busy_poll(void)
+{
+    BusyPollTestData data = { .n_poll = 0 };
+    int n_poll;
+
+    set_busy_poll_notifier(&data);
+    while (g_main_context_iteration(NULL, false));
+    g_assert_cmpint(data.n_poll, ==, 0);
+
+    aio_context_set_busy_poll(ctx, true);
+
+    /* aio_dispatch() polls the handler without waiting for its fd */
+    g_assert(g_main_context_iteration(NULL, true));
+    g_assert_cmpint(data.n_poll, >, 0);
+    g_assert_cmpint(data.n_ready, ==, 0);
+
+    data.pending = true;
+    g_assert(g_main_context_iteration(NULL, true));
+    g_assert_cmpint(data.n_ready, ==, 1);
+    g_assert(!data.pending);
+
+    aio_context_set_busy_poll(ctx, false);
+
+    /* Without busy polling, the completion is not looked for */
+    while (g_main_context_iteration(NULL, false));
+    n_poll = data.n_poll;
+    data.pending = true;
+    while (g_main_context_iteration(NULL, false));
+    g_assert_cmpint(data.n_poll, ==, n_poll);
+    g_assert_cmpint(data.n_ready, ==, 1);
+
+    set_event_notifier(ctx, &data.e, NULL);
+    event_notifier_cleanup(&data.e);
+}
+#endif
+
 /*
  * Check that aio_co_enter() can chain many times
  *
@@ -847,6 +972,9 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
+#ifndef _WIN32
+    g_test_add_func("/aio/poll/busy",               test_busy_poll);
+#endif
 
     g_test_add_func("/aio/coroutine/queue-chaining", test_queue_chaining);
     g_test_add_func("/aio/coroutine/worker-thread-co-enter", test_worker_thread_co_enter);
@@ -864,5 +992,8 @@ int main(int argc, char **argv)
     g_test_add_func("/aio-gsource/event/wait/no-flush-cb",  test_source_wait_event_notifier_noflush);
     g_test_add_func("/aio-gsource/event/flush",             test_source_flush_event_notifier);
     g_test_add_func("/aio-gsource/timer/schedule",          test_source_timer_schedule);
+#ifndef _WIN32
+    g_test_add_func("/aio-gsource/poll/busy",               test_source_busy_poll);
+#endif
     return g_test_run();
 }
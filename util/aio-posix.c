@@ -263,7 +263,8 @@ bool aio_prepare(AioContext *ctx)
     poll_set_started(ctx, &ready_list, false);
     /* TODO what to do with this list? */
 
-    return false;
+    /* Don't sleep while completions that only polling finds are pending */
+    return ctx->poll_busy_cnt;
 }
 
 bool aio_pending(AioContext *ctx)
@@ -271,6 +272,11 @@ bool aio_pending(AioContext *ctx)
     AioHandler *node;
     bool result = false;
 
+    /* aio_dispatch() polls the handlers */
+    if (ctx->poll_busy_cnt) {
+        return true;
+    }
+
     /*
      * We have to walk very carefully in case aio_set_fd_handler is
      * called while we're walking.
@@ -417,17 +423,6 @@ static bool aio_dispatch_handlers(AioContext *ctx)
     return progress;
 }
 
-void aio_dispatch(AioContext *ctx)
-{
-    qemu_lockcnt_inc(&ctx->list_lock);
-    aio_bh_poll(ctx);
-    aio_dispatch_handlers(ctx);
-    aio_free_deleted_handlers(ctx);
-    qemu_lockcnt_dec(&ctx->list_lock);
-
-    timerlistgroup_run_timers(&ctx->tlg);
-}
-
 static bool run_poll_handlers_once(AioContext *ctx,
                                    AioHandlerList *ready_list,
                                    int64_t now,
@@ -459,6 +454,54 @@ static bool run_poll_handlers_once(AioContext *ctx,
     return progress;
 }
 
+/*
+ * Completions that aio_context_set_busy_poll() is used for may never make
+ * the file descriptor of their handler ready, so all handlers that support
+ * it are polled while it is in use rather than only those that have been
+ * ready before.
+ */
+static void poll_add_all_handlers(AioContext *ctx)
+{
+    AioHandler *node;
+
+    QLIST_FOREACH_RCU(node, &ctx->aio_handlers, node) {
+        if (!QLIST_IS_INSERTED(node, node_deleted) &&
+            !QLIST_IS_INSERTED(node, node_poll) &&
+            node->io_poll) {
+            trace_poll_add(ctx, node, node->pfd.fd, 0);
+            if (ctx->poll_started && node->io_poll_begin) {
+                node->io_poll_begin(node->opaque);
+            }
+            QLIST_INSERT_HEAD(&ctx->poll_aio_handlers, node, node_poll);
+        }
+    }
+}
+
+void aio_dispatch(AioContext *ctx)
+{
+    qemu_lockcnt_inc(&ctx->list_lock);
+    aio_bh_poll(ctx);
+    aio_dispatch_handlers(ctx);
+
+    if (ctx->poll_busy_cnt) {
+        AioHandlerList ready_list = QLIST_HEAD_INITIALIZER(ready_list);
+        int64_t timeout = 0;
+
+        WITH_RCU_READ_LOCK_GUARD() {
+            poll_add_all_handlers(ctx);
+            run_poll_handlers_once(ctx, &ready_list,
+                                   qemu_clock_get_ns(QEMU_CLOCK_REALTIME),
+                                   &timeout);
+        }
+        aio_dispatch_ready_handlers(ctx, &ready_list);
+    }
+
+    aio_free_deleted_handlers(ctx);
+    qemu_lockcnt_dec(&ctx->list_lock);
+
+    timerlistgroup_run_timers(&ctx->tlg);
+}
+
 static bool fdmon_supports_polling(AioContext *ctx)
 {
     return ctx->fdmon_ops->need_wait != aio_poll_disabled;
@@ -482,6 +525,11 @@ static bool remove_idle_poll_handlers(AioContext *ctx,
         return false;
     }
 
+    /* Busy polling relies on the handlers, see poll_add_all_handlers() */
+    if (ctx->poll_busy_cnt) {
+        return false;
+    }
+
     QLIST_FOREACH_SAFE(node, &ctx->poll_aio_handlers, node_poll, tmp) {
         if (node->poll_idle_timeout == 0LL) {
             node->poll_idle_timeout = now + POLL_IDLE_INTERVAL_NS;
@@ -580,6 +628,12 @@ static bool try_poll_mode(AioContext *ctx, AioHandlerList *ready_list,
 {
     int64_t max_ns;
 
+    if (ctx->poll_busy_cnt) {
+        WITH_RCU_READ_LOCK_GUARD() {
+            poll_add_all_handlers(ctx);
+        }
+    }
+
     if (QLIST_EMPTY_RCU(&ctx->poll_aio_handlers)) {
         return false;
     }
@@ -595,6 +649,12 @@ static bool try_poll_mode(AioContext *ctx, AioHandlerList *ready_list,
         if (run_poll_handlers(ctx, ready_list, max_ns, timeout)) {
             return true;
         }
+    } else if (ctx->poll_busy_cnt) {
+        /*
+         * Poll at least once for the completions that busy polling is
+         * needed for, even when file descriptors must be checked as well.
+         */
+        return run_poll_handlers(ctx, ready_list, 0, timeout);
     }
     return false;
 }
@@ -629,6 +689,11 @@ bool aio_poll(AioContext *ctx, bool blocking)
     progress = try_poll_mode(ctx, &ready_list, &timeout);
     assert(!(timeout && progress));
 
+    /* Don't sleep while completions that only polling finds are pending */
+    if (ctx->poll_busy_cnt) {
+        timeout = 0;
+    }
+
     /*
      * aio_notify can avoid the expensive event_notifier_set if
      * everything (file descriptors, bottom halves, timers) will
@@ -777,6 +842,14 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
     aio_notify(ctx);
 }
 
+void aio_context_set_busy_poll(AioContext *ctx, bool busy)
+{
+    assert(in_aio_context_home_thread(ctx));
+
+    ctx->poll_busy_cnt += busy ? 1 : -1;
+    assert(ctx->poll_busy_cnt >= 0);
+}
+
 void aio_context_set_aio_params(AioContext *ctx, int64_t max_batch)
 {
     /*